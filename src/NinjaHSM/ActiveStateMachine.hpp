@@ -0,0 +1,566 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#endif
+
+#include "MpscEventQueue.hpp"
+#include "QueuedStateMachine.hpp"
+#include "State.hpp"
+
+namespace NinjaHSM {
+
+/**
+ * What became of an event given to ActiveStateMachine::submit().
+ */
+template <typename EventType>
+struct SubmitResult {
+    /**
+     * True if a state transitioned or called eventHandled() (see StateMachine::handleEvent()).
+     */
+    bool handled = false;
+
+    /**
+     * The state machine's current state once the event had run to completion.
+     */
+    const State<EventType> * state = nullptr;
+};
+
+namespace detail {
+
+/**
+ * One outstanding submit(). Status goes FREE -> PENDING when submit() claims the slot, then to
+ * DONE when the worker thread has handled the event. AWAITED (a coroutine is suspended on it) and
+ * ABANDONED (the handle was destroyed first) are the two ways of getting there via someone else
+ * still needing to be told.
+ */
+template <typename EventType>
+struct CompletionSlot {
+    enum : uint32_t { FREE, PENDING, AWAITED, ABANDONED, DONE };
+
+    std::atomic<uint32_t> status{FREE};
+    SubmitResult<EventType> result;
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    std::coroutine_handle<> continuation;
+#endif
+};
+
+/**
+ * What a state machine's completion slots share: how many are free, and what
+ * EventCompletion::wait() blocks on (only notified if someone is actually waiting).
+ */
+struct CompletionPool {
+    explicit CompletionPool(uint32_t numSlots) : numFreeSlots(numSlots) {}
+
+    std::mutex mutex;
+    std::condition_variable done;
+    std::atomic<uint32_t> numWaiting{0};
+
+    /**
+     * Slots that are FREE and not yet spoken for by a claimSlot(). Taken before a slot is looked
+     * for, so the search can't miss a free slot that moves behind it.
+     */
+    std::atomic<uint32_t> numFreeSlots;
+};
+
+/**
+ * Return a slot to the pool.
+ */
+template <typename EventType>
+void freeSlot(CompletionSlot<EventType>& slot, CompletionPool& pool) {
+    slot.status.store(CompletionSlot<EventType>::FREE, std::memory_order_release);
+    pool.numFreeSlots.fetch_add(1, std::memory_order_release);
+}
+
+/**
+ * The completion slots of an ActiveStateMachine, and the slot (if any) of the event at each queue
+ * position. Empty if submit() is disabled.
+ */
+template <typename EventType, size_t QueueCapacity, size_t MaxSubmitted>
+struct ActiveSubmissions {
+    CompletionSlot<EventType> m_completionSlots[MaxSubmitted];
+    CompletionSlot<EventType> * m_completionAt[QueueCapacity] = {};
+    CompletionPool m_pool{MaxSubmitted};
+    std::atomic<uint32_t> m_nextSlot{0};
+    uint32_t m_popPosition = 0;
+};
+
+template <typename EventType, size_t QueueCapacity>
+struct ActiveSubmissions<EventType, QueueCapacity, 0> {};
+
+} // namespace detail
+
+/**
+ * A handle to an event given to ActiveStateMachine::submit(), resolved once the worker thread has
+ * handled it (and everything it posted) to completion. Either block on it with wait(), poll it
+ * with isReady(), or, in a C++20 coroutine, `co_await` it.
+ *
+ * Move-only. The handle owns one of the state machine's completion slots, which is returned to
+ * the pool when the handle is destroyed (or, if the event is still pending then, when it has been
+ * handled). A handle must not outlive its state machine.
+ */
+template <typename EventType>
+class EventCompletion {
+public:
+    /**
+     * An empty handle, as returned by submit() when the event could not be queued.
+     */
+    EventCompletion() {}
+
+    EventCompletion(EventCompletion&& other) noexcept :
+            m_slot(std::exchange(other.m_slot, nullptr)),
+            m_pool(other.m_pool) {}
+
+    EventCompletion& operator=(EventCompletion&& other) noexcept {
+        if (this != &other) {
+            release();
+            m_slot = std::exchange(other.m_slot, nullptr);
+            m_pool = other.m_pool;
+        }
+        return *this;
+    }
+
+    EventCompletion(const EventCompletion&) = delete;
+    EventCompletion& operator=(const EventCompletion&) = delete;
+
+    ~EventCompletion() {
+        release();
+    }
+
+    /**
+     * @return True if the event was queued, false if submit() failed (queue full or no free
+     *         completion slot).
+     */
+    bool isValid() const {
+        return m_slot != nullptr;
+    }
+
+    /**
+     * @return True once the event has been handled (always false for an empty handle).
+     */
+    bool isReady() const {
+        return m_slot != nullptr && m_slot->status.load() == Slot::DONE;
+    }
+
+    /**
+     * Block until the event has been handled.
+     *
+     * @return The result. Default constructed (not handled, no state) for an empty handle.
+     */
+    SubmitResult<EventType> wait() {
+        if (m_slot == nullptr) {
+            return SubmitResult<EventType>();
+        }
+        if (!isReady()) {
+            std::unique_lock<std::mutex> lock(m_pool->mutex);
+            m_pool->numWaiting.fetch_add(1);
+            m_pool->done.wait(lock, [this]() { return isReady(); });
+            m_pool->numWaiting.fetch_sub(1);
+        }
+        return m_slot->result;
+    }
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    /**
+     * Awaitable (C++20): `SubmitResult<Event> result = co_await stateMachine.submit(event);`. The
+     * coroutine is resumed on the state machine's worker thread, straight after the event has
+     * been handled, so it should hand off to its own executor rather than do much there (and
+     * must not wait() on another submit() to the same state machine). An empty handle resumes
+     * at once with a default constructed result.
+     */
+    bool await_ready() const {
+        return m_slot == nullptr || isReady();
+    }
+
+    bool await_suspend(std::coroutine_handle<> continuation) {
+        m_slot->continuation = continuation;
+        uint32_t expected = Slot::PENDING;
+        // Fails if the event was handled in the meantime: carry on without suspending.
+        return m_slot->status.compare_exchange_strong(expected, Slot::AWAITED, std::memory_order_acq_rel);
+    }
+
+    SubmitResult<EventType> await_resume() const {
+        return m_slot == nullptr ? SubmitResult<EventType>() : m_slot->result;
+    }
+#endif
+
+private:
+    template <typename, size_t, template <typename, size_t, size_t> class, size_t, typename>
+    friend class ActiveStateMachine;
+
+    using Slot = detail::CompletionSlot<EventType>;
+
+    EventCompletion(Slot& slot, detail::CompletionPool& pool) :
+            m_slot(&slot),
+            m_pool(&pool) {}
+
+    /**
+     * Give up the slot: free it if the event has been handled, otherwise leave the worker thread
+     * to free it.
+     */
+    void release() {
+        if (m_slot == nullptr) {
+            return;
+        }
+        uint32_t status = m_slot->status.load(std::memory_order_acquire);
+        while (status != Slot::DONE) {
+            if (m_slot->status.compare_exchange_weak(status, Slot::ABANDONED, std::memory_order_acq_rel)) {
+                m_slot = nullptr;
+                return;
+            }
+        }
+        detail::freeSlot(*m_slot, *m_pool);
+        m_slot = nullptr;
+    }
+
+    Slot * m_slot = nullptr;
+    detail::CompletionPool * m_pool = nullptr;
+};
+
+/**
+ * An "active object": a state machine with its own event queue and its own worker thread.
+ *
+ * The worker thread performs the initial transition and then runs handleEvent() on every posted
+ * event, one at a time (run-to-completion). The QueuedStateMachine it is built on is a private
+ * base, so handleEvent(), dispatchPending(), initialTransitionTo() and restore() can't be reached
+ * at all, not even through a base class reference: other threads postEvent() (or submit())
+ * instead. Your state handlers run on the worker thread and call transitionTo(), eventHandled(),
+ * post(), defer() and so on as usual, so those stay public, along with the observer setters and
+ * the other setup calls to make before start(). Only call them from the handlers (or before
+ * start()): calling transitionTo() from another thread while the worker is running races with
+ * it. Post an event asking for the transition instead.
+ *
+ * When the queue is empty the worker thread parks on a condition variable (a futex on Linux), so
+ * an idle machine costs no CPU. postEvent() only takes the lock to wake the worker when it is
+ * actually parked, so posting to a busy machine is lock-free.
+ *
+ * @code
+ * class Blinky {
+ * public:
+ *     Blinky() : m_off(makeState<Event, ...>("Off", *this)), m_on(...) {
+ *         m_stateMachine.start(m_off);
+ *     }
+ *     void post(const Event& event) { m_stateMachine.postEvent(event); } // Any thread
+ * private:
+ *     State<Event> m_off;
+ *     State<Event> m_on;
+ *     ActiveStateMachine<Event, 64> m_stateMachine; // Declared after the states (see stop())
+ * };
+ * @endcode
+ *
+ * To find out when an event has been handled, and how, submit() it instead of posting it (with
+ * @p MaxSubmitted set). See submit().
+ *
+ * This uses std::thread, so it is intended for hosted (e.g. Linux) targets and is not included by
+ * NinjaHSM.hpp. Include <NinjaHSM/ActiveStateMachine.hpp> explicitly.
+ *
+ * @tparam EventType     The state machine's event type.
+ * @tparam QueueCapacity The maximum number of pending events. Must be a power of two.
+ * @tparam Queue         The queue class template. Defaults to MpscEventQueue so that any number
+ *                       of threads can post. Use SpscEventQueue if only one thread ever posts.
+ * @tparam MaxSubmitted  The maximum number of submit() handles alive at once (the size of the
+ *                       completion slot pool). 0, the default, disables submit().
+ * @tparam Policy        Which optional features to compile in (see StateMachinePolicy).
+ */
+template <
+    typename EventType,
+    size_t QueueCapacity,
+    template <typename, size_t, size_t> class Queue = MpscEventQueue,
+    size_t MaxSubmitted = 0,
+    typename Policy = StateMachinePolicy>
+class ActiveStateMachine :
+        private QueuedStateMachine<EventType, QueueCapacity, CACHE_LINE_SIZE, Queue, Policy>,
+        private detail::ActiveSubmissions<EventType, QueueCapacity, MaxSubmitted> {
+    using Base = QueuedStateMachine<EventType, QueueCapacity, CACHE_LINE_SIZE, Queue, Policy>;
+    using Slot = detail::CompletionSlot<EventType>;
+
+public:
+    // Safe from any thread.
+    using Base::getEventQueue;
+    using Base::numPendingEvents;
+
+    // For the handlers, which run on the worker thread.
+    using Base::transitionTo;
+    using Base::transitionToHistory;
+    using Base::eventHandled;
+    using Base::post;
+    using Base::defer;
+    using Base::recall;
+    using Base::discardDeferred;
+    using Base::numDeferred;
+    using Base::getCurrentState;
+    using Base::getRegionState;
+    using Base::isInState;
+
+    // Setup, before start().
+    using typename Base::TransitionObserver;
+    using typename Base::UnhandledEventObserver;
+    using typename Base::ErrorObserver;
+    using typename Base::EventKindSelector;
+    using typename Base::RegionExecutor;
+    using Base::setTransitionObserver;
+    using Base::setUnhandledEventObserver;
+    using Base::setErrorObserver;
+    using Base::setEventKindSelector;
+    using Base::setRegions;
+    using Base::setRegionExecutor;
+    using Base::finalize;
+    using Base::isSealed;
+
+    ActiveStateMachine() {}
+
+    ActiveStateMachine(const ActiveStateMachine&) = delete;
+    ActiveStateMachine& operator=(const ActiveStateMachine&) = delete;
+
+    /**
+     * Stops the worker thread (see stop()).
+     */
+    ~ActiveStateMachine() {
+        stop();
+    }
+
+    /**
+     * Start the worker thread, which first transitions to @p initialState and then handles posted
+     * events until stop() is called. Events posted before start() are handled after the initial
+     * transition. Does nothing if already running.
+     *
+     * @param[in] initialState The initial state to transition to.
+     */
+    void start(const State<EventType>& initialState) {
+        if (m_worker.joinable()) {
+            return;
+        }
+        m_stopRequested.store(false);
+        m_worker = std::thread([this, &initialState]() { run(initialState); });
+    }
+
+    /**
+     * Stop the worker thread. Every event posted before stop() was called is handled first, then
+     * the worker thread exits and this returns. Does nothing if not running.
+     *
+     * Must be called before the states (or anything else the handlers use) are destroyed. The
+     * destructor calls it, so declaring the ActiveStateMachine after the states in your class is
+     * enough.
+     */
+    void stop() {
+        if (!m_worker.joinable()) {
+            return;
+        }
+        m_stopRequested.store(true);
+        wake();
+        m_worker.join();
+    }
+
+    /**
+     * @return True between start() and stop().
+     */
+    bool isRunning() const {
+        return m_worker.joinable();
+    }
+
+    /**
+     * Queue an event for the worker thread. Safe to call from any thread (with the default
+     * MpscEventQueue), including from the state machine's own handlers.
+     *
+     * @param[in] event The event to queue.
+     * @return True if the event was queued, false if the queue was full (the event is dropped).
+     */
+    bool postEvent(const EventType& event) {
+        const bool queued = Base::postEvent(event);
+        wakeIfParked();
+        return queued;
+    }
+
+    /**
+     * Same as postEvent(), but moves the event into the queue.
+     */
+    bool postEvent(EventType&& event) {
+        const bool queued = Base::postEvent(std::move(event));
+        wakeIfParked();
+        return queued;
+    }
+
+    /**
+     * Queue an event like postEvent(), and get a handle that resolves once the worker thread has
+     * handled it to completion, with whether it was handled and the state the machine ended up in.
+     * Safe to call from any thread that may call postEvent().
+     *
+     * @code
+     * ActiveStateMachine<Event, 64, MpscEventQueue, 16> m_stateMachine; // Up to 16 handles at once
+     *
+     * SubmitResult<Event> result = m_stateMachine.submit(Event(EventId::CONNECT)).wait();
+     * if (result.state == &m_connected) { ... }
+     * @endcode
+     *
+     * Each handle holds one of @p MaxSubmitted preallocated completion slots until it is
+     * destroyed, so nothing is allocated per event. The result is recorded right after
+     * handleEvent() returns, so it reflects everything the event caused, including the events its
+     * handlers posted.
+     *
+     * @param[in] event The event to queue.
+     * @return A handle to the result, or an empty handle (see EventCompletion::isValid()) if the
+     *         queue was full or every completion slot was in use, in which case the event was not
+     *         queued.
+     */
+    EventCompletion<EventType> submit(EventType event) {
+        static_assert(MaxSubmitted != 0, "submit() needs MaxSubmitted (the number of completion slots) to be set.");
+        Slot* slot = claimSlot();
+        if (slot == nullptr) {
+            return EventCompletion<EventType>();
+        }
+        // Recorded against the event's queue position before the worker thread can pop it.
+        const bool queued = this->m_eventQueue.push(std::move(event), [this, slot](uint32_t position) {
+            this->m_completionAt[position & (QueueCapacity - 1)] = slot;
+        });
+        if (!queued) {
+            detail::freeSlot(*slot, this->m_pool);
+            return EventCompletion<EventType>();
+        }
+        wakeIfParked();
+        return EventCompletion<EventType>(*slot, this->m_pool);
+    }
+
+private:
+    /**
+     * Base::dispatchPending(), resolving the completion of each submitted event as it goes.
+     */
+    size_t dispatchQueued() {
+        if constexpr (MaxSubmitted == 0) {
+            return Base::dispatchPending();
+        } else {
+            size_t numDispatched = 0;
+            while (true) {
+                Slot* slot = nullptr;
+                bool handled = false;
+                // Only this thread pops, so it can count the positions. The event's slot is taken
+                // out of m_completionAt before pop() frees the position for reuse, and resolved
+                // after pop() returns.
+                const bool popped = this->m_eventQueue.pop([this, &slot, &handled](EventType&& event) {
+                    handled = Base::handleEvent(event);
+                    slot = std::exchange(this->m_completionAt[this->m_popPosition++ & (QueueCapacity - 1)], nullptr);
+                });
+                if (!popped) {
+                    break;
+                }
+                numDispatched++;
+                if (slot != nullptr) {
+                    complete(*slot, handled);
+                }
+            }
+            return numDispatched;
+        }
+    }
+
+    /**
+     * @return A free completion slot, now PENDING, or nullptr if all are in use.
+     */
+    Slot* claimSlot() {
+        uint32_t numFreeSlots = this->m_pool.numFreeSlots.load(std::memory_order_relaxed);
+        do {
+            if (numFreeSlots == 0) {
+                return nullptr;
+            }
+        } while (!this->m_pool.numFreeSlots.compare_exchange_weak(numFreeSlots, numFreeSlots - 1,
+                std::memory_order_acquire, std::memory_order_relaxed));
+        // One of the FREE slots is now ours. Other threads freeing and claiming slots while we
+        // look can move it behind us, so keep going round until we find it.
+        for (uint32_t i = this->m_nextSlot.fetch_add(1, std::memory_order_relaxed);; i++) {
+            Slot& slot = this->m_completionSlots[i % MaxSubmitted];
+            uint32_t expected = Slot::FREE;
+            if (slot.status.compare_exchange_strong(expected, Slot::PENDING, std::memory_order_acq_rel)) {
+                return &slot;
+            }
+        }
+    }
+
+    /**
+     * Resolve a submitted event's completion, waking whoever is waiting for it.
+     */
+    void complete(Slot& slot, bool handled) {
+        slot.result.handled = handled;
+        slot.result.state = this->getCurrentState();
+        // Sequentially consistent, like the waiters' count: either EventCompletion::wait() sees
+        // DONE, or we see it waiting.
+        const uint32_t previous = slot.status.exchange(Slot::DONE);
+        if (previous == Slot::ABANDONED) {
+            detail::freeSlot(slot, this->m_pool);
+            return;
+        }
+        if (this->m_pool.numWaiting.load() != 0) {
+            std::lock_guard<std::mutex> lock(this->m_pool.mutex);
+            this->m_pool.done.notify_all();
+        }
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+        if (previous == Slot::AWAITED) {
+            // May destroy the handle (and free the slot), so nothing touches the slot after this.
+            slot.continuation.resume();
+        }
+#endif
+    }
+
+    /**
+     * The worker thread's loop.
+     */
+    void run(const State<EventType>& initialState) {
+        Base::initialTransitionTo(initialState);
+        while (true) {
+            const size_t numDispatched = dispatchQueued();
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            // Announce that we are about to park, then look at the queue again. A producer that
+            // posted before seeing m_parked will have left its event for us to find here; one
+            // that posts after will see m_parked and wake us.
+            m_parked.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!this->m_eventQueue.empty()) {
+                m_parked.store(false);
+                if (numDispatched == 0) {
+                    // A producer has claimed a slot but not finished writing it. Let it run
+                    // rather than spinning (it may share our core).
+                    lock.unlock();
+                    std::this_thread::yield();
+                }
+                continue;
+            }
+            if (m_stopRequested.load()) {
+                m_parked.store(false);
+                return;
+            }
+            m_wakeup.wait(lock, [this]() { return !m_parked.load(); });
+        }
+    }
+
+    void wakeIfParked() {
+        // Pairs with the fence in run(): either we see m_parked, or the worker sees our event.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_parked.load()) {
+            wake();
+        }
+    }
+
+    void wake() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_parked.store(false);
+        m_wakeup.notify_one();
+    }
+
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+
+    /**
+     * True while the worker thread is parked (or about to park) waiting for events.
+     */
+    std::atomic<bool> m_parked{false};
+
+    std::atomic<bool> m_stopRequested{false};
+}; // class ActiveStateMachine
+
+} // namespace NinjaHSM
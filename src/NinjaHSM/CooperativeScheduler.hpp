@@ -0,0 +1,259 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <etl/delegate.h>
+
+#include "QueuedStateMachine.hpp"
+#include "SpscEventQueue.hpp"
+
+namespace NinjaHSM {
+
+namespace detail {
+
+/**
+ * @return The index of the most significant set bit of @p value, which must not be 0.
+ */
+inline uint8_t highestSetBit(uint32_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    // A single CLZ instruction on Cortex-M3 and up (and most other targets).
+    return static_cast<uint8_t>(31 - __builtin_clz(value));
+#else
+    uint8_t bit = 0;
+    while (value >>= 1) {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+} // namespace detail
+
+/**
+ * A cooperative, run-to-completion scheduler for many state machines sharing one thread (e.g. the
+ * superloop of an MCU), in the style of the QP "QV" kernel.
+ *
+ * Each state machine is added with a unique, fixed priority (0 to MAX_PRIORITY, higher numbers
+ * are more urgent) and has its own event queue (see ScheduledStateMachine). Posting an event
+ * marks its machine as ready in a 32-bit ready set. Each step of run()/runOnce() picks the
+ * highest-priority ready machine with a single count-leading-zeros instruction and lets it handle
+ * one event. Handlers are never preempted by other state machines, only by interrupts.
+ *
+ * When no machine is ready, run() calls the idle hook, which is the place to enter a low power
+ * mode. Events can arrive from an ISR at any moment, so the hook should disable interrupts, check
+ * isIdle() again, and only then sleep (on Cortex-M, WFI wakes up on a pending interrupt even with
+ * interrupts disabled), re-enabling interrupts afterwards.
+ *
+ * postEvent() (and so markReady()) is safe to call from ISRs. The rest of the API must be used
+ * from the thread that calls run().
+ *
+ * The ready set is updated with atomic read-modify-writes, so the target needs lock-free 32-bit
+ * atomics (LDREX/STREX, i.e. Cortex-M3 and up). On cores without them, such as the Cortex-M0,
+ * std::atomic falls back to library calls that aren't ISR-safe, so this doesn't compile there.
+ */
+class CooperativeScheduler {
+public:
+    static_assert(std::atomic<uint32_t>::is_always_lock_free,
+            "CooperativeScheduler needs lock-free 32-bit atomics, which this target (e.g. Cortex-M0) lacks.");
+
+    /**
+     * The highest priority a state machine can have. There are MAX_PRIORITY + 1 priority levels,
+     * one bit each in the ready set.
+     */
+    static constexpr uint8_t MAX_PRIORITY = 31;
+
+    /**
+     * Handles one queued event of a state machine. Returns true if more events are still queued.
+     */
+    using DispatchDelegate = etl::delegate<bool()>;
+
+    /**
+     * Called by run() whenever no state machine is ready.
+     */
+    using IdleHook = etl::delegate<void()>;
+
+    CooperativeScheduler() {}
+
+    /**
+     * Add a state machine. Usually called for you by ScheduledStateMachine::attach().
+     *
+     * @param[in] priority The machine's priority (0 to MAX_PRIORITY). Must be unique.
+     * @param[in] dispatch Delegate that handles one queued event of the machine.
+     * @return False if the priority is out of range or already taken.
+     */
+    bool add(uint8_t priority, DispatchDelegate dispatch) {
+        if (priority > MAX_PRIORITY || m_dispatchers[priority].is_valid() || !dispatch.is_valid()) {
+            return false;
+        }
+        m_dispatchers[priority] = dispatch;
+        return true;
+    }
+
+    /**
+     * Set the hook run() calls when no state machine is ready. Pass a default constructed
+     * (unbound) delegate to clear.
+     *
+     * @param[in] hook The hook to call, or an unbound delegate to clear.
+     */
+    void setIdleHook(IdleHook hook) {
+        m_idleHook = hook;
+    }
+
+    /**
+     * Mark the state machine at @p priority as having events to handle. Called by
+     * ScheduledStateMachine::postEvent(). Safe to call from an ISR.
+     *
+     * @param[in] priority The priority of the machine (0 to MAX_PRIORITY).
+     */
+    void markReady(uint8_t priority) {
+        m_readySet.fetch_or(uint32_t(1) << priority, std::memory_order_release);
+    }
+
+    /**
+     * @return True if no state machine has events to handle.
+     */
+    bool isIdle() const {
+        return m_readySet.load(std::memory_order_acquire) == 0;
+    }
+
+    /**
+     * Let the highest-priority ready state machine handle one event.
+     *
+     * @return True if an event was handled, false if no machine was ready.
+     */
+    bool runOnce() {
+        const uint32_t readySet = m_readySet.load(std::memory_order_acquire);
+        if (readySet == 0) {
+            return false;
+        }
+        const uint8_t priority = detail::highestSetBit(readySet);
+        // Clear the bit before dispatching: if an ISR posts to this machine in the meantime it
+        // sets the bit again, so the event cannot be missed.
+        m_readySet.fetch_and(~(uint32_t(1) << priority), std::memory_order_acq_rel);
+        if (m_dispatchers[priority].is_valid() && m_dispatchers[priority]()) {
+            markReady(priority);
+        }
+        return true;
+    }
+
+    /**
+     * Run the scheduler: repeatedly let the highest-priority ready state machine handle one
+     * event, calling the idle hook whenever none is ready. Only returns once stop() is called
+     * (from a handler, the idle hook or an ISR).
+     */
+    void run() {
+        m_stopRequested.store(false, std::memory_order_relaxed);
+        while (!m_stopRequested.load(std::memory_order_relaxed)) {
+            if (!runOnce() && m_idleHook.is_valid()) {
+                m_idleHook();
+            }
+        }
+    }
+
+    /**
+     * Make run() return after the current step.
+     */
+    void stop() {
+        m_stopRequested.store(true, std::memory_order_relaxed);
+    }
+
+private:
+    DispatchDelegate m_dispatchers[MAX_PRIORITY + 1];
+    IdleHook m_idleHook;
+
+    /**
+     * Bit n is set while the state machine at priority n has queued events.
+     */
+    std::atomic<uint32_t> m_readySet{0};
+
+    std::atomic<bool> m_stopRequested{false};
+}; // class CooperativeScheduler
+
+/**
+ * A QueuedStateMachine that is run by a CooperativeScheduler. postEvent() queues the event and
+ * marks the machine ready, and the scheduler dispatches its events one at a time, in priority
+ * order with the other machines.
+ *
+ * @code
+ * ScheduledStateMachine<Event, 8, alignof(uint32_t)> m_stateMachine;
+ * // ...
+ * m_stateMachine.attach(scheduler, 3); // Priority 3
+ * m_stateMachine.initialTransitionTo(m_idle);
+ * @endcode
+ *
+ * Template parameters are as for QueuedStateMachine. As with the default SpscEventQueue, events
+ * for one machine must all be posted from one context (e.g. one ISR, or the superloop including
+ * other machines' handlers).
+ */
+template <
+    typename EventType,
+    size_t QueueCapacity,
+    size_t IndexAlignment = CACHE_LINE_SIZE,
+    template <typename, size_t, size_t> class Queue = SpscEventQueue,
+    typename Policy = StateMachinePolicy>
+class ScheduledStateMachine : public QueuedStateMachine<EventType, QueueCapacity, IndexAlignment, Queue, Policy> {
+    using Base = QueuedStateMachine<EventType, QueueCapacity, IndexAlignment, Queue, Policy>;
+
+public:
+    ScheduledStateMachine() {}
+
+    /**
+     * Add this state machine to a scheduler. Call once, before posting events.
+     *
+     * @param[in] scheduler The scheduler that will dispatch this machine's events.
+     * @param[in] priority  This machine's priority (0 to CooperativeScheduler::MAX_PRIORITY,
+     *                      unique within the scheduler).
+     * @return False if the priority is out of range or already taken.
+     */
+    bool attach(CooperativeScheduler& scheduler, uint8_t priority) {
+        if (!scheduler.add(priority, CooperativeScheduler::DispatchDelegate::create<
+                ScheduledStateMachine, &ScheduledStateMachine::dispatchOne>(*this))) {
+            return false;
+        }
+        m_scheduler = &scheduler;
+        m_priority = priority;
+        return true;
+    }
+
+    /**
+     * Queue an event and mark this machine ready. ISR-safe (single producer, see above).
+     *
+     * @param[in] event The event to queue.
+     * @return True if the event was queued, false if the queue was full or the machine has not
+     *         been attached to a scheduler.
+     */
+    bool postEvent(const EventType& event) {
+        if (m_scheduler == nullptr || !Base::postEvent(event)) {
+            return false;
+        }
+        m_scheduler->markReady(m_priority);
+        return true;
+    }
+
+    /**
+     * Same as postEvent(), but moves the event into the queue.
+     */
+    bool postEvent(EventType&& event) {
+        if (m_scheduler == nullptr || !Base::postEvent(std::move(event))) {
+            return false;
+        }
+        m_scheduler->markReady(m_priority);
+        return true;
+    }
+
+private:
+    // Events are dispatched by the scheduler.
+    using Base::dispatchPending;
+
+    bool dispatchOne() {
+        Base::dispatchPending(1);
+        return Base::numPendingEvents() != 0;
+    }
+
+    CooperativeScheduler* m_scheduler = nullptr;
+    uint8_t m_priority = 0;
+}; // class ScheduledStateMachine
+
+} // namespace NinjaHSM
@@ -0,0 +1,618 @@
+#pragma once
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+#include <etl/delegate.h>
+
+#include "State.hpp"
+#include "Timer.hpp"
+#include "TimerService.hpp"
+
+namespace NinjaHSM {
+
+/**
+ * The pool logic shared by every CoroutineFramePool, whatever its frame size: a free list of
+ * fixed-size blocks. Each block starts with a header pointing back at its pool (so a frame can
+ * be freed without knowing where it came from), followed by the frame.
+ */
+class CoroutineFrameAllocator {
+public:
+    CoroutineFrameAllocator(const CoroutineFrameAllocator&) = delete;
+    CoroutineFrameAllocator& operator=(const CoroutineFrameAllocator&) = delete;
+
+    /**
+     * @param[in] size The size of the frame.
+     * @return A frame of at least @p size bytes, or nullptr if @p size is more than the pool's
+     *         frame size or every frame is in use.
+     */
+    void* allocate(size_t size) {
+        if (size > m_frameSize || m_free == nullptr) {
+            return nullptr;
+        }
+        Header* header = m_free;
+        m_free = header->next;
+        header->pool = this;
+        m_numInUse++;
+        if (m_numInUse > m_highWaterMark) {
+            m_highWaterMark = m_numInUse;
+        }
+        return header + 1;
+    }
+
+    /**
+     * Return a frame to the pool it came from.
+     *
+     * @param[in] frame A frame returned by allocate() on any pool.
+     */
+    static void deallocate(void* frame) {
+        Header* header = static_cast<Header*>(frame) - 1;
+        CoroutineFrameAllocator* pool = header->pool;
+        header->next = pool->m_free;
+        pool->m_free = header;
+        pool->m_numInUse--;
+    }
+
+    /**
+     * @return The number of frames currently allocated.
+     */
+    uint32_t numInUse() const {
+        return m_numInUse;
+    }
+
+    /**
+     * @return The most frames that have been allocated at once.
+     */
+    uint32_t highWaterMark() const {
+        return m_highWaterMark;
+    }
+
+protected:
+    /**
+     * A block's header: its pool while allocated, the next free block while free. Padded so the
+     * frame after it is suitably aligned for anything.
+     */
+    union alignas(alignof(std::max_align_t)) Header {
+        CoroutineFrameAllocator* pool;
+        Header* next;
+    };
+
+    /**
+     * @param[in] blocks    Storage for @p numFrames blocks of @p blockSize bytes each.
+     * @param[in] blockSize The size of a block: a Header and a frame, rounded up to a Header.
+     * @param[in] numFrames The number of blocks.
+     */
+    CoroutineFrameAllocator(Header* blocks, size_t blockSize, uint32_t numFrames) :
+            m_frameSize(blockSize - sizeof(Header)) {
+        const size_t headersPerBlock = blockSize / sizeof(Header);
+        for (uint32_t i = numFrames; i-- > 0;) {
+            Header* block = blocks + i * headersPerBlock;
+            block->next = m_free;
+            m_free = block;
+        }
+    }
+
+private:
+    size_t m_frameSize;
+    Header* m_free = nullptr;
+    uint32_t m_numInUse = 0;
+    uint32_t m_highWaterMark = 0;
+};
+
+/**
+ * A fixed-size pool of coroutine frames for CoroutineState bodies, so running a body never
+ * touches the heap.
+ *
+ * A frame is allocated when a coroutine state is entered and freed when it is exited (or its body
+ * returns), so the pool needs as many frames as coroutine states can be active at once, and each
+ * frame must be as large as the largest body's frame. The size of a coroutine frame is only known
+ * to the compiler: start with a generous FrameSize and trim it, or check highWaterMark() and a
+ * failed entry in tests (see CoroutineState::isRunning()).
+ *
+ * @tparam FrameSize The maximum frame size in bytes.
+ * @tparam NumFrames The number of frames.
+ */
+template <size_t FrameSize, uint32_t NumFrames>
+class CoroutineFramePool : public CoroutineFrameAllocator {
+public:
+    static_assert(NumFrames > 0, "NumFrames must be at least 1.");
+
+    CoroutineFramePool() :
+            CoroutineFrameAllocator(m_blocks, BLOCK_SIZE, NumFrames) {}
+
+private:
+    static constexpr size_t BLOCK_SIZE =
+        sizeof(Header) + (FrameSize + sizeof(Header) - 1) / sizeof(Header) * sizeof(Header);
+
+    Header m_blocks[NumFrames * (BLOCK_SIZE / sizeof(Header))];
+};
+
+template <typename EventType>
+class CoroutineState;
+
+/**
+ * The return type of a CoroutineState's body: a coroutine that co_awaits events from the state
+ * (see CoroutineState::nextEvent()). It starts suspended; the state runs it when entered.
+ *
+ * The body must take the CoroutineState as a parameter, which is how its frame is allocated from
+ * the state's CoroutineFramePool.
+ */
+template <typename EventType>
+class CoroutineBody {
+public:
+    struct promise_type {
+        CoroutineBody get_return_object() {
+            return CoroutineBody(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        /**
+         * Makes allocation failures return an empty body rather than throw.
+         */
+        static CoroutineBody get_return_object_on_allocation_failure() {
+            return CoroutineBody(nullptr);
+        }
+
+        /**
+         * Allocates the frame from the pool of the CoroutineState among the body's parameters.
+         */
+        template <typename... Args>
+        static void* operator new(size_t size, Args&... args) noexcept {
+            static_assert(!std::is_same<decltype(findState(args...)), std::nullptr_t>::value,
+                "A coroutine state's body must take the CoroutineState as a parameter.");
+            return findState(args...)->m_framePool->allocate(size);
+        }
+
+        static void operator delete(void* frame) {
+            CoroutineFrameAllocator::deallocate(frame);
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+    private:
+        static std::nullptr_t findState() {
+            return nullptr;
+        }
+
+        template <typename First, typename... Rest>
+        static auto findState(First& first, Rest&... rest) {
+            if constexpr (std::is_base_of<CoroutineState<EventType>, First>::value) {
+                return static_cast<CoroutineState<EventType>*>(&first);
+            } else {
+                return findState(rest...);
+            }
+        }
+    };
+
+    CoroutineBody(CoroutineBody&& other) noexcept :
+            m_handle(std::exchange(other.m_handle, nullptr)) {}
+
+    CoroutineBody(const CoroutineBody&) = delete;
+    CoroutineBody& operator=(const CoroutineBody&) = delete;
+    CoroutineBody& operator=(CoroutineBody&&) = delete;
+
+    ~CoroutineBody() {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+private:
+    friend class CoroutineState<EventType>;
+
+    explicit CoroutineBody(std::coroutine_handle<promise_type> handle) :
+            m_handle(handle) {}
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+/**
+ * A State whose behaviour is a coroutine (its "body") rather than entry()/event()/exit()
+ * callbacks, for long sequential behaviours like "send, wait for an ack or a timeout, retry three
+ * times" that would otherwise be split across many states. Built with makeCoroutineState().
+ *
+ * @code
+ * CoroutineBody<Event> MyStateMachine::sending_body(CoroutineState<Event>& state) {
+ *     for (int attempt = 0; attempt < 3; attempt++) {
+ *         send();
+ *         const Event* reply = co_await state.nextEvent(&isAck, Event(EventId::ACK_TIMEOUT), 500);
+ *         if (reply != nullptr) {
+ *             m_stateMachine.transitionTo(m_connected);
+ *             co_return;
+ *         }
+ *     }
+ *     m_stateMachine.transitionTo(m_failed);
+ * }
+ * @endcode
+ *
+ * Entering the state starts the body, which runs until its first co_await. Each co_await of
+ * nextEvent() then suspends the body until handleEvent() is given an event the matcher accepts.
+ * That event is claimed (it does not bubble up) and the body resumes from inside handleEvent(),
+ * so it can call transitionTo() just like an event() handler. Events the body is not waiting for
+ * bubble up to the parent as usual. Exiting the state destroys the body wherever it is suspended
+ * (running the destructors of its locals), and a body that returns simply leaves the state
+ * waiting for a transition.
+ *
+ * If the body calls transitionTo() to leave the state, it should co_return straight away: the
+ * body is destroyed at its next co_await, without waiting. If that transition comes back into the
+ * state (a self-transition, or another state's entry() transitioning back), the new body starts
+ * from the top once the old one has been destroyed there. Frames come from a
+ * CoroutineFramePool; if the pool is out of frames the body does not run (see isRunning()).
+ *
+ * A CoroutineState cannot be copied or moved, since its delegates point at itself: declare it as
+ * a CoroutineState member initialised from makeCoroutineState().
+ *
+ * Needs C++20 coroutines; only defined if the compiler supports them.
+ *
+ * @tparam EventType The state machine's event type.
+ */
+template <typename EventType>
+class CoroutineState : public State<EventType> {
+    using Base = State<EventType>;
+
+public:
+    /**
+     * Starts the body: calls the coroutine function, which allocates its frame.
+     */
+    using BodyDelegate = etl::delegate<CoroutineBody<EventType>(CoroutineState&)>;
+
+    /**
+     * @param[in] name         Human readable name for the state.
+     * @param[in] body         Calls the body coroutine.
+     * @param[in] eventHandled Calls the state machine's eventHandled().
+     * @param[in] framePool    The pool to allocate the body's frame from.
+     * @param[in] parent       Pointer to the parent state, or nullptr for a top-level state.
+     */
+    CoroutineState(
+        const char * name,
+        BodyDelegate body,
+        etl::delegate<void()> eventHandled,
+        CoroutineFrameAllocator & framePool,
+        Base * parent) :
+            Base(
+                name,
+                Base::EntryDelegate::template create<CoroutineState, &CoroutineState::start>(*this),
+                Base::EventDelegate::template create<CoroutineState, &CoroutineState::dispatch>(*this),
+                Base::ExitDelegate::template create<CoroutineState, &CoroutineState::stop>(*this),
+                parent),
+            m_body(body),
+            m_eventHandled(eventHandled),
+            m_framePool(&framePool) {}
+
+    CoroutineState(const CoroutineState&) = delete;
+    CoroutineState& operator=(const CoroutineState&) = delete;
+
+    ~CoroutineState() {
+        destroyBody();
+    }
+
+    /**
+     * Use @p timers for the timeouts of nextEvent(). The timeout event is delivered to
+     * @p stateMachine like any timer's, and the timer is tied to this state, so it never fires
+     * after the state has been exited.
+     *
+     * @param[in] timers       The timer service.
+     * @param[in] stateMachine The state machine this state belongs to.
+     */
+    template <size_t NumLevels, typename StateMachineType>
+    void setTimerService(TimerService<EventType, NumLevels>& timers, StateMachineType& stateMachine) {
+        m_timers = &timers;
+        m_stateMachine = &stateMachine;
+        m_startTimer = &startTimer<NumLevels, StateMachineType>;
+        m_deliverTimeout = &detail::deliverTimerEvent<StateMachineType, EventType>;
+    }
+
+    /**
+     * Await the next event that @p matcher accepts.
+     *
+     * @code
+     * const Event& event = co_await state.nextEvent([](const Event& e) { return e.id == EventId::ACK; });
+     * @endcode
+     *
+     * @param[in] matcher Any callable taking `const EventType&` and returning bool. Kept in the
+     *                    body's frame while it waits, so it may capture by value or reference.
+     * @return An awaitable whose result is the matched event (a reference valid until the body's
+     *         next co_await).
+     */
+    template <typename Matcher>
+    auto nextEvent(Matcher matcher) {
+        return EventAwaiter<Matcher>(*this, std::move(matcher));
+    }
+
+    /**
+     * Await the next event that @p matcher accepts, or a timeout: @p timeoutEvent is delivered
+     * after @p delay ticks unless a matching event arrives first. Needs setTimerService().
+     *
+     * @param[in] matcher      Any callable taking `const EventType&` and returning bool.
+     * @param[in] timeoutEvent The event the timer delivers.
+     * @param[in] delay        Ticks until the timeout.
+     * @return An awaitable whose result is a pointer to the matched event (valid until the body's
+     *         next co_await), or nullptr if the wait timed out.
+     */
+    template <typename Matcher>
+    auto nextEvent(Matcher matcher, EventType timeoutEvent, uint64_t delay) {
+        return TimeoutAwaiter<Matcher>(*this, std::move(matcher), std::move(timeoutEvent), delay);
+    }
+
+    /**
+     * @return True from when the state is entered until its body returns or the state is exited.
+     *         False straight after entry if the frame pool was out of frames.
+     */
+    bool isRunning() const {
+        return m_handle && !m_handle.done();
+    }
+
+private:
+    friend struct CoroutineBody<EventType>::promise_type;
+
+    using Handle = std::coroutine_handle<typename CoroutineBody<EventType>::promise_type>;
+
+    /**
+     * The awaiter of nextEvent(): registers the matcher with the state while suspended.
+     */
+    template <typename Matcher>
+    class EventAwaiter {
+    public:
+        EventAwaiter(CoroutineState& state, Matcher matcher) :
+                m_state(state),
+                m_matcher(std::move(matcher)) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<>) {
+            m_state.wait(&m_matcher, &match<Matcher>);
+        }
+
+        const EventType& await_resume() const {
+            return *m_state.m_event;
+        }
+
+    private:
+        CoroutineState& m_state;
+        Matcher m_matcher;
+    };
+
+    /**
+     * The awaiter of nextEvent() with a timeout: also arms the state's timer while suspended.
+     */
+    template <typename Matcher>
+    class TimeoutAwaiter {
+    public:
+        TimeoutAwaiter(CoroutineState& state, Matcher matcher, EventType timeoutEvent, uint64_t delay) :
+                m_state(state),
+                m_matcher(std::move(matcher)),
+                m_timeoutEvent(std::move(timeoutEvent)),
+                m_delay(delay) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<>) {
+            if (m_state.wait(&m_matcher, &match<Matcher>)) {
+                m_state.m_timeoutArmed = m_state.m_startTimer(m_state, std::move(m_timeoutEvent), m_delay);
+            }
+        }
+
+        const EventType* await_resume() const {
+            return m_state.m_timedOut ? nullptr : m_state.m_event;
+        }
+
+    private:
+        CoroutineState& m_state;
+        Matcher m_matcher;
+        EventType m_timeoutEvent;
+        uint64_t m_delay;
+    };
+
+    template <typename Matcher>
+    static bool match(const void* matcher, const EventType& event) {
+        return (*static_cast<const Matcher*>(matcher))(event);
+    }
+
+    /**
+     * What the timer delivers its event to: tells the state which event is its timeout on the
+     * way to the state machine.
+     */
+    struct TimeoutTarget {
+        void handleEvent(const EventType& event) {
+            state->m_timeoutEvent = &event;
+            state->m_deliverTimeout(state->m_stateMachine, event);
+            state->m_timeoutEvent = nullptr;
+        }
+
+        CoroutineState* state;
+    };
+
+    /**
+     * @return False if the timer could not be started (see TimerService::start()).
+     */
+    template <size_t NumLevels, typename StateMachineType>
+    static bool startTimer(CoroutineState& state, EventType&& event, uint64_t delay) {
+        StateMachineType& stateMachine = *static_cast<StateMachineType*>(state.m_stateMachine);
+        if (detail::ParallelRegionCheck<StateMachineType>::reject(stateMachine)) {
+            return false;
+        }
+        return static_cast<TimerService<EventType, NumLevels>*>(state.m_timers)->startInState(
+            state.m_timer, state.m_timeoutTarget, state, std::move(event), delay);
+    }
+
+    /**
+     * Called by an awaiter as the body suspends.
+     *
+     * @return False if the state has already been exited or re-entered (the body is about to be
+     *         destroyed).
+     */
+    bool wait(const void* matcher, bool (*match)(const void*, const EventType&)) {
+        if (m_exited || m_restartPending) {
+            return false;
+        }
+        m_matcher = matcher;
+        m_match = match;
+        m_timedOut = false;
+        return true;
+    }
+
+    /**
+     * The entry() handler: start the body and run it to its first co_await. If the body is what
+     * is re-entering the state, it is still running, so have resume() restart it once it
+     * suspends.
+     */
+    void start() {
+        if (m_running) {
+            m_restartPending = true;
+            return;
+        }
+        // A body left over from an entry that was cut short (an entry guard).
+        destroyBody();
+        m_exited = false;
+        CoroutineBody<EventType> body = m_body(*this);
+        m_handle = std::exchange(body.m_handle, nullptr);
+        if (m_handle) {
+            resume();
+        }
+    }
+
+    /**
+     * The event() handler: resume the body if it is waiting for this event (or for a timeout
+     * that this is the delivery of). Otherwise do nothing, so the event bubbles up.
+     */
+    void dispatch(const EventType& event) {
+        if (m_matcher == nullptr) {
+            return;
+        }
+        // Only the event the timer is delivering right now (a child state may have claimed an
+        // earlier one).
+        const bool timedOut = m_timeoutArmed && &event == m_timeoutEvent;
+        if (!timedOut && !m_match(m_matcher, event)) {
+            return;
+        }
+        m_timedOut = timedOut;
+        m_eventHandled();
+        resume(&event);
+    }
+
+    /**
+     * The exit() handler: destroy the body, or if the body is what is exiting the state (by
+     * calling transitionTo()), have resume() destroy it once it suspends.
+     */
+    void stop() {
+        m_exited = true;
+        m_restartPending = false;
+        if (!m_running) {
+            destroyBody();
+        }
+    }
+
+    void resume(const EventType* event = nullptr) {
+        m_event = event;
+        m_matcher = nullptr;
+        if (m_timeoutArmed) {
+            m_timeoutArmed = false;
+            m_timer.cancel();
+        }
+        m_running = true;
+        m_handle.resume();
+        m_running = false;
+        m_event = nullptr;
+        if (m_restartPending) {
+            m_restartPending = false;
+            start();
+        } else if (m_exited || m_handle.done()) {
+            destroyBody();
+        }
+    }
+
+    void destroyBody() {
+        if (m_handle) {
+            m_handle.destroy();
+            m_handle = nullptr;
+        }
+        m_matcher = nullptr;
+        if (m_timeoutArmed) {
+            m_timeoutArmed = false;
+            m_timer.cancel();
+        }
+    }
+
+    BodyDelegate m_body;
+    etl::delegate<void()> m_eventHandled;
+    CoroutineFrameAllocator * m_framePool;
+    Handle m_handle = nullptr;
+
+    /**
+     * While the body waits: the awaiter's matcher, and a function calling it. Null otherwise.
+     */
+    const void * m_matcher = nullptr;
+    bool (*m_match)(const void*, const EventType&) = nullptr;
+
+    /**
+     * The event the body was resumed with, while it runs.
+     */
+    const EventType * m_event = nullptr;
+
+    bool m_running = false;
+    bool m_exited = true;
+    bool m_restartPending = false;
+    bool m_timeoutArmed = false;
+    bool m_timedOut = false;
+
+    /**
+     * The timeout event, while the timer is delivering it.
+     */
+    const EventType * m_timeoutEvent = nullptr;
+
+    Timer<EventType> m_timer;
+    TimeoutTarget m_timeoutTarget{this};
+    void * m_timers = nullptr;
+    void * m_stateMachine = nullptr;
+    bool (*m_startTimer)(CoroutineState&, EventType&&, uint64_t) = nullptr;
+    void (*m_deliverTimeout)(void*, const EventType&) = nullptr;
+}; // class CoroutineState
+
+/**
+ * Build a CoroutineState whose body is the member coroutine @p Body of @p self.
+ *
+ * @code
+ * CoroutineFramePool<256, 2> m_framePool;
+ * CoroutineState<Event> m_sending = makeCoroutineState<Event, &MyStateMachine::sending_body>(
+ *     "Sending", *this, m_stateMachine, m_framePool);
+ * @endcode
+ *
+ * @tparam EventType        The state machine's event type.
+ * @tparam Body             Pointer to the body, a member function
+ *                          `CoroutineBody<EventType> (CoroutineState<EventType>&)`.
+ * @tparam Self             The class that owns the body. Deduced from @p self.
+ * @tparam StateMachineType The state machine's type. Deduced from @p stateMachine.
+ * @param[in] name         Human readable name for the state.
+ * @param[in] self         The instance the body is called on.
+ * @param[in] stateMachine The state machine the state belongs to.
+ * @param[in] framePool    The pool to allocate the body's frame from.
+ * @param[in] parent       Pointer to the parent state, or nullptr (the default) for a top-level
+ *                         state.
+ * @return A fully constructed CoroutineState.
+ */
+template <typename EventType, auto Body, typename Self, typename StateMachineType>
+CoroutineState<EventType> makeCoroutineState(
+        const char * name,
+        Self & self,
+        StateMachineType & stateMachine,
+        CoroutineFrameAllocator & framePool,
+        State<EventType> * parent = nullptr) {
+    return CoroutineState<EventType>(
+        name,
+        CoroutineState<EventType>::BodyDelegate::template create<Self, Body>(self),
+        etl::delegate<void()>::template create<StateMachineType, &StateMachineType::eventHandled>(stateMachine),
+        framePool,
+        parent);
+}
+
+} // namespace NinjaHSM
+
+#endif
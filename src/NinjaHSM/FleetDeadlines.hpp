@@ -0,0 +1,282 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__AVX512F__) || defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace NinjaHSM {
+
+namespace detail {
+
+/**
+ * @return The index of the least significant set bit of @p value, which must not be 0.
+ */
+inline uint8_t lowestSetBit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<uint8_t>(__builtin_ctzll(value));
+#else
+    uint8_t bit = 0;
+    while ((value & 1) == 0) {
+        value >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+/**
+ * @return The number of set bits in @p value.
+ */
+inline uint8_t countSetBits(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<uint8_t>(__builtin_popcountll(value));
+#else
+    uint8_t count = 0;
+    for (; value != 0; value &= value - 1) {
+        count++;
+    }
+    return count;
+#endif
+}
+
+/**
+ * Compare a block of 64 deadlines against @p now.
+ *
+ * A deadline has expired when it is not after now, compared as the signed difference
+ * (deadline - now) so the tick counter may wrap around. Vectorised with whichever of AVX-512,
+ * AVX2 or SSE the compiler targets (e.g. -mavx2 or -march=native), otherwise a plain loop.
+ *
+ * @param[in] deadlines 64 deadlines, aligned to 64 bytes.
+ * @param[in] now       The current tick.
+ * @return Bit i is set if deadlines[i] has expired.
+ */
+template <typename Tick>
+inline uint64_t scanDeadlineBlock(const Tick* deadlines, Tick now) {
+    static_assert(std::is_same<Tick, uint32_t>::value || std::is_same<Tick, uint64_t>::value,
+        "Tick must be uint32_t or uint64_t.");
+    uint64_t expired = 0;
+#if defined(__AVX512F__)
+    if (sizeof(Tick) == 4) {
+        const __m512i nowVector = _mm512_set1_epi32(static_cast<int32_t>(now));
+        for (size_t i = 0; i < 64; i += 16) {
+            const __m512i diff = _mm512_sub_epi32(_mm512_load_si512(deadlines + i), nowVector);
+            expired |= uint64_t(_mm512_cmple_epi32_mask(diff, _mm512_setzero_si512())) << i;
+        }
+    } else {
+        const __m512i nowVector = _mm512_set1_epi64(static_cast<int64_t>(now));
+        for (size_t i = 0; i < 64; i += 8) {
+            const __m512i diff = _mm512_sub_epi64(_mm512_load_si512(deadlines + i), nowVector);
+            expired |= uint64_t(_mm512_cmple_epi64_mask(diff, _mm512_setzero_si512())) << i;
+        }
+    }
+#elif defined(__AVX2__)
+    // No "less or equal" compare: find the deadlines still in the future and invert.
+    if (sizeof(Tick) == 4) {
+        const __m256i nowVector = _mm256_set1_epi32(static_cast<int32_t>(now));
+        for (size_t i = 0; i < 64; i += 8) {
+            const __m256i deadline = _mm256_load_si256(reinterpret_cast<const __m256i*>(deadlines + i));
+            const __m256i pending = _mm256_cmpgt_epi32(_mm256_sub_epi32(deadline, nowVector), _mm256_setzero_si256());
+            expired |= uint64_t(~_mm256_movemask_ps(_mm256_castsi256_ps(pending)) & 0xFF) << i;
+        }
+    } else {
+        const __m256i nowVector = _mm256_set1_epi64x(static_cast<int64_t>(now));
+        for (size_t i = 0; i < 64; i += 4) {
+            const __m256i deadline = _mm256_load_si256(reinterpret_cast<const __m256i*>(deadlines + i));
+            const __m256i pending = _mm256_cmpgt_epi64(_mm256_sub_epi64(deadline, nowVector), _mm256_setzero_si256());
+            expired |= uint64_t(~_mm256_movemask_pd(_mm256_castsi256_pd(pending)) & 0xF) << i;
+        }
+    }
+#elif defined(__SSE2__)
+    if (sizeof(Tick) == 4) {
+        const __m128i nowVector = _mm_set1_epi32(static_cast<int32_t>(now));
+        for (size_t i = 0; i < 64; i += 4) {
+            const __m128i deadline = _mm_load_si128(reinterpret_cast<const __m128i*>(deadlines + i));
+            const __m128i pending = _mm_cmpgt_epi32(_mm_sub_epi32(deadline, nowVector), _mm_setzero_si128());
+            expired |= uint64_t(~_mm_movemask_ps(_mm_castsi128_ps(pending)) & 0xF) << i;
+        }
+    } else {
+#if defined(__SSE4_2__)
+        const __m128i nowVector = _mm_set1_epi64x(static_cast<int64_t>(now));
+        for (size_t i = 0; i < 64; i += 2) {
+            const __m128i deadline = _mm_load_si128(reinterpret_cast<const __m128i*>(deadlines + i));
+            const __m128i pending = _mm_cmpgt_epi64(_mm_sub_epi64(deadline, nowVector), _mm_setzero_si128());
+            expired |= uint64_t(~_mm_movemask_pd(_mm_castsi128_pd(pending)) & 0x3) << i;
+        }
+#else
+        // SSE2 has no 64-bit compare.
+        for (size_t i = 0; i < 64; i++) {
+            expired |= uint64_t(static_cast<int64_t>(deadlines[i] - now) <= 0) << i;
+        }
+#endif
+    }
+#else
+    using Signed = typename std::make_signed<Tick>::type;
+    for (size_t i = 0; i < 64; i++) {
+        expired |= uint64_t(static_cast<Signed>(deadlines[i] - now) <= 0) << i;
+    }
+#endif
+    return expired;
+}
+
+} // namespace detail
+
+/**
+ * One deadline per instance of a fleet of state machines (e.g. a StateFleet), stored contiguously
+ * so that finding every expired instance is a linear, vectorised scan.
+ *
+ * Each instance has at most one armed deadline, typically its current state's timeout: arm() it
+ * when entering the state and disarm() it when leaving. scan() compares all deadlines against the
+ * current tick (with AVX-512, AVX2 or SSE if the compiler targets them, otherwise a plain loop
+ * the compiler can auto-vectorise) and produces a bitmask of the expired instances, one bit per
+ * instance; dispatchExpired() also disarms each expired instance and delivers a timeout event to
+ * it through the fleet's handleEvent().
+ *
+ * @code
+ * FleetDeadlines<100000> g_deadlines;
+ *
+ * void Particle::collided_entry() {
+ *     g_deadlines.arm(g_fleet.indexOf(*this), millis() + 500);
+ * }
+ *
+ * // Each tick:
+ * g_deadlines.dispatchExpired(g_fleet, millis(), Event(EventId::TIMEOUT));
+ * @endcode
+ *
+ * Ticks wrap around: a deadline is expired once it is not after now, judged by the signed
+ * difference, so deadlines must be less than half the tick range (2^31 ticks for uint32_t) away.
+ * The default 32-bit tick halves the memory the scan has to stream compared to uint64_t. Unarmed
+ * instances cost nothing to skip when a whole block of 64 is unarmed.
+ *
+ * Not thread-safe. Like the fleet, use it from one context.
+ *
+ * @tparam Capacity The number of instances.
+ * @tparam Tick     The tick type, uint32_t or uint64_t.
+ */
+template <size_t Capacity, typename Tick = uint32_t>
+class FleetDeadlines {
+public:
+    static_assert(Capacity > 0, "FleetDeadlines needs at least one instance.");
+
+    /**
+     * The number of 64-bit words in a bitmask of expired instances.
+     */
+    static constexpr size_t NUM_MASK_WORDS = (Capacity + 63) / 64;
+
+    FleetDeadlines() {
+        for (Tick& deadline : m_deadlines) {
+            deadline = 0;
+        }
+        for (size_t word = 0; word < NUM_MASK_WORDS; word++) {
+            m_armed[word] = 0;
+            m_expired[word] = 0;
+        }
+    }
+
+    static constexpr size_t capacity() {
+        return Capacity;
+    }
+
+    /**
+     * Set an instance's deadline, replacing any it already had.
+     *
+     * @param[in] instance The index of the instance.
+     * @param[in] deadline The tick at which the instance times out.
+     */
+    void arm(size_t instance, Tick deadline) {
+        m_deadlines[instance] = deadline;
+        m_armed[instance / 64] |= uint64_t(1) << (instance % 64);
+    }
+
+    /**
+     * Clear an instance's deadline. Does nothing if it has none.
+     *
+     * @param[in] instance The index of the instance.
+     */
+    void disarm(size_t instance) {
+        m_armed[instance / 64] &= ~(uint64_t(1) << (instance % 64));
+    }
+
+    /**
+     * @param[in] instance The index of the instance.
+     * @return True if the instance has a deadline.
+     */
+    bool isArmed(size_t instance) const {
+        return (m_armed[instance / 64] >> (instance % 64)) & 1;
+    }
+
+    /**
+     * @param[in] instance The index of the instance.
+     * @return The instance's deadline (only meaningful while armed).
+     */
+    Tick getDeadline(size_t instance) const {
+        return m_deadlines[instance];
+    }
+
+    /**
+     * Find every armed instance whose deadline has expired. Does not disarm them.
+     *
+     * @param[in]  now     The current tick.
+     * @param[out] expired Bit (i % 64) of word (i / 64) is set if instance i has expired.
+     * @return The number of expired instances.
+     */
+    size_t scan(Tick now, uint64_t (&expired)[NUM_MASK_WORDS]) const {
+        size_t numExpired = 0;
+        for (size_t word = 0; word < NUM_MASK_WORDS; word++) {
+            const uint64_t armed = m_armed[word];
+            expired[word] = armed == 0 ? 0 : detail::scanDeadlineBlock(&m_deadlines[word * 64], now) & armed;
+            numExpired += detail::countSetBits(expired[word]);
+        }
+        return numExpired;
+    }
+
+    /**
+     * Disarm every expired instance and provide @p event to each, in index order, through
+     * fleet.handleEvent(instance, event). Handlers may arm() a new deadline (for their own
+     * instance or others). An instance an earlier handler disarmed, or re-armed to a later
+     * deadline, is skipped; one that only becomes expired during the dispatch is left for next
+     * time.
+     *
+     * @param[in] fleet Any fleet with a handleEvent(size_t instance, const EventType&) method,
+     *                  e.g. a StateFleet with the same capacity.
+     * @param[in] now   The current tick.
+     * @param[in] event The timeout event.
+     * @return The number of instances the event was provided to.
+     */
+    template <typename Fleet, typename EventType>
+    size_t dispatchExpired(Fleet& fleet, Tick now, const EventType& event) {
+        using Signed = typename std::make_signed<Tick>::type;
+        scan(now, m_expired);
+        size_t numDispatched = 0;
+        for (size_t word = 0; word < NUM_MASK_WORDS; word++) {
+            for (uint64_t bits = m_expired[word]; bits != 0; bits &= bits - 1) {
+                const size_t instance = word * 64 + detail::lowestSetBit(bits);
+                // An earlier handler may have disarmed or re-armed this instance.
+                if (!isArmed(instance) || static_cast<Signed>(m_deadlines[instance] - now) > 0) {
+                    continue;
+                }
+                disarm(instance);
+                fleet.handleEvent(instance, event);
+                numDispatched++;
+            }
+        }
+        return numDispatched;
+    }
+
+private:
+    /**
+     * Padded to whole blocks of 64 (the padding is never armed) so the scan has no tail.
+     */
+    alignas(64) Tick m_deadlines[NUM_MASK_WORDS * 64];
+    uint64_t m_armed[NUM_MASK_WORDS];
+
+    /**
+     * Scratch bitmask for dispatchExpired().
+     */
+    uint64_t m_expired[NUM_MASK_WORDS];
+}; // class FleetDeadlines
+
+} // namespace NinjaHSM
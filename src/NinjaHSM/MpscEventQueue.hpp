@@ -0,0 +1,300 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <thread>
+#include <utility>
+
+#include "SpscEventQueue.hpp"
+
+namespace NinjaHSM {
+
+/**
+ * What MpscEventQueue::push() does when the queue is full.
+ */
+enum class FullQueuePolicy {
+    /**
+     * push() fails immediately and the event is dropped (counted in MpscEventQueueStats).
+     */
+    Drop,
+
+    /**
+     * push() yields and retries until the consumer frees a slot, so no event is ever dropped.
+     * Only use this if the consumer runs on a different thread to every producer, otherwise a
+     * full queue deadlocks.
+     */
+    Retry,
+};
+
+/**
+ * Counters kept by MpscEventQueue to help tune its capacity. The drop, contention and retry
+ * counters are only updated on slow paths. The high-water mark costs each push() a read of the
+ * consumer's index, and is only written when it grows, so pop() does no bookkeeping at all.
+ */
+struct MpscEventQueueStats {
+    /**
+     * Events rejected by push() because the queue was full (FullQueuePolicy::Drop).
+     */
+    uint64_t numDropped = 0;
+
+    /**
+     * Times a producer lost a race with another producer for a slot and had to try again.
+     */
+    uint64_t numContended = 0;
+
+    /**
+     * Times a producer found the queue full and retried (FullQueuePolicy::Retry).
+     */
+    uint64_t numFullRetries = 0;
+
+    /**
+     * The most events queued at once, as seen by producers just after claiming a slot (events
+     * the consumer is in the middle of popping may be counted).
+     */
+    uint32_t highWaterMark = 0;
+};
+
+/**
+ * A bounded, lock-free, multi-producer/single-consumer queue of events, for feeding one state
+ * machine from several threads without serializing them on a mutex.
+ *
+ * Based on Dmitry Vyukov's bounded MPMC array queue: every slot has a sequence number that tells
+ * producers whether it is free and tells the consumer whether it has been filled, so producers
+ * only contend on a single compare-and-swap of the enqueue index. The consumer side is
+ * simplified for a single consumer. Events are stored inline, so there is no dynamic allocation.
+ *
+ * This uses std::thread (for yielding under FullQueuePolicy::Retry) and 64-bit atomics, so it
+ * is intended for hosted (e.g. Linux) targets and is not included by NinjaHSM.hpp. Include
+ * <NinjaHSM/MpscEventQueue.hpp> explicitly. To put it in front of a state machine, use it as the
+ * queue of a QueuedStateMachine:
+ *
+ * @code
+ * QueuedStateMachine<Event, 1024, CACHE_LINE_SIZE, MpscEventQueue> m_stateMachine;
+ * @endcode
+ *
+ * @tparam EventType      The type of event stored.
+ * @tparam Capacity       The maximum number of events queued at once. Must be a power of two.
+ * @tparam IndexAlignment Alignment of the producer index, consumer index and counters (each is
+ *                        kept on its own cache line by default).
+ */
+template <typename EventType, size_t Capacity, size_t IndexAlignment = CACHE_LINE_SIZE>
+class MpscEventQueue {
+public:
+    static_assert(Capacity > 1 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two (and at least 2).");
+    static_assert(Capacity <= UINT32_MAX / 2, "Capacity is too large for 32-bit indices.");
+
+    MpscEventQueue() {
+        for (uint32_t i = 0; i < Capacity; i++) {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscEventQueue(const MpscEventQueue&) = delete;
+    MpscEventQueue& operator=(const MpscEventQueue&) = delete;
+
+    ~MpscEventQueue() {
+        while (pop([](EventType&&) {})) {}
+    }
+
+    /**
+     * Set what push() does when the queue is full. Defaults to FullQueuePolicy::Drop. Set this
+     * before producers start pushing.
+     *
+     * @param[in] policy The policy to use.
+     */
+    void setFullQueuePolicy(FullQueuePolicy policy) {
+        m_fullQueuePolicy = policy;
+    }
+
+    /**
+     * Add an event to the back of the queue. May be called from any number of threads at once.
+     *
+     * @param[in] event The event to copy into the queue.
+     * @return True if the event was queued, false if the queue was full and the event was dropped
+     *         (FullQueuePolicy::Drop only).
+     */
+    bool push(const EventType& event) {
+        return emplace(event, [](uint32_t) {});
+    }
+
+    /**
+     * Same as push(), but moves the event into the queue.
+     */
+    bool push(EventType&& event) {
+        return emplace(std::move(event), [](uint32_t) {});
+    }
+
+    /**
+     * Same as push(), but also calls @p onClaimed with the event's position in the queue once
+     * its slot is claimed, before the consumer can see it. The position is the number of events
+     * pushed before this one (wrapping at 2^32), so a consumer that counts the events it pops
+     * knows which is which, e.g. to look up data kept alongside the queue at
+     * `position & (Capacity - 1)`. Not called if the event is not queued.
+     *
+     * @param[in] event     The event to move into the queue.
+     * @param[in] onClaimed Callable taking the position (uint32_t).
+     * @return Same as push().
+     */
+    template <typename OnClaimed>
+    bool push(EventType&& event, OnClaimed&& onClaimed) {
+        return emplace(std::move(event), onClaimed);
+    }
+
+    /**
+     * Remove the event at the front of the queue and pass it to @p consumer. Only one thread may
+     * call this. The event is destroyed (and its slot freed) after @p consumer returns.
+     *
+     * Note that, as in any queue of this design, a producer that has claimed a slot but not yet
+     * finished writing it makes the queue look empty to the consumer until it does.
+     *
+     * @param[in] consumer Callable taking EventType&& (e.g. a lambda that dispatches the event).
+     * @return True if an event was consumed, false if the queue was empty.
+     */
+    template <typename Consumer>
+    bool pop(Consumer&& consumer) {
+        const uint32_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        Cell& cell = m_cells[pos & (Capacity - 1)];
+        if (cell.sequence.load(std::memory_order_acquire) != pos + 1) {
+            return false;
+        }
+
+        EventType* event = std::launder(reinterpret_cast<EventType*>(&cell.storage[0]));
+        consumer(std::move(*event));
+        event->~EventType();
+        // Advance the index before freeing the slot, so the producer that claims it never counts
+        // more than Capacity events queued.
+        m_dequeuePos.store(pos + 1, std::memory_order_relaxed);
+        // Mark the slot free for the producer that will wrap around to it.
+        cell.sequence.store(pos + Capacity, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @return True if there are no events in the queue (a snapshot).
+     */
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /**
+     * @return The number of events in the queue, including any still being written by a producer
+     *         (a snapshot).
+     */
+    size_t size() const {
+        const uint32_t dequeuePos = m_dequeuePos.load(std::memory_order_acquire);
+        const uint32_t enqueuePos = m_enqueuePos.load(std::memory_order_acquire);
+        return enqueuePos - dequeuePos;
+    }
+
+    static constexpr size_t capacity() {
+        return Capacity;
+    }
+
+    /**
+     * @return A snapshot of the queue's counters.
+     */
+    MpscEventQueueStats getStats() const {
+        MpscEventQueueStats stats;
+        stats.numDropped = m_numDropped.load(std::memory_order_relaxed);
+        stats.numContended = m_numContended.load(std::memory_order_relaxed);
+        stats.numFullRetries = m_numFullRetries.load(std::memory_order_relaxed);
+        stats.highWaterMark = m_highWaterMark.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    /**
+     * Zero the counters.
+     */
+    void resetStats() {
+        m_numDropped.store(0, std::memory_order_relaxed);
+        m_numContended.store(0, std::memory_order_relaxed);
+        m_numFullRetries.store(0, std::memory_order_relaxed);
+        m_highWaterMark.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    struct Cell {
+        /**
+         * pos when the slot is free for the producer claiming index pos, pos + 1 once that
+         * producer has written it, and pos + Capacity once the consumer has emptied it again.
+         */
+        std::atomic<uint32_t> sequence;
+        alignas(EventType) unsigned char storage[sizeof(EventType)];
+    };
+
+    template <typename T, typename OnClaimed>
+    bool emplace(T&& event, OnClaimed&& onClaimed) {
+        uint32_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &m_cells[pos & (Capacity - 1)];
+            const uint32_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const int32_t diff = static_cast<int32_t>(sequence - pos);
+            if (diff == 0) {
+                // The slot is free. Claim it, unless another producer beats us to it (in which
+                // case pos is updated to the current index and we go around again).
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+                m_numContended.fetch_add(1, std::memory_order_relaxed);
+            } else if (diff < 0) {
+                // The slot still holds the event from one lap ago: the queue is full.
+                if (m_fullQueuePolicy == FullQueuePolicy::Drop) {
+                    m_numDropped.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                m_numFullRetries.fetch_add(1, std::memory_order_relaxed);
+                std::this_thread::yield();
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            } else {
+                // Another producer claimed this slot since we read the index.
+                m_numContended.fetch_add(1, std::memory_order_relaxed);
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        new (&cell->storage[0]) EventType(std::forward<T>(event));
+        onClaimed(pos);
+        // Read before publishing: until then the consumer can't get past this slot, so the count
+        // is between 1 and Capacity.
+        const uint32_t occupancy = pos + 1 - m_dequeuePos.load(std::memory_order_relaxed);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        raiseHighWaterMark(occupancy);
+        return true;
+    }
+
+    /**
+     * Raise the high-water mark to @p occupancy if it is lower. Only writes (to a line that is
+     * otherwise only written on slow paths) when it actually grows.
+     */
+    void raiseHighWaterMark(uint32_t occupancy) {
+        uint32_t highWaterMark = m_highWaterMark.load(std::memory_order_relaxed);
+        while (occupancy > highWaterMark
+                && !m_highWaterMark.compare_exchange_weak(highWaterMark, occupancy, std::memory_order_relaxed)) {}
+    }
+
+    Cell m_cells[Capacity];
+
+    FullQueuePolicy m_fullQueuePolicy = FullQueuePolicy::Drop;
+
+    /**
+     * Written by every producer.
+     */
+    alignas(IndexAlignment) std::atomic<uint32_t> m_enqueuePos{0};
+
+    /**
+     * Written only by the consumer.
+     */
+    alignas(IndexAlignment) std::atomic<uint32_t> m_dequeuePos{0};
+
+    /**
+     * Counters, written by producers only on slow paths (or when the high-water mark grows).
+     */
+    alignas(IndexAlignment) std::atomic<uint32_t> m_highWaterMark{0};
+    std::atomic<uint64_t> m_numDropped{0};
+    std::atomic<uint64_t> m_numContended{0};
+    std::atomic<uint64_t> m_numFullRetries{0};
+}; // class MpscEventQueue
+
+} // namespace NinjaHSM
@@ -1,4 +1,17 @@
 #pragma once
 
+#include "CooperativeScheduler.hpp"
+#include "CoroutineState.hpp"
+#include "FleetDeadlines.hpp"
+#include "QueuedStateMachine.hpp"
+#include "SharedStateMachine.hpp"
+#include "Snapshot.hpp"
+#include "SpscEventQueue.hpp"
 #include "State.hpp"
+#include "StateFleet.hpp"
 #include "StateMachine.hpp"
+#include "StaticStateMachine.hpp"
+#include "Timer.hpp"
+#include "TimerService.hpp"
+#include "TransitionTable.hpp"
+#include "VariantState.hpp"
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "SpscEventQueue.hpp"
+#include "StateMachine.hpp"
+
+namespace NinjaHSM {
+
+/**
+ * A StateMachine with a built-in SpscEventQueue, so events can be posted from a different
+ * context (an ISR, or another thread) than the one driving the state machine.
+ *
+ * Use it anywhere you would use a StateMachine (it is one). The producer calls postEvent(), which
+ * is wait-free and ISR-safe. The context that owns the state machine (e.g. your main loop) calls
+ * dispatchPending() to drain the queue into handleEvent(). Since only that one context ever calls
+ * handleEvent(), the state machine is never re-entered.
+ *
+ * @code
+ * QueuedStateMachine<Event, 16> m_stateMachine;
+ *
+ * void uartIsr() { m_stateMachine.postEvent(Event{EventId::BYTE_RECEIVED}); }
+ *
+ * void mainLoop() {
+ *     while (true) {
+ *         m_stateMachine.dispatchPending();
+ *         // ...
+ *     }
+ * }
+ * @endcode
+ *
+ * By default the queue is an SpscEventQueue, so there must be exactly one producer. If several
+ * threads post events, pass MpscEventQueue (from <NinjaHSM/MpscEventQueue.hpp>) as @p Queue.
+ *
+ * @tparam EventType      The state machine's event type.
+ * @tparam QueueCapacity  The maximum number of pending events. Must be a power of two.
+ * @tparam IndexAlignment See SpscEventQueue.
+ * @tparam Queue          The queue class template. Must provide push() and pop() like
+ *                        SpscEventQueue.
+ * @tparam Policy         Which optional features to compile in (see StateMachinePolicy).
+ */
+template <
+    typename EventType,
+    size_t QueueCapacity,
+    size_t IndexAlignment = CACHE_LINE_SIZE,
+    template <typename, size_t, size_t> class Queue = SpscEventQueue,
+    typename Policy = StateMachinePolicy>
+class QueuedStateMachine : public StateMachine<EventType, Policy> {
+public:
+    QueuedStateMachine() {}
+
+    /**
+     * Queue an event to be handled later by dispatchPending(). With the default SpscEventQueue
+     * this is wait-free and safe to call from an ISR or a thread other than the one driving the
+     * state machine (single producer only).
+     *
+     * @param[in] event The event to queue.
+     * @return True if the event was queued, false if the queue was full (the event is dropped).
+     */
+    bool postEvent(const EventType& event) {
+        return m_eventQueue.push(event);
+    }
+
+    /**
+     * Same as postEvent(), but moves the event into the queue.
+     */
+    bool postEvent(EventType&& event) {
+        return m_eventQueue.push(std::move(event));
+    }
+
+    /**
+     * Handle queued events, in the order they were posted, by passing each to handleEvent(). Call
+     * this from the context that owns the state machine. Events posted while this is running are
+     * also handled (up to @p maxEvents in total).
+     *
+     * @param[in] maxEvents The maximum number of events to handle, to bound the time spent in
+     *                      this call. Defaults to no limit.
+     * @return The number of events handled.
+     */
+    size_t dispatchPending(size_t maxEvents = SIZE_MAX) {
+        size_t numDispatched = 0;
+        while (numDispatched < maxEvents && m_eventQueue.pop([this](EventType&& event) { this->handleEvent(event); })) {
+            numDispatched++;
+        }
+        return numDispatched;
+    }
+
+    /**
+     * @return The number of events waiting to be dispatched (a snapshot).
+     */
+    size_t numPendingEvents() const {
+        return m_eventQueue.size();
+    }
+
+    /**
+     * @return The underlying queue, e.g. to configure it or read its statistics.
+     */
+    Queue<EventType, QueueCapacity, IndexAlignment>& getEventQueue() {
+        return m_eventQueue;
+    }
+
+protected:
+    Queue<EventType, QueueCapacity, IndexAlignment> m_eventQueue;
+}; // class QueuedStateMachine
+
+} // namespace NinjaHSM
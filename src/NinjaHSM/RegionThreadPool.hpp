@@ -0,0 +1,234 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include <etl/delegate.h>
+
+namespace NinjaHSM {
+
+/**
+ * A small pool of worker threads for running the regions of an orthogonal state in parallel (see
+ * StateMachine::setRegionExecutor()).
+ *
+ * run() hands out its tasks to the workers and to the calling thread, which also runs tasks
+ * rather than sitting idle, and returns once every task has finished. So a pool with
+ * NumWorkers workers runs up to NumWorkers + 1 regions at once: for an orthogonal state with N
+ * heavy regions, N - 1 workers is enough.
+ *
+ * @code
+ * RegionThreadPool<1> m_regionPool;
+ *
+ * m_regionPool.start();
+ * m_stateMachine.setRegions(m_regions);
+ * m_stateMachine.setRegionExecutor(m_regionPool.executor());
+ * @endcode
+ *
+ * Several state machines can share a pool; their run() calls take turns. Workers park on a
+ * condition variable between runs, so waking them costs a few microseconds: worth it for
+ * handlers that take much longer than that, not for quick ones.
+ *
+ * This uses std::thread, so it is intended for hosted (e.g. Linux) targets and is not included by
+ * NinjaHSM.hpp. Include <NinjaHSM/RegionThreadPool.hpp> explicitly.
+ *
+ * @tparam NumWorkers The number of worker threads.
+ */
+template <uint32_t NumWorkers>
+class RegionThreadPool {
+public:
+    static_assert(NumWorkers > 0, "NumWorkers must be at least 1.");
+
+    /**
+     * Runs task(context, i) for each i from 0 to numTasks - 1 on the pool. The same signature as
+     * StateMachine::RegionExecutor.
+     */
+    using Executor = etl::delegate<void(void (*)(void*, uint32_t), void*, uint32_t)>;
+
+    RegionThreadPool() {}
+
+    RegionThreadPool(const RegionThreadPool&) = delete;
+    RegionThreadPool& operator=(const RegionThreadPool&) = delete;
+
+    /**
+     * Stops the worker threads (see stop()).
+     */
+    ~RegionThreadPool() {
+        stop();
+    }
+
+    /**
+     * Start the worker threads. Does nothing if already running.
+     */
+    void start() {
+        if (m_running) {
+            return;
+        }
+        m_stopRequested = false;
+        for (std::thread& worker : m_workers) {
+            worker = std::thread([this]() { work(); });
+        }
+        m_running = true;
+    }
+
+    /**
+     * Stop the worker threads, waiting for them to exit. Does nothing if not running. Must not be
+     * called while a run() is in progress.
+     */
+    void stop() {
+        if (!m_running) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopRequested = true;
+        }
+        m_wakeup.notify_all();
+        for (std::thread& worker : m_workers) {
+            worker.join();
+        }
+        m_running = false;
+    }
+
+    /**
+     * @return True between start() and stop().
+     */
+    bool isRunning() const {
+        return m_running;
+    }
+
+    static constexpr uint32_t numWorkers() {
+        return NumWorkers;
+    }
+
+    /**
+     * Run task(context, i) for each i from 0 to numTasks - 1, spread over the workers and the
+     * calling thread, and return once they have all returned. If the pool is not running (or
+     * there is only one task), the tasks are simply run in order on the calling thread.
+     *
+     * @param[in] task     The task function.
+     * @param[in] context  Passed to every call of @p task.
+     * @param[in] numTasks The number of tasks.
+     */
+    void run(void (*task)(void*, uint32_t), void* context, uint32_t numTasks) {
+        if (!m_running || numTasks <= 1) {
+            for (uint32_t i = 0; i < numTasks; i++) {
+                task(context, i);
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> runLock(m_runMutex);
+        uint64_t generation;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            // A worker woken for an earlier run may only now have joined in (finding nothing left
+            // to do). Publish this run once it has left, so no worker is ever between runs.
+            m_done.wait(lock, [this]() { return m_numBusyWorkers == 0; });
+            m_task = task;
+            m_context = context;
+            m_numTasks = numTasks;
+            generation = ++m_generation;
+            m_nextTask.store(generation << 32);
+            m_numUnfinished.store(numTasks);
+        }
+        m_wakeup.notify_all();
+        runTasks(task, context, numTasks, generation);
+
+        // Also wait for every worker that joined in to leave, so none of them can pick up tasks
+        // of the next run() with this run's task function.
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this]() { return m_numUnfinished.load() == 0 && m_numBusyWorkers == 0; });
+    }
+
+    /**
+     * @return A delegate calling run(), for StateMachine::setRegionExecutor().
+     */
+    Executor executor() {
+        return Executor::template create<RegionThreadPool, &RegionThreadPool::run>(*this);
+    }
+
+private:
+    /**
+     * Claim and run tasks of run() number @p generation until there are none left. Each claim
+     * checks the generation as well as the index, so a worker holding an earlier run's task can
+     * never claim (or count as finished) a task of a later one.
+     */
+    void runTasks(void (*task)(void*, uint32_t), void* context, uint32_t numTasks, uint64_t generation) {
+        uint64_t next = m_nextTask.load();
+        while (true) {
+            if ((next >> 32) != (generation & UINT32_MAX) || static_cast<uint32_t>(next) >= numTasks) {
+                return;
+            }
+            if (!m_nextTask.compare_exchange_weak(next, next + 1)) {
+                continue;
+            }
+            task(context, static_cast<uint32_t>(next));
+            if (m_numUnfinished.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_done.notify_all();
+            }
+            next = m_nextTask.load();
+        }
+    }
+
+    /**
+     * The loop run by each worker thread.
+     */
+    void work() {
+        uint64_t seenGeneration = 0;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_wakeup.wait(lock, [&]() { return m_stopRequested || m_generation != seenGeneration; });
+            if (m_stopRequested) {
+                return;
+            }
+            // Copied while holding the lock: run() only publishes the next run once this worker
+            // has left this one.
+            seenGeneration = m_generation;
+            void (*const task)(void*, uint32_t) = m_task;
+            void* const context = m_context;
+            const uint32_t numTasks = m_numTasks;
+            m_numBusyWorkers++;
+            lock.unlock();
+            runTasks(task, context, numTasks, seenGeneration);
+            lock.lock();
+            if (--m_numBusyWorkers == 0) {
+                m_done.notify_all();
+            }
+        }
+    }
+
+    std::thread m_workers[NumWorkers];
+    bool m_running = false;
+
+    /**
+     * Serialises run() calls from different threads.
+     */
+    std::mutex m_runMutex;
+
+    /**
+     * Guards everything below except the atomics. The current run's task is only changed while
+     * no worker is busy (run() waits for m_numBusyWorkers to drop to 0 first).
+     */
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::condition_variable m_done;
+    bool m_stopRequested = false;
+    uint64_t m_generation = 0;
+    uint32_t m_numBusyWorkers = 0;
+
+    void (*m_task)(void*, uint32_t) = nullptr;
+    void* m_context = nullptr;
+    uint32_t m_numTasks = 0;
+    /**
+     * The current run's generation (low 32 bits) in the top half, and the index of the next task
+     * to claim in the bottom half.
+     */
+    std::atomic<uint64_t> m_nextTask{0};
+    std::atomic<uint32_t> m_numUnfinished{0};
+}; // class RegionThreadPool
+
+} // namespace NinjaHSM
@@ -0,0 +1,475 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "StateMachine.hpp"
+#include "StaticStateMachine.hpp"
+
+namespace NinjaHSM {
+
+/**
+ * Index used by SharedState to mean "no parent" (a top-level state), and by SharedStateMachine to
+ * mean "no state" (before the initial transition).
+ */
+constexpr uint16_t NO_SHARED_STATE = detail::NO_STATIC_STATE;
+
+/**
+ * One state of a SharedTopology. Unlike State, it is not bound to an instance: the handlers are
+ * plain function pointers that are given the instance (the "context") when they are called, and
+ * the parent is referred to by its index in the topology. Build these with makeSharedState().
+ *
+ * @tparam Context   The class the handlers operate on (one instance per state machine).
+ * @tparam EventType The state machine's event type.
+ */
+template <typename Context, typename EventType>
+struct SharedState {
+    using EntryHandler = void (*)(Context&);
+    using EventHandler = void (*)(Context&, const EventType&);
+    using ExitHandler = void (*)(Context&);
+
+    const char * name = nullptr;
+    EntryHandler entry = nullptr;
+    EventHandler event = nullptr;
+    ExitHandler exit = nullptr;
+
+    /**
+     * Index of the parent state in the topology, or NO_SHARED_STATE for a top-level state.
+     */
+    uint16_t parent = NO_SHARED_STATE;
+};
+
+namespace detail {
+
+template <typename Context, auto Method>
+void callSharedHandler(Context & context) {
+    (context.*Method)();
+}
+
+template <typename Context, typename EventType, auto Method>
+void callSharedEventHandler(Context & context, const EventType & event) {
+    (context.*Method)(event);
+}
+
+template <typename Context, typename EventType, size_t NumStates>
+struct SharedEngine;
+
+} // namespace detail
+
+/**
+ * Helper for constructing a SharedState, the shared-topology counterpart of makeState(). The
+ * handlers are member functions of @p Context (any of them may be nullptr), and are called on
+ * whichever instance is passed to the SharedStateMachine at the time.
+ *
+ * @code
+ * constexpr SharedState<Session, Event> SESSION_STATES[] = {
+ *     makeSharedState<Session, Event, nullptr, &Session::idle_event, nullptr>("Idle"),
+ *     makeSharedState<Session, Event, &Session::busy_entry, &Session::busy_event, nullptr>("Busy", 0),
+ * };
+ * @endcode
+ *
+ * @tparam Context   The class that owns the handler methods.
+ * @tparam EventType The state machine's event type.
+ * @tparam Entry     Pointer to the entry() member function (signature void()), or nullptr.
+ * @tparam Event     Pointer to the event() member function (signature void(const EventType&)), or
+ *                   nullptr.
+ * @tparam Exit      Pointer to the exit() member function (signature void()), or nullptr.
+ * @param[in] name   Human readable name for the state.
+ * @param[in] parent Index of the parent state (which must come earlier in the topology), or
+ *                   NO_SHARED_STATE (the default) for a top-level state.
+ * @return The SharedState.
+ */
+template <typename Context, typename EventType, auto Entry, auto Event, auto Exit>
+constexpr SharedState<Context, EventType> makeSharedState(const char * name, uint16_t parent = NO_SHARED_STATE) {
+    SharedState<Context, EventType> state;
+    state.name = name;
+    if constexpr (Entry != nullptr) {
+        state.entry = &detail::callSharedHandler<Context, Entry>;
+    }
+    if constexpr (Event != nullptr) {
+        state.event = &detail::callSharedEventHandler<Context, EventType, Event>;
+    }
+    if constexpr (Exit != nullptr) {
+        state.exit = &detail::callSharedHandler<Context, Exit>;
+    }
+    state.parent = parent;
+    return state;
+}
+
+/**
+ * The immutable part of a state machine --- its states, their handlers and the hierarchy ---
+ * defined once and shared by any number of SharedStateMachine instances. All transition paths are
+ * precomputed when it is constructed, which can be at compile time (make it constexpr and it ends
+ * up in read-only memory).
+ *
+ * @code
+ * constexpr SharedTopology<Session, Event, 2> SESSION_TOPOLOGY(SESSION_STATES);
+ * static_assert(SESSION_TOPOLOGY.isValid(), "Parents must be listed before their children.");
+ * @endcode
+ *
+ * @tparam Context   The class the handlers operate on.
+ * @tparam EventType The state machine's event type.
+ * @tparam NumStates The number of states.
+ */
+template <typename Context, typename EventType, size_t NumStates>
+class SharedTopology {
+public:
+    static_assert(NumStates > 0, "A SharedTopology needs at least one state.");
+    static_assert(NumStates < NO_SHARED_STATE, "State indexes are stored as uint16_t.");
+
+    /**
+     * Called with the instance when one of the topology's state machines encounters an internal
+     * error (see Error). Shared by every instance, like the rest of the topology.
+     */
+    using ErrorHandler = void (*)(Context&, Error);
+
+    /**
+     * @param[in] states       Every state. A state's parent must come before it.
+     * @param[in] errorHandler Function to call on errors, or nullptr (the default) for none.
+     */
+    constexpr SharedTopology(const SharedState<Context, EventType> (&states)[NumStates], ErrorHandler errorHandler = nullptr) :
+            m_states{},
+            m_hierarchy{},
+            m_errorHandler(errorHandler),
+            m_valid(true) {
+        uint16_t parents[NumStates] = {};
+        for (size_t i = 0; i < NumStates; i++) {
+            m_states[i] = states[i];
+            parents[i] = states[i].parent;
+            // Requiring parents to come first rules out cycles in the hierarchy.
+            if (parents[i] != NO_SHARED_STATE && parents[i] >= i) {
+                m_valid = false;
+                parents[i] = NO_SHARED_STATE;
+            }
+        }
+        m_hierarchy = detail::buildStaticHierarchy(parents);
+    }
+
+    /**
+     * @return False if a state's parent was not listed before it. A state machine using an
+     *         invalid topology reports Error::InvalidTopology instead of transitioning.
+     */
+    constexpr bool isValid() const {
+        return m_valid;
+    }
+
+    static constexpr size_t numStates() {
+        return NumStates;
+    }
+
+    /**
+     * @param[in] index The index of the state (0 to NumStates - 1).
+     * @return The state.
+     */
+    constexpr const SharedState<Context, EventType>& getState(uint16_t index) const {
+        return m_states[index];
+    }
+
+private:
+    template <typename, typename, size_t>
+    friend struct detail::SharedEngine;
+
+    SharedState<Context, EventType> m_states[NumStates];
+    detail::StaticHierarchy<NumStates> m_hierarchy;
+    ErrorHandler m_errorHandler;
+    bool m_valid;
+}; // class SharedTopology
+
+namespace detail {
+
+/**
+ * Flags in the per-machine bookkeeping byte, set by transitionTo() and eventHandled() while an
+ * event is being handled.
+ */
+constexpr uint8_t SHARED_TRANSITION_TO_CALLED = 1u << 0;
+constexpr uint8_t SHARED_EVENT_HANDLED = 1u << 1;
+
+/**
+ * The bookkeeping of one machine running a SharedTopology. Held by reference so that it can live
+ * in a SharedStateMachine's members or in a StateFleet's parallel arrays.
+ */
+struct SharedMachineRefs {
+    uint16_t & currentState;
+
+    /**
+     * As in StateMachine, the state whose entry()/exit() method is currently running (or
+     * NO_SHARED_STATE), used to implement entry/exit guards.
+     */
+    uint16_t & calledEntryState;
+    uint16_t & calledExitState;
+
+    /**
+     * Never exceeds MAX_RECURSION_COUNT + 1, so a byte is enough.
+     */
+    uint8_t & recursionDepth;
+
+    uint8_t & flags;
+};
+
+/**
+ * handleEvent() and transitionTo() for anything that runs a SharedTopology. Same semantics as
+ * StateMachine.
+ */
+template <typename Context, typename EventType, size_t NumStates>
+struct SharedEngine {
+    using Topology = SharedTopology<Context, EventType, NumStates>;
+
+    static bool handleEvent(const Topology & topology, Context & context, const EventType & event, SharedMachineRefs machine) {
+        return bubbleEvent(topology, context, event, machine, machine.currentState);
+    }
+
+    /**
+     * Give the event to @p state and bubble it up from there, as handleEvent() does from the
+     * current state.
+     */
+    static bool bubbleEvent(const Topology & topology, Context & context, const EventType & event, SharedMachineRefs machine, uint16_t state) {
+        machine.flags = 0;
+        for (; state != NO_SHARED_STATE; state = topology.m_hierarchy.parents[state]) {
+            const typename SharedState<Context, EventType>::EventHandler handler = topology.m_states[state].event;
+            if (handler != nullptr) {
+                handler(context, event);
+            }
+            if (machine.flags != 0) {
+                break;
+            }
+        }
+        return machine.flags != 0;
+    }
+
+    /**
+     * Collect the event() handlers an event sent to @p state would bubble through, in order,
+     * leaving out states with no event() handler.
+     *
+     * @param[out] chain Receives the handlers. Must have room for NumStates.
+     * @return The number of handlers.
+     */
+    static size_t resolveEventChain(
+            const Topology & topology,
+            uint16_t state,
+            typename SharedState<Context, EventType>::EventHandler (&chain)[NumStates]) {
+        size_t length = 0;
+        for (; state != NO_SHARED_STATE; state = topology.m_hierarchy.parents[state]) {
+            if (topology.m_states[state].event != nullptr) {
+                chain[length++] = topology.m_states[state].event;
+            }
+        }
+        return length;
+    }
+
+    static void transitionTo(const Topology & topology, Context & context, uint16_t destinationState, SharedMachineRefs machine) {
+        const StaticHierarchy<NumStates> & hierarchy = topology.m_hierarchy;
+
+        machine.flags |= SHARED_TRANSITION_TO_CALLED;
+        if (!topology.m_valid || destinationState >= NumStates) {
+            reportError(topology, context, Error::InvalidTopology);
+            return;
+        }
+        machine.recursionDepth++;
+        if (machine.recursionDepth > MAX_RECURSION_COUNT) {
+            reportError(topology, context, Error::MaxRecursionDepthExceeded);
+            return;
+        }
+        const uint8_t ourRecursionDepth = machine.recursionDepth;
+
+        // Same entry/exit guard handling as StateMachine::transitionTo().
+        if (machine.calledEntryState != NO_SHARED_STATE && isChildOf(hierarchy, machine.calledEntryState, destinationState)) {
+            machine.currentState = machine.calledEntryState;
+            machine.calledEntryState = NO_SHARED_STATE;
+        }
+
+        if (machine.calledExitState != NO_SHARED_STATE && !isChildOf(hierarchy, machine.calledExitState, destinationState)) {
+            machine.currentState = hierarchy.parents[machine.calledExitState];
+            machine.calledExitState = NO_SHARED_STATE;
+        }
+
+        if (machine.currentState == destinationState) {
+            callExit(topology, context, machine.currentState);
+            if (ourRecursionDepth == machine.recursionDepth) {
+                machine.currentState = hierarchy.parents[machine.currentState];
+            }
+        }
+
+        if (ourRecursionDepth == machine.recursionDepth) {
+            const int32_t commonDepth = machine.currentState == NO_SHARED_STATE ? 0
+                : hierarchy.commonDepths[machine.currentState][destinationState];
+            bool completed = true;
+            while (depthOf(hierarchy, machine.currentState) >= commonDepth) {
+                machine.calledExitState = machine.currentState;
+                callExit(topology, context, machine.currentState);
+                machine.calledExitState = NO_SHARED_STATE;
+                if (ourRecursionDepth != machine.recursionDepth) {
+                    completed = false;
+                    break;
+                }
+                machine.currentState = hierarchy.parents[machine.currentState];
+            }
+            for (int32_t depth = commonDepth; completed && depth <= depthOf(hierarchy, destinationState); depth++) {
+                const uint16_t stateToEnter = hierarchy.ancestors[destinationState][depth];
+                machine.calledEntryState = stateToEnter;
+                const typename SharedState<Context, EventType>::EntryHandler entry = topology.m_states[stateToEnter].entry;
+                if (entry != nullptr) {
+                    entry(context);
+                }
+                machine.calledEntryState = NO_SHARED_STATE;
+                if (ourRecursionDepth != machine.recursionDepth) {
+                    break;
+                }
+                machine.currentState = stateToEnter;
+            }
+        }
+
+        // If we are at the top of the recursion, reset the recursion index so it's
+        // ready for the next non-recursive transitionTo() call.
+        if (ourRecursionDepth == 1) {
+            machine.recursionDepth = 0;
+        }
+    }
+
+    static int32_t depthOf(const StaticHierarchy<NumStates> & hierarchy, uint16_t state) {
+        return state == NO_SHARED_STATE ? -1 : static_cast<int32_t>(hierarchy.depths[state]);
+    }
+
+    /**
+     * @return True if child is parent or one of its descendants.
+     */
+    static bool isChildOf(const StaticHierarchy<NumStates> & hierarchy, uint16_t parent, uint16_t child) {
+        return hierarchy.depths[parent] <= hierarchy.depths[child]
+            && hierarchy.ancestors[child][hierarchy.depths[parent]] == parent;
+    }
+
+    static void callExit(const Topology & topology, Context & context, uint16_t state) {
+        const typename SharedState<Context, EventType>::ExitHandler exit = topology.m_states[state].exit;
+        if (exit != nullptr) {
+            exit(context);
+        }
+    }
+
+    static void reportError(const Topology & topology, Context & context, Error error) {
+        if (topology.m_errorHandler != nullptr) {
+            topology.m_errorHandler(context, error);
+        }
+    }
+}; // struct SharedEngine
+
+} // namespace detail
+
+/**
+ * A state machine that runs a SharedTopology on behalf of one instance (the context). It stores
+ * only a reference to the topology, the current state's index and a few bytes of transition
+ * bookkeeping, so large fleets of identical state machines do not each carry a copy of the state
+ * tree (as they would with State objects, which hold three delegates each).
+ *
+ * The context is passed to every call and handed on to the handlers, so it is not stored either.
+ * Typically the context owns its SharedStateMachine and passes *this:
+ *
+ * @code
+ * class Session {
+ * public:
+ *     Session() : m_sm(SESSION_TOPOLOGY) { m_sm.initialTransitionTo(*this, IDLE); }
+ *     void onEvent(const Event& event) { m_sm.handleEvent(*this, event); }
+ *     void idle_event(const Event& event) { m_sm.transitionTo(*this, BUSY); }
+ *     void busy_entry() {}
+ *     void busy_event(const Event& event) {}
+ * private:
+ *     SharedStateMachine<Session, Event, 2> m_sm;
+ * };
+ * @endcode
+ *
+ * Event bubbling, eventHandled(), entry/exit guards and MAX_RECURSION_COUNT all behave as in
+ * StateMachine.
+ *
+ * @tparam Context   The class the handlers operate on.
+ * @tparam EventType The state machine's event type.
+ * @tparam NumStates The number of states in the topology.
+ */
+template <typename Context, typename EventType, size_t NumStates>
+class SharedStateMachine {
+    using Engine = detail::SharedEngine<Context, EventType, NumStates>;
+
+public:
+    using Topology = SharedTopology<Context, EventType, NumStates>;
+
+    /**
+     * Returned by getCurrentStateIndex() before the initial transition.
+     */
+    static constexpr uint16_t NO_STATE = NO_SHARED_STATE;
+
+    /**
+     * @param[in] topology The shared topology. Must outlive the state machine.
+     */
+    explicit SharedStateMachine(const Topology & topology) : m_topology(topology) {}
+
+    /**
+     * Perform the transition to the provided initial state. This function should be called before
+     * calling handleEvent() for the first time.
+     *
+     * @param[in] context The instance to pass to the handlers.
+     * @param[in] state   The index of the initial state.
+     */
+    void initialTransitionTo(Context & context, uint16_t state) {
+        transitionTo(context, state);
+    }
+
+    /**
+     * Provide an event to the state machine. The event is given to the current state's event()
+     * handler and bubbles up to its parents until one of them calls transitionTo() or
+     * eventHandled(). Not re-entrant (see StateMachine::handleEvent()).
+     *
+     * @param[in] context The instance to pass to the handlers.
+     * @param[in] event   The event to handle.
+     * @return True if a state handled the event, false if it bubbled past the top unhandled.
+     */
+    bool handleEvent(Context & context, const EventType & event) {
+        return Engine::handleEvent(m_topology, context, event, refs());
+    }
+
+    /**
+     * @return The index of the current state, or NO_STATE before the initial transition.
+     */
+    uint16_t getCurrentStateIndex() const {
+        return m_currentState;
+    }
+
+    /**
+     * @return The topology this state machine runs.
+     */
+    const Topology & getTopology() const {
+        return m_topology;
+    }
+
+    /**
+     * @brief Trigger a transition to a state.
+     *
+     * Same semantics as StateMachine::transitionTo(), including calling it recursively from
+     * entry()/exit() (bounded by MAX_RECURSION_COUNT).
+     *
+     * @param[in] context The instance to pass to the handlers.
+     * @param[in] state   The index of the state to transition to.
+     */
+    void transitionTo(Context & context, uint16_t state) {
+        Engine::transitionTo(m_topology, context, state, refs());
+    }
+
+    /**
+     * Indicate to the state machine that an event was handled and event bubbling should stop.
+     * This function should be called only inside state event() functions.
+     */
+    void eventHandled() {
+        m_flags |= detail::SHARED_EVENT_HANDLED;
+    }
+
+private:
+    detail::SharedMachineRefs refs() {
+        return { m_currentState, m_calledEntryState, m_calledExitState, m_recursionDepth, m_flags };
+    }
+
+    const Topology & m_topology;
+
+    uint16_t m_currentState = NO_STATE;
+    uint16_t m_calledEntryState = NO_STATE;
+    uint16_t m_calledExitState = NO_STATE;
+    uint8_t m_recursionDepth = 0;
+    uint8_t m_flags = 0;
+}; // class SharedStateMachine
+
+} // namespace NinjaHSM
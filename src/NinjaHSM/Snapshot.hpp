@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace NinjaHSM {
+
+/**
+ * The version of the snapshot format written by StateMachine::snapshot() and
+ * StateFleet::snapshot(). Bumped whenever the format changes; restore() rejects snapshots of any
+ * other version.
+ */
+constexpr uint8_t SNAPSHOT_VERSION = 1;
+
+/**
+ * Which entry() methods restore() runs once the snapshot's state is in place.
+ */
+enum class RestoreEntry {
+    /**
+     * None: the state machine simply is in the restored state, as if it had never stopped.
+     */
+    None,
+
+    /**
+     * Only the entry() of each restored leaf state (the current state, or the active state of
+     * each region), e.g. to re-arm the timeouts and re-open the resources the leaf owns. Its
+     * ancestors' entry() methods are not run.
+     */
+    Leaves,
+};
+
+namespace detail {
+
+/**
+ * The first bytes of every snapshot.
+ */
+constexpr uint8_t SNAPSHOT_MAGIC[2] = { 'N', 'H' };
+
+/**
+ * Snapshot flags: what the writer stored after the header. restore() only accepts a snapshot
+ * with exactly the flags it would write itself, i.e. from a state machine with the same policy.
+ */
+constexpr uint8_t SNAPSHOT_HISTORY = 1u << 0;
+constexpr uint8_t SNAPSHOT_REGIONS = 1u << 1;
+constexpr uint8_t SNAPSHOT_EVENTS = 1u << 2;
+constexpr uint8_t SNAPSHOT_FLEET = 1u << 3;
+
+/**
+ * Writes a snapshot, little-endian whatever the host. Counts the bytes without writing them if
+ * given no buffer, and stops writing (but keeps counting) once the buffer is full.
+ */
+class SnapshotWriter {
+public:
+    SnapshotWriter(uint8_t* data, size_t capacity) :
+            m_data(data),
+            m_capacity(data == nullptr ? 0 : capacity) {}
+
+    void u8(uint8_t value) {
+        if (m_size < m_capacity) {
+            m_data[m_size] = value;
+        }
+        m_size++;
+    }
+
+    void u16(uint16_t value) {
+        u8(static_cast<uint8_t>(value));
+        u8(static_cast<uint8_t>(value >> 8));
+    }
+
+    void u32(uint32_t value) {
+        u16(static_cast<uint16_t>(value));
+        u16(static_cast<uint16_t>(value >> 16));
+    }
+
+    void bytes(const void* source, size_t size) {
+        if (m_size + size <= m_capacity) {
+            std::memcpy(m_data + m_size, source, size);
+        }
+        m_size += size;
+    }
+
+    /**
+     * @return The number of bytes written (or that would have been).
+     */
+    size_t size() const {
+        return m_size;
+    }
+
+    /**
+     * @return True if everything fitted in the buffer.
+     */
+    bool fitted() const {
+        return m_data != nullptr && m_size <= m_capacity;
+    }
+
+private:
+    uint8_t* m_data;
+    size_t m_capacity;
+    size_t m_size = 0;
+};
+
+/**
+ * Reads a snapshot written by SnapshotWriter. Reading past the end returns zeros and makes ok()
+ * false, so a truncated snapshot is caught by a single check at the end.
+ */
+class SnapshotReader {
+public:
+    SnapshotReader(const uint8_t* data, size_t size) :
+            m_data(data),
+            m_size(data == nullptr ? 0 : size) {}
+
+    uint8_t u8() {
+        if (m_position >= m_size) {
+            m_ok = false;
+            return 0;
+        }
+        return m_data[m_position++];
+    }
+
+    uint16_t u16() {
+        const uint16_t low = u8();
+        return static_cast<uint16_t>(low | (u8() << 8));
+    }
+
+    uint32_t u32() {
+        const uint32_t low = u16();
+        return low | (static_cast<uint32_t>(u16()) << 16);
+    }
+
+    /**
+     * @return The next @p size bytes, or nullptr if there are not that many left.
+     */
+    const uint8_t* bytes(size_t size) {
+        if (size > m_size - m_position) {
+            m_ok = false;
+            m_position = m_size;
+            return nullptr;
+        }
+        const uint8_t* bytes = m_data + m_position;
+        m_position += size;
+        return bytes;
+    }
+
+    /**
+     * @return True if nothing was read past the end.
+     */
+    bool ok() const {
+        return m_ok;
+    }
+
+    /**
+     * @return True if everything has been read.
+     */
+    bool atEnd() const {
+        return m_position == m_size;
+    }
+
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+    size_t m_position = 0;
+    bool m_ok = true;
+};
+
+/**
+ * Write the header common to every snapshot.
+ */
+inline void writeSnapshotHeader(SnapshotWriter& writer, uint8_t flags) {
+    writer.u8(SNAPSHOT_MAGIC[0]);
+    writer.u8(SNAPSHOT_MAGIC[1]);
+    writer.u8(SNAPSHOT_VERSION);
+    writer.u8(flags);
+}
+
+/**
+ * @return True if the snapshot starts with a header of this version with exactly @p flags.
+ */
+inline bool readSnapshotHeader(SnapshotReader& reader, uint8_t flags) {
+    const uint8_t magic0 = reader.u8();
+    const uint8_t magic1 = reader.u8();
+    const uint8_t version = reader.u8();
+    const uint8_t readFlags = reader.u8();
+    return reader.ok() && magic0 == SNAPSHOT_MAGIC[0] && magic1 == SNAPSHOT_MAGIC[1]
+        && version == SNAPSHOT_VERSION && readFlags == flags;
+}
+
+} // namespace detail
+
+} // namespace NinjaHSM
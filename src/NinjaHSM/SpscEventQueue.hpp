@@ -0,0 +1,155 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+namespace NinjaHSM {
+
+/**
+ * Assumed size of a cache line, used to keep indices written by different threads/cores on
+ * separate cache lines (avoiding false sharing). 64 bytes suits most desktop/server CPUs and
+ * Cortex-A parts.
+ */
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+/**
+ * A fixed-capacity, wait-free, single-producer/single-consumer ring buffer of events.
+ *
+ * Exactly one context may call push() (e.g. an ISR or an I/O thread) and exactly one other
+ * context may call pop() (e.g. the main loop driving the state machine). Neither call ever blocks
+ * or loops: push() fails immediately if the queue is full, and pop() fails immediately if it is
+ * empty. Events are stored inline, so there is no dynamic allocation, and EventType does not need
+ * to be default constructible.
+ *
+ * The producer and consumer indices are kept on separate cache lines (see @p IndexAlignment) so
+ * that the two sides do not invalidate each other's cache line on every operation. On MCUs
+ * without a data cache this only wastes RAM, so pass e.g. alignof(uint32_t) instead.
+ *
+ * @tparam EventType      The type of event stored.
+ * @tparam Capacity       The maximum number of events queued at once. Must be a power of two.
+ * @tparam IndexAlignment Alignment of the producer and consumer indices. Defaults to
+ *                        CACHE_LINE_SIZE.
+ */
+template <typename EventType, size_t Capacity, size_t IndexAlignment = CACHE_LINE_SIZE>
+class SpscEventQueue {
+public:
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two.");
+    static_assert(Capacity <= UINT32_MAX / 2, "Capacity is too large for 32-bit indices.");
+
+    SpscEventQueue() = default;
+    SpscEventQueue(const SpscEventQueue&) = delete;
+    SpscEventQueue& operator=(const SpscEventQueue&) = delete;
+
+    ~SpscEventQueue() {
+        while (pop([](EventType&&) {})) {}
+    }
+
+    /**
+     * Add an event to the back of the queue. Producer side only. Wait-free, and safe to call from
+     * an ISR.
+     *
+     * @param[in] event The event to copy into the queue.
+     * @return True if the event was queued, false if the queue was full (the event is dropped).
+     */
+    bool push(const EventType& event) {
+        return emplace(event, [](uint32_t) {});
+    }
+
+    /**
+     * Same as push(), but moves the event into the queue.
+     */
+    bool push(EventType&& event) {
+        return emplace(std::move(event), [](uint32_t) {});
+    }
+
+    /**
+     * Same as push(), but also calls @p onClaimed with the event's position in the queue once
+     * its slot is claimed, before the consumer can see it. The position is the number of events
+     * pushed before this one (wrapping at 2^32), so a consumer that counts the events it pops
+     * knows which is which, e.g. to look up data kept alongside the queue at
+     * `position & (Capacity - 1)`. Not called if the event is not queued.
+     *
+     * @param[in] event     The event to move into the queue.
+     * @param[in] onClaimed Callable taking the position (uint32_t).
+     * @return Same as push().
+     */
+    template <typename OnClaimed>
+    bool push(EventType&& event, OnClaimed&& onClaimed) {
+        return emplace(std::move(event), onClaimed);
+    }
+
+    /**
+     * Remove the event at the front of the queue and pass it to @p consumer. Consumer side only.
+     * The event is only destroyed (and its slot freed) after @p consumer returns, so the consumer
+     * can use it in place without copying it out first.
+     *
+     * @param[in] consumer Callable taking EventType&& (e.g. a lambda that dispatches the event).
+     * @return True if an event was consumed, false if the queue was empty.
+     */
+    template <typename Consumer>
+    bool pop(Consumer&& consumer) {
+        const uint32_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        EventType* event = std::launder(reinterpret_cast<EventType*>(slot(head)));
+        consumer(std::move(*event));
+        event->~EventType();
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @return True if there are no events in the queue. Only a snapshot if the other side is
+     *         active concurrently.
+     */
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /**
+     * @return The number of events in the queue. Only a snapshot if the other side is active
+     *         concurrently.
+     */
+    size_t size() const {
+        // Read the head first: the tail can only move further ahead of it in the meantime.
+        const uint32_t head = m_head.load(std::memory_order_acquire);
+        const uint32_t tail = m_tail.load(std::memory_order_acquire);
+        return tail - head;
+    }
+
+    static constexpr size_t capacity() {
+        return Capacity;
+    }
+
+private:
+    template <typename T, typename OnClaimed>
+    bool emplace(T&& event, OnClaimed&& onClaimed) {
+        const uint32_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        new (slot(tail)) EventType(std::forward<T>(event));
+        onClaimed(tail);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    void* slot(uint32_t index) {
+        return &m_storage[index & (Capacity - 1)][0];
+    }
+
+    /**
+     * Free-running indices (they wrap at 2^32, not at Capacity). m_head is only written by the
+     * consumer and m_tail only by the producer.
+     */
+    alignas(IndexAlignment) std::atomic<uint32_t> m_head{0};
+    alignas(IndexAlignment) std::atomic<uint32_t> m_tail{0};
+
+    alignas(IndexAlignment) alignas(EventType) unsigned char m_storage[Capacity][sizeof(EventType)];
+}; // class SpscEventQueue
+
+} // namespace NinjaHSM
@@ -1,9 +1,99 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if __has_include(<variant>)
+#include <variant>
+#endif
+
 #include <etl/delegate.h>
 
 namespace NinjaHSM {
 
+/**
+ * The maximum depth of the state hierarchy supported by StateMachine::transitionTo(), i.e. a
+ * top-level state plus MAX_STATE_DEPTH - 1 levels of children. The state machine keeps a
+ * fixed-size buffer of this many state pointers to record the path it enters.
+ */
+constexpr uint32_t MAX_STATE_DEPTH = 16;
+
+/**
+ * A set of event kinds, one bit per kind, used by states to subscribe to only the events they
+ * handle (see State::eventMask and StateMachine::setEventKindSelector()).
+ */
+using EventMask = uint32_t;
+
+/**
+ * The number of event kinds an EventMask can describe. Events of a kind outside this range are
+ * offered to every state.
+ */
+constexpr uint8_t MAX_EVENT_KINDS = 32;
+
+/**
+ * Subscribes a state to every event (the default).
+ */
+constexpr EventMask ALL_EVENTS = 0xFFFFFFFF;
+
+/**
+ * Build an EventMask from event kinds given as integers or enumerators, e.g.
+ * eventMaskOf(EventId::BUTTON_PRESSED, EventId::TIMER_EXPIRED).
+ *
+ * @param[in] kinds The event kinds, each less than MAX_EVENT_KINDS.
+ * @return The mask with the bit of each kind set.
+ */
+template <typename... Kinds>
+constexpr EventMask eventMaskOf(Kinds... kinds) {
+    return (EventMask(0) | ... | (EventMask(1) << static_cast<uint32_t>(kinds)));
+}
+
+#if __has_include(<variant>)
+
+namespace detail {
+
+/**
+ * @return The index of @p T among the alternatives of the std::variant @p Variant.
+ */
+template <typename T, typename Variant, size_t Index = 0>
+constexpr size_t variantIndexOf() {
+    if constexpr (Index >= std::variant_size_v<Variant>) {
+        static_assert(Index < std::variant_size_v<Variant>, "Type is not an alternative of the variant.");
+        return Index;
+    } else if constexpr (std::is_same_v<std::variant_alternative_t<Index, Variant>, T>) {
+        return Index;
+    } else {
+        return variantIndexOf<T, Variant, Index + 1>();
+    }
+}
+
+} // namespace detail
+
+/**
+ * Build an EventMask for a std::variant event type from the alternatives a state handles, e.g.
+ * variantEventMask<Events::Generic, Events::ButtonPressed>(). The kind of each alternative is its
+ * index in the variant (see variantEventKind()).
+ */
+template <typename Variant, typename... Alternatives>
+constexpr EventMask variantEventMask() {
+    return eventMaskOf(detail::variantIndexOf<Alternatives, Variant>()...);
+}
+
+/**
+ * Event kind selector for std::variant event types: the kind of an event is the index of the
+ * alternative it holds. Pass to StateMachine::setEventKindSelector(), e.g.
+ * StateMachine<Events::Generic>::EventKindSelector::create<&variantEventKind<Events::Generic>>().
+ */
+template <typename Variant>
+uint8_t variantEventKind(const Variant & event) {
+    return static_cast<uint8_t>(event.index());
+}
+
+#endif
+
+template <typename EventType>
+class Timer;
+
 template <typename EventType>
 class State {
 public:
@@ -16,12 +106,16 @@ public:
         EntryDelegate entry,
         EventDelegate event,
         ExitDelegate exit,
-        State * parent) :
+        State * parent,
+        EventMask eventMask = ALL_EVENTS) :
             name(name),
             entry(entry),
             event(event),
             exit(exit),
-            parent(parent) {}
+            parent(parent),
+            depth(parent == nullptr ? 0 : parent->depth + 1),
+            eventMask(eventMask),
+            bubbleMask(parent == nullptr ? eventMask : eventMask | parent->bubbleMask) {}
 
     const char * name;
     EntryDelegate entry;
@@ -29,6 +123,51 @@ public:
     ExitDelegate exit;
 
     State * parent = nullptr;
+
+    /**
+     * How many ancestors this state has (0 for a top-level state). Computed from the parent when
+     * the state is constructed, so a parent state must be constructed before its children (which
+     * is naturally the case when states are declared parent-first as members). Used by the state
+     * machine to find the common ancestor of two states without repeatedly walking the hierarchy.
+     */
+    uint8_t depth = 0;
+
+    /**
+     * Dense index of this state, assigned by StateMachine::finalize() (its position in the array
+     * of states passed to finalize()). Unused (and left at 0) unless the state machine is sealed.
+     */
+    uint16_t index = 0;
+
+    /**
+     * The event kinds this state's event() handler is interested in (see
+     * StateMachine::setEventKindSelector()). While bubbling an event the state machine skips the
+     * handler of a state that is not subscribed to the event's kind. Defaults to ALL_EVENTS.
+     * Pass it to the constructor (or makeState()) rather than assigning it later, as the
+     * bubbleMask of this state and its children is derived from it at construction.
+     */
+    EventMask eventMask = ALL_EVENTS;
+
+    /**
+     * eventMask of this state and all of its ancestors combined. Computed from the parent when
+     * the state is constructed (like depth), so the state machine can tell in one check that
+     * nothing from a state upwards is interested in an event and stop bubbling there.
+     */
+    EventMask bubbleMask = ALL_EVENTS;
+
+    /**
+     * Timers tied to this state (see TimerService::startInState()). The state machine cancels
+     * them when it exits this state.
+     */
+    Timer<EventType> * timers = nullptr;
+
+    /**
+     * History (see StateMachine::transitionToHistory()), recorded by the state machine each time
+     * it exits this state: the child that was active, and the deepest descendant that was active.
+     * Both are nullptr if this state has never been exited, or was itself the deepest active
+     * state when it last was.
+     */
+    mutable const State * shallowHistory = nullptr;
+    mutable const State * deepHistory = nullptr;
 }; // class State
 
 /**
@@ -83,6 +222,8 @@ public:
  * @param[in] name   Human readable name for the state.
  * @param[in] self   The instance the handler methods are called on.
  * @param[in] parent Pointer to the parent state, or nullptr (the default) for a top-level state.
+ * @param[in] eventMask The event kinds the event() handler is interested in (see
+ *                   State::eventMask). Defaults to ALL_EVENTS.
  * @return A fully constructed State.
  */
 namespace detail {
@@ -111,13 +252,18 @@ Delegate bindOrEmpty(Self & self) {
 } // namespace detail
 
 template <typename EventType, auto Entry, auto Event, auto Exit, typename Self>
-State<EventType> makeState(const char * name, Self & self, State<EventType> * parent = nullptr) {
+State<EventType> makeState(
+        const char * name,
+        Self & self,
+        State<EventType> * parent = nullptr,
+        EventMask eventMask = ALL_EVENTS) {
     return State<EventType>(
         name,
         detail::bindOrEmpty<typename State<EventType>::EntryDelegate, Entry>(self),
         detail::bindOrEmpty<typename State<EventType>::EventDelegate, Event>(self),
         detail::bindOrEmpty<typename State<EventType>::ExitDelegate, Exit>(self),
-        parent);
+        parent,
+        eventMask);
 }
 
 } // namespace NinjaHSM
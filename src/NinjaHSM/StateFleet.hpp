@@ -0,0 +1,399 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "SharedStateMachine.hpp"
+#include "Snapshot.hpp"
+
+namespace NinjaHSM {
+
+/**
+ * A fixed-size fleet of state machines that all run the same SharedTopology, stored as parallel
+ * arrays (struct-of-arrays) rather than as separate objects.
+ *
+ * The fleet keeps each instance's current state index, entry/exit guard states, recursion depth
+ * and flags in their own arrays, along with scratch space for broadcastByState() (12 bytes per
+ * instance in total), and the per-instance user data (the contexts passed to the handlers) in an
+ * array you provide. Bulk operations such as broadcast() walk instances in index order, so they
+ * stream linearly through these arrays instead of chasing pointers to separately allocated state
+ * machines.
+ *
+ * An instance is identified by its context: handlers call transitionTo()/eventHandled() with the
+ * context they were given, and the fleet works out the instance from its position in the
+ * contexts array. Handlers reach the fleet however suits you (e.g. a global, or a reference in the
+ * context).
+ *
+ * @code
+ * struct Particle {
+ *     void free_event(const Tick& tick);   // Calls g_fleet.transitionTo(*this, COLLIDED) etc.
+ *     void collided_entry();
+ *     float x, y;
+ * };
+ * Particle g_particles[100000];
+ * StateFleet<Particle, Tick, 2, 100000> g_fleet(PARTICLE_TOPOLOGY, g_particles);
+ *
+ * g_fleet.initialTransitionAllTo(FREE);
+ * g_fleet.broadcast(Tick{});
+ * @endcode
+ *
+ * Event bubbling, eventHandled(), entry/exit guards and MAX_RECURSION_COUNT all behave as in
+ * StateMachine. Like a single state machine, the fleet is not re-entrant: drive it from one
+ * context.
+ *
+ * @tparam Context   The per-instance user data type the handlers operate on.
+ * @tparam EventType The state machines' event type.
+ * @tparam NumStates The number of states in the topology.
+ * @tparam Capacity  The number of instances.
+ */
+template <typename Context, typename EventType, size_t NumStates, size_t Capacity>
+class StateFleet {
+    using Engine = detail::SharedEngine<Context, EventType, NumStates>;
+
+public:
+    static_assert(Capacity > 0, "A StateFleet needs at least one instance.");
+    static_assert(Capacity <= UINT32_MAX, "Instance indexes are stored as uint32_t.");
+
+    using Topology = SharedTopology<Context, EventType, NumStates>;
+
+    /**
+     * Returned by getCurrentStateIndex() before the initial transition.
+     */
+    static constexpr uint16_t NO_STATE = NO_SHARED_STATE;
+
+    /**
+     * @param[in] topology The shared topology. Must outlive the fleet.
+     * @param[in] contexts The per-instance user data, one per instance. Must outlive the fleet.
+     */
+    StateFleet(const Topology & topology, Context (&contexts)[Capacity]) :
+            m_topology(topology),
+            m_contexts(contexts) {
+        for (size_t i = 0; i < Capacity; i++) {
+            m_currentStates[i] = NO_STATE;
+            m_calledEntryStates[i] = NO_STATE;
+            m_calledExitStates[i] = NO_STATE;
+            m_recursionDepths[i] = 0;
+            m_flags[i] = 0;
+        }
+    }
+
+    StateFleet(const StateFleet&) = delete;
+    StateFleet& operator=(const StateFleet&) = delete;
+
+    static constexpr size_t capacity() {
+        return Capacity;
+    }
+
+    /**
+     * Perform the initial transition of every instance, in index order.
+     *
+     * @param[in] state The index of the initial state.
+     */
+    void initialTransitionAllTo(uint16_t state) {
+        for (size_t i = 0; i < Capacity; i++) {
+            Engine::transitionTo(m_topology, m_contexts[i], state, refs(i));
+        }
+    }
+
+    /**
+     * Perform the initial transition of one instance.
+     *
+     * @param[in] instance The index of the instance.
+     * @param[in] state    The index of the initial state.
+     */
+    void initialTransitionTo(size_t instance, uint16_t state) {
+        Engine::transitionTo(m_topology, m_contexts[instance], state, refs(instance));
+    }
+
+    /**
+     * Provide an event to one instance (see StateMachine::handleEvent()).
+     *
+     * @param[in] instance The index of the instance.
+     * @param[in] event    The event to handle.
+     * @return True if a state handled the event, false if it bubbled past the top unhandled.
+     */
+    bool handleEvent(size_t instance, const EventType & event) {
+        return Engine::handleEvent(m_topology, m_contexts[instance], event, refs(instance));
+    }
+
+    /**
+     * Provide the same event to a range of instances, in index order.
+     *
+     * @param[in] event The event to handle.
+     * @param[in] first The index of the first instance.
+     * @param[in] count The number of instances. Clamped to the end of the fleet. Defaults to all
+     *                  instances from @p first on.
+     * @return The number of instances that handled the event.
+     */
+    size_t broadcast(const EventType & event, size_t first = 0, size_t count = Capacity) {
+        if (first >= Capacity) {
+            return 0;
+        }
+        const size_t end = count > Capacity - first ? Capacity : first + count;
+        size_t numHandled = 0;
+        for (size_t i = first; i < end; i++) {
+            numHandled += Engine::handleEvent(m_topology, m_contexts[i], event, refs(i)) ? 1 : 0;
+        }
+        return numHandled;
+    }
+
+    /**
+     * Provide the same event to every instance, grouped by current state. Has the same effect as
+     * broadcast(event) but is cheaper when there are many instances and few states: instead of
+     * walking the bubbling chain from scratch for every instance, it sorts the instances into
+     * one group per current state (a counting sort, so O(instances + states)), works out the
+     * chain of event() handlers once per group, and then runs each group's instances through that
+     * chain in a tight loop.
+     *
+     * Instances are handled one group at a time (groups in state index order, instances in index
+     * order within a group). An instance's group, and so its handler chain, is fixed when the
+     * broadcast starts: a transition made by an instance's own handlers affects it from the next
+     * event as usual, but if a handler transitions a *different* instance that has not had the
+     * event yet, that instance still gets it in its old state. Instances that have not made their
+     * initial transition are skipped.
+     *
+     * @param[in] event The event to handle.
+     * @return The number of instances that handled the event.
+     */
+    size_t broadcastByState(const EventType & event) {
+        groupByState();
+        size_t numHandled = 0;
+        typename SharedState<Context, EventType>::EventHandler chain[NumStates];
+        for (uint16_t state = 0; state < NumStates; state++) {
+            const uint32_t begin = m_groupStarts[state];
+            const uint32_t end = m_groupStarts[state + 1];
+            if (begin == end) {
+                continue;
+            }
+            // Resolve the bubbling chain once for the whole group.
+            const size_t chainLength = Engine::resolveEventChain(m_topology, state, chain);
+            if (chainLength == 0) {
+                continue; // Nobody in this group can handle it.
+            }
+            for (uint32_t position = begin; position < end; position++) {
+                const uint32_t instance = m_groupOrder[position];
+                m_flags[instance] = 0;
+                for (size_t link = 0; link < chainLength; link++) {
+                    chain[link](m_contexts[instance], event);
+                    if (m_flags[instance] != 0) {
+                        numHandled++;
+                        break;
+                    }
+                }
+            }
+        }
+        return numHandled;
+    }
+
+    /**
+     * @param[in] instance The index of the instance.
+     * @return The index of the instance's current state, or NO_STATE before its initial
+     *         transition.
+     */
+    uint16_t getCurrentStateIndex(size_t instance) const {
+        return m_currentStates[instance];
+    }
+
+    /**
+     * @param[in] context An instance's context (an element of the contexts array).
+     * @return The index of that instance.
+     */
+    size_t indexOf(const Context & context) const {
+        return static_cast<size_t>(&context - &m_contexts[0]);
+    }
+
+    /**
+     * @param[in] instance The index of the instance.
+     * @return The instance's context.
+     */
+    Context & getContext(size_t instance) {
+        return m_contexts[instance];
+    }
+
+    /**
+     * @return The topology every instance runs.
+     */
+    const Topology & getTopology() const {
+        return m_topology;
+    }
+
+    /**
+     * @brief Trigger a transition of one instance to a state.
+     *
+     * Same semantics as StateMachine::transitionTo(). Usually called from a handler, passing the
+     * context the handler was given.
+     *
+     * @param[in] context The instance's context.
+     * @param[in] state   The index of the state to transition to.
+     */
+    void transitionTo(Context & context, uint16_t state) {
+        Engine::transitionTo(m_topology, context, state, refs(indexOf(context)));
+    }
+
+    /**
+     * Indicate that an instance handled the event it was given and event bubbling should stop.
+     * This function should be called only inside state event() functions.
+     *
+     * @param[in] context The instance's context.
+     */
+    void eventHandled(const Context & context) {
+        m_flags[indexOf(context)] |= detail::SHARED_EVENT_HANDLED;
+    }
+
+    /**
+     * @return The size of the snapshot snapshot() writes: a few bytes of header plus 2 bytes per
+     *         instance.
+     */
+    static constexpr size_t snapshotSize() {
+        return SNAPSHOT_HEADER_SIZE + 2 * Capacity;
+    }
+
+    /**
+     * Save the current state of every instance into @p buffer as a compact binary snapshot, to be
+     * restored later with restore() (see StateMachine::snapshot()). States are saved by their
+     * index in the topology. The contexts are your data, and are not saved. Call it between
+     * events, not from a handler.
+     *
+     * @param[out] buffer   Where to write the snapshot.
+     * @param[in]  capacity The size of @p buffer in bytes (snapshotSize() is enough).
+     * @return The size of the snapshot in bytes, or 0 if it did not fit in @p buffer.
+     */
+    size_t snapshot(uint8_t * buffer, size_t capacity) const {
+        if (buffer == nullptr || capacity < snapshotSize()) {
+            return 0;
+        }
+        detail::SnapshotWriter writer(buffer, capacity);
+        writeSnapshotHeader(writer);
+        uint8_t* out = buffer + SNAPSHOT_HEADER_SIZE;
+        for (size_t i = 0; i < Capacity; i++) {
+            out[2 * i] = static_cast<uint8_t>(m_currentStates[i]);
+            out[2 * i + 1] = static_cast<uint8_t>(m_currentStates[i] >> 8);
+        }
+        return snapshotSize();
+    }
+
+    /**
+     * Put every instance back in the state saved by snapshot(), without replaying any events or
+     * running exit() methods (see StateMachine::restore()). With RestoreEntry::Leaves, the entry()
+     * method of each instance's restored state is then run, in index order. Instances saved
+     * before their initial transition are restored without a current state.
+     *
+     * The snapshot is checked in full before anything is changed: if it is truncated, of another
+     * SNAPSHOT_VERSION, from a fleet of another size or topology size, or names a state that
+     * doesn't exist, false is returned and the fleet is unchanged.
+     *
+     * @param[in] data    The snapshot.
+     * @param[in] size    The size of the snapshot in bytes.
+     * @param[in] entries Which entry() methods to run (see RestoreEntry).
+     * @return True if the snapshot was restored.
+     */
+    bool restore(const uint8_t * data, size_t size, RestoreEntry entries = RestoreEntry::None) {
+        if (data == nullptr || size != snapshotSize()) {
+            return false;
+        }
+        detail::SnapshotReader reader(data, SNAPSHOT_HEADER_SIZE);
+        if (!detail::readSnapshotHeader(reader, detail::SNAPSHOT_FLEET)
+                || reader.u16() != NumStates || reader.u32() != Capacity) {
+            return false;
+        }
+        const uint8_t* in = data + SNAPSHOT_HEADER_SIZE;
+        for (size_t i = 0; i < Capacity; i++) {
+            const uint16_t state = static_cast<uint16_t>(in[2 * i] | (in[2 * i + 1] << 8));
+            if (state >= NumStates && state != NO_STATE) {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < Capacity; i++) {
+            m_currentStates[i] = static_cast<uint16_t>(in[2 * i] | (in[2 * i + 1] << 8));
+            m_calledEntryStates[i] = NO_STATE;
+            m_calledExitStates[i] = NO_STATE;
+            m_recursionDepths[i] = 0;
+            m_flags[i] = 0;
+        }
+        if (entries == RestoreEntry::Leaves) {
+            for (size_t i = 0; i < Capacity; i++) {
+                if (m_currentStates[i] == NO_STATE) {
+                    continue;
+                }
+                const typename SharedState<Context, EventType>::EntryHandler entry =
+                    m_topology.getState(m_currentStates[i]).entry;
+                if (entry != nullptr) {
+                    entry(m_contexts[i]);
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    /**
+     * The snapshot header: the common header, then the number of states and of instances, which
+     * restore() checks against its own.
+     */
+    static constexpr size_t SNAPSHOT_HEADER_SIZE = 4 + 2 + 4;
+
+    void writeSnapshotHeader(detail::SnapshotWriter& writer) const {
+        detail::writeSnapshotHeader(writer, detail::SNAPSHOT_FLEET);
+        writer.u16(static_cast<uint16_t>(NumStates));
+        writer.u32(static_cast<uint32_t>(Capacity));
+    }
+
+    detail::SharedMachineRefs refs(size_t instance) {
+        return {
+            m_currentStates[instance],
+            m_calledEntryStates[instance],
+            m_calledExitStates[instance],
+            m_recursionDepths[instance],
+            m_flags[instance],
+        };
+    }
+
+    /**
+     * Fill m_groupOrder with the instance indexes sorted (stably) by current state, and
+     * m_groupStarts with where each state's group starts. Instances with no current state are
+     * left out.
+     */
+    void groupByState() {
+        for (uint32_t& start : m_groupStarts) {
+            start = 0;
+        }
+        for (size_t i = 0; i < Capacity; i++) {
+            if (m_currentStates[i] != NO_STATE) {
+                m_groupStarts[m_currentStates[i] + 1]++;
+            }
+        }
+        for (size_t state = 0; state < NumStates; state++) {
+            m_groupStarts[state + 1] += m_groupStarts[state];
+        }
+        for (size_t state = 0; state < NumStates; state++) {
+            m_groupCursors[state] = m_groupStarts[state];
+        }
+        for (size_t i = 0; i < Capacity; i++) {
+            if (m_currentStates[i] != NO_STATE) {
+                m_groupOrder[m_groupCursors[m_currentStates[i]]++] = static_cast<uint32_t>(i);
+            }
+        }
+    }
+
+    const Topology & m_topology;
+    Context (&m_contexts)[Capacity];
+
+    /**
+     * Per-instance bookkeeping, one array per field (see detail::SharedMachineRefs).
+     */
+    uint16_t m_currentStates[Capacity];
+    uint16_t m_calledEntryStates[Capacity];
+    uint16_t m_calledExitStates[Capacity];
+    uint8_t m_recursionDepths[Capacity];
+    uint8_t m_flags[Capacity];
+
+    /**
+     * Scratch space for broadcastByState(): the instances sorted by current state, where each
+     * state's group starts within that order, and the next free slot of each group while sorting.
+     */
+    uint32_t m_groupOrder[Capacity];
+    uint32_t m_groupStarts[NumStates + 1];
+    uint32_t m_groupCursors[NumStates];
+}; // class StateFleet
+
+} // namespace NinjaHSM
@@ -1,8 +1,15 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
 
+#include "Snapshot.hpp"
 #include "State.hpp"
+#include "Timer.hpp"
+#include "TransitionTable.hpp"
 
 namespace NinjaHSM {
 
@@ -23,14 +30,30 @@ enum class TransitionAction {
     Exit,
 };
 
+/**
+ * Which history StateMachine::transitionToHistory() restores.
+ */
+enum class History {
+    /**
+     * The child of the state that was last active in it.
+     */
+    Shallow,
+
+    /**
+     * The deepest state that was last active in it (all the way down the hierarchy).
+     */
+    Deep,
+};
+
 /**
  * Errors the state machine can report to an error observer (see StateMachine::setErrorObserver()).
  */
 enum class Error {
     /**
      * transitionTo() recursed deeper than MAX_RECURSION_COUNT (almost always an unconditional
-     * transitionTo() in an entry()/exit() method). The transition is abandoned and the state
-     * machine may be left in an indeterminate current state.
+     * transitionTo() in an entry()/exit() method), or with the iterative engine, more nested
+     * transitions were waiting to run than its work list holds. The transition is abandoned and
+     * the state machine may be left in an indeterminate current state.
      *
      * To recover, transition to a known-good state once control returns to your code (e.g. call
      * initialTransitionTo()/transitionTo() from the error observer or after handleEvent()
@@ -38,10 +61,425 @@ enum class Error {
      * transitionTo() unwinds, so a subsequent transition starts cleanly.
      */
     MaxRecursionDepthExceeded,
+
+    /**
+     * transitionTo() was asked to transition to a state that is MAX_STATE_DEPTH or more levels
+     * deep (the state hierarchy is deeper than MAX_STATE_DEPTH). The transition is abandoned
+     * before any state is exited or entered, so the current state is left unchanged.
+     */
+    MaxStateDepthExceeded,
+
+    /**
+     * finalize() was given states it cannot build a transition table for: a state was listed
+     * twice, a state's parent was not listed, a state was constructed before its parent (see
+     * InvalidHierarchy), or the hierarchy is deeper than the table's MaxDepth. The state machine is left unsealed (transitions still work, just without the
+     * table).
+     */
+    FinalizeFailed,
+
+    /**
+     * A SharedStateMachine was asked to transition using a SharedTopology that failed validation
+     * (a state's parent is not listed before it), or to a state index outside the topology. The
+     * transition is abandoned before any state is exited or entered.
+     */
+    InvalidTopology,
+
+    /**
+     * StateMachine::setRegions() was given an invalid set of regions (a null or top-level region
+     * state, one listed twice, or an orthogonal state inside another's region), or was called
+     * while an orthogonal state was active. No regions are set.
+     */
+    InvalidRegions,
+
+    /**
+     * A state's depth or bubbleMask doesn't match its parent's, almost always because the state
+     * was constructed before its parent (e.g. a child member declared before its parent member),
+     * so it derived them from a parent that didn't exist yet. Reported by transitionTo() for the
+     * destination and its ancestors, abandoning the transition before any state is exited or
+     * entered, and by finalize() (as FinalizeFailed).
+     */
+    InvalidHierarchy,
+
+    /**
+     * post(), defer(), recall() or TimerService::start()/startInState() was called from one of
+     * the state machine's region event() handlers running in parallel (see
+     * StateMachine::setRegionExecutor()). None of them is thread safe, so the call is rejected:
+     * nothing is posted, deferred, recalled or armed. Do it from the entry() of the state the
+     * region transitions to instead, which runs after the join. Note that the error observer is
+     * called on the handler's thread.
+     */
+    CalledFromParallelRegion,
+};
+
+/**
+ * Compile-time configuration of a StateMachine, passed as its optional second template
+ * parameter. Features that are turned off are compiled out entirely: their members are not
+ * stored (making the state machine smaller) and their checks are not in the hot path.
+ *
+ * To change just some features, derive from this and hide the constants you want to change:
+ *
+ * @code
+ * struct NoObserversPolicy : StateMachinePolicy {
+ *     static constexpr bool OBSERVERS = false;
+ * };
+ * StateMachine<Event, NoObserversPolicy> m_stateMachine;
+ * @endcode
+ *
+ * QueuedStateMachine, ActiveStateMachine, ScheduledStateMachine and ExecutorStateMachine take a
+ * policy as their last template parameter too.
+ *
+ * The policy only shapes the state machine. A State doesn't know which state machine it belongs
+ * to, so it always carries the fields the optional features use: depth, index, eventMask,
+ * bubbleMask, timers and the two history pointers. That is 40 bytes per state on a 64-bit target
+ * (24 on a 32-bit one) on top of its name, delegates and parent, whatever the policy.
+ */
+struct StateMachinePolicy {
+    /**
+     * Support the transition, unhandled event and error observers. When false, the setters do not
+     * compile and errors are not reported (the state machine still recovers from them as usual).
+     */
+    static constexpr bool OBSERVERS = true;
+
+    /**
+     * The maximum number of times transitionTo() can be called recursively (see
+     * MAX_RECURSION_COUNT), or 0 to not check. Without the check, a state that unconditionally
+     * transitions away from its entry() to a state that transitions back overflows the stack.
+     */
+    static constexpr uint32_t RECURSION_LIMIT = MAX_RECURSION_COUNT;
+
+    /**
+     * Support setEventKindSelector() (event subscription masks).
+     */
+    static constexpr bool EVENT_KIND_SELECTOR = true;
+
+    /**
+     * Support finalize() (sealed state machines with a precomputed transition table).
+     */
+    static constexpr bool SEALING = true;
+
+    /**
+     * Resolve transitionTo() calls made from entry()/exit() with a fixed-size work list instead
+     * of recursing, so the stack used by a transition is constant however many transitions are
+     * chained. The nested transition is recorded and runs as soon as the entry()/exit() that
+     * requested it returns, with the same entry/exit guard semantics as the recursive engine.
+     *
+     * The only visible difference is ordering within that entry()/exit(): code after the
+     * transitionTo() call (and the transition observer's notification for the state) runs before
+     * the nested transition instead of after it.
+     */
+    static constexpr bool ITERATIVE_TRANSITIONS = false;
+
+    /**
+     * With ITERATIVE_TRANSITIONS, the number of work list slots (at least 2). Chains of
+     * transitions (each entry() calling transitionTo() once) need only two slots however long
+     * they are; each extra transitionTo() from the same entry()/exit() needs one more. Running
+     * out is reported as Error::MaxRecursionDepthExceeded.
+     */
+    static constexpr uint32_t TRANSITION_WORK_LIST_SIZE = 8;
+
+    /**
+     * The capacity of the internal event queue that post() adds to, or 0 for no post(). Each slot
+     * stores one event.
+     */
+    static constexpr uint32_t INTERNAL_EVENT_QUEUE_SIZE = 0;
+
+    /**
+     * The number of events defer() can hold, or 0 for no defer()/recall(). Each slot stores one
+     * event.
+     */
+    static constexpr uint32_t DEFERRED_EVENT_POOL_SIZE = 0;
+
+    /**
+     * Record each state's history as it is exited, for transitionToHistory().
+     */
+    static constexpr bool HISTORY = true;
+
+    /**
+     * The number of orthogonal regions setRegions() can register, or 0 for no regions. Each
+     * region costs two pointers.
+     */
+    static constexpr uint32_t MAX_REGIONS = 0;
+
+    /**
+     * With MAX_REGIONS, support setRegionExecutor(): the event() handlers of an orthogonal
+     * state's regions run concurrently, and the transitions they request are made once they have
+     * all returned.
+     */
+    static constexpr bool PARALLEL_REGIONS = false;
+};
+
+/**
+ * Policy with every optional feature turned off, for state machines that are already debugged
+ * and need to be as small and fast as possible (e.g. release builds, or thousands of instances).
+ */
+struct LeanStateMachinePolicy : StateMachinePolicy {
+    static constexpr bool OBSERVERS = false;
+    static constexpr uint32_t RECURSION_LIMIT = 0;
+    static constexpr bool EVENT_KIND_SELECTOR = false;
+    static constexpr bool SEALING = false;
+    static constexpr bool HISTORY = false;
+};
+
+namespace detail {
+
+/**
+ * Storage for the optional parts of a StateMachine, selected by its policy. The disabled
+ * specialisations are empty base classes, so they take up no space.
+ */
+template <typename EventType, bool Enabled>
+struct StateMachineObservers {};
+
+template <typename EventType>
+struct StateMachineObservers<EventType, true> {
+    /**
+     * Default constructed (unbound) until set via the corresponding setter. Unbound delegates are
+     * never called (guarded by is_valid()).
+     */
+    etl::delegate<void(const State<EventType>&, TransitionAction)> m_transitionObserver;
+    etl::delegate<void(const EventType&)> m_unhandledEventObserver;
+    etl::delegate<void(Error)> m_errorObserver;
+};
+
+template <typename EventType, bool Enabled>
+struct StateMachineEventKinds {};
+
+template <typename EventType>
+struct StateMachineEventKinds<EventType, true> {
+    etl::delegate<uint8_t(const EventType&)> m_eventKindSelector;
+};
+
+template <typename EventType, bool Enabled>
+struct StateMachineTableView {};
+
+template <typename EventType>
+struct StateMachineTableView<EventType, true> {
+    /**
+     * View onto the TransitionTable passed to finalize(). m_tableNumStates is 0 while the state
+     * machine is unsealed.
+     */
+    const State<EventType>* const* m_tableStates = nullptr;
+    const State<EventType>* const* m_tableAncestors = nullptr;
+    const uint8_t* m_tableCommonDepths = nullptr;
+    uint16_t m_tableMaxDepth = 0;
+    uint16_t m_tableNumStates = 0;
+};
+
+/**
+ * An entry in the iterative transition engine's work list: either a transition still to run,
+ * or (with a null destination) entry/exit guards to clear once the transitions above it have run.
+ */
+template <typename EventType>
+struct TransitionWorkItem {
+    const State<EventType>* destination;
+    uint8_t guardsToClear;
+};
+
+template <typename EventType, uint32_t Size>
+struct StateMachineWorkList {
+    static_assert(Size >= 2, "TRANSITION_WORK_LIST_SIZE must be at least 2.");
+
+    TransitionWorkItem<EventType> m_workList[Size] = {};
+    uint32_t m_workListSize = 0;
+};
+
+template <typename EventType>
+struct StateMachineWorkList<EventType, 0> {};
+
+/**
+ * A fixed-capacity FIFO of Size events, constructed in place as they are pushed. Used for a
+ * StateMachine's internal event queue and its deferred events.
+ */
+template <typename EventType, uint32_t Size>
+class EventRing {
+public:
+    EventRing() {}
+
+    EventRing(const EventRing&) = delete;
+    EventRing& operator=(const EventRing&) = delete;
+
+    ~EventRing() {
+        clear();
+    }
+
+    template <typename T>
+    bool push(T&& event) {
+        if (m_size == Size) {
+            return false;
+        }
+        uint32_t tail = m_head + m_size;
+        tail = tail >= Size ? tail - Size : tail;
+        new (&m_events[tail][0]) EventType(std::forward<T>(event));
+        m_size++;
+        return true;
+    }
+
+    /**
+     * Remove the oldest event. The ring must not be empty.
+     */
+    EventType take() {
+        EventType* stored = std::launder(reinterpret_cast<EventType*>(&m_events[m_head][0]));
+        EventType event(std::move(*stored));
+        stored->~EventType();
+        m_head = m_head + 1 == Size ? 0 : m_head + 1;
+        m_size--;
+        return event;
+    }
+
+    void clear() {
+        while (m_size != 0) {
+            take();
+        }
+    }
+
+    uint32_t size() const {
+        return m_size;
+    }
+
+    /**
+     * @return The event @p i places from the oldest. @p i must be less than size().
+     */
+    const EventType& at(uint32_t i) const {
+        uint32_t index = m_head + i;
+        index = index >= Size ? index - Size : index;
+        return *std::launder(reinterpret_cast<const EventType*>(&m_events[index][0]));
+    }
+
+private:
+    uint32_t m_head = 0;
+    uint32_t m_size = 0;
+    alignas(EventType) unsigned char m_events[Size][sizeof(EventType)];
+};
+
+template <typename EventType, uint32_t Size>
+struct StateMachineInternalQueue {
+    EventRing<EventType, Size> m_internalEvents;
 };
 
 template <typename EventType>
-class StateMachine {
+struct StateMachineInternalQueue<EventType, 0> {};
+
+template <typename EventType, uint32_t Size>
+struct StateMachineDeferredEvents {
+    EventRing<EventType, Size> m_deferredEvents;
+
+    /**
+     * How many of the oldest deferred events recall() has scheduled to be handled again.
+     */
+    uint32_t m_numRecalled = 0;
+};
+
+template <typename EventType>
+struct StateMachineDeferredEvents<EventType, 0> {};
+
+/**
+ * Marks "no region" in StateMachineRegions::m_focusedRegion.
+ */
+constexpr uint32_t NO_REGION = UINT32_MAX;
+
+template <typename EventType, uint32_t Size>
+struct StateMachineRegions {
+    /**
+     * The region states registered with setRegions(), in dispatch order, and the active state of
+     * each region (its orthogonal state while the region is not entered). The entry of the
+     * focused region is stale: its active state is m_currentState.
+     */
+    const State<EventType>* m_regions[Size] = {};
+    const State<EventType>* m_regionStates[Size] = {};
+    uint32_t m_numRegions = 0;
+
+    /**
+     * The orthogonal state whose regions are active (nullptr if none), and the region whose
+     * active state is currently in m_currentState (NO_REGION if none).
+     */
+    const State<EventType>* m_orthogonalState = nullptr;
+    uint32_t m_focusedRegion = NO_REGION;
+
+    /**
+     * Set whenever the regions are exited, so an event is not offered to the regions after one
+     * whose handler exited (and perhaps re-entered) them all.
+     */
+    bool m_regionsExited = false;
+};
+
+template <typename EventType>
+struct StateMachineRegions<EventType, 0> {};
+
+/**
+ * One region's part in a parallel dispatch: which region, and what its event() handlers asked
+ * for (only the last transitionTo() is kept).
+ */
+template <typename EventType>
+struct ParallelRegion {
+    const void* stateMachine;
+    uint32_t region;
+    const State<EventType>* destination;
+    bool transitionToCalled;
+    bool eventHandledCalled;
+};
+
+/**
+ * @return The region whose event() handlers the calling thread is running in a parallel
+ *         dispatch, or nullptr. A function-local thread_local, so only state machines with
+ *         PARALLEL_REGIONS need thread-local storage.
+ */
+template <typename EventType>
+ParallelRegion<EventType>*& currentParallelRegion() {
+    static thread_local ParallelRegion<EventType>* region = nullptr;
+    return region;
+}
+
+template <typename EventType, uint32_t Size>
+struct StateMachineParallelRegions {
+    etl::delegate<void(void (*)(void*, uint32_t), void*, uint32_t)> m_regionExecutor;
+    ParallelRegion<EventType> m_parallelRegions[Size] = {};
+
+    /**
+     * The event being dispatched in parallel, and the bit of its kind (or ALL_EVENTS).
+     */
+    const EventType* m_parallelEvent = nullptr;
+    EventMask m_parallelKindMask = ALL_EVENTS;
+};
+
+template <typename EventType>
+struct StateMachineParallelRegions<EventType, 0> {};
+
+template <bool Enabled>
+struct StateMachineRunToCompletion {};
+
+template <>
+struct StateMachineRunToCompletion<true> {
+    /**
+     * True while handleEvent() (or the outermost transitionTo() called from outside any handler)
+     * is running, i.e. while posted and recalled events will be handled before it returns.
+     */
+    bool m_runningToCompletion = false;
+};
+
+} // namespace detail
+
+/**
+ * @tparam EventType The event type.
+ * @tparam Policy    Which optional features to compile in (see StateMachinePolicy).
+ */
+template <typename EventType, typename Policy = StateMachinePolicy>
+class StateMachine :
+        private detail::StateMachineObservers<EventType, Policy::OBSERVERS>,
+        private detail::StateMachineEventKinds<EventType, Policy::EVENT_KIND_SELECTOR>,
+        private detail::StateMachineTableView<EventType, Policy::SEALING>,
+        private detail::StateMachineWorkList<EventType,
+            Policy::ITERATIVE_TRANSITIONS ? Policy::TRANSITION_WORK_LIST_SIZE : 0>,
+        private detail::StateMachineInternalQueue<EventType, Policy::INTERNAL_EVENT_QUEUE_SIZE>,
+        private detail::StateMachineDeferredEvents<EventType, Policy::DEFERRED_EVENT_POOL_SIZE>,
+        private detail::StateMachineRegions<EventType, Policy::MAX_REGIONS>,
+        private detail::StateMachineParallelRegions<EventType, Policy::PARALLEL_REGIONS ? Policy::MAX_REGIONS : 0>,
+        private detail::StateMachineRunToCompletion<
+            Policy::INTERNAL_EVENT_QUEUE_SIZE != 0 || Policy::DEFERRED_EVENT_POOL_SIZE != 0> {
+    /**
+     * Whether anything (posted or recalled events) can be waiting to be handled after a step.
+     */
+    static constexpr bool RUN_TO_COMPLETION =
+        Policy::INTERNAL_EVENT_QUEUE_SIZE != 0 || Policy::DEFERRED_EVENT_POOL_SIZE != 0;
+
 public:
     /**
      * Observer called immediately after a state's entry() or exit() method runs. Useful for
@@ -62,6 +500,18 @@ public:
      */
     using ErrorObserver = etl::delegate<void(Error)>;
 
+    /**
+     * Returns the kind of an event (0 to MAX_EVENT_KINDS - 1), which is matched against the
+     * states' eventMask. See setEventKindSelector().
+     */
+    using EventKindSelector = etl::delegate<uint8_t(const EventType&)>;
+
+    /**
+     * Runs task(context, i) for each i from 0 to numTasks - 1, possibly concurrently, and returns
+     * once they have all returned. See setRegionExecutor().
+     */
+    using RegionExecutor = etl::delegate<void(void (*task)(void* context, uint32_t i), void* context, uint32_t numTasks)>;
+
     StateMachine() {}
 
     /**
@@ -72,7 +522,8 @@ public:
      * @param[in] observer The observer to call, or an unbound delegate to clear.
      */
     void setTransitionObserver(TransitionObserver observer) {
-        m_transitionObserver = observer;
+        static_assert(Policy::OBSERVERS, "Observers are disabled by this state machine's policy.");
+        this->m_transitionObserver = observer;
     }
 
     /**
@@ -82,7 +533,8 @@ public:
      * @param[in] observer The observer to call, or an unbound delegate to clear.
      */
     void setUnhandledEventObserver(UnhandledEventObserver observer) {
-        m_unhandledEventObserver = observer;
+        static_assert(Policy::OBSERVERS, "Observers are disabled by this state machine's policy.");
+        this->m_unhandledEventObserver = observer;
     }
 
     /**
@@ -92,7 +544,223 @@ public:
      * @param[in] observer The observer to call, or an unbound delegate to clear.
      */
     void setErrorObserver(ErrorObserver observer) {
-        m_errorObserver = observer;
+        static_assert(Policy::OBSERVERS, "Observers are disabled by this state machine's policy.");
+        this->m_errorObserver = observer;
+    }
+
+    /**
+     * Enable event subscription masks. Once set, handleEvent() works out each event's kind with
+     * @p selector and only calls the event() handlers of states whose eventMask includes that
+     * kind, skipping straight past the others. As soon as no state from the current one upwards
+     * is subscribed to the kind (see State::bubbleMask), bubbling stops and the event goes to the
+     * unhandled event observer without any more handlers being called.
+     *
+     * Events of a kind of MAX_EVENT_KINDS or more are offered to every state. Without a selector
+     * (the default), or for states left at ALL_EVENTS, every handler is called as usual. For
+     * std::variant event types, variantEventKind() is a ready-made selector.
+     *
+     * @param[in] selector The selector to use, or an unbound delegate to disable masks.
+     */
+    void setEventKindSelector(EventKindSelector selector) {
+        static_assert(Policy::EVENT_KIND_SELECTOR, "Event kind selectors are disabled by this state machine's policy.");
+        this->m_eventKindSelector = selector;
+    }
+
+    /**
+     * Seal the state machine: register every state once and precompute the exit/entry path of
+     * every possible transition into @p table. After this, transitionTo() between registered
+     * states just walks contiguous runs of the table instead of searching the hierarchy, so its
+     * cost no longer depends on how deep the states are.
+     *
+     * Call once at startup, after constructing the states and before initialTransitionTo(). Each
+     * state is assigned a dense index (its position in @p states). Transitions involving a state
+     * that was not registered still work, they just take the unsealed path.
+     *
+     * @param[in,out] table  Storage for the precomputed paths. Must outlive the state machine.
+     * @param[in,out] states Every state of the state machine. Parents must be included.
+     * @return True on success. On failure, the error observer is notified with
+     *         Error::FinalizeFailed, false is returned and the state machine stays unsealed.
+     */
+    template <size_t NumStates, size_t MaxDepth>
+    bool finalize(
+            TransitionTable<EventType, NumStates, MaxDepth>& table,
+            State<EventType>* const (&states)[NumStates]) {
+        static_assert(Policy::SEALING, "Sealing is disabled by this state machine's policy.");
+        unseal();
+
+        // Assign indexes first so that parents can be checked for registration below.
+        for (size_t i = 0; i < NumStates; i++) {
+            states[i]->index = static_cast<uint16_t>(i);
+            table.m_states[i] = states[i];
+        }
+
+        for (size_t i = 0; i < NumStates; i++) {
+            const State<EventType>* state = states[i];
+            // A state listed twice ends up with the index of its last occurrence.
+            if (state->index != i || state->depth >= MaxDepth || !isConstructedAfterParent(state)) {
+                return finalizeFailed();
+            }
+            for (const State<EventType>* ancestor = state; ancestor != nullptr; ancestor = ancestor->parent) {
+                if (ancestor->index >= NumStates || table.m_states[ancestor->index] != ancestor) {
+                    return finalizeFailed();
+                }
+                table.m_ancestors[i][ancestor->depth] = ancestor;
+            }
+        }
+
+        for (size_t i = 0; i < NumStates; i++) {
+            for (size_t j = 0; j < NumStates; j++) {
+                const State<EventType>* lca = findCommonAncestor(states[i], states[j]);
+                table.m_commonDepths[i][j] = static_cast<uint8_t>(depthOf(lca) + 1);
+            }
+        }
+
+        this->m_tableStates = &table.m_states[0];
+        this->m_tableAncestors = &table.m_ancestors[0][0];
+        this->m_tableCommonDepths = &table.m_commonDepths[0][0];
+        this->m_tableMaxDepth = static_cast<uint16_t>(MaxDepth);
+        this->m_tableNumStates = static_cast<uint16_t>(NumStates);
+        return true;
+    }
+
+    /**
+     * @return True if finalize() has successfully sealed the state machine.
+     */
+    bool isSealed() const {
+        if constexpr (Policy::SEALING) {
+            return this->m_tableNumStates != 0;
+        } else {
+            return false;
+        }
+    }
+
+    /**
+     * Save the state machine's state into @p buffer as a compact binary snapshot, to be restored
+     * later with restore(), e.g. by the next run of the program after a restart. States are
+     * identified by their index from finalize(), not by address, so the snapshot stays valid
+     * across runs as long as the same states are passed to finalize() in the same order.
+     *
+     * The snapshot holds:
+     *  - the current state
+     *  - each state's history, if the policy has HISTORY
+     *  - the active state of each region, if it has MAX_REGIONS
+     *  - the posted and deferred events still waiting, if it has INTERNAL_EVENT_QUEUE_SIZE or
+     *    DEFERRED_EVENT_POOL_SIZE. These are copied byte for byte, so they can only be saved
+     *    if EventType is trivially copyable (and should not hold pointers).
+     *
+     * Integers are written little-endian, so a snapshot can be restored on a different host.
+     * Timers, observers and everything else you set up at startup are not saved. Call it
+     * between events, not from a handler.
+     *
+     * Needs a policy with SEALING.
+     *
+     * @param[out] buffer   Where to write the snapshot.
+     * @param[in]  capacity The size of @p buffer in bytes (snapshotSize() is enough).
+     * @return The size of the snapshot in bytes, or 0 if it did not fit in @p buffer or the state
+     *         machine can't be saved: it is not sealed, an active state was not registered with
+     *         finalize(), or events are waiting that are not trivially copyable.
+     */
+    size_t snapshot(uint8_t * buffer, size_t capacity) const {
+        static_assert(Policy::SEALING, "snapshot() needs a policy with SEALING (states are saved by their finalize() index).");
+        detail::SnapshotWriter writer(buffer, capacity);
+        return writeSnapshot(writer) && writer.fitted() ? writer.size() : 0;
+    }
+
+    /**
+     * @return The size of the snapshot snapshot() would write now, or 0 if the state machine
+     *         can't be saved (see snapshot()).
+     */
+    size_t snapshotSize() const {
+        static_assert(Policy::SEALING, "snapshotSize() needs a policy with SEALING.");
+        detail::SnapshotWriter writer(nullptr, 0);
+        return writeSnapshot(writer) ? writer.size() : 0;
+    }
+
+    /**
+     * Put the state machine back in the state saved by snapshot(), without replaying any events.
+     * Nothing is exited, and by default nothing is entered either: the state machine is simply in
+     * the saved state. With RestoreEntry::Leaves, the entry() method of each restored leaf (the
+     * current state, or the active state of each region) is then run, e.g. to re-arm its
+     * timeouts. A transitionTo() from one of those runs as an ordinary transition out of the
+     * restored state.
+     *
+     * Meant for a state machine that has just been constructed and finalize()d with the same
+     * states as the one saved (and given the same setRegions()), before initialTransitionTo().
+     * The snapshot is checked in full before anything is changed: if it is truncated, of another
+     * SNAPSHOT_VERSION, from a state machine with a different policy or number of states, or
+     * names a state that doesn't exist, false is returned and the state machine is unchanged.
+     *
+     * Needs a policy with SEALING.
+     *
+     * @param[in] data    The snapshot.
+     * @param[in] size    The size of the snapshot in bytes.
+     * @param[in] entries Which entry() methods to run (see RestoreEntry).
+     * @return True if the snapshot was restored.
+     */
+    bool restore(const uint8_t * data, size_t size, RestoreEntry entries = RestoreEntry::None) {
+        static_assert(Policy::SEALING, "restore() needs a policy with SEALING (states are saved by their finalize() index).");
+        if (!isSealed() || !readSnapshot(detail::SnapshotReader(data, size), false)) {
+            return false;
+        }
+        readSnapshot(detail::SnapshotReader(data, size), true);
+        if (entries == RestoreEntry::Leaves) {
+            enterRestoredLeaves();
+        }
+        return true;
+    }
+
+    /**
+     * Register orthogonal regions. A region is a state (the "region state") whose parent is an
+     * orthogonal state: while the orthogonal state is active, every one of its regions is active
+     * too, each with its own active state inside it. Entering the orthogonal state enters each of
+     * its regions (their entry() can transitionTo() a child as the initial state), handleEvent()
+     * offers each event to every region in turn, and leaving the orthogonal state exits every
+     * region.
+     *
+     * @code
+     * // Keyboard has two regions, CapsLock and NumLock, each with its own substates.
+     * const State<Event>* const regions[] = { &m_capsLock, &m_numLock };
+     * m_stateMachine.setRegions(regions);
+     * @endcode
+     *
+     * Regions are ordered as listed here: it is the order they are entered and handle events in
+     * (they are exited in reverse). An orthogonal state has no other children than its regions,
+     * and a region cannot contain another orthogonal state. Call once at startup, before
+     * initialTransitionTo(). Needs a policy with MAX_REGIONS.
+     *
+     * @param[in] regions The region states of every orthogonal state. The pointers are copied.
+     * @return True on success. On failure, the error observer is notified with
+     *         Error::InvalidRegions, false is returned and no regions are set.
+     */
+    template <size_t NumRegions>
+    bool setRegions(const State<EventType>* const (&regions)[NumRegions]) {
+        static_assert(Policy::MAX_REGIONS != 0, "setRegions() needs a policy with MAX_REGIONS.");
+        static_assert(NumRegions <= Policy::MAX_REGIONS, "More regions than the policy's MAX_REGIONS.");
+        this->m_numRegions = 0;
+        if (this->m_orthogonalState != nullptr) {
+            reportError(Error::InvalidRegions);
+            return false;
+        }
+        for (size_t i = 0; i < NumRegions; i++) {
+            if (regions[i] == nullptr || regions[i]->parent == nullptr) {
+                reportError(Error::InvalidRegions);
+                return false;
+            }
+            for (size_t j = 0; j < i; j++) {
+                // Listed twice, or one region's orthogonal state is inside the other region.
+                if (regions[j] == regions[i]
+                        || isChildOf(regions[i], regions[j]->parent)
+                        || isChildOf(regions[j], regions[i]->parent)) {
+                    reportError(Error::InvalidRegions);
+                    return false;
+                }
+            }
+        }
+        for (size_t i = 0; i < NumRegions; i++) {
+            this->m_regions[i] = regions[i];
+        }
+        this->m_numRegions = static_cast<uint32_t>(NumRegions);
+        return true;
     }
 
     /**
@@ -106,76 +774,625 @@ public:
     }
 
     /**
-     * Provide an event to the state machine. The state machine will call the current state's
-     * event() function.
-     *
-     * Not re-entrant. handleEvent() and transitionTo() share internal bookkeeping, so you must
-     * not call handleEvent() again before the current call returns (e.g. from another thread or
-     * from an interrupt that fires mid-call). To feed events from an ISR, push them onto a queue
-     * and drain that queue from your main loop. It is fine, however, to call transitionTo() or
-     * eventHandled() from within a state's event() handler --- that is the normal usage.
-     *
-     * @param[in] event The event to handle.
+     * Provide an event to the state machine. The state machine will call the current state's
+     * event() function.
+     *
+     * Not re-entrant. handleEvent() and transitionTo() share internal bookkeeping, so you must
+     * not call handleEvent() again before the current call returns (e.g. from another thread or
+     * from an interrupt that fires mid-call). To feed events from an ISR, push them onto a queue
+     * and drain that queue from your main loop. It is fine, however, to call transitionTo() or
+     * eventHandled() from within a state's event() handler --- that is the normal usage. To send
+     * the state machine an event from one of its own handlers, use post().
+     *
+     * @param[in] event The event to handle.
+     * @return True if a state handled the event (transitioned or called eventHandled()), false if
+     *         it bubbled past the top unhandled. Events posted or recalled along the way don't
+     *         count.
+     */
+    bool handleEvent(const EventType& event) {
+        if constexpr (RUN_TO_COMPLETION) {
+            this->m_runningToCompletion = true;
+            // Posted events go first, including any posted while the state machine was idle.
+            dispatchPendingEvents();
+            const bool handled = dispatchEvent(event);
+            dispatchPendingEvents();
+            this->m_runningToCompletion = false;
+            return handled;
+        } else {
+            return dispatchEvent(event);
+        }
+    }
+
+    /**
+     * Send the state machine an event from one of its own entry()/event()/exit() handlers. The
+     * event is queued and handled once the current step (the handleEvent() or transitionTo() in
+     * progress) has run to completion, before handleEvent() returns and before any other
+     * external event. Posted events are handled in the order they were posted, and may post more
+     * events themselves.
+     *
+     * Only available if the policy sets INTERNAL_EVENT_QUEUE_SIZE. Like handleEvent(), not
+     * thread or interrupt safe: use a QueuedStateMachine to receive events from other contexts.
+     * If called while the state machine is idle, the event waits for the next handleEvent(), which
+     * handles it first (or for the next transitionTo(), which handles it afterwards).
+     *
+     * @param[in] event The event to post.
+     * @return True if the event was queued, false if the internal queue was full (the event is
+     *         dropped) or if called from a region handler running in parallel (see
+     *         Error::CalledFromParallelRegion).
+     */
+    bool post(const EventType& event) {
+        static_assert(Policy::INTERNAL_EVENT_QUEUE_SIZE != 0, "post() needs a policy with an INTERNAL_EVENT_QUEUE_SIZE.");
+        if (rejectIfCalledInParallel()) {
+            return false;
+        }
+        return this->m_internalEvents.push(event);
+    }
+
+    /**
+     * Same as post(), but moves the event into the queue.
+     */
+    bool post(EventType&& event) {
+        static_assert(Policy::INTERNAL_EVENT_QUEUE_SIZE != 0, "post() needs a policy with an INTERNAL_EVENT_QUEUE_SIZE.");
+        if (rejectIfCalledInParallel()) {
+            return false;
+        }
+        return this->m_internalEvents.push(std::move(event));
+    }
+
+    /**
+     * Put off handling an event until the state machine is in a state that can handle it: call
+     * from an event() handler that receives an event too early, e.g. data arriving mid-handshake.
+     * The event is stored in a fixed-capacity pool and marked as handled (so it does not bubble
+     * up), until recall() hands it back.
+     *
+     * Only available if the policy sets DEFERRED_EVENT_POOL_SIZE.
+     *
+     * @param[in] event The event to defer.
+     * @return True if the event was deferred. False if the pool is full, or if called from a
+     *         region handler running in parallel (see Error::CalledFromParallelRegion), in which
+     *         case the event is neither stored nor marked as handled.
+     */
+    bool defer(const EventType& event) {
+        static_assert(Policy::DEFERRED_EVENT_POOL_SIZE != 0, "defer() needs a policy with a DEFERRED_EVENT_POOL_SIZE.");
+        if (rejectIfCalledInParallel() || !this->m_deferredEvents.push(event)) {
+            return false;
+        }
+        eventHandled();
+        return true;
+    }
+
+    /**
+     * Same as defer(), but moves the event into the pool.
+     */
+    bool defer(EventType&& event) {
+        static_assert(Policy::DEFERRED_EVENT_POOL_SIZE != 0, "defer() needs a policy with a DEFERRED_EVENT_POOL_SIZE.");
+        if (rejectIfCalledInParallel() || !this->m_deferredEvents.push(std::move(event))) {
+            return false;
+        }
+        eventHandled();
+        return true;
+    }
+
+    /**
+     * Hand every deferred event back to the state machine, typically from the entry() of a
+     * state that can now handle them. They are moved out of the pool and handled in the order
+     * they were deferred, once the current step has run to completion (like post()ed events,
+     * and ahead of them). A recalled event that is deferred again goes back into the pool and
+     * waits for the next recall().
+     *
+     * This includes an entry() run by a transitionTo() called from outside any handler (e.g.
+     * initialTransitionTo()): the events wait for that transition to complete. Only when called
+     * while the state machine is idle are they handled straight away.
+     *
+     * @return The number of events recalled (0 if called from a region handler running in
+     *         parallel, see Error::CalledFromParallelRegion).
+     */
+    uint32_t recall() {
+        static_assert(Policy::DEFERRED_EVENT_POOL_SIZE != 0, "recall() needs a policy with a DEFERRED_EVENT_POOL_SIZE.");
+        if (rejectIfCalledInParallel()) {
+            return 0;
+        }
+        this->m_numRecalled = this->m_deferredEvents.size();
+        const uint32_t numRecalled = this->m_numRecalled;
+        // Mid-transition, completeStep() handles them once the outermost transitionTo() is done.
+        if (!this->m_runningToCompletion && m_recursionDepth == 0) {
+            this->m_runningToCompletion = true;
+            dispatchPendingEvents();
+            this->m_runningToCompletion = false;
+        }
+        return numRecalled;
+    }
+
+    /**
+     * Drop every deferred event without handling it (e.g. when a connection is reset).
+     */
+    void discardDeferred() {
+        static_assert(Policy::DEFERRED_EVENT_POOL_SIZE != 0, "discardDeferred() needs a policy with a DEFERRED_EVENT_POOL_SIZE.");
+        this->m_deferredEvents.clear();
+        this->m_numRecalled = 0;
+    }
+
+    /**
+     * @return The number of events waiting in the deferred event pool (including any recalled
+     *         but not handled yet).
+     */
+    uint32_t numDeferred() const {
+        static_assert(Policy::DEFERRED_EVENT_POOL_SIZE != 0, "numDeferred() needs a policy with a DEFERRED_EVENT_POOL_SIZE.");
+        return this->m_deferredEvents.size();
+    }
+
+    /**
+     * Get the current state of the state machine. Can be nullptr before initial transition occurs
+     * due to transitionTo() being called.
+     *
+     * While an orthogonal state is active (see setRegions()), each of its regions has its own
+     * current state; this returns that of whichever region last handled an event or
+     * transitioned. Use getRegionState() or isInState() instead.
+     * 
+     * @return A pointer to the current state.
+     */
+    const State<EventType>* getCurrentState() const {
+        return m_currentState;
+    }
+
+    /**
+     * Run the regions' event() handlers in parallel. From now on, handleEvent() hands each active
+     * region of the orthogonal state to @p executor as a task (e.g. RegionThreadPool, which runs
+     * them on worker threads), which delivers the event to the region's active state and bubbles
+     * it up to the region state, and waits for them all to finish. Only then, on the calling
+     * thread and in region order, are the transitions they asked for made, so entry()/exit()
+     * methods, observers, timers and posted events stay single-threaded. If no region handled
+     * the event, it bubbles on from the orthogonal state as usual.
+     *
+     * This pays off when region handlers are slow (e.g. milliseconds of sensor fusion) and
+     * independent. Compared to dispatching the regions one after the other:
+     *
+     *  - Every region's handlers see the state machine as it was before the event, and all of
+     *    them run, even if an earlier region's transition leaves the orthogonal state (whose
+     *    regions' transitions are then discarded, since they have been exited).
+     *  - Handlers may only call transitionTo() (or transitionToHistory()) and eventHandled() on
+     *    the state machine, and if a region's handlers call transitionTo() more than once, only
+     *    the last one is made. Anything else they share must be synchronised by you.
+     *
+     * Needs a policy with MAX_REGIONS and PARALLEL_REGIONS.
+     *
+     * @param[in] executor The executor, or an unbound delegate to dispatch the regions one after
+     *                     the other again.
+     */
+    void setRegionExecutor(RegionExecutor executor) {
+        static_assert(Policy::PARALLEL_REGIONS && Policy::MAX_REGIONS != 0,
+            "setRegionExecutor() needs a policy with MAX_REGIONS and PARALLEL_REGIONS.");
+        this->m_regionExecutor = executor;
+    }
+
+    /**
+     * @param[in] region The index of a region in the list passed to setRegions().
+     * @return The region's active state, or nullptr if the region is not active.
+     */
+    const State<EventType>* getRegionState(uint32_t region) const {
+        static_assert(Policy::MAX_REGIONS != 0, "getRegionState() needs a policy with MAX_REGIONS.");
+        if (region >= this->m_numRegions || this->m_regions[region]->parent != this->m_orthogonalState) {
+            return nullptr;
+        }
+        const State<EventType>* state = regionStateOf(region);
+        return state == this->m_orthogonalState ? nullptr : state;
+    }
+
+    /**
+     * @param[in] state A state.
+     * @return True if @p state is active: it is the current state or one of its ancestors, or,
+     *         while an orthogonal state is active, the active state of any of its regions or one
+     *         of their ancestors.
+     */
+    bool isInState(const State<EventType>& state) const {
+        if constexpr (Policy::MAX_REGIONS != 0) {
+            if (this->m_orthogonalState != nullptr) {
+                for (uint32_t region = 0; region < this->m_numRegions; region++) {
+                    if (this->m_regions[region]->parent == this->m_orthogonalState
+                            && isChildOf(&state, regionStateOf(region))) {
+                        return true;
+                    }
+                }
+                return isChildOf(&state, this->m_orthogonalState);
+            }
+        }
+        return isChildOf(&state, m_currentState);
+    }
+
+    /**
+     * @brief Trigger a transition to a state.
+     *
+     * Intended to be called from within a state's event()/entry()/exit() handlers, or from your
+     * own code when the state machine is otherwise idle. Not re-entrant with handleEvent() (see
+     * handleEvent()): do not invoke it from a thread or interrupt that could preempt an in-flight
+     * handleEvent()/transitionTo(). Calls from entry()/exit() are supported and bounded by
+     * MAX_RECURSION_COUNT (the policy's RECURSION_LIMIT). They recurse, unless the policy selects
+     * ITERATIVE_TRANSITIONS, in which case they are queued and run once the entry()/exit()
+     * returns.
+     *
+     * @param state The state to transition to.
+     */
+    void transitionTo(const State<EventType>& state) {
+        if constexpr (Policy::PARALLEL_REGIONS) {
+            detail::ParallelRegion<EventType>* region = detail::currentParallelRegion<EventType>();
+            if (region != nullptr && region->stateMachine == this) {
+                // From a region's event() handler running in parallel: made after the join.
+                region->destination = &state;
+                region->transitionToCalled = true;
+                return;
+            }
+        }
+        m_transitionToCalled = true;
+        m_recursionDepth++;
+        if constexpr (Policy::RECURSION_LIMIT != 0) {
+            if (m_recursionDepth > Policy::RECURSION_LIMIT) {
+                reportError(Error::MaxRecursionDepthExceeded);
+                return;
+            }
+        }
+
+        if constexpr (Policy::ITERATIVE_TRANSITIONS) {
+            if (m_recursionDepth != 1) {
+                // Called from an entry()/exit(): the outermost transitionTo() runs it.
+                deferTransition(&state);
+                return;
+            }
+            runTransitions(&state);
+            m_recursionDepth = 0;
+            completeStep();
+        } else {
+            const uint32_t ourRecursionDepth = m_recursionDepth;
+            // Any nested transitions have already run, so their guard can be cleared.
+            clearGuards(performTransition(&state));
+
+            // If we are at the top of the recursion, reset the recursion index so it's
+            // ready for the next non-recursive transitionTo() call.
+            if (ourRecursionDepth == 1) {
+                m_recursionDepth = 0;
+                completeStep();
+            }
+        }
+    } // transitionTo()
+
+    /**
+     * Transition to the history of a state: back to where the state machine was in @p state when
+     * it last exited it. With History::Shallow, that is the child of @p state that was active
+     * then (and the child is entered afresh, without its own history); with History::Deep, the
+     * deepest state that was active then. If @p state has never been exited, or had no active
+     * child when it was, this is a plain transitionTo(@p state).
+     *
+     * The history is recorded as each state is exited, in the state itself, so restoring it is a
+     * single lookup. Otherwise behaves exactly like transitionTo() (and can be called from the
+     * same places).
+     *
+     * @param state The state whose history to restore.
+     * @param kind  Shallow or deep history.
+     */
+    void transitionToHistory(const State<EventType>& state, History kind = History::Deep) {
+        static_assert(Policy::HISTORY, "History is disabled by this state machine's policy.");
+        const State<EventType>* history = kind == History::Deep ? state.deepHistory : state.shallowHistory;
+        transitionTo(history != nullptr ? *history : state);
+    }
+
+    /**
+     * Indicate to the state machine that an event was handled and event bubbling should stop.
+     * This function should be called only inside state event() functions.
+     *
+     * Calling transitionTo() from within a state's event() function will also stop event bubbling.
+     */
+    void eventHandled() {
+        if constexpr (Policy::PARALLEL_REGIONS) {
+            detail::ParallelRegion<EventType>* region = detail::currentParallelRegion<EventType>();
+            if (region != nullptr && region->stateMachine == this) {
+                region->eventHandledCalled = true;
+                return;
+            }
+        }
+        m_eventHandledCalled = true;
+    }
+
+    /**
+     * Check that the caller isn't one of this state machine's region event() handlers running in
+     * parallel (see setRegionExecutor()), for operations that aren't thread safe: post(), defer(),
+     * recall() and TimerService::start()/startInState().
+     *
+     * @return True, having reported Error::CalledFromParallelRegion, if it is (the operation must
+     *         not go ahead). Always false unless the policy sets PARALLEL_REGIONS.
+     */
+    bool rejectIfCalledInParallel() {
+        if constexpr (Policy::PARALLEL_REGIONS) {
+            const detail::ParallelRegion<EventType>* region = detail::currentParallelRegion<EventType>();
+            if (region != nullptr && region->stateMachine == this) {
+                reportError(Error::CalledFromParallelRegion);
+                return true;
+            }
+        }
+        return false;
+    }
+
+protected:
+
+    /**
+     * Pass an event to the current state's event() handler, bubbling it up to the parents until a
+     * state transitions or claims it.
+     *
+     * @param[in] event The event to handle.
+     * @return True if a state transitioned or claimed the event.
+     */
+    bool dispatchEvent(const EventType& event) {
+        // The event handler could call transitionTo() to change the state, and/or
+        // call eventHandled() to indicate that the event was handled. If any of these
+        // occur, we do not want to propagate the event to the parent state.
+        m_transitionToCalled = false;
+        m_eventHandledCalled = false;
+        EventMask kindMask = ALL_EVENTS;
+        if constexpr (Policy::EVENT_KIND_SELECTOR) {
+            if (this->m_eventKindSelector.is_valid()) {
+                const uint8_t kind = this->m_eventKindSelector(event);
+                if (kind < MAX_EVENT_KINDS) {
+                    kindMask = EventMask(1) << kind;
+                }
+            }
+        }
+        const State<EventType>* stateToHandleEvent = m_currentState;
+        if constexpr (Policy::MAX_REGIONS != 0) {
+            if (this->m_orthogonalState != nullptr) {
+                stateToHandleEvent = dispatchToRegions(event, kindMask);
+            }
+        }
+        bubbleEvent(event, stateToHandleEvent, nullptr, kindMask);
+        // If no state transitioned or claimed the event, it bubbled past the top of the
+        // hierarchy unhandled. Let any observer know.
+        const bool handled = m_transitionToCalled || m_eventHandledCalled;
+        if constexpr (Policy::OBSERVERS) {
+            if (!handled && this->m_unhandledEventObserver.is_valid()) {
+                this->m_unhandledEventObserver(event);
+            }
+        }
+        return handled;
+    }
+
+    /**
+     * Call the event() handlers from @p state up to (but not including) @p top, until one
+     * transitions or claims the event.
+     *
+     * @param[in] event    The event to handle.
+     * @param[in] state    The state to start from, or nullptr.
+     * @param[in] top      The ancestor of @p state to stop at, or nullptr for the top of the hierarchy.
+     * @param[in] kindMask The bit of the event's kind, or ALL_EVENTS.
+     */
+    void bubbleEvent(const EventType& event, const State<EventType>* state, const State<EventType>* top, EventMask kindMask) {
+        // Stop as soon as no state from here upwards is subscribed to this kind of event.
+        while (state != top && (state->bubbleMask & kindMask) != 0) {
+            // A state may have no event() handler (an unbound delegate), or not be subscribed to
+            // this kind of event; skip it so the event bubbles up to the parent.
+            if (state->event.is_valid() && (state->eventMask & kindMask) != 0) {
+                state->event(event);
+            }
+            if (m_transitionToCalled || m_eventHandledCalled) {
+                break;
+            }
+            state = state->parent;
+        }
+    }
+
+    /**
+     * Offer an event to each region of the active orthogonal state in turn, bubbling it up to
+     * (but not including) the orthogonal state. Stops early if a region's handler transitions
+     * out of (or to) the orthogonal state.
+     *
+     * @param[in] event    The event to handle.
+     * @param[in] kindMask The bit of the event's kind, or ALL_EVENTS.
+     * @return The state to bubble the event on from: the orthogonal state if no region handled
+     *         it, otherwise nullptr (with m_eventHandledCalled set).
+     */
+    const State<EventType>* dispatchToRegions(const EventType& event, EventMask kindMask) {
+        if constexpr (Policy::PARALLEL_REGIONS) {
+            if (this->m_regionExecutor.is_valid()) {
+                return dispatchToRegionsInParallel(event, kindMask);
+            }
+        }
+        const State<EventType>* orthogonalState = this->m_orthogonalState;
+        bool handled = false;
+        this->m_regionsExited = false;
+        for (uint32_t region = 0; region < this->m_numRegions && !this->m_regionsExited; region++) {
+            if (this->m_regions[region]->parent != orthogonalState || regionStateOf(region) == orthogonalState) {
+                continue;
+            }
+            focusRegion(region);
+            m_transitionToCalled = false;
+            m_eventHandledCalled = false;
+            bubbleEvent(event, m_currentState, orthogonalState, kindMask);
+            handled = handled || m_transitionToCalled || m_eventHandledCalled;
+        }
+        m_transitionToCalled = false;
+        m_eventHandledCalled = handled;
+        return handled ? nullptr : orthogonalState;
+    }
+
+    /**
+     * Like dispatchToRegions(), but the regions' event() handlers run as tasks of the region
+     * executor, and the transitions they request are made afterwards (see setRegionExecutor()).
+     */
+    const State<EventType>* dispatchToRegionsInParallel(const EventType& event, EventMask kindMask) {
+        if constexpr (Policy::PARALLEL_REGIONS) {
+            const State<EventType>* orthogonalState = this->m_orthogonalState;
+            // The tasks read every region's active state from m_regionStates.
+            if (this->m_focusedRegion != detail::NO_REGION) {
+                this->m_regionStates[this->m_focusedRegion] = m_currentState;
+            }
+            uint32_t numTasks = 0;
+            for (uint32_t region = 0; region < this->m_numRegions; region++) {
+                if (this->m_regions[region]->parent == orthogonalState && this->m_regionStates[region] != orthogonalState) {
+                    this->m_parallelRegions[numTasks++] = {this, region, nullptr, false, false};
+                }
+            }
+            this->m_parallelEvent = &event;
+            this->m_parallelKindMask = kindMask;
+            this->m_regionExecutor(&StateMachine::runParallelRegion, this, numTasks);
+            this->m_parallelEvent = nullptr;
+
+            bool handled = false;
+            this->m_regionsExited = false;
+            for (uint32_t task = 0; task < numTasks; task++) {
+                const detail::ParallelRegion<EventType>& region = this->m_parallelRegions[task];
+                handled = handled || region.transitionToCalled || region.eventHandledCalled;
+                // Once a transition has exited the regions, the others' transitions are moot.
+                if (region.destination != nullptr && !this->m_regionsExited) {
+                    focusRegion(region.region);
+                    transitionTo(*region.destination);
+                }
+            }
+            m_transitionToCalled = false;
+            m_eventHandledCalled = handled;
+            return handled ? nullptr : orthogonalState;
+        } else {
+            (void)event;
+            (void)kindMask;
+            return nullptr;
+        }
+    }
+
+    /**
+     * A region executor task: deliver the event being dispatched to one region's active state,
+     * bubbling it up to the region state, recording what the handlers ask for instead of acting
+     * on it.
+     *
+     * @param context The state machine.
+     * @param task    The index into m_parallelRegions.
+     */
+    static void runParallelRegion(void* context, uint32_t task) {
+        if constexpr (Policy::PARALLEL_REGIONS) {
+            StateMachine& self = *static_cast<StateMachine*>(context);
+            detail::ParallelRegion<EventType>& region = self.m_parallelRegions[task];
+            detail::ParallelRegion<EventType>*& current = detail::currentParallelRegion<EventType>();
+            // The executor may run the task on the calling thread, inside another dispatch.
+            detail::ParallelRegion<EventType>* outer = current;
+            current = &region;
+            const EventMask kindMask = self.m_parallelKindMask;
+            const State<EventType>* top = self.m_regions[region.region]->parent;
+            const State<EventType>* state = self.m_regionStates[region.region];
+            // The same walk as bubbleEvent(), but with this region's own flags.
+            while (state != top && (state->bubbleMask & kindMask) != 0) {
+                if (state->event.is_valid() && (state->eventMask & kindMask) != 0) {
+                    state->event(*self.m_parallelEvent);
+                }
+                if (region.transitionToCalled || region.eventHandledCalled) {
+                    break;
+                }
+                state = state->parent;
+            }
+            current = outer;
+        } else {
+            (void)context;
+            (void)task;
+        }
+    }
+
+    /**
+     * Handle every recalled event, and then every posted event, oldest first, including those
+     * recalled or posted while doing so.
+     */
+    void dispatchPendingEvents() {
+        while (true) {
+            if constexpr (Policy::DEFERRED_EVENT_POOL_SIZE != 0) {
+                if (this->m_numRecalled != 0) {
+                    this->m_numRecalled--;
+                    // Moved out first, so its slot is free should the event be deferred again.
+                    const EventType event(this->m_deferredEvents.take());
+                    dispatchEvent(event);
+                    continue;
+                }
+            }
+            if constexpr (Policy::INTERNAL_EVENT_QUEUE_SIZE != 0) {
+                if (this->m_internalEvents.size() != 0) {
+                    // Moved out first, so its slot is free for the handlers to post into.
+                    const EventType event(this->m_internalEvents.take());
+                    dispatchEvent(event);
+                    continue;
+                }
+            }
+            break;
+        }
+    }
+
+    /**
+     * Called when the outermost transitionTo() returns. If it was called from outside any handler
+     * (e.g. initialTransitionTo()), handle the events its entry()/exit() methods posted or
+     * recalled.
      */
-    void handleEvent(const EventType& event) {
-        // The event handler could call transitionTo() to change the state, and/or
-        // call eventHandled() to indicate that the event was handled. If any of these
-        // occur, we do not want to propagate the event to the parent state.
-        m_transitionToCalled = false;
-        m_eventHandledCalled = false;
-        const State<EventType>* stateToHandleEvent = m_currentState;
-        while (stateToHandleEvent != nullptr) {
-            // A state may have no event() handler (an unbound delegate); skip it so the event
-            // bubbles up to the parent.
-            if (stateToHandleEvent->event.is_valid()) {
-                stateToHandleEvent->event(event);
+    void completeStep() {
+        if constexpr (RUN_TO_COMPLETION) {
+            if (!this->m_runningToCompletion) {
+                this->m_runningToCompletion = true;
+                dispatchPendingEvents();
+                this->m_runningToCompletion = false;
             }
-            if (m_transitionToCalled || m_eventHandledCalled) {
-                break;
-            }
-            stateToHandleEvent = stateToHandleEvent->parent;
-        }
-        // If no state transitioned or claimed the event, it bubbled past the top of the
-        // hierarchy unhandled. Let any observer know.
-        if (!m_transitionToCalled && !m_eventHandledCalled && m_unhandledEventObserver.is_valid()) {
-            m_unhandledEventObserver(event);
         }
     }
 
     /**
-     * Get the current state of the state machine. Can be nullptr before initial transition occurs
-     * due to transitionTo() being called.
-     * 
-     * @return A pointer to the current state.
+     * Bits of the entry/exit guards (m_calledEntryState/m_calledExitState) to clear.
      */
-    const State<EventType>* getCurrentState() const {
-        return m_currentState;
-    }
+    static constexpr uint8_t ENTRY_GUARD = 1;
+    static constexpr uint8_t EXIT_GUARD = 2;
 
     /**
-     * @brief Trigger a transition to a state.
-     *
-     * Intended to be called from within a state's event()/entry()/exit() handlers, or from your
-     * own code when the state machine is otherwise idle. Not re-entrant with handleEvent() (see
-     * handleEvent()): do not invoke it from a thread or interrupt that could preempt an in-flight
-     * handleEvent()/transitionTo(). Recursive calls from entry()/exit() are supported and bounded
-     * by MAX_RECURSION_COUNT.
+     * Perform one transition, applying the entry/exit guard rules (see transitionChain()). With
+     * orthogonal regions, a transition within a region moves only that region's active state, a
+     * transition out of (or to) an orthogonal state first exits every region, and a transition
+     * that ends up in an orthogonal state then enters the regions not yet entered.
      *
-     * @param state The state to transition to.
+     * @param destinationState The state to transition to.
+     * @return The guard to clear (ENTRY_GUARD or EXIT_GUARD) if the transition was cut short by
+     *         an entry()/exit() method calling transitionTo(), otherwise 0.
      */
-    void transitionTo(const State<EventType>& state) {
-        m_transitionToCalled = true;
-        m_recursionDepth++;
-        if (m_recursionDepth > MAX_RECURSION_COUNT) {
-            if (m_errorObserver.is_valid()) {
-                m_errorObserver(Error::MaxRecursionDepthExceeded);
+    uint8_t performTransition(const State<EventType>* destinationState) {
+        if constexpr (Policy::MAX_REGIONS == 0) {
+            return transitionChain(destinationState);
+        } else {
+            const uint32_t ourRecursionDepth = m_recursionDepth;
+            const State<EventType>* orthogonalState = this->m_orthogonalState;
+            if (orthogonalState != nullptr) {
+                const uint32_t region = regionOf(destinationState);
+                if (region != detail::NO_REGION) {
+                    focusRegion(region);
+                } else {
+                    const uint8_t guards = leaveRegions();
+                    if (ourRecursionDepth != m_recursionDepth) {
+                        return guards;
+                    }
+                    if (destinationState == orthogonalState) {
+                        // Like any transition to an ancestor: only the states below it are exited
+                        // (its regions), and then re-entered.
+                        return enterRegions();
+                    }
+                }
+            }
+            const uint8_t guards = transitionChain(destinationState);
+            if (ourRecursionDepth != m_recursionDepth) {
+                return guards;
             }
-            return;
+            return enterRegions();
         }
-        uint32_t ourRecursionDepth = m_recursionDepth;
+    }
 
-        // Rename just for readability below
-        const State<EventType>* destinationState = &state;
+    /**
+     * Perform one transition of the current state: exit from it up to the common ancestor and
+     * enter down to @p destinationState, applying the entry/exit guard rules.
+     *
+     * If an entry()/exit() method calls transitionTo() (which bumps m_recursionDepth), this
+     * transition stops as soon as that method returns, leaving its guard set: the nested
+     * transitions must still see it, so the caller clears it once they have run.
+     *
+     * @param destinationState The state to transition to.
+     * @return The guard to clear (ENTRY_GUARD or EXIT_GUARD) if the transition was cut short by
+     *         an entry()/exit() method calling transitionTo(), otherwise 0.
+     */
+    uint8_t transitionChain(const State<EventType>* destinationState) {
+        const uint32_t ourRecursionDepth = m_recursionDepth;
+        // The child of m_currentState that has already been exited, for recording history.
+        const State<EventType>* exitedChild = nullptr;
 
         // If the new destination state is a child of the previous entry() function,
         // we don't want to re-call the entry() function (we assume the state was entered).
@@ -186,78 +1403,273 @@ public:
 
         if (m_calledExitState != nullptr && !isChildOf(m_calledExitState, destinationState)) {
             m_currentState = m_calledExitState->parent;
+            exitedChild = m_calledExitState;
             m_calledExitState = nullptr; // Clear flag
         }
 
         if (m_currentState == destinationState) {
-            exitState(m_currentState);
+            exitState(m_currentState, exitedChild);
             if (ourRecursionDepth != m_recursionDepth) {
-                goto END;
+                return 0;
             }
+            exitedChild = m_currentState;
             m_currentState = m_currentState->parent;
         }
 
-        // This loop handles one entry or exit per iteration.
-        while (m_currentState != destinationState) {
-            // Logic:
-            // Search for the current state in the tree containing the destination
-            // state and all of it's parents. If the current state is found,
-            // Move down one state. If the current state is not found there, we
-            // need to move to the current state's parent
-            const State<EventType>* stateInDestinationBranch = destinationState;
-            bool foundCurrentStateInDestinationBranch = false;
-            while (stateInDestinationBranch != nullptr) {
-                if (stateInDestinationBranch->parent == m_currentState) {
-                    foundCurrentStateInDestinationBranch = true;
-                    break;
+        // Work out how many ancestors (or self) the current and destination states have in
+        // common, i.e. one more than the depth of their least common ancestor (LCA). We exit
+        // from the current state up to (but not including) the LCA, and then enter the
+        // destination's ancestors from just below the LCA down to the destination.
+        int32_t commonDepth;
+        // Root-first chain of the destination's ancestors, indexed by depth.
+        const State<EventType>* const* entryPath;
+        if (isRegistered(destinationState) && (m_currentState == nullptr || isRegistered(m_currentState))) {
+            // Sealed: both are a single table lookup.
+            commonDepth = m_currentState == nullptr ? 0 : tableCommonDepth(m_currentState, destinationState);
+            entryPath = tableAncestors(destinationState);
+        } else {
+            for (const State<EventType>* state = destinationState; state != nullptr; state = state->parent) {
+                if (!isConstructedAfterParent(state)) {
+                    reportError(Error::InvalidHierarchy);
+                    return 0;
                 }
-                stateInDestinationBranch = stateInDestinationBranch->parent;
             }
-
-            if (foundCurrentStateInDestinationBranch) {
-                // We've found the current state in the destination branch.
-                // Move down one state.
-                m_calledEntryState = stateInDestinationBranch;
-                enterState(stateInDestinationBranch);
-                m_calledEntryState = nullptr;
-                if (ourRecursionDepth != m_recursionDepth) {
-                    break;
-                }
-                m_currentState = stateInDestinationBranch;
-                continue;
+            if (depthOf(destinationState) >= static_cast<int32_t>(MAX_STATE_DEPTH)) {
+                reportError(Error::MaxStateDepthExceeded);
+                return 0;
+            }
+            const State<EventType>* lca = findCommonAncestor(m_currentState, destinationState);
+            commonDepth = depthOf(lca) + 1;
+            // A single buffer per state machine is enough even though transitions can nest:
+            // if an exit() or entry() method calls transitionTo(), this transition stops
+            // using the buffer as soon as that method returns.
+            for (const State<EventType>* state = destinationState; state != lca; state = state->parent) {
+                m_entryPath[state->depth] = state;
             }
+            entryPath = m_entryPath;
+        }
 
-            // If we get here, we need to exit the current state.
-            // Transition to the top most parent of the destination state.
+        while (depthOf(m_currentState) >= commonDepth) {
             m_calledExitState = m_currentState;
-            exitState(m_currentState);
-            m_calledExitState = nullptr; // Clear flag
+            exitState(m_currentState, exitedChild);
             if (ourRecursionDepth != m_recursionDepth) {
-                break;
+                return EXIT_GUARD;
             }
+            m_calledExitState = nullptr; // Clear flag
+            exitedChild = m_currentState;
             m_currentState = m_currentState->parent; // This might be nullptr
         }
 
-        END:
+        for (int32_t depth = commonDepth; depth <= depthOf(destinationState); depth++) {
+            const State<EventType>* stateToEnter = entryPath[depth];
+            m_calledEntryState = stateToEnter;
+            enterState(stateToEnter);
+            if (ourRecursionDepth != m_recursionDepth) {
+                return ENTRY_GUARD;
+            }
+            m_calledEntryState = nullptr;
+            m_currentState = stateToEnter;
+        }
+        return 0;
+    }
 
-        // If we are at the top of the recursion, reset the recursion index so it's
-        // ready for the next non-recursive transitionTo() call.
-        if (ourRecursionDepth == 1) {
-            m_recursionDepth = 0;
+    /**
+     * @param region The index of a registered region.
+     * @return The region's active state (its orthogonal state if it is not entered).
+     */
+    const State<EventType>* regionStateOf(uint32_t region) const {
+        if constexpr (Policy::MAX_REGIONS != 0) {
+            return region == this->m_focusedRegion ? m_currentState : this->m_regionStates[region];
+        } else {
+            (void)region;
+            return nullptr;
         }
-    } // transitionTo()
+    }
 
     /**
-     * Indicate to the state machine that an event was handled and event bubbling should stop.
-     * This function should be called only inside state event() functions.
+     * @param state A state, or nullptr.
+     * @return The index of the region of the active orthogonal state that contains @p state, or
+     *         NO_REGION.
+     */
+    uint32_t regionOf(const State<EventType>* state) const {
+        if constexpr (Policy::MAX_REGIONS != 0) {
+            for (uint32_t region = 0; region < this->m_numRegions; region++) {
+                if (this->m_regions[region]->parent == this->m_orthogonalState
+                        && isChildOf(this->m_regions[region], state)) {
+                    return region;
+                }
+            }
+        } else {
+            (void)state;
+        }
+        return detail::NO_REGION;
+    }
+
+    /**
+     * Make a region's active state the current state (the one transitions and events work on),
+     * saving that of the previously focused region.
      *
-     * Calling transitionTo() from within a state's event() function will also stop event bubbling.
+     * @param region The index of a region of the active orthogonal state.
      */
-    void eventHandled() {
-        m_eventHandledCalled = true;
+    void focusRegion(uint32_t region) {
+        if constexpr (Policy::MAX_REGIONS != 0) {
+            if (region == this->m_focusedRegion) {
+                return;
+            }
+            if (this->m_focusedRegion != detail::NO_REGION) {
+                this->m_regionStates[this->m_focusedRegion] = m_currentState;
+            }
+            this->m_focusedRegion = region;
+            m_currentState = this->m_regionStates[region];
+        } else {
+            (void)region;
+        }
     }
 
-protected:
+    /**
+     * If the current state is (in) an orthogonal state, enter each of its regions that is not
+     * entered yet, in order. Called at the end of every transition, so regions left unentered by
+     * a transition that was cut short are entered by the transition that replaces it.
+     *
+     * @return The guard to clear if a region's entry was cut short, otherwise 0.
+     */
+    uint8_t enterRegions() {
+        if constexpr (Policy::MAX_REGIONS != 0) {
+            if (this->m_orthogonalState == nullptr) {
+                for (uint32_t region = 0; region < this->m_numRegions; region++) {
+                    if (isChildOf(this->m_regions[region]->parent, m_currentState)) {
+                        this->m_orthogonalState = this->m_regions[region]->parent;
+                        break;
+                    }
+                }
+                if (this->m_orthogonalState == nullptr) {
+                    return 0;
+                }
+                for (uint32_t region = 0; region < this->m_numRegions; region++) {
+                    this->m_regionStates[region] = this->m_orthogonalState;
+                }
+                // The transition may have entered one of the regions already.
+                this->m_focusedRegion = regionOf(m_currentState);
+            }
+
+            const State<EventType>* orthogonalState = this->m_orthogonalState;
+            const uint32_t ourRecursionDepth = m_recursionDepth;
+            for (uint32_t region = 0; region < this->m_numRegions; region++) {
+                if (this->m_regions[region]->parent == orthogonalState && regionStateOf(region) == orthogonalState) {
+                    focusRegion(region);
+                    const uint8_t guards = transitionChain(this->m_regions[region]);
+                    if (ourRecursionDepth != m_recursionDepth) {
+                        return guards;
+                    }
+                }
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Exit every region of the active orthogonal state, last first, leaving the orthogonal state
+     * itself as the current state.
+     *
+     * @return The guard to clear if a region's exit was cut short, otherwise 0.
+     */
+    uint8_t leaveRegions() {
+        if constexpr (Policy::MAX_REGIONS != 0) {
+            const State<EventType>* orthogonalState = this->m_orthogonalState;
+            const uint32_t ourRecursionDepth = m_recursionDepth;
+            for (uint32_t region = this->m_numRegions; region-- > 0;) {
+                if (this->m_regions[region]->parent == orthogonalState && regionStateOf(region) != orthogonalState) {
+                    focusRegion(region);
+                    // A transition to an ancestor exits the states below it and enters nothing.
+                    const uint8_t guards = transitionChain(orthogonalState);
+                    if (ourRecursionDepth != m_recursionDepth) {
+                        return guards;
+                    }
+                }
+            }
+            this->m_orthogonalState = nullptr;
+            this->m_focusedRegion = detail::NO_REGION;
+            this->m_regionsExited = true;
+            m_currentState = orthogonalState;
+        }
+        return 0;
+    }
+
+    /**
+     * Clear the entry/exit guards left set by performTransition().
+     *
+     * @param guards ENTRY_GUARD and/or EXIT_GUARD.
+     */
+    void clearGuards(uint8_t guards) {
+        if ((guards & ENTRY_GUARD) != 0) {
+            m_calledEntryState = nullptr;
+        }
+        if ((guards & EXIT_GUARD) != 0) {
+            m_calledExitState = nullptr;
+        }
+    }
+
+    /**
+     * Iterative engine: record a transitionTo() made from an entry()/exit() method, to be run by
+     * runTransitions() once that method returns.
+     *
+     * @param destinationState The state to transition to.
+     */
+    void deferTransition(const State<EventType>* destinationState) {
+        if constexpr (Policy::ITERATIVE_TRANSITIONS) {
+            if (this->m_workListSize >= Policy::TRANSITION_WORK_LIST_SIZE) {
+                reportError(Error::MaxRecursionDepthExceeded);
+                return;
+            }
+            this->m_workList[this->m_workListSize++] = {destinationState, 0};
+        }
+    }
+
+    /**
+     * Iterative engine: run a transition and every transition its entry()/exit() methods request,
+     * in the same order as the recursive engine would, without recursing.
+     *
+     * The work list is a stack. Each transition runs with a marker on top of the stack, which
+     * clears the guard left set if the transition is cut short by an entry()/exit() method
+     * calling transitionTo(). The transitions requested by that method are pushed above the
+     * marker (in call order, then reversed so the first one runs first), so the guard is
+     * cleared only after they, and any transitions they request in turn, have run --- exactly
+     * when the recursive engine clears it on unwinding. A transition that finds a marker already
+     * on top (it was the last one requested by its method) shares it, which keeps chains of
+     * transitions from growing the stack.
+     *
+     * @param destinationState The state to transition to.
+     */
+    void runTransitions(const State<EventType>* destinationState) {
+        if constexpr (Policy::ITERATIVE_TRANSITIONS) {
+            detail::TransitionWorkItem<EventType>* workList = this->m_workList;
+            workList[0] = {nullptr, 0};
+            workList[1] = {destinationState, 0};
+            this->m_workListSize = 2;
+            while (this->m_workListSize != 0) {
+                const detail::TransitionWorkItem<EventType> item = workList[--this->m_workListSize];
+                if (item.destination == nullptr) {
+                    clearGuards(item.guardsToClear);
+                    continue;
+                }
+                if (workList[this->m_workListSize - 1].destination != nullptr) {
+                    // A sibling is still waiting below, so this transition needs its own marker.
+                    // The transition that was just popped freed its slot.
+                    workList[this->m_workListSize++] = {nullptr, 0};
+                }
+
+                uint32_t first = this->m_workListSize;
+                workList[first - 1].guardsToClear |= performTransition(item.destination);
+                for (uint32_t last = this->m_workListSize - 1; first < last; first++, last--) {
+                    const detail::TransitionWorkItem<EventType> swapped = workList[first];
+                    workList[first] = workList[last];
+                    workList[last] = swapped;
+                }
+            }
+        } else {
+            (void)destinationState;
+        }
+    }
 
     /**
      * Call a state's entry() method and then notify the transition observer (if set).
@@ -269,23 +1681,43 @@ protected:
         if (state->entry.is_valid()) {
             state->entry();
         }
-        if (m_transitionObserver.is_valid()) {
-            m_transitionObserver(*state, TransitionAction::Entry);
+        if constexpr (Policy::OBSERVERS) {
+            if (this->m_transitionObserver.is_valid()) {
+                this->m_transitionObserver(*state, TransitionAction::Entry);
+            }
         }
     }
 
     /**
-     * Call a state's exit() method and then notify the transition observer (if set).
+     * Record a state's history, call its exit() method, cancel any timers tied to the state, and
+     * then notify the transition observer (if set).
      *
-     * @param[in] state The state to exit.
+     * @param[in] state       The state to exit.
+     * @param[in] exitedChild The child of @p state this transition has just exited, or nullptr if
+     *                        @p state is the deepest active state.
      */
-    void exitState(const State<EventType>* state) {
+    void exitState(const State<EventType>* state, const State<EventType>* exitedChild) {
+        if constexpr (Policy::HISTORY) {
+            // Recorded before exit() runs, so a transitionToHistory() from exit() sees it.
+            state->shallowHistory = exitedChild;
+            state->deepHistory = exitedChild == nullptr || exitedChild->deepHistory == nullptr
+                ? exitedChild
+                : exitedChild->deepHistory;
+        } else {
+            (void)exitedChild;
+        }
         // The state may have no exit() handler (an unbound delegate).
         if (state->exit.is_valid()) {
             state->exit();
         }
-        if (m_transitionObserver.is_valid()) {
-            m_transitionObserver(*state, TransitionAction::Exit);
+        // Timers armed for the lifetime of this state must not outlive it.
+        while (state->timers != nullptr) {
+            state->timers->cancel();
+        }
+        if constexpr (Policy::OBSERVERS) {
+            if (this->m_transitionObserver.is_valid()) {
+                this->m_transitionObserver(*state, TransitionAction::Exit);
+            }
         }
     }
 
@@ -310,35 +1742,402 @@ protected:
     const State<EventType>* m_calledExitState = nullptr;
 
     /**
-     * Keeps track of how many times transitionTo() has been called recursively.
+     * Keeps track of how many times transitionTo() has been called recursively (with the
+     * iterative engine, from entry()/exit() methods) since the outermost call.
      */
     uint32_t m_recursionDepth = 0;
 
     /**
-     * Observers. Default constructed (unbound) until set via the corresponding setter. Unbound
-     * delegates are never called (guarded by is_valid()).
+     * Scratch buffer used by transitionTo() to hold the states it is about to enter when the
+     * transition is not covered by the transition table, indexed by depth.
      */
-    TransitionObserver m_transitionObserver;
-    UnhandledEventObserver m_unhandledEventObserver;
-    ErrorObserver m_errorObserver;
+    const State<EventType>* m_entryPath[MAX_STATE_DEPTH] = {};
+
+    // The transition table view, observers and event kind selector (if enabled by the policy)
+    // live in the private detail:: base classes.
 
     /**
      * Check if a child state is a child of a parent state.
      * 
      * @param parent The parent state.
      * @param child The potential child state.
-     * @return True if the child is a child of the parent, false otherwise.
+     * @return True if the child is a child of the parent (or is the parent), false otherwise.
      */
-    bool isChildOf(const State<EventType>* parent, const State<EventType>* child) {
+    bool isChildOf(const State<EventType>* parent, const State<EventType>* child) const {
+        if (child == nullptr || parent == nullptr) {
+            return parent == nullptr;
+        }
+        if (isRegistered(child)) {
+            // Sealed: the child's ancestor at the parent's depth is a single lookup.
+            return parent->depth <= child->depth && tableAncestors(child)[parent->depth] == parent;
+        }
+        // Only the ancestor of child at the same depth as parent can possibly be parent.
         const State<EventType>* state = child;
-        while (state != nullptr) {
-            if (state == parent) {
-                return true;
-            }
+        while (depthOf(state) > depthOf(parent)) {
             state = state->parent;
         }
+        return state == parent;
+    }
+
+    /**
+     * What snapshot() saves beyond the current state, which depends on the policy.
+     */
+    static constexpr uint8_t SNAPSHOT_FLAGS =
+        (Policy::HISTORY ? detail::SNAPSHOT_HISTORY : 0)
+        | (Policy::MAX_REGIONS != 0 ? detail::SNAPSHOT_REGIONS : 0)
+        | (RUN_TO_COMPLETION ? detail::SNAPSHOT_EVENTS : 0);
+
+    /**
+     * The id saved for "no state".
+     */
+    static constexpr uint16_t NO_STATE_ID = UINT16_MAX;
+
+    /**
+     * Write the snapshot (see snapshot()).
+     *
+     * @return False if the state machine can't be saved.
+     */
+    bool writeSnapshot(detail::SnapshotWriter& writer) const {
+        if (!isSealed()) {
+            return false;
+        }
+        bool ok = true;
+        const auto writeState = [this, &writer, &ok](const State<EventType>* state) {
+            if (state == nullptr) {
+                writer.u16(NO_STATE_ID);
+            } else if (isRegistered(state)) {
+                writer.u16(state->index);
+            } else {
+                ok = false;
+            }
+        };
+
+        detail::writeSnapshotHeader(writer, SNAPSHOT_FLAGS);
+        writer.u16(numSnapshotStates());
+        writeState(m_currentState);
+        if constexpr (Policy::HISTORY) {
+            for (uint16_t i = 0; i < numSnapshotStates(); i++) {
+                writeState(this->m_tableStates[i]->shallowHistory);
+                writeState(this->m_tableStates[i]->deepHistory);
+            }
+        }
+        if constexpr (Policy::MAX_REGIONS != 0) {
+            writer.u8(static_cast<uint8_t>(this->m_numRegions));
+            writer.u8(this->m_focusedRegion == detail::NO_REGION ? UINT8_MAX : static_cast<uint8_t>(this->m_focusedRegion));
+            writeState(this->m_orthogonalState);
+            for (uint32_t region = 0; region < this->m_numRegions; region++) {
+                writeState(this->m_regionStates[region]);
+            }
+        }
+        if constexpr (RUN_TO_COMPLETION) {
+            const uint32_t numPosted = numPostedEvents();
+            const uint32_t numDeferred = numDeferredEvents();
+            if constexpr (std::is_trivially_copyable<EventType>::value) {
+                writer.u16(static_cast<uint16_t>(sizeof(EventType)));
+            } else {
+                writer.u16(0);
+                ok = ok && numPosted == 0 && numDeferred == 0;
+            }
+            writer.u32(numPosted);
+            writer.u32(numDeferred);
+            if constexpr (Policy::INTERNAL_EVENT_QUEUE_SIZE != 0) {
+                for (uint32_t i = 0; i < numPosted; i++) {
+                    writer.bytes(&this->m_internalEvents.at(i), sizeof(EventType));
+                }
+            }
+            if constexpr (Policy::DEFERRED_EVENT_POOL_SIZE != 0) {
+                for (uint32_t i = 0; i < numDeferred; i++) {
+                    writer.bytes(&this->m_deferredEvents.at(i), sizeof(EventType));
+                }
+            }
+        }
+        return ok;
+    }
+
+    /**
+     * Read a snapshot (see restore()): first with @p apply false, to check it without changing
+     * anything, then with @p apply true to restore it.
+     *
+     * @return False if the snapshot is not valid for this state machine.
+     */
+    bool readSnapshot(detail::SnapshotReader reader, bool apply) {
+        const auto readState = [this, &reader](const State<EventType>*& state) {
+            const uint16_t id = reader.u16();
+            state = id < numSnapshotStates() ? this->m_tableStates[id] : nullptr;
+            return id < numSnapshotStates() || id == NO_STATE_ID;
+        };
+
+        if (!detail::readSnapshotHeader(reader, SNAPSHOT_FLAGS) || reader.u16() != numSnapshotStates()) {
+            return false;
+        }
+        const State<EventType>* current;
+        if (!readState(current)) {
+            return false;
+        }
+        if (apply) {
+            m_currentState = current;
+            m_calledEntryState = nullptr;
+            m_calledExitState = nullptr;
+            m_recursionDepth = 0;
+        }
+        if constexpr (Policy::HISTORY) {
+            for (uint16_t i = 0; i < numSnapshotStates(); i++) {
+                const State<EventType>* shallow;
+                const State<EventType>* deep;
+                if (!readState(shallow) || !readState(deep)) {
+                    return false;
+                }
+                if (apply) {
+                    this->m_tableStates[i]->shallowHistory = shallow;
+                    this->m_tableStates[i]->deepHistory = deep;
+                }
+            }
+        }
+        if constexpr (Policy::MAX_REGIONS != 0) {
+            const uint32_t numRegions = reader.u8();
+            const uint8_t focusedRegion = reader.u8();
+            const State<EventType>* orthogonalState;
+            if (numRegions != this->m_numRegions || !readState(orthogonalState)
+                    || (focusedRegion != UINT8_MAX && focusedRegion >= numRegions)) {
+                return false;
+            }
+            for (uint32_t region = 0; region < numRegions; region++) {
+                const State<EventType>* state;
+                if (!readState(state)) {
+                    return false;
+                }
+                if (apply) {
+                    this->m_regionStates[region] = state;
+                }
+            }
+            if (apply) {
+                this->m_orthogonalState = orthogonalState;
+                this->m_focusedRegion = focusedRegion == UINT8_MAX ? detail::NO_REGION : focusedRegion;
+                this->m_regionsExited = false;
+            }
+        }
+        if constexpr (RUN_TO_COMPLETION) {
+            const uint16_t eventSize = reader.u16();
+            const uint32_t numPosted = reader.u32();
+            const uint32_t numDeferred = reader.u32();
+            if (numPosted > Policy::INTERNAL_EVENT_QUEUE_SIZE || numDeferred > Policy::DEFERRED_EVENT_POOL_SIZE
+                    || ((numPosted != 0 || numDeferred != 0) && eventSize != sizeof(EventType))) {
+                return false;
+            }
+            if constexpr (std::is_trivially_copyable<EventType>::value) {
+                if constexpr (Policy::INTERNAL_EVENT_QUEUE_SIZE != 0) {
+                    if (apply) {
+                        this->m_internalEvents.clear();
+                    }
+                    for (uint32_t i = 0; i < numPosted; i++) {
+                        const uint8_t* bytes = reader.bytes(sizeof(EventType));
+                        if (apply) {
+                            this->m_internalEvents.push(eventFromBytes(bytes));
+                        }
+                    }
+                }
+                if constexpr (Policy::DEFERRED_EVENT_POOL_SIZE != 0) {
+                    if (apply) {
+                        this->m_deferredEvents.clear();
+                        this->m_numRecalled = 0;
+                    }
+                    for (uint32_t i = 0; i < numDeferred; i++) {
+                        const uint8_t* bytes = reader.bytes(sizeof(EventType));
+                        if (apply) {
+                            this->m_deferredEvents.push(eventFromBytes(bytes));
+                        }
+                    }
+                }
+            } else if (numPosted != 0 || numDeferred != 0) {
+                return false;
+            }
+        }
+        return reader.ok() && reader.atEnd();
+    }
+
+    /**
+     * @return A copy of the event saved byte for byte at @p bytes (EventType is trivially
+     *         copyable).
+     */
+    static EventType eventFromBytes(const uint8_t* bytes) {
+        alignas(EventType) unsigned char storage[sizeof(EventType)];
+        std::memcpy(storage, bytes, sizeof(EventType));
+        return *std::launder(reinterpret_cast<const EventType*>(storage));
+    }
+
+    /**
+     * Run the entry() of each restored leaf state (see restore()).
+     */
+    void enterRestoredLeaves() {
+        if constexpr (Policy::MAX_REGIONS != 0) {
+            const State<EventType>* orthogonalState = this->m_orthogonalState;
+            if (orthogonalState != nullptr) {
+                for (uint32_t region = 0; region < this->m_numRegions; region++) {
+                    if (this->m_regions[region]->parent != orthogonalState) {
+                        continue;
+                    }
+                    const State<EventType>* state = regionStateOf(region);
+                    if (state != orthogonalState) {
+                        enterState(state);
+                    }
+                    // An entry() that left the orthogonal state leaves nothing more to enter.
+                    if (this->m_regionsExited) {
+                        return;
+                    }
+                }
+                return;
+            }
+        }
+        if (m_currentState != nullptr) {
+            enterState(m_currentState);
+        }
+    }
+
+    uint16_t numSnapshotStates() const {
+        if constexpr (Policy::SEALING) {
+            return this->m_tableNumStates;
+        } else {
+            return 0;
+        }
+    }
+
+    uint32_t numPostedEvents() const {
+        if constexpr (Policy::INTERNAL_EVENT_QUEUE_SIZE != 0) {
+            return this->m_internalEvents.size();
+        } else {
+            return 0;
+        }
+    }
+
+    uint32_t numDeferredEvents() const {
+        if constexpr (Policy::DEFERRED_EVENT_POOL_SIZE != 0) {
+            return this->m_deferredEvents.size();
+        } else {
+            return 0;
+        }
+    }
+
+    /**
+     * Check if a state was registered with finalize(). Always false while unsealed.
+     *
+     * @param state The state.
+     * @return True if the state has an entry in the transition table.
+     */
+    bool isRegistered(const State<EventType>* state) const {
+        if constexpr (Policy::SEALING) {
+            return state->index < this->m_tableNumStates && this->m_tableStates[state->index] == state;
+        } else {
+            return false;
+        }
+    }
+
+    /**
+     * @param from A registered state.
+     * @param to   A registered state.
+     * @return The number of ancestors (or self) the two states have in common, from the table.
+     */
+    int32_t tableCommonDepth(const State<EventType>* from, const State<EventType>* to) const {
+        if constexpr (Policy::SEALING) {
+            return this->m_tableCommonDepths[from->index * this->m_tableNumStates + to->index];
+        } else {
+            return 0; // Never called: no state is registered.
+        }
+    }
+
+    /**
+     * @param state A registered state.
+     * @return The root-first chain of the state's ancestors (and itself) from the table, indexed
+     *         by depth.
+     */
+    const State<EventType>* const* tableAncestors(const State<EventType>* state) const {
+        if constexpr (Policy::SEALING) {
+            return &this->m_tableAncestors[state->index * this->m_tableMaxDepth];
+        } else {
+            return nullptr; // Never called: no state is registered.
+        }
+    }
+
+    /**
+     * Drop any transition table set by finalize(), returning to the unsealed behaviour.
+     */
+    void unseal() {
+        this->m_tableStates = nullptr;
+        this->m_tableAncestors = nullptr;
+        this->m_tableCommonDepths = nullptr;
+        this->m_tableMaxDepth = 0;
+        this->m_tableNumStates = 0;
+    }
+
+    /**
+     * Report a failed finalize() to the error observer (if set).
+     *
+     * @return false, for convenience.
+     */
+    bool finalizeFailed() {
+        reportError(Error::FinalizeFailed);
         return false;
     }
+
+    /**
+     * Notify the error observer (if enabled and set) of an error.
+     *
+     * @param error The error.
+     */
+    void reportError(Error error) {
+        if constexpr (Policy::OBSERVERS) {
+            if (this->m_errorObserver.is_valid()) {
+                this->m_errorObserver(error);
+            }
+        } else {
+            (void)error;
+        }
+    }
+
+    /**
+     * Get the depth of a state, treating nullptr (the implicit root above all top-level states)
+     * as having a depth of -1.
+     *
+     * @param state The state, or nullptr.
+     * @return The depth of the state.
+     */
+    /**
+     * @return False if @p state's depth or bubbleMask, derived from its parent at construction,
+     *         don't match the parent's (see Error::InvalidHierarchy).
+     */
+    static bool isConstructedAfterParent(const State<EventType>* state) {
+        const State<EventType>* parent = state->parent;
+        if (parent == nullptr) {
+            return state->depth == 0;
+        }
+        return state->depth == parent->depth + 1 && state->bubbleMask == (state->eventMask | parent->bubbleMask);
+    }
+
+    static int32_t depthOf(const State<EventType>* state) {
+        return state == nullptr ? -1 : static_cast<int32_t>(state->depth);
+    }
+
+    /**
+     * Find the deepest state that is both an ancestor (or self) of stateA and an ancestor (or
+     * self) of stateB. Walks each branch up to the same depth and then walks both up in lockstep,
+     * so the cost is linear in the depth of the hierarchy.
+     *
+     * @param stateA The first state, or nullptr.
+     * @param stateB The second state, or nullptr.
+     * @return The least common ancestor, or nullptr if the states share no ancestor.
+     */
+    static const State<EventType>* findCommonAncestor(const State<EventType>* stateA, const State<EventType>* stateB) {
+        while (depthOf(stateA) > depthOf(stateB)) {
+            stateA = stateA->parent;
+        }
+        while (depthOf(stateB) > depthOf(stateA)) {
+            stateB = stateB->parent;
+        }
+        while (stateA != stateB) {
+            stateA = stateA->parent;
+            stateB = stateB->parent;
+        }
+        return stateA;
+    }
 }; // class StateMachine
 
 }; // namespace NinjaHSM
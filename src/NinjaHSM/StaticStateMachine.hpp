@@ -0,0 +1,456 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include <etl/delegate.h>
+
+#include "StateMachine.hpp"
+
+namespace NinjaHSM {
+
+/**
+ * Compile-time description of a state for use with StaticStateMachine. The handlers are the same
+ * member function pointers you would pass to makeState() (any of them may be nullptr), and the
+ * parent is another StaticState type (or void, the default, for a top-level state).
+ *
+ * @code
+ * using Idle    = StaticState<&Machine::idle_entry, &Machine::idle_event, &Machine::idle_exit>;
+ * using Running = StaticState<&Machine::running_entry, &Machine::running_event, nullptr, Idle>;
+ * @endcode
+ *
+ * States are identified by their type, so two states with exactly the same template arguments
+ * (e.g. two handler-less siblings) would be the same state. If you need that, derive a distinct
+ * type for each instead: struct Bare1 : StaticState<nullptr, nullptr, nullptr> {};
+ *
+ * @tparam Entry  Pointer to the entry() member function (signature void()), or nullptr.
+ * @tparam Event  Pointer to the event() member function (signature void(const EventType&)), or
+ *                nullptr.
+ * @tparam Exit   Pointer to the exit() member function (signature void()), or nullptr.
+ * @tparam Parent The parent state type, or void for a top-level state.
+ */
+template <auto Entry, auto Event, auto Exit, typename Parent = void>
+struct StaticState {
+    static constexpr auto entry = Entry;
+    static constexpr auto event = Event;
+    static constexpr auto exit = Exit;
+    using ParentState = Parent;
+};
+
+namespace detail {
+
+/**
+ * Index used by StaticStateMachine to mean "no state" (e.g. the parent of a top-level state, or
+ * the current state before the initial transition).
+ */
+constexpr uint16_t NO_STATIC_STATE = UINT16_MAX;
+
+/**
+ * @return The position of T in States, or sizeof...(States) if it is not there.
+ */
+template <typename T, typename... States>
+constexpr size_t staticStateIndex() {
+    constexpr bool matches[] = { std::is_same_v<T, States>... };
+    for (size_t i = 0; i < sizeof...(States); i++) {
+        if (matches[i]) {
+            return i;
+        }
+    }
+    return sizeof...(States);
+}
+
+/**
+ * @return The index of State's parent within States, or NO_STATIC_STATE for a top-level state.
+ */
+template <typename State, typename... States>
+constexpr uint16_t staticParentIndex() {
+    if constexpr (std::is_void_v<typename State::ParentState>) {
+        return NO_STATIC_STATE;
+    } else {
+        constexpr size_t index = staticStateIndex<typename State::ParentState, States...>();
+        static_assert(index < sizeof...(States), "A StaticState's parent must also be listed in the StaticStateMachine.");
+        return static_cast<uint16_t>(index);
+    }
+}
+
+/**
+ * The hierarchy of a StaticStateMachine, flattened into lookup tables at compile time.
+ */
+template <size_t NumStates>
+struct StaticHierarchy {
+    uint16_t parents[NumStates];
+    uint16_t depths[NumStates];
+    /**
+     * ancestors[i][d] is the ancestor of state i at depth d (ancestors[i][depths[i]] == i).
+     */
+    uint16_t ancestors[NumStates][NumStates];
+    /**
+     * commonDepths[i][j] is one more than the depth of the least common ancestor of i and j (0 if
+     * they share no ancestor).
+     */
+    uint16_t commonDepths[NumStates][NumStates];
+    bool hasDuplicates;
+};
+
+/**
+ * Flatten a hierarchy given as each state's parent index (or NO_STATIC_STATE) into lookup
+ * tables. The parents must not form a cycle.
+ */
+template <size_t NumStates>
+constexpr StaticHierarchy<NumStates> buildStaticHierarchy(const uint16_t (&parents)[NumStates]) {
+    StaticHierarchy<NumStates> hierarchy{};
+    hierarchy.hasDuplicates = false;
+    for (size_t i = 0; i < NumStates; i++) {
+        hierarchy.parents[i] = parents[i];
+        uint16_t depth = 0;
+        for (uint16_t state = parents[i]; state != NO_STATIC_STATE; state = parents[state]) {
+            depth++;
+        }
+        hierarchy.depths[i] = depth;
+    }
+
+    for (size_t i = 0; i < NumStates; i++) {
+        for (uint16_t state = static_cast<uint16_t>(i); state != NO_STATIC_STATE; state = parents[state]) {
+            hierarchy.ancestors[i][hierarchy.depths[state]] = state;
+        }
+    }
+
+    for (size_t i = 0; i < NumStates; i++) {
+        for (size_t j = 0; j < NumStates; j++) {
+            uint16_t common = 0;
+            while (common <= hierarchy.depths[i] && common <= hierarchy.depths[j]
+                    && hierarchy.ancestors[i][common] == hierarchy.ancestors[j][common]) {
+                common++;
+            }
+            hierarchy.commonDepths[i][j] = common;
+        }
+    }
+    return hierarchy;
+}
+
+template <typename... States>
+constexpr StaticHierarchy<sizeof...(States)> makeStaticHierarchy() {
+    const uint16_t parents[] = { staticParentIndex<States, States...>()... };
+    const size_t indexes[] = { staticStateIndex<States, States...>()... };
+
+    StaticHierarchy<sizeof...(States)> hierarchy = buildStaticHierarchy(parents);
+    for (size_t i = 0; i < sizeof...(States); i++) {
+        // A repeated type resolves to the index of its first occurrence.
+        hierarchy.hasDuplicates = hierarchy.hasDuplicates || indexes[i] != i;
+    }
+    return hierarchy;
+}
+
+} // namespace detail
+
+/**
+ * A state machine whose hierarchy is fixed at compile time. It behaves exactly like StateMachine
+ * (event bubbling, eventHandled(), entry/exit guards via transitionTo() from entry()/exit(), the
+ * MAX_RECURSION_COUNT limit), but:
+ *
+ * - States are types (see StaticState) rather than State objects, so there are no delegates,
+ *   names or parent pointers stored at runtime. The object itself is just a reference to the
+ *   owner plus a few bytes of bookkeeping.
+ * - All transition paths are computed at compile time. transitionTo<Dest>() only has to exit the
+ *   current state's branch and then makes a fixed sequence of entry() calls.
+ * - Handlers are called directly through compile-time constant member function pointers, so the
+ *   compiler can inline them. Dispatching on the current state compiles down to a switch.
+ *
+ * @code
+ * class Machine {
+ * public:
+ *     Machine() : m_sm(*this) { m_sm.initialTransitionTo<Idle>(); }
+ *     void step(const Event& event) { m_sm.handleEvent(event); }
+ * private:
+ *     void idle_event(const Event& event) { if (event.id == 1) { m_sm.transitionTo<Running>(); } }
+ *     void running_entry() {}
+ *
+ *     using Idle    = StaticState<nullptr, &Machine::idle_event, nullptr>;
+ *     using Running = StaticState<&Machine::running_entry, nullptr, nullptr, Idle>;
+ *     StaticStateMachine<Machine, Event, Idle, Running> m_sm;
+ * };
+ * @endcode
+ *
+ * Use StateMachine instead if states need to be created at runtime or you want the transition
+ * and unhandled event observers.
+ *
+ * @tparam Owner     The class that owns the handler methods.
+ * @tparam EventType The state machine's event type.
+ * @tparam States    Every state of the state machine (StaticState types). Parents must be listed.
+ */
+template <typename Owner, typename EventType, typename... States>
+class StaticStateMachine {
+public:
+    static_assert(sizeof...(States) > 0, "A StaticStateMachine needs at least one state.");
+    static_assert(sizeof...(States) < detail::NO_STATIC_STATE, "State indexes are stored as uint16_t.");
+
+    /**
+     * Observer called when the state machine encounters an internal error (see Error).
+     */
+    using ErrorObserver = etl::delegate<void(Error)>;
+
+    static constexpr uint16_t NUM_STATES = sizeof...(States);
+
+    /**
+     * Returned by getCurrentStateIndex() before the initial transition.
+     */
+    static constexpr uint16_t NO_STATE = detail::NO_STATIC_STATE;
+
+    /**
+     * @param[in] owner The instance the handler methods are called on.
+     */
+    explicit StaticStateMachine(Owner & owner) : m_owner(owner) {}
+
+    /**
+     * Get the index of a state (its position in the States list).
+     */
+    template <typename State>
+    static constexpr uint16_t indexOf() {
+        constexpr size_t index = detail::staticStateIndex<State, States...>();
+        static_assert(index < NUM_STATES, "State is not part of this StaticStateMachine.");
+        return static_cast<uint16_t>(index);
+    }
+
+    /**
+     * Set an observer to be notified when the state machine encounters an internal error.
+     * Pass a default constructed (unbound) delegate to clear.
+     *
+     * @param[in] observer The observer to call, or an unbound delegate to clear.
+     */
+    void setErrorObserver(ErrorObserver observer) {
+        m_errorObserver = observer;
+    }
+
+    /**
+     * Perform the transition to the provided initial state. This function should be called before
+     * calling handleEvent() for the first time.
+     *
+     * @tparam State The initial state to transition to.
+     */
+    template <typename State>
+    void initialTransitionTo() {
+        transitionTo<State>();
+    }
+
+    /**
+     * Provide an event to the state machine. The event is given to the current state's event()
+     * handler and bubbles up to its parents until one of them calls transitionTo() or
+     * eventHandled(). Not re-entrant (see StateMachine::handleEvent()).
+     *
+     * @param[in] event The event to handle.
+     * @return True if a state handled the event, false if it bubbled past the top unhandled.
+     */
+    bool handleEvent(const EventType& event) {
+        m_transitionToCalled = false;
+        m_eventHandledCalled = false;
+        dispatchEvent(m_currentState, event, std::make_index_sequence<NUM_STATES>());
+        return m_transitionToCalled || m_eventHandledCalled;
+    }
+
+    /**
+     * @return The index of the current state (see indexOf()), or NO_STATE before the initial
+     *         transition.
+     */
+    uint16_t getCurrentStateIndex() const {
+        return m_currentState;
+    }
+
+    /**
+     * @tparam State The state to check.
+     * @return True if State is active: it is the current state or one of its ancestors (as with
+     *         StateMachine::isInState()). Compare getCurrentStateIndex() with indexOf() to check
+     *         for the current state only.
+     */
+    template <typename State>
+    bool isInState() const {
+        constexpr uint16_t state = indexOf<State>();
+        constexpr uint16_t depth = HIERARCHY.depths[state];
+        return m_currentState != NO_STATE && HIERARCHY.depths[m_currentState] >= depth
+                && HIERARCHY.ancestors[m_currentState][depth] == state;
+    }
+
+    /**
+     * @brief Trigger a transition to a state.
+     *
+     * Same semantics as StateMachine::transitionTo(), including calling it recursively from
+     * entry()/exit() (bounded by MAX_RECURSION_COUNT).
+     *
+     * @tparam State The state to transition to.
+     */
+    template <typename State>
+    void transitionTo() {
+        constexpr uint16_t destinationState = indexOf<State>();
+
+        m_transitionToCalled = true;
+        m_recursionDepth++;
+        if (m_recursionDepth > MAX_RECURSION_COUNT) {
+            if (m_errorObserver.is_valid()) {
+                m_errorObserver(Error::MaxRecursionDepthExceeded);
+            }
+            return;
+        }
+        uint32_t ourRecursionDepth = m_recursionDepth;
+
+        // Same entry/exit guard handling as StateMachine::transitionTo().
+        if (m_calledEntryState != NO_STATE && isChildOf(m_calledEntryState, destinationState)) {
+            m_currentState = m_calledEntryState;
+            m_calledEntryState = NO_STATE;
+        }
+
+        if (m_calledExitState != NO_STATE && !isChildOf(m_calledExitState, destinationState)) {
+            m_currentState = HIERARCHY.parents[m_calledExitState];
+            m_calledExitState = NO_STATE;
+        }
+
+        if (m_currentState == destinationState) {
+            callExitOf(m_currentState, std::make_index_sequence<NUM_STATES>());
+            if (ourRecursionDepth == m_recursionDepth) {
+                m_currentState = HIERARCHY.parents[m_currentState];
+            }
+        }
+
+        if (ourRecursionDepth == m_recursionDepth) {
+            const int32_t commonDepth = m_currentState == NO_STATE ? 0
+                : HIERARCHY.commonDepths[m_currentState][destinationState];
+            bool completed = true;
+            while (depthOf(m_currentState) >= commonDepth) {
+                m_calledExitState = m_currentState;
+                callExitOf(m_currentState, std::make_index_sequence<NUM_STATES>());
+                m_calledExitState = NO_STATE;
+                if (ourRecursionDepth != m_recursionDepth) {
+                    completed = false;
+                    break;
+                }
+                m_currentState = HIERARCHY.parents[m_currentState];
+            }
+            if (completed) {
+                enterDownTo<destinationState>(commonDepth, ourRecursionDepth);
+            }
+        }
+
+        // If we are at the top of the recursion, reset the recursion index so it's
+        // ready for the next non-recursive transitionTo() call.
+        if (ourRecursionDepth == 1) {
+            m_recursionDepth = 0;
+        }
+    }
+
+    /**
+     * Indicate to the state machine that an event was handled and event bubbling should stop.
+     * This function should be called only inside state event() functions.
+     */
+    void eventHandled() {
+        m_eventHandledCalled = true;
+    }
+
+private:
+    template <size_t I>
+    using StateAt = std::tuple_element_t<I, std::tuple<States...>>;
+
+    static constexpr detail::StaticHierarchy<NUM_STATES> HIERARCHY = detail::makeStaticHierarchy<States...>();
+    static_assert(!HIERARCHY.hasDuplicates, "Each state may only be listed once (see StaticState on identical states).");
+
+    static int32_t depthOf(uint16_t state) {
+        return state == NO_STATE ? -1 : static_cast<int32_t>(HIERARCHY.depths[state]);
+    }
+
+    /**
+     * @return True if child is parent or one of its descendants.
+     */
+    static bool isChildOf(uint16_t parent, uint16_t child) {
+        return HIERARCHY.depths[parent] <= HIERARCHY.depths[child]
+            && HIERARCHY.ancestors[child][HIERARCHY.depths[parent]] == parent;
+    }
+
+    /**
+     * Enter every ancestor of state I (and I itself) that is at least commonDepth deep, outermost
+     * first. The sequence of entry() calls is fixed at compile time.
+     *
+     * @return False if an entry() method called transitionTo(), abandoning this transition.
+     */
+    template <uint16_t I>
+    bool enterDownTo(int32_t commonDepth, uint32_t ourRecursionDepth) {
+        if constexpr (HIERARCHY.parents[I] != NO_STATE) {
+            if (!enterDownTo<HIERARCHY.parents[I]>(commonDepth, ourRecursionDepth)) {
+                return false;
+            }
+        }
+        if (static_cast<int32_t>(HIERARCHY.depths[I]) < commonDepth) {
+            return true; // Already active.
+        }
+        m_calledEntryState = I;
+        using State = StateAt<I>;
+        if constexpr (State::entry != nullptr) {
+            (m_owner.*State::entry)();
+        }
+        m_calledEntryState = NO_STATE;
+        if (ourRecursionDepth != m_recursionDepth) {
+            return false;
+        }
+        m_currentState = I;
+        return true;
+    }
+
+    template <size_t I>
+    void callExit() {
+        using State = StateAt<I>;
+        if constexpr (State::exit != nullptr) {
+            (m_owner.*State::exit)();
+        }
+    }
+
+    /**
+     * Call the exit() method of a state chosen at runtime. The fold expands to a chain of
+     * comparisons against compile-time constants, which the compiler turns into a switch.
+     */
+    template <size_t... Is>
+    void callExitOf(uint16_t state, std::index_sequence<Is...>) {
+        (void)((state == Is && (callExit<Is>(), true)) || ...);
+    }
+
+    /**
+     * Give the event to state I and, unless it transitions or calls eventHandled(), bubble it up
+     * to I's parent. The whole chain is resolved at compile time.
+     */
+    template <size_t I>
+    void bubbleEvent(const EventType& event) {
+        using State = StateAt<I>;
+        if constexpr (State::event != nullptr) {
+            (m_owner.*State::event)(event);
+            if (m_transitionToCalled || m_eventHandledCalled) {
+                return;
+            }
+        }
+        if constexpr (HIERARCHY.parents[I] != NO_STATE) {
+            bubbleEvent<HIERARCHY.parents[I]>(event);
+        }
+    }
+
+    template <size_t... Is>
+    void dispatchEvent(uint16_t state, const EventType& event, std::index_sequence<Is...>) {
+        (void)((state == Is && (bubbleEvent<Is>(event), true)) || ...);
+    }
+
+    Owner & m_owner;
+
+    uint16_t m_currentState = NO_STATE;
+
+    /**
+     * As in StateMachine, the state whose entry()/exit() method is currently running (or
+     * NO_STATE), used to implement entry/exit guards.
+     */
+    uint16_t m_calledEntryState = NO_STATE;
+    uint16_t m_calledExitState = NO_STATE;
+
+    bool m_transitionToCalled = false;
+    bool m_eventHandledCalled = false;
+
+    uint32_t m_recursionDepth = 0;
+
+    ErrorObserver m_errorObserver;
+}; // class StaticStateMachine
+
+} // namespace NinjaHSM
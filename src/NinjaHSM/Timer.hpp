@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+namespace NinjaHSM {
+
+template <typename EventType, size_t NumLevels>
+class TimerService;
+
+/**
+ * A one-shot timer that delivers an event to a state machine when it expires. Started and run by
+ * a TimerService (see there for an example).
+ *
+ * Timers are intrusive: each one carries its own links into the timer wheel (and, if it is tied
+ * to a state, into that state's list of timers), so starting and cancelling never allocates and
+ * takes constant time. Allocate one Timer per timeout you need, typically as a member next to
+ * your states. A Timer may be restarted at any time (even from the handler of its own event),
+ * which cancels the pending expiry first.
+ *
+ * @tparam EventType The state machine's event type. Must be move constructible.
+ */
+template <typename EventType>
+class Timer {
+public:
+    Timer() {}
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    /**
+     * A destroyed timer never fires.
+     */
+    ~Timer() {
+        cancel();
+    }
+
+    /**
+     * @return True from when the timer is started until it fires or is cancelled.
+     */
+    bool isArmed() const {
+        return m_wheelPrev != nullptr;
+    }
+
+    /**
+     * @return The tick the timer expires at (only meaningful while armed).
+     */
+    uint64_t getExpiry() const {
+        return m_expiry;
+    }
+
+    /**
+     * Stop the timer without delivering its event. Does nothing if it is not armed.
+     *
+     * @return True if the timer was armed.
+     */
+    bool cancel() {
+        if (!isArmed()) {
+            return false;
+        }
+        disarm();
+        eventPtr()->~EventType();
+        return true;
+    }
+
+private:
+    template <typename, size_t>
+    friend class TimerService;
+
+    EventType* eventPtr() {
+        return std::launder(reinterpret_cast<EventType*>(&m_event[0]));
+    }
+
+    /**
+     * Unlink the timer from the wheel and from its state, leaving the event in place.
+     */
+    void disarm() {
+        *m_wheelPrev = m_wheelNext;
+        if (m_wheelNext != nullptr) {
+            m_wheelNext->m_wheelPrev = m_wheelPrev;
+        }
+        m_wheelPrev = nullptr;
+        m_wheelNext = nullptr;
+
+        if (m_statePrev != nullptr) {
+            *m_statePrev = m_stateNext;
+            if (m_stateNext != nullptr) {
+                m_stateNext->m_statePrev = m_statePrev;
+            }
+            m_statePrev = nullptr;
+            m_stateNext = nullptr;
+        }
+        (*m_numArmed)--;
+    }
+
+    /**
+     * Links are "pointer to the previous link's next pointer" (as in the Linux hlist), so a timer
+     * can unlink itself without knowing which list head it is on. A null m_wheelPrev means the
+     * timer is not armed.
+     */
+    Timer* m_wheelNext = nullptr;
+    Timer** m_wheelPrev = nullptr;
+    Timer* m_stateNext = nullptr;
+    Timer** m_statePrev = nullptr;
+
+    /**
+     * The state machine to deliver the event to, and a function that calls its handleEvent()
+     * (so timers work with any kind of state machine).
+     */
+    void* m_target = nullptr;
+    void (*m_deliver)(void* target, const EventType& event) = nullptr;
+    uint32_t* m_numArmed = nullptr;
+    uint64_t m_expiry = 0;
+
+    alignas(EventType) unsigned char m_event[sizeof(EventType)];
+}; // class Timer
+
+} // namespace NinjaHSM
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <etl/delegate.h>
+
+#include "State.hpp"
+#include "Timer.hpp"
+
+namespace NinjaHSM {
+
+namespace detail {
+
+template <typename StateMachineType, typename EventType>
+void deliverTimerEvent(void* stateMachine, const EventType& event) {
+    static_cast<StateMachineType*>(stateMachine)->handleEvent(event);
+}
+
+/**
+ * StateMachineType::rejectIfCalledInParallel() if it has one (see
+ * StateMachine::rejectIfCalledInParallel()), otherwise false.
+ */
+template <typename StateMachineType, typename = void>
+struct ParallelRegionCheck {
+    static bool reject(StateMachineType&) {
+        return false;
+    }
+};
+
+template <typename StateMachineType>
+struct ParallelRegionCheck<StateMachineType,
+        std::void_t<decltype(std::declval<StateMachineType&>().rejectIfCalledInParallel())>> {
+    static bool reject(StateMachineType& stateMachine) {
+        return stateMachine.rejectIfCalledInParallel();
+    }
+};
+
+} // namespace detail
+
+/**
+ * A hierarchical timing wheel that delivers timeout events to state machines.
+ *
+ * Time is measured in ticks of a monotonic clock you provide (a delegate returning the current
+ * tick count, e.g. milliseconds since boot, or a virtual clock in tests). Starting and cancelling
+ * a Timer are O(1) and never allocate, however many timers are armed. poll() advances the wheel
+ * to the clock's current tick and delivers the event of every timer that has expired, in expiry
+ * order, by calling handleEvent() on the timer's state machine.
+ *
+ * The wheel has NumLevels levels of 64 slots. Level 0 holds timers expiring in the next 64 ticks,
+ * one slot per tick; each higher level covers 64 times the range of the one below, and its timers
+ * are moved ("cascaded") one level down as their slot comes up. Timers further out than the
+ * whole wheel (64^NumLevels ticks, ~16.7 million with the default 4 levels) park in the top level
+ * and are cascaded until they are in range, so any delay works.
+ *
+ * A timer started with startInState() is tied to a state: the state machine cancels it as the
+ * state exits, so a timeout armed in a state's entry() can never fire after the state has been
+ * left, and exit() does not have to cancel it by hand.
+ *
+ * @code
+ * TimerService<Event> m_timers(TimerService<Event>::ClockDelegate::create<&millis>());
+ * Timer<Event> m_responseTimeout;
+ *
+ * void waiting_entry() {
+ *     m_timers.startInState(m_responseTimeout, m_stateMachine, m_waiting, Event(RESPONSE_TIMEOUT), 500);
+ * }
+ *
+ * // In the main loop:
+ * m_timers.poll();
+ * @endcode
+ *
+ * Not thread-safe: start, cancel and poll from the thread that drives the state machines. Timers
+ * (and their state machines) must stay at the same address while armed, and a state a timer is
+ * tied to must be exited by its state machine before the timer is reused elsewhere.
+ *
+ * @tparam EventType The state machines' event type. Must be move constructible.
+ * @tparam NumLevels The number of wheel levels (1 to 10).
+ */
+template <typename EventType, size_t NumLevels = 4>
+class TimerService {
+public:
+    static_assert(NumLevels > 0 && NumLevels <= 10, "NumLevels must be between 1 and 10.");
+
+    /**
+     * Returns the current tick of the monotonic clock.
+     */
+    using ClockDelegate = etl::delegate<uint64_t()>;
+
+    static constexpr uint32_t SLOT_BITS = 6;
+    static constexpr uint32_t NUM_SLOTS = 1u << SLOT_BITS;
+
+    /**
+     * @param[in] clock The monotonic clock. Read once here to set the wheel's starting tick.
+     */
+    explicit TimerService(ClockDelegate clock) :
+            m_clock(clock),
+            m_now(clock()) {}
+
+    TimerService(const TimerService&) = delete;
+    TimerService& operator=(const TimerService&) = delete;
+
+    /**
+     * Cancels every timer still armed, so none is left linked into the destroyed wheel.
+     */
+    ~TimerService() {
+        for (auto& level : m_slots) {
+            for (Timer<EventType>*& slot : level) {
+                while (slot != nullptr) {
+                    slot->cancel(); // Unlinks it, so slot moves on to the next timer.
+                }
+            }
+        }
+    }
+
+    /**
+     * Arm a timer. If it is already armed, it is cancelled first.
+     *
+     * @param[in] timer        The timer to arm.
+     * @param[in] stateMachine The state machine to deliver the event to (anything with a
+     *                         handleEvent(const EventType&) method, e.g. any StateMachine).
+     * @param[in] event        The event to deliver.
+     * @param[in] delay        Ticks from now until the timer expires. 0 expires on the next tick.
+     * @return True if the timer was armed. False, leaving the timer as it was, if called from one
+     *         of @p stateMachine's region event() handlers running in parallel (reported as
+     *         Error::CalledFromParallelRegion).
+     */
+    template <typename StateMachineType>
+    bool start(Timer<EventType>& timer, StateMachineType& stateMachine, EventType event, uint64_t delay) {
+        if (detail::ParallelRegionCheck<StateMachineType>::reject(stateMachine)) {
+            return false;
+        }
+        timer.cancel();
+        new (&timer.m_event[0]) EventType(std::move(event));
+        timer.m_target = &stateMachine;
+        timer.m_deliver = &detail::deliverTimerEvent<StateMachineType, EventType>;
+        timer.m_numArmed = &m_numArmed;
+        // The wheel cannot fire anything on a tick it has already passed.
+        const uint64_t expiry = m_clock() + delay;
+        timer.m_expiry = expiry > m_now ? expiry : m_now + 1;
+        m_numArmed++;
+        insert(timer);
+        return true;
+    }
+
+    /**
+     * Arm a timer tied to a state: same as start(), but the timer is also cancelled when the state
+     * machine exits @p state. Typically called from @p state's entry().
+     *
+     * @param[in] timer        The timer to arm.
+     * @param[in] stateMachine The state machine to deliver the event to.
+     * @param[in] state        The state whose exit cancels the timer.
+     * @param[in] event        The event to deliver.
+     * @param[in] delay        Ticks from now until the timer expires. 0 expires on the next tick.
+     * @return True if the timer was armed (see start()).
+     */
+    template <typename StateMachineType>
+    bool startInState(
+            Timer<EventType>& timer,
+            StateMachineType& stateMachine,
+            State<EventType>& state,
+            EventType event,
+            uint64_t delay) {
+        if (!start(timer, stateMachine, std::move(event), delay)) {
+            return false;
+        }
+        timer.m_stateNext = state.timers;
+        if (state.timers != nullptr) {
+            state.timers->m_statePrev = &timer.m_stateNext;
+        }
+        state.timers = &timer;
+        timer.m_statePrev = &state.timers;
+        return true;
+    }
+
+    /**
+     * Cancel a timer (same as Timer::cancel()).
+     *
+     * @return True if the timer was armed.
+     */
+    bool cancel(Timer<EventType>& timer) {
+        return timer.cancel();
+    }
+
+    /**
+     * Advance the wheel to the clock's current tick and deliver the events of all timers that have
+     * expired, earliest first. Handlers may start and cancel timers (including the one that just
+     * fired); a timer started with delay 0 from a handler fires in the same poll() if the clock is
+     * already past its tick.
+     *
+     * @return The number of timers that fired.
+     */
+    size_t poll() {
+        const uint64_t target = m_clock();
+        size_t numFired = 0;
+        while (m_now < target) {
+            if (m_numArmed == 0) {
+                m_now = target; // Nothing to fire or cascade on the way.
+                break;
+            }
+            m_now++;
+            // Cascade from the top down, so timers that land in a lower level's current slot are
+            // cascaded again (or fired) on this same tick.
+            for (size_t level = NumLevels - 1; level > 0; level--) {
+                if ((m_now & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) == 0) {
+                    cascade(level);
+                }
+            }
+            Timer<EventType>*& slot = m_slots[0][m_now & (NUM_SLOTS - 1)];
+            while (slot != nullptr) {
+                Timer<EventType>& timer = *slot;
+                if (timer.m_expiry > m_now) {
+                    // Parked beyond the wheel (only with a single level): go round again.
+                    slot = timer.m_wheelNext;
+                    if (slot != nullptr) {
+                        slot->m_wheelPrev = &slot;
+                    }
+                    insert(timer);
+                    continue;
+                }
+                timer.disarm();
+                // Free the timer before delivering, so the handler can restart it.
+                EventType event(std::move(*timer.eventPtr()));
+                timer.eventPtr()->~EventType();
+                timer.m_deliver(timer.m_target, event);
+                numFired++;
+            }
+        }
+        return numFired;
+    }
+
+    /**
+     * @return The tick the wheel has advanced to: the clock's value at the last poll(), or inside
+     *         a handler called by poll(), the tick the timer fired on.
+     */
+    uint64_t now() const {
+        return m_now;
+    }
+
+    /**
+     * @return The number of armed timers.
+     */
+    uint32_t numArmed() const {
+        return m_numArmed;
+    }
+
+private:
+    /**
+     * Link a timer into the slot it belongs in, given how far it is from m_now. When cascading,
+     * a timer can be due on m_now itself: it goes in level 0's current slot, which poll() fires
+     * straight after cascading.
+     */
+    void insert(Timer<EventType>& timer) {
+        const uint64_t delta = timer.m_expiry - m_now;
+        uint64_t slotTick = timer.m_expiry;
+        size_t level = 0;
+        while (level < NumLevels - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+            level++;
+        }
+        if (delta >= (uint64_t(1) << (SLOT_BITS * NumLevels))) {
+            // Beyond the wheel: park in the furthest top-level slot and cascade again from there.
+            slotTick = m_now + (uint64_t(1) << (SLOT_BITS * NumLevels)) - 1;
+        }
+        Timer<EventType>*& slot = m_slots[level][(slotTick >> (SLOT_BITS * level)) & (NUM_SLOTS - 1)];
+        timer.m_wheelNext = slot;
+        if (slot != nullptr) {
+            slot->m_wheelPrev = &timer.m_wheelNext;
+        }
+        slot = &timer;
+        timer.m_wheelPrev = &slot;
+    }
+
+    /**
+     * Move every timer in the current slot of @p level down to the level it now belongs in.
+     */
+    void cascade(size_t level) {
+        Timer<EventType>*& slot = m_slots[level][(m_now >> (SLOT_BITS * level)) & (NUM_SLOTS - 1)];
+        Timer<EventType>* timer = slot;
+        slot = nullptr;
+        while (timer != nullptr) {
+            Timer<EventType>* next = timer->m_wheelNext;
+            insert(*timer);
+            timer = next;
+        }
+    }
+
+    ClockDelegate m_clock;
+    uint64_t m_now;
+    uint32_t m_numArmed = 0;
+
+    /**
+     * Heads of each slot's list of timers.
+     */
+    Timer<EventType>* m_slots[NumLevels][NUM_SLOTS] = {};
+}; // class TimerService
+
+} // namespace NinjaHSM
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "State.hpp"
+
+namespace NinjaHSM {
+
+/**
+ * Storage for the precomputed transition paths of a sealed state machine (see
+ * StateMachine::finalize()). Declare one of these (typically static, or as a member next to the
+ * states) sized for your state machine, and pass it to finalize() once at startup. It performs no
+ * dynamic allocation; its size is fixed by the template parameters:
+ *
+ * - NumStates x MaxDepth state pointers: the root-first chain of ancestors of each state
+ *   (including the state itself). The exit and entry sequences of any transition are contiguous
+ *   runs of these chains.
+ * - NumStates x NumStates bytes: for every (source, destination) pair, how many ancestors the
+ *   two states share, i.e. where the exit sequence stops and the entry sequence starts.
+ *
+ * @code
+ * static TransitionTable<Event, 3> s_transitionTable;
+ * m_sm.finalize(s_transitionTable, {&m_idle, &m_running, &m_paused});
+ * @endcode
+ *
+ * The contents are only written by finalize() and should be treated as opaque.
+ *
+ * @tparam EventType The state machine's event type.
+ * @tparam NumStates The number of states that will be registered with finalize().
+ * @tparam MaxDepth  The maximum depth of the state hierarchy (a top-level state plus
+ *                   MaxDepth - 1 levels of children). Defaults to MAX_STATE_DEPTH.
+ */
+template <typename EventType, size_t NumStates, size_t MaxDepth = MAX_STATE_DEPTH>
+class TransitionTable {
+    static_assert(NumStates > 0, "A transition table needs at least one state.");
+    static_assert(NumStates <= UINT16_MAX, "State indexes are stored as uint16_t.");
+    static_assert(MaxDepth > 0 && MaxDepth <= UINT8_MAX, "State depths are stored as uint8_t.");
+
+    template <typename, typename>
+    friend class StateMachine;
+
+    /**
+     * The registered states, in index order.
+     */
+    const State<EventType>* m_states[NumStates] = {};
+
+    /**
+     * m_ancestors[i][d] is the ancestor of state i at depth d (m_ancestors[i][depth] is state i
+     * itself). Entries deeper than state i are unused.
+     */
+    const State<EventType>* m_ancestors[NumStates][MaxDepth] = {};
+
+    /**
+     * m_commonDepths[i][j] is the number of ancestors (or self) states i and j have in common,
+     * which is one more than the depth of their least common ancestor.
+     */
+    uint8_t m_commonDepths[NumStates][NumStates] = {};
+}; // class TransitionTable
+
+} // namespace NinjaHSM
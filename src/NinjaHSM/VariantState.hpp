@@ -0,0 +1,204 @@
+#pragma once
+
+#if __has_include(<variant>)
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "State.hpp"
+
+namespace NinjaHSM {
+
+/**
+ * A State whose event() handler is a jump table over the alternatives of a std::variant event
+ * type, with one handler per alternative. Built with makeVariantState() (see there).
+ *
+ * The event delegate is bound to the VariantState itself, which looks the handler up by the
+ * event's index() and calls it with the alternative already extracted, so dispatch is one indexed
+ * indirect call however many alternatives there are. Alternatives without a handler do nothing
+ * (so the event bubbles up to the parent), and are left out of the state's eventMask.
+ *
+ * A VariantState cannot be copied or moved, since its delegate points at itself: declare it as a
+ * VariantState member (not a plain State, which would slice it) initialised from
+ * makeVariantState().
+ *
+ * @tparam Variant The state machine's event type, a std::variant.
+ */
+template <typename Variant>
+class VariantState : public State<Variant> {
+    using Base = State<Variant>;
+
+public:
+    /**
+     * Calls one handler: @p self is the object the handlers are members of.
+     */
+    using Handler = void (*)(void* self, const Variant& event);
+
+    /**
+     * @param[in] name      Human readable name for the state.
+     * @param[in] entry     The entry() handler (may be unbound).
+     * @param[in] exit      The exit() handler (may be unbound).
+     * @param[in] parent    Pointer to the parent state, or nullptr for a top-level state.
+     * @param[in] self      The object the handlers are called on.
+     * @param[in] handlers  One entry per alternative of Variant, nullptr for unhandled ones.
+     * @param[in] eventMask The event kinds the state is subscribed to (see State::eventMask).
+     */
+    VariantState(
+        const char * name,
+        typename Base::EntryDelegate entry,
+        typename Base::ExitDelegate exit,
+        Base * parent,
+        void * self,
+        const Handler * handlers,
+        EventMask eventMask) :
+            Base(
+                name,
+                entry,
+                Base::EventDelegate::template create<VariantState, &VariantState::dispatch>(*this),
+                exit,
+                parent,
+                eventMask),
+            m_self(self),
+            m_handlers(handlers) {}
+
+    VariantState(const VariantState&) = delete;
+    VariantState& operator=(const VariantState&) = delete;
+
+private:
+    void dispatch(const Variant& event) {
+        const size_t index = event.index();
+        // index() is variant_npos if the variant is valueless (after an exception).
+        if (index < std::variant_size_v<Variant> && m_handlers[index] != nullptr) {
+            m_handlers[index](m_self, event);
+        }
+    }
+
+    void * m_self;
+    const Handler * m_handlers;
+}; // class VariantState
+
+namespace detail {
+
+/**
+ * Extracts the alternative type from a variant handler, a member function taking
+ * `const Alternative&`.
+ */
+template <typename HandlerPtr>
+struct VariantHandlerTraits;
+
+template <typename Self, typename Alternative>
+struct VariantHandlerTraits<void (Self::*)(const Alternative&)> {
+    using Type = Alternative;
+};
+
+template <auto Handler>
+using HandledAlternative = typename VariantHandlerTraits<decltype(Handler)>::Type;
+
+/**
+ * @return How many of @p Handlers take @p Alternative.
+ */
+template <typename Alternative, auto... Handlers>
+constexpr size_t numHandlersFor() {
+    return (size_t(0) + ... + (std::is_same_v<HandledAlternative<Handlers>, Alternative> ? 1 : 0));
+}
+
+/**
+ * @return The bit of the alternative @p Handler takes, or 0 if it is beyond MAX_EVENT_KINDS.
+ */
+template <typename Variant, auto Handler>
+constexpr EventMask handledEventBit() {
+    constexpr size_t index = variantIndexOf<HandledAlternative<Handler>, Variant>();
+    return index < MAX_EVENT_KINDS ? EventMask(1) << index : EventMask(0);
+}
+
+template <typename Variant, typename Self, size_t Index, auto Handler>
+void callVariantHandler(void* self, const Variant& event) {
+    // Only called when event.index() == Index, so get_if cannot fail (and never throws).
+    (static_cast<Self*>(self)->*Handler)(*std::get_if<Index>(&event));
+}
+
+/**
+ * @return The thunk calling whichever of the handlers takes alternative @p Index, or nullptr.
+ */
+template <typename Variant, typename Self, size_t Index>
+constexpr typename VariantState<Variant>::Handler variantHandlerAt() {
+    return nullptr;
+}
+
+template <typename Variant, typename Self, size_t Index, auto Handler, auto... Rest>
+constexpr typename VariantState<Variant>::Handler variantHandlerAt() {
+    if constexpr (std::is_same_v<HandledAlternative<Handler>, std::variant_alternative_t<Index, Variant>>) {
+        return &callVariantHandler<Variant, Self, Index, Handler>;
+    } else {
+        return variantHandlerAt<Variant, Self, Index, Rest...>();
+    }
+}
+
+template <typename Variant, typename Self, typename Indexes, auto... Handlers>
+struct VariantHandlerTable;
+
+/**
+ * The jump table for one set of handlers: one entry per alternative, in index order. A single
+ * static constexpr array shared by every state built from the same handlers.
+ */
+template <typename Variant, typename Self, size_t... Indexes, auto... Handlers>
+struct VariantHandlerTable<Variant, Self, std::index_sequence<Indexes...>, Handlers...> {
+    static constexpr typename VariantState<Variant>::Handler handlers[] = {
+        variantHandlerAt<Variant, Self, Indexes, Handlers...>()...
+    };
+};
+
+} // namespace detail
+
+/**
+ * Build a VariantState: like makeState(), but instead of one event() handler that tests which
+ * alternative the event holds (a chain of std::holds_alternative checks), pass one handler per
+ * alternative the state handles.
+ *
+ * @code
+ * VariantState<Events::Generic> m_state1 = makeVariantState<Events::Generic,
+ *     &MyStateMachine::state1_entry,
+ *     nullptr,                                 // no exit()
+ *     &MyStateMachine::state1_onTimerExpired,  // void(const Events::TimerExpired&)
+ *     &MyStateMachine::state1_onButtonPressed  // void(const Events::ButtonPressed&)
+ *     >("State1", *this);
+ * @endcode
+ *
+ * Each handler is a member function taking `const Alternative&` for one of the variant's
+ * alternatives (at most one handler per alternative). Alternatives with no handler bubble up to
+ * the parent. The state's eventMask is set to the handled alternatives, so with variantEventKind()
+ * as the state machine's event kind selector the other alternatives skip the state entirely.
+ *
+ * @tparam Variant   The state machine's event type, a std::variant.
+ * @tparam Entry     Pointer to the entry() member function, or nullptr.
+ * @tparam Exit      Pointer to the exit() member function, or nullptr.
+ * @tparam Handlers  Pointers to the per-alternative handler member functions.
+ * @tparam Self      The class that owns the handler methods. Deduced from @p self.
+ * @param[in] name   Human readable name for the state.
+ * @param[in] self   The instance the handler methods are called on.
+ * @param[in] parent Pointer to the parent state, or nullptr (the default) for a top-level state.
+ * @return A fully constructed VariantState.
+ */
+template <typename Variant, auto Entry, auto Exit, auto... Handlers, typename Self>
+VariantState<Variant> makeVariantState(const char * name, Self & self, State<Variant> * parent = nullptr) {
+    static_assert(((detail::numHandlersFor<detail::HandledAlternative<Handlers>, Handlers...>() == 1) && ...),
+        "Each alternative can have at most one handler.");
+    constexpr size_t NUM_ALTERNATIVES = std::variant_size_v<Variant>;
+    // Alternatives beyond MAX_EVENT_KINDS are offered to every state anyway.
+    constexpr EventMask eventMask = (EventMask(0) | ... | detail::handledEventBit<Variant, Handlers>());
+    return VariantState<Variant>(
+        name,
+        detail::bindOrEmpty<typename State<Variant>::EntryDelegate, Entry>(self),
+        detail::bindOrEmpty<typename State<Variant>::ExitDelegate, Exit>(self),
+        parent,
+        &self,
+        detail::VariantHandlerTable<Variant, Self, std::make_index_sequence<NUM_ALTERNATIVES>, Handlers...>::handlers,
+        eventMask == 0 && sizeof...(Handlers) != 0 ? ALL_EVENTS : eventMask);
+}
+
+} // namespace NinjaHSM
+
+#endif
@@ -0,0 +1,469 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <etl/delegate.h>
+
+#include "MpscEventQueue.hpp"
+#include "QueuedStateMachine.hpp"
+
+namespace NinjaHSM {
+
+/**
+ * Per-worker counters kept by WorkStealingExecutor.
+ */
+struct ExecutorWorkerStats {
+    /**
+     * Events handled by state machines run on this worker.
+     */
+    uint64_t numEventsDispatched = 0;
+
+    /**
+     * Times a state machine was taken off a run queue and run on this worker.
+     */
+    uint64_t numTasksRun = 0;
+
+    /**
+     * Times this worker ran out of work and took a state machine from another worker's run queue.
+     */
+    uint64_t numSteals = 0;
+};
+
+/**
+ * The executor's handle on one state machine. ExecutorStateMachine owns one, so you only need
+ * this to plug in some other kind of task.
+ *
+ * A task is in at most one run queue at a time (tracked by @p scheduled), so it only ever runs
+ * on one worker at a time. Run queues are intrusive linked lists through @p next, so scheduling
+ * never allocates.
+ */
+struct ExecutorTask {
+    /**
+     * Handles up to the given number of queued events and returns how many it handled.
+     */
+    etl::delegate<size_t(size_t)> dispatchPending;
+
+    /**
+     * Returns the number of queued events (a snapshot).
+     */
+    etl::delegate<size_t()> numPendingEvents;
+
+    /**
+     * True from when the task is put in a run queue until the worker running it has emptied it.
+     */
+    std::atomic<bool> scheduled{false};
+
+    /**
+     * The worker whose run queue the task is put in when it becomes ready.
+     */
+    uint32_t homeWorker = 0;
+
+    ExecutorTask* next = nullptr;
+};
+
+/**
+ * Runs a large fleet of state machines (e.g. one per network connection) on a fixed pool of
+ * worker threads, keeping every machine single-threaded and run-to-completion.
+ *
+ * Machines are sharded across the workers round-robin as they are added. Posting an event to an
+ * idle machine puts it in its home worker's run queue. A worker takes a machine off its run
+ * queue, lets it handle up to a batch of events (see setBatchSize()) and puts it back at the end
+ * of its own run queue if it still has events. A worker whose run queue is empty steals the
+ * oldest machine from another worker's, so a few busy shards cannot leave other cores idle. When
+ * no run queue has anything in it, workers park on a condition variable.
+ *
+ * Each run queue has its own mutex, only held long enough to link or unlink one machine, so
+ * workers rarely contend with each other.
+ *
+ * @code
+ * WorkStealingExecutor<8> executor;
+ * executor.setPinToCores(true);
+ * executor.start();
+ *
+ * // In each session:
+ * ExecutorStateMachine<Event, 64> m_stateMachine;
+ * m_stateMachine.initialTransitionTo(m_connecting);
+ * m_stateMachine.attach(executor);
+ * m_stateMachine.postEvent(event); // Any thread
+ * @endcode
+ *
+ * This uses std::thread, so it is intended for hosted (e.g. Linux) targets and is not included by
+ * NinjaHSM.hpp. Include <NinjaHSM/WorkStealingExecutor.hpp> explicitly.
+ *
+ * @tparam NumWorkers The number of worker threads.
+ */
+template <uint32_t NumWorkers>
+class WorkStealingExecutor {
+public:
+    static_assert(NumWorkers > 0, "NumWorkers must be at least 1.");
+
+    WorkStealingExecutor() {}
+
+    WorkStealingExecutor(const WorkStealingExecutor&) = delete;
+    WorkStealingExecutor& operator=(const WorkStealingExecutor&) = delete;
+
+    /**
+     * Stops the worker threads (see stop()).
+     */
+    ~WorkStealingExecutor() {
+        stop();
+    }
+
+    /**
+     * Set the maximum number of events a state machine handles each time a worker runs it,
+     * before it goes to the back of the run queue. Smaller is fairer, larger has less overhead.
+     * Defaults to 16. Set this before start().
+     *
+     * @param[in] batchSize The batch size (at least 1).
+     */
+    void setBatchSize(size_t batchSize) {
+        m_batchSize = batchSize > 0 ? batchSize : 1;
+    }
+
+    /**
+     * Pin worker n to CPU core n (modulo the number of cores) when started. Only supported on
+     * Linux, ignored elsewhere. Defaults to false. Set this before start().
+     *
+     * @param[in] pinToCores True to pin the workers.
+     */
+    void setPinToCores(bool pinToCores) {
+        m_pinToCores = pinToCores;
+    }
+
+    /**
+     * Add a task, giving it the next home worker (round-robin). Usually called for you by
+     * ExecutorStateMachine::attach().
+     *
+     * @param[in] task The task. Must outlive the executor's worker threads (or stop()).
+     */
+    void add(ExecutorTask& task) {
+        task.homeWorker = m_nextHomeWorker.fetch_add(1, std::memory_order_relaxed) % NumWorkers;
+    }
+
+    /**
+     * Put a task in its home worker's run queue, unless it is already in one. Called by
+     * ExecutorStateMachine::postEvent() after queuing an event. Safe to call from any thread.
+     *
+     * @param[in] task The task, which must have been add()ed.
+     */
+    void schedule(ExecutorTask& task) {
+        if (!task.scheduled.load(std::memory_order_relaxed) && !task.scheduled.exchange(true)) {
+            push(task.homeWorker, task);
+        }
+    }
+
+    /**
+     * Start the worker threads. Tasks scheduled before start() are run once it is called. Does
+     * nothing if already running.
+     */
+    void start() {
+        if (m_running) {
+            return;
+        }
+        m_stopRequested.store(false);
+        for (uint32_t i = 0; i < NumWorkers; i++) {
+            m_workers[i].thread = std::thread([this, i]() { run(i); });
+            pin(i);
+        }
+        m_running = true;
+    }
+
+    /**
+     * Stop the worker threads. Every event posted before stop() was called is handled first, then
+     * the worker threads exit and this returns. Does nothing if not running.
+     */
+    void stop() {
+        if (!m_running) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_parkMutex);
+            m_stopRequested.store(true);
+        }
+        m_wakeup.notify_all();
+        for (Worker& worker : m_workers) {
+            worker.thread.join();
+        }
+        m_running = false;
+    }
+
+    /**
+     * @return True between start() and stop().
+     */
+    bool isRunning() const {
+        return m_running;
+    }
+
+    static constexpr uint32_t numWorkers() {
+        return NumWorkers;
+    }
+
+    /**
+     * @param[in] worker The worker (0 to NumWorkers - 1).
+     * @return A snapshot of the worker's counters.
+     */
+    ExecutorWorkerStats getWorkerStats(uint32_t worker) const {
+        ExecutorWorkerStats stats;
+        stats.numEventsDispatched = m_workers[worker].numEventsDispatched.load(std::memory_order_relaxed);
+        stats.numTasksRun = m_workers[worker].numTasksRun.load(std::memory_order_relaxed);
+        stats.numSteals = m_workers[worker].numSteals.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    /**
+     * Each worker is kept on its own cache lines, since its run queue and counters are written
+     * mostly by its own thread.
+     */
+    struct alignas(CACHE_LINE_SIZE) Worker {
+        std::mutex mutex;
+        ExecutorTask* head = nullptr;
+        ExecutorTask* tail = nullptr;
+
+        std::atomic<uint64_t> numEventsDispatched{0};
+        std::atomic<uint64_t> numTasksRun{0};
+        std::atomic<uint64_t> numSteals{0};
+
+        std::thread thread;
+    };
+
+    void push(uint32_t worker, ExecutorTask& task) {
+        {
+            std::lock_guard<std::mutex> lock(m_workers[worker].mutex);
+            task.next = nullptr;
+            if (m_workers[worker].tail == nullptr) {
+                m_workers[worker].head = &task;
+            } else {
+                m_workers[worker].tail->next = &task;
+            }
+            m_workers[worker].tail = &task;
+        }
+        m_numQueuedTasks.fetch_add(1);
+        // Pairs with the fence in run(): either we see the parked worker, or it sees our task.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_numParked.load() > 0) {
+            std::lock_guard<std::mutex> lock(m_parkMutex);
+            m_wakeup.notify_one();
+        }
+    }
+
+    ExecutorTask* pop(uint32_t worker) {
+        ExecutorTask* task;
+        {
+            std::lock_guard<std::mutex> lock(m_workers[worker].mutex);
+            task = m_workers[worker].head;
+            if (task == nullptr) {
+                return nullptr;
+            }
+            m_workers[worker].head = task->next;
+            if (m_workers[worker].head == nullptr) {
+                m_workers[worker].tail = nullptr;
+            }
+        }
+        m_numQueuedTasks.fetch_sub(1);
+        return task;
+    }
+
+    ExecutorTask* steal(uint32_t self) {
+        for (uint32_t i = 1; i < NumWorkers; i++) {
+            ExecutorTask* task = pop((self + i) % NumWorkers);
+            if (task != nullptr) {
+                m_workers[self].numSteals.fetch_add(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Let @p task handle a batch of events on worker @p self, then requeue or release it.
+     */
+    void runTask(uint32_t self, ExecutorTask& task) {
+        const size_t numDispatched = task.dispatchPending(m_batchSize);
+        m_workers[self].numEventsDispatched.fetch_add(numDispatched, std::memory_order_relaxed);
+        m_workers[self].numTasksRun.fetch_add(1, std::memory_order_relaxed);
+
+        if (task.numPendingEvents() > 0) {
+            // Still has events: back of the queue (ours, since its data is in our cache now).
+            if (numDispatched == 0) {
+                // A producer has claimed a slot but not finished writing it. Let it run rather
+                // than spinning (it may share our core).
+                std::this_thread::yield();
+            }
+            push(self, task);
+            return;
+        }
+        task.scheduled.store(false);
+        // Pairs with the fence in ExecutorStateMachine::postEvent(): either the producer sees the
+        // task is no longer scheduled and schedules it, or we see its event here.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (task.numPendingEvents() > 0 && !task.scheduled.exchange(true)) {
+            push(self, task);
+        }
+    }
+
+    /**
+     * The loop run by each worker thread.
+     */
+    void run(uint32_t self) {
+        while (true) {
+            ExecutorTask* task = pop(self);
+            if (task == nullptr) {
+                task = steal(self);
+            }
+            if (task != nullptr) {
+                runTask(self, *task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_parkMutex);
+            m_numParked.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_numQueuedTasks.load() == 0) {
+                if (m_stopRequested.load()) {
+                    m_numParked.fetch_sub(1);
+                    return;
+                }
+                m_wakeup.wait(lock);
+            }
+            m_numParked.fetch_sub(1);
+        }
+    }
+
+    void pin(uint32_t worker) {
+#if defined(__linux__)
+        if (!m_pinToCores) {
+            return;
+        }
+        const uint32_t numCores = std::thread::hardware_concurrency();
+        if (numCores == 0) {
+            return;
+        }
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker % numCores, &cpus);
+        pthread_setaffinity_np(m_workers[worker].thread.native_handle(), sizeof(cpus), &cpus);
+#else
+        (void)worker;
+#endif
+    }
+
+    Worker m_workers[NumWorkers];
+
+    size_t m_batchSize = 16;
+    bool m_pinToCores = false;
+    bool m_running = false;
+
+    std::atomic<uint32_t> m_nextHomeWorker{0};
+
+    /**
+     * The total number of tasks in all run queues.
+     */
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> m_numQueuedTasks{0};
+
+    /**
+     * The number of workers parked (or about to park) waiting for tasks.
+     */
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> m_numParked{0};
+
+    std::mutex m_parkMutex;
+    std::condition_variable m_wakeup;
+    std::atomic<bool> m_stopRequested{false};
+}; // class WorkStealingExecutor
+
+/**
+ * A QueuedStateMachine that is run by a WorkStealingExecutor. postEvent() may be called from any
+ * thread; the executor's workers call handleEvent(), never more than one at a time, so the state
+ * machine is never re-entered (handleEvent() and dispatchPending() are hidden for that reason).
+ *
+ * Call initialTransitionTo() before attach(). Stop the executor before destroying the machine.
+ *
+ * @tparam EventType     The state machine's event type.
+ * @tparam QueueCapacity The maximum number of pending events. Must be a power of two.
+ * @tparam Queue         The queue class template. Defaults to MpscEventQueue so that any number
+ *                       of threads can post. Use SpscEventQueue if only one thread ever posts.
+ * @tparam Policy        Which optional features to compile in (see StateMachinePolicy).
+ */
+template <
+    typename EventType,
+    size_t QueueCapacity,
+    template <typename, size_t, size_t> class Queue = MpscEventQueue,
+    typename Policy = StateMachinePolicy>
+class ExecutorStateMachine : public QueuedStateMachine<EventType, QueueCapacity, CACHE_LINE_SIZE, Queue, Policy> {
+    using Base = QueuedStateMachine<EventType, QueueCapacity, CACHE_LINE_SIZE, Queue, Policy>;
+
+public:
+    ExecutorStateMachine() {
+        m_task.dispatchPending = etl::delegate<size_t(size_t)>::create<Base, &Base::dispatchPending>(*this);
+        m_task.numPendingEvents = etl::delegate<size_t()>::create<Base, &Base::numPendingEvents>(*this);
+    }
+
+    ExecutorStateMachine(const ExecutorStateMachine&) = delete;
+    ExecutorStateMachine& operator=(const ExecutorStateMachine&) = delete;
+
+    /**
+     * Add this state machine to an executor, which will run it from now on. Call once, before
+     * posting events.
+     *
+     * @param[in] executor The executor.
+     */
+    template <uint32_t NumWorkers>
+    void attach(WorkStealingExecutor<NumWorkers>& executor) {
+        executor.add(m_task);
+        m_schedule = etl::delegate<void(ExecutorTask&)>::create<
+            WorkStealingExecutor<NumWorkers>, &WorkStealingExecutor<NumWorkers>::schedule>(executor);
+    }
+
+    /**
+     * Queue an event and make sure a worker will handle it. Safe to call from any thread (with
+     * the default MpscEventQueue), including from this or other machines' handlers.
+     *
+     * @param[in] event The event to queue.
+     * @return True if the event was queued, false if the queue was full (the event is dropped) or
+     *         the machine has not been attached to an executor.
+     */
+    bool postEvent(const EventType& event) {
+        if (!m_schedule.is_valid() || !Base::postEvent(event)) {
+            return false;
+        }
+        scheduleTask();
+        return true;
+    }
+
+    /**
+     * Same as postEvent(), but moves the event into the queue.
+     */
+    bool postEvent(EventType&& event) {
+        if (!m_schedule.is_valid() || !Base::postEvent(std::move(event))) {
+            return false;
+        }
+        scheduleTask();
+        return true;
+    }
+
+private:
+    // Only the executor's workers drive the state machine.
+    using Base::handleEvent;
+    using Base::dispatchPending;
+
+    void scheduleTask() {
+        // Pairs with the fence in WorkStealingExecutor::runTask().
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        m_schedule(m_task);
+    }
+
+    ExecutorTask m_task;
+    etl::delegate<void(ExecutorTask&)> m_schedule;
+}; // class ExecutorStateMachine
+
+} // namespace NinjaHSM
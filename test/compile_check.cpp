@@ -12,6 +12,10 @@ struct Event {
     int id;
 };
 
+uint8_t eventKind(const Event& event) {
+    return static_cast<uint8_t>(event.id);
+}
+
 class Machine {
 public:
     Machine() :
@@ -19,9 +23,10 @@ public:
             &Machine::idle_entry, &Machine::idle_event, &Machine::idle_exit>("Idle", *this)),
         m_running(makeState<Event,
             &Machine::running_entry, &Machine::running_event, &Machine::running_exit>("Running", *this, &m_idle)),
-        // A state that omits its entry()/exit() handlers by passing nullptr (only reacts to events).
+        // A state that omits its entry()/exit() handlers by passing nullptr (only reacts to
+        // events, and only to those of kind 2).
         m_paused(makeState<Event,
-            nullptr, &Machine::paused_event, nullptr>("Paused", *this, &m_idle)),
+            nullptr, &Machine::paused_event, nullptr>("Paused", *this, &m_idle, eventMaskOf(2))),
         m_sm() {
         m_sm.setTransitionObserver(
             StateMachine<Event>::TransitionObserver::create<Machine, &Machine::onTransition>(*this));
@@ -29,11 +34,16 @@ public:
             StateMachine<Event>::UnhandledEventObserver::create<Machine, &Machine::onUnhandledEvent>(*this));
         m_sm.setErrorObserver(
             StateMachine<Event>::ErrorObserver::create<Machine, &Machine::onError>(*this));
+        m_sm.setEventKindSelector(StateMachine<Event>::EventKindSelector::create<&eventKind>());
+        m_sm.finalize(m_transitionTable, {&m_idle, &m_running, &m_paused});
         m_sm.initialTransitionTo(m_idle);
     }
 
     void step(const Event& event) { m_sm.handleEvent(event); }
 
+    size_t save(uint8_t* buffer, size_t capacity) const { return m_sm.snapshot(buffer, capacity); }
+    bool warmRestart(const uint8_t* data, size_t size) { return m_sm.restore(data, size, RestoreEntry::Leaves); }
+
 private:
     void idle_entry() {}
     void idle_event(const Event& event) {
@@ -61,8 +71,322 @@ private:
     State<Event> m_running;
     State<Event> m_paused;
     StateMachine<Event> m_sm;
+    TransitionTable<Event, 3> m_transitionTable;
+};
+
+/**
+ * The same machine shape, with the hierarchy fixed at compile time.
+ */
+class StaticMachine {
+public:
+    StaticMachine() : m_sm(*this) {
+        m_sm.initialTransitionTo<Idle>();
+    }
+
+    void step(const Event& event) { m_sm.handleEvent(event); }
+
+private:
+    void idle_event(const Event& event) {
+        if (event.id == 1) {
+            m_sm.transitionTo<Running>();
+        }
+    }
+    void running_entry() {}
+    void running_exit() {}
+
+    using Idle = StaticState<nullptr, &StaticMachine::idle_event, nullptr>;
+    using Running = StaticState<&StaticMachine::running_entry, nullptr, &StaticMachine::running_exit, Idle>;
+
+    StaticStateMachine<StaticMachine, Event, Idle, Running> m_sm;
+};
+
+/**
+ * The same machine shape again, with the topology shared by every instance.
+ */
+class SharedMachine {
+public:
+    enum StateIndex : uint16_t { IDLE, RUNNING };
+    using Topology = SharedTopology<SharedMachine, Event, 2>;
+
+    explicit SharedMachine(const Topology& topology) : m_sm(topology) {
+        m_sm.initialTransitionTo(*this, IDLE);
+    }
+
+    void step(const Event& event) { m_sm.handleEvent(*this, event); }
+
+    void idle_event(const Event& event) {
+        if (event.id == 1) {
+            m_sm.transitionTo(*this, RUNNING);
+        }
+    }
+    void running_entry() {}
+
+private:
+    SharedStateMachine<SharedMachine, Event, 2> m_sm;
+};
+
+constexpr SharedState<SharedMachine, Event> SHARED_STATES[] = {
+    makeSharedState<SharedMachine, Event, nullptr, &SharedMachine::idle_event, nullptr>("Idle"),
+    makeSharedState<SharedMachine, Event, &SharedMachine::running_entry, nullptr, nullptr>("Running", SharedMachine::IDLE),
+};
+
+constexpr SharedMachine::Topology SHARED_TOPOLOGY(SHARED_STATES);
+
+namespace Events {
+struct Tick {};
+struct Press { uint8_t button; };
+using Generic = std::variant<Tick, Press>;
+}
+
+/**
+ * A std::variant event type with one handler per alternative.
+ */
+class VariantMachine {
+public:
+    VariantMachine() :
+        m_idle(makeVariantState<Events::Generic, nullptr, nullptr,
+            &VariantMachine::idle_onTick, &VariantMachine::idle_onPress>("Idle", *this)) {
+        m_sm.setEventKindSelector(
+            StateMachine<Events::Generic>::EventKindSelector::create<&variantEventKind<Events::Generic>>());
+        m_sm.initialTransitionTo(m_idle);
+    }
+
+    void step(const Events::Generic& event) { m_sm.handleEvent(event); }
+
+private:
+    void idle_onTick(const Events::Tick& tick) {}
+    void idle_onPress(const Events::Press& press) { m_sm.eventHandled(); }
+
+    VariantState<Events::Generic> m_idle;
+    StateMachine<Events::Generic> m_sm;
+};
+
+/**
+ * A machine with every optional StateMachine feature compiled out.
+ */
+class LeanMachine {
+public:
+    LeanMachine() :
+        m_off(makeState<Event, nullptr, &LeanMachine::off_event, nullptr>("Off", *this)),
+        m_on(makeState<Event, &LeanMachine::on_entry, nullptr, nullptr>("On", *this, &m_off)) {
+        m_sm.initialTransitionTo(m_off);
+    }
+
+    void step(const Event& event) { m_sm.handleEvent(event); }
+
+private:
+    void off_event(const Event& event) { m_sm.transitionTo(m_on); }
+    void on_entry() {}
+
+    State<Event> m_off;
+    State<Event> m_on;
+    StateMachine<Event, LeanStateMachinePolicy> m_sm;
+};
+
+// Stands in for a hardware tick counter (e.g. incremented by SysTick).
+volatile uint32_t g_ticks = 0;
+
+uint64_t readTicks() {
+    return g_ticks;
+}
+
+/**
+ * Transitions from entry() without recursing, so the stack a transition needs is fixed.
+ */
+struct FixedStackPolicy : LeanStateMachinePolicy {
+    static constexpr bool ITERATIVE_TRANSITIONS = true;
+    static constexpr uint32_t TRANSITION_WORK_LIST_SIZE = 2;
+};
+
+class GuardedMachine {
+public:
+    GuardedMachine() :
+        m_idle(makeState<Event, nullptr, &GuardedMachine::idle_event, nullptr>("Idle", *this)),
+        m_running(makeState<Event, &GuardedMachine::running_entry, nullptr, nullptr>("Running", *this)) {
+        m_sm.initialTransitionTo(m_idle);
+    }
+
+    void step(const Event& event) { m_sm.handleEvent(event); }
+
+private:
+    void idle_event(const Event& event) { m_sm.transitionTo(m_running); }
+    void running_entry() {
+        // Entry guard.
+        if (g_ticks == 0) {
+            m_sm.transitionTo(m_idle);
+        }
+    }
+
+    State<Event> m_idle;
+    State<Event> m_running;
+    StateMachine<Event, FixedStackPolicy> m_sm;
+};
+
+struct SelfPostingPolicy : LeanStateMachinePolicy {
+    static constexpr uint32_t INTERNAL_EVENT_QUEUE_SIZE = 2;
+    static constexpr uint32_t DEFERRED_EVENT_POOL_SIZE = 4;
+};
+
+/**
+ * Kicks itself into its first real state by posting an event from entry(), deferring anything
+ * else that arrives while booting.
+ */
+class SelfPostingMachine {
+public:
+    SelfPostingMachine() :
+        m_booting(makeState<Event, &SelfPostingMachine::booting_entry, &SelfPostingMachine::booting_event, nullptr>("Booting", *this)),
+        m_ready(makeState<Event, &SelfPostingMachine::ready_entry, nullptr, nullptr>("Ready", *this)) {
+        m_sm.initialTransitionTo(m_booting);
+    }
+
+    void step(const Event& event) { m_sm.handleEvent(event); }
+
+private:
+    void booting_entry() { m_sm.post(Event{1}); }
+    void booting_event(const Event& event) {
+        if (event.id == 1) {
+            m_sm.transitionTo(m_ready);
+        } else {
+            m_sm.defer(event);
+        }
+    }
+    void ready_entry() { m_sm.recall(); }
+
+    State<Event> m_booting;
+    State<Event> m_ready;
+    StateMachine<Event, SelfPostingPolicy> m_sm;
+};
+
+struct ResumingPolicy : LeanStateMachinePolicy {
+    static constexpr bool HISTORY = true;
+};
+
+/**
+ * Picks up where it left off after a pause, using deep history.
+ */
+class ResumingMachine {
+public:
+    ResumingMachine() :
+        m_paused(makeState<Event, nullptr, &ResumingMachine::paused_event, nullptr>("Paused", *this)),
+        m_active(makeState<Event, nullptr, &ResumingMachine::active_event, nullptr>("Active", *this)),
+        m_fetching(makeState<Event, nullptr, nullptr, nullptr>("Fetching", *this, &m_active)),
+        m_decoding(makeState<Event, nullptr, nullptr, nullptr>("Decoding", *this, &m_active)) {
+        m_sm.initialTransitionTo(m_decoding);
+    }
+
+    void step(const Event& event) { m_sm.handleEvent(event); }
+
+private:
+    void paused_event(const Event& event) { m_sm.transitionToHistory(m_active); }
+    void active_event(const Event& event) { m_sm.transitionTo(m_paused); }
+
+    State<Event> m_paused;
+    State<Event> m_active;
+    State<Event> m_fetching;
+    State<Event> m_decoding;
+    StateMachine<Event, ResumingPolicy> m_sm;
+};
+
+struct ParallelPolicy : LeanStateMachinePolicy {
+    static constexpr uint32_t MAX_REGIONS = 2;
+};
+
+/**
+ * Two independent blinkers in one state machine, as orthogonal regions of Running.
+ */
+class ParallelMachine {
+public:
+    ParallelMachine() :
+        m_running(makeState<Event, nullptr, nullptr, nullptr>("Running", *this)),
+        m_left(makeState<Event, &ParallelMachine::left_entry, nullptr, nullptr>("Left", *this, &m_running)),
+        m_leftOn(makeState<Event, nullptr, &ParallelMachine::leftOn_event, nullptr>("LeftOn", *this, &m_left)),
+        m_leftOff(makeState<Event, nullptr, &ParallelMachine::leftOff_event, nullptr>("LeftOff", *this, &m_left)),
+        m_right(makeState<Event, nullptr, nullptr, nullptr>("Right", *this, &m_running)) {
+        const State<Event>* const regions[] = { &m_left, &m_right };
+        m_sm.setRegions(regions);
+        m_sm.initialTransitionTo(m_running);
+    }
+
+    void step(const Event& event) { m_sm.handleEvent(event); }
+    bool isLeftOn() const { return m_sm.isInState(m_leftOn); }
+
+private:
+    void left_entry() { m_sm.transitionTo(m_leftOn); }
+    void leftOn_event(const Event& event) { m_sm.transitionTo(m_leftOff); }
+    void leftOff_event(const Event& event) { m_sm.transitionTo(m_leftOn); }
+
+    State<Event> m_running;
+    State<Event> m_left;
+    State<Event> m_leftOn;
+    State<Event> m_leftOff;
+    State<Event> m_right;
+    StateMachine<Event, ParallelPolicy> m_sm;
+};
+
+/**
+ * Waits in one state with a timeout that is cancelled automatically if the state is left early.
+ */
+class TimedMachine {
+public:
+    explicit TimedMachine(TimerService<Event>& timers) :
+        m_waiting(makeState<Event, &TimedMachine::waiting_entry, &TimedMachine::waiting_event, nullptr>("Waiting", *this)),
+        m_done(makeState<Event, nullptr, nullptr, nullptr>("Done", *this)),
+        m_timers(timers) {
+        m_sm.initialTransitionTo(m_waiting);
+    }
+
+private:
+    void waiting_entry() {
+        m_timers.startInState(m_timeout, m_sm, m_waiting, Event{2}, 500);
+    }
+    void waiting_event(const Event& event) {
+        m_sm.transitionTo(m_done);
+    }
+
+    State<Event> m_waiting;
+    State<Event> m_done;
+    StateMachine<Event> m_sm;
+    Timer<Event> m_timeout;
+    TimerService<Event>& m_timers;
 };
 
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+/**
+ * Polls for a reply in a coroutine state, giving up after a timeout. The frame comes from a
+ * static pool, so there is no heap use (C++20 builds only).
+ */
+class CoroutineMachine {
+public:
+    explicit CoroutineMachine(TimerService<Event>& timers) :
+        m_polling(makeCoroutineState<Event, &CoroutineMachine::polling_body>("Polling", *this, m_sm, m_framePool)),
+        m_done(makeState<Event, nullptr, nullptr, nullptr>("Done", *this)) {
+        m_polling.setTimerService(timers, m_sm);
+        m_sm.initialTransitionTo(m_polling);
+    }
+
+    void step(const Event& event) {
+        m_sm.handleEvent(event);
+    }
+
+private:
+    static bool isReply(const Event& event) {
+        return event.id == 1;
+    }
+
+    CoroutineBody<Event> polling_body(CoroutineState<Event>& state) {
+        const Event* reply = co_await state.nextEvent(&isReply, Event{2}, 500);
+        m_gotReply = reply != nullptr;
+        m_sm.transitionTo(m_done);
+    }
+
+    CoroutineFramePool<256, 1> m_framePool;
+    CoroutineState<Event> m_polling;
+    State<Event> m_done;
+    StateMachine<Event> m_sm;
+    bool m_gotReply = false;
+};
+#endif
+
 } // namespace
 
 // Exported (non-internal-linkage) entry point so the translation unit produces a symbol and the
@@ -71,4 +395,59 @@ void ninjahsm_compile_check() {
     Machine machine;
     Event event{1};
     machine.step(event);
+
+    uint8_t snapshot[16];
+    Machine restarted;
+    restarted.warmRestart(snapshot, machine.save(snapshot, sizeof(snapshot)));
+
+    StaticMachine staticMachine;
+    staticMachine.step(event);
+
+    LeanMachine leanMachine;
+    leanMachine.step(event);
+
+    GuardedMachine guardedMachine;
+    guardedMachine.step(event);
+
+    SelfPostingMachine selfPostingMachine;
+    selfPostingMachine.step(event);
+
+    ResumingMachine resumingMachine;
+    resumingMachine.step(event);
+    resumingMachine.step(event);
+
+    ParallelMachine parallelMachine;
+    parallelMachine.step(event);
+    (void)parallelMachine.isLeftOn();
+
+    VariantMachine variantMachine;
+    variantMachine.step(Events::Press{ 1 });
+
+    SharedMachine sharedMachines[2] = { SharedMachine(SHARED_TOPOLOGY), SharedMachine(SHARED_TOPOLOGY) };
+    sharedMachines[0].step(event);
+
+    // No data cache on the typical MCU, so don't pad the queue indices out to cache lines.
+    QueuedStateMachine<Event, 4, alignof(uint32_t), SpscEventQueue, LeanStateMachinePolicy> queuedMachine;
+    queuedMachine.postEvent(event);
+    queuedMachine.dispatchPending();
+
+    CooperativeScheduler scheduler;
+    ScheduledStateMachine<Event, 4, alignof(uint32_t), SpscEventQueue, LeanStateMachinePolicy> scheduledMachine;
+    scheduledMachine.attach(scheduler, 1);
+    scheduledMachine.postEvent(event);
+    while (scheduler.runOnce()) {}
+
+    TimerService<Event> timers(TimerService<Event>::ClockDelegate::create<&readTicks>());
+    TimedMachine timedMachine(timers);
+    timers.poll();
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+    CoroutineMachine coroutineMachine(timers);
+    coroutineMachine.step(event);
+#endif
+
+    static FleetDeadlines<100> deadlines;
+    uint64_t expired[FleetDeadlines<100>::NUM_MASK_WORDS];
+    deadlines.arm(42, g_ticks + 10);
+    deadlines.scan(g_ticks, expired);
 }
@@ -1,11 +1,23 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <variant>
 #include <vector>
 
 #include <gtest/gtest.h>
 
 #include <gmock/gmock.h>
 
+#include "NinjaHSM/ActiveStateMachine.hpp"
+#include "NinjaHSM/MpscEventQueue.hpp"
 #include "NinjaHSM/NinjaHSM.hpp"
+#include "NinjaHSM/RegionThreadPool.hpp"
+#include "NinjaHSM/WorkStealingExecutor.hpp"
 
 using namespace NinjaHSM;
 
@@ -258,8 +270,8 @@ public:
         m_stateMachine.initialTransitionTo(state);
     }
 
-    void handleEvent(const Event& event) {
-        m_stateMachine.handleEvent(event);
+    bool handleEvent(const Event& event) {
+        return m_stateMachine.handleEvent(event);
     }
 
     const State<Event>* getCurrentState() {
@@ -274,10 +286,23 @@ public:
         m_stateMachine.transitionTo(state);
     }
 
+    bool finalize() {
+        return m_stateMachine.finalize(m_transitionTable, {
+            &state1, &state1A, &state1B, &state1C, &state2, &state3, &state4, &state4A,
+            &state5, &state5A, &state5A1, &state6, &state6A, &state7, &state8});
+    }
+
+    bool isSealed() const {
+        return m_stateMachine.isSealed();
+    }
+
 private:
     // State machine instance
     StateMachine<Event> m_stateMachine;
 
+    // Only used if finalize() is called
+    TransitionTable<Event, 15> m_transitionTable;
+
     //========================================================================//
     // state1
     //========================================================================//
@@ -748,6 +773,16 @@ TEST(HsmTests, TransitionToStopsBubbleUp) {
     EXPECT_EQ(hsm.state1EventCallCount, 0);
 }
 
+TEST(HsmTests, HandleEventReportsWhetherTheEventWasHandled) {
+    TestHsm hsm;
+    hsm.initialTransitionTo(hsm.state1A);
+
+    EXPECT_FALSE(hsm.handleEvent(Event(EventId::NO_ONE_HANDLES_THIS)));
+    EXPECT_TRUE(hsm.handleEvent(Event(EventId::EVERYONE_HANDLES_THIS)));
+    EXPECT_TRUE(hsm.handleEvent(Event(EventId::GO_TO_STATE_2)));
+    EXPECT_EQ(hsm.getCurrentState(), &hsm.state2);
+}
+
 TEST(HsmTests, EntryGuardsWorkWithTopLevelStates) {
     TestHsm hsm;
 
@@ -1321,3 +1356,3610 @@ TEST(ObserverTests, CanRecoverByTransitioningToAKnownStateAfterMaxRecursionDepth
     EXPECT_EQ(hsm.getCurrentState(), &hsm.parent);
     EXPECT_EQ(hsm.errorCount, errorsAfterTrip);
 }
+
+//============================================================================================//
+// Depth-aware transitions (least common ancestor)
+//============================================================================================//
+
+/**
+ * A deeper HSM used to check that transitions between distant states exit up to, and enter down
+ * from, their least common ancestor. Layout:
+ *
+ *   A
+ *     |-- A1
+ *           |-- A1a
+ *                 |-- A1a1
+ *           |-- A1b
+ *   B
+ *     |-- B1
+ */
+class DeepHsm {
+public:
+    DeepHsm() :
+      a(makeState<Event, nullptr, nullptr, nullptr>("A", *this)),
+      a1(makeState<Event, nullptr, nullptr, nullptr>("A1", *this, &a)),
+      a1a(makeState<Event, nullptr, nullptr, nullptr>("A1a", *this, &a1)),
+      a1a1(makeState<Event, nullptr, nullptr, nullptr>("A1a1", *this, &a1a)),
+      a1b(makeState<Event, nullptr, nullptr, nullptr>("A1b", *this, &a1)),
+      b(makeState<Event, nullptr, nullptr, nullptr>("B", *this)),
+      b1(makeState<Event, nullptr, nullptr, nullptr>("B1", *this, &b)),
+      m_stateMachine() {
+        m_stateMachine.setTransitionObserver(
+            StateMachine<Event>::TransitionObserver::create<DeepHsm, &DeepHsm::onTransition>(*this));
+        m_stateMachine.setErrorObserver(
+            StateMachine<Event>::ErrorObserver::create<DeepHsm, &DeepHsm::onError>(*this));
+    }
+
+    void onTransition(const State<Event>& state, TransitionAction action) {
+        transitions.push_back(std::string(state.name) + (action == TransitionAction::Entry ? ":entry" : ":exit"));
+    }
+    void onError(Error error) {
+        errorCount++;
+        lastError = error;
+    }
+
+    State<Event> a;
+    State<Event> a1;
+    State<Event> a1a;
+    State<Event> a1a1;
+    State<Event> a1b;
+    State<Event> b;
+    State<Event> b1;
+    StateMachine<Event> m_stateMachine;
+
+    std::vector<std::string> transitions;
+    int errorCount = 0;
+    Error lastError = Error::MaxRecursionDepthExceeded;
+};
+
+TEST(DepthTests, StatesRecordTheirDepth) {
+    DeepHsm hsm;
+    EXPECT_EQ(hsm.a.depth, 0);
+    EXPECT_EQ(hsm.a1.depth, 1);
+    EXPECT_EQ(hsm.a1a.depth, 2);
+    EXPECT_EQ(hsm.a1a1.depth, 3);
+    EXPECT_EQ(hsm.a1b.depth, 2);
+    EXPECT_EQ(hsm.b.depth, 0);
+    EXPECT_EQ(hsm.b1.depth, 1);
+}
+
+TEST(DepthTests, TransitionBetweenCousinsStopsAtCommonAncestor) {
+    DeepHsm hsm;
+    hsm.m_stateMachine.initialTransitionTo(hsm.a1a1);
+    EXPECT_THAT(hsm.transitions, ::testing::ElementsAre("A:entry", "A1:entry", "A1a:entry", "A1a1:entry"));
+
+    // A1 is the common ancestor, so neither A nor A1 should be exited or re-entered.
+    hsm.transitions.clear();
+    hsm.m_stateMachine.transitionTo(hsm.a1b);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.a1b);
+    EXPECT_THAT(hsm.transitions, ::testing::ElementsAre("A1a1:exit", "A1a:exit", "A1b:entry"));
+}
+
+TEST(DepthTests, TransitionBetweenUnrelatedBranchesExitsToTheTop) {
+    DeepHsm hsm;
+    hsm.m_stateMachine.initialTransitionTo(hsm.a1a1);
+
+    hsm.transitions.clear();
+    hsm.m_stateMachine.transitionTo(hsm.b1);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.b1);
+    EXPECT_THAT(hsm.transitions,
+        ::testing::ElementsAre("A1a1:exit", "A1a:exit", "A1:exit", "A:exit", "B:entry", "B1:entry"));
+
+    // Transitioning to an ancestor only exits the states below it.
+    hsm.transitions.clear();
+    hsm.m_stateMachine.transitionTo(hsm.b);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.b);
+    EXPECT_THAT(hsm.transitions, ::testing::ElementsAre("B1:exit"));
+}
+
+TEST(DepthTests, ErrorObserverFiresWhenHierarchyIsTooDeep) {
+    DeepHsm hsm;
+    hsm.m_stateMachine.initialTransitionTo(hsm.b);
+
+    // Build a chain of states one level deeper than the state machine supports.
+    std::deque<State<Event>> chain;
+    for (uint32_t i = 0; i < MAX_STATE_DEPTH + 1; i++) {
+        chain.push_back(makeState<Event, nullptr, nullptr, nullptr>("Deep", hsm, i == 0 ? nullptr : &chain.back()));
+    }
+
+    // The transition is abandoned before anything is exited or entered.
+    hsm.transitions.clear();
+    hsm.m_stateMachine.transitionTo(chain.back());
+    EXPECT_EQ(hsm.errorCount, 1);
+    EXPECT_EQ(hsm.lastError, Error::MaxStateDepthExceeded);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.b);
+    EXPECT_TRUE(hsm.transitions.empty());
+
+    // One level less is fine.
+    hsm.m_stateMachine.transitionTo(chain[MAX_STATE_DEPTH - 1]);
+    EXPECT_EQ(hsm.errorCount, 1);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &chain[MAX_STATE_DEPTH - 1]);
+}
+
+//============================================================================================//
+// Sealed state machines (finalize())
+//============================================================================================//
+
+TEST(SealedTests, FinalizeAssignsDenseIndexes) {
+    TestHsm hsm;
+    EXPECT_FALSE(hsm.isSealed());
+    EXPECT_TRUE(hsm.finalize());
+    EXPECT_TRUE(hsm.isSealed());
+    EXPECT_EQ(hsm.state1.index, 0);
+    EXPECT_EQ(hsm.state1A.index, 1);
+    EXPECT_EQ(hsm.state8.index, 14);
+}
+
+TEST(SealedTests, SealedTransitionsKeepEntryAndExitGuardSemantics) {
+    // Repeats the guard scenarios of the HsmTests above, but with the transition table in use.
+    {
+        TestHsm hsm;
+        ASSERT_TRUE(hsm.finalize());
+        hsm.initialTransitionTo(hsm.state1);
+        hsm.handleEvent(Event(EventId::GO_TO_STATE_1B));
+        EXPECT_EQ(hsm.getCurrentState(), &hsm.state1C);
+        EXPECT_EQ(hsm.state1EntryCallCount, 1);
+        EXPECT_EQ(hsm.state1bEntryCallCount, 1);
+        EXPECT_EQ(hsm.state1cEntryCallCount, 1);
+    }
+    {
+        TestHsm hsm;
+        ASSERT_TRUE(hsm.finalize());
+        hsm.initialTransitionTo(hsm.state1);
+        hsm.handleEvent(Event(EventId::GO_TO_STATE_5));
+        EXPECT_EQ(hsm.getCurrentState(), &hsm.state1);
+        EXPECT_EQ(hsm.state1EntryCallCount, 2);
+        EXPECT_EQ(hsm.state5EntryCallCount, 1);
+        EXPECT_EQ(hsm.state5ExitCallCount, 1);
+        EXPECT_EQ(hsm.state5aEntryCallCount, 1);
+        EXPECT_EQ(hsm.state5aExitCallCount, 1);
+        EXPECT_EQ(hsm.state5a1EntryCallCount, 1);
+        EXPECT_EQ(hsm.state5a1ExitCallCount, 0);
+    }
+    {
+        TestHsm hsm;
+        ASSERT_TRUE(hsm.finalize());
+        hsm.initialTransitionTo(hsm.state6);
+        hsm.handleEvent(Event(EventId::GO_TO_STATE_1));
+        EXPECT_EQ(hsm.getCurrentState(), &hsm.state6A);
+        EXPECT_EQ(hsm.state6ExitCallCount, 1);
+        EXPECT_EQ(hsm.state6aEntryCallCount, 1);
+    }
+    {
+        TestHsm hsm;
+        ASSERT_TRUE(hsm.finalize());
+        hsm.initialTransitionTo(hsm.state7);
+        hsm.handleEvent(Event(EventId::GO_TO_STATE_1));
+        EXPECT_EQ(hsm.getCurrentState(), &hsm.state2);
+        EXPECT_EQ(hsm.state7ExitCallCount, 1);
+        EXPECT_EQ(hsm.state2EntryCallCount, 1);
+    }
+    {
+        TestHsm hsm;
+        ASSERT_TRUE(hsm.finalize());
+        hsm.initialTransitionTo(hsm.state1);
+        hsm.handleEvent(Event(EventId::GO_TO_STATE_8));
+        EXPECT_EQ(hsm.getCurrentState(), &hsm.state8);
+        EXPECT_EQ(hsm.state8EntryCallCount, 2);
+        EXPECT_EQ(hsm.state8ExitCallCount, 1);
+    }
+}
+
+TEST(SealedTests, SealedTransitionsMatchUnsealedOrder) {
+    DeepHsm hsm;
+    TransitionTable<Event, 7> table;
+    ASSERT_TRUE(hsm.m_stateMachine.finalize(table, {&hsm.a, &hsm.a1, &hsm.a1a, &hsm.a1a1, &hsm.a1b, &hsm.b, &hsm.b1}));
+
+    hsm.m_stateMachine.initialTransitionTo(hsm.a1a1);
+    hsm.m_stateMachine.transitionTo(hsm.a1b);
+    hsm.m_stateMachine.transitionTo(hsm.b1);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.b1);
+    EXPECT_THAT(hsm.transitions, ::testing::ElementsAre(
+        "A:entry", "A1:entry", "A1a:entry", "A1a1:entry",
+        "A1a1:exit", "A1a:exit", "A1b:entry",
+        "A1b:exit", "A1:exit", "A:exit", "B:entry", "B1:entry"));
+}
+
+TEST(DepthTests, StatesConstructedBeforeTheirParentAreRejected) {
+    DeepHsm hsm;
+    hsm.m_stateMachine.initialTransitionTo(hsm.b1);
+
+    // What A1a1 ends up with if it is constructed before A1a, which is still all zeros then.
+    hsm.a1a1.depth = 1;
+    hsm.transitions.clear();
+    hsm.m_stateMachine.transitionTo(hsm.a1a1);
+    EXPECT_EQ(hsm.errorCount, 1);
+    EXPECT_EQ(hsm.lastError, Error::InvalidHierarchy);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.b1);
+    EXPECT_TRUE(hsm.transitions.empty());
+
+    TransitionTable<Event, 4> table;
+    EXPECT_FALSE(hsm.m_stateMachine.finalize(table, {&hsm.a, &hsm.a1, &hsm.a1a, &hsm.a1a1}));
+    EXPECT_EQ(hsm.lastError, Error::FinalizeFailed);
+
+    // Its siblings and ancestors are fine.
+    hsm.m_stateMachine.transitionTo(hsm.a1a);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.a1a);
+    EXPECT_EQ(hsm.errorCount, 2);
+}
+
+TEST(SealedTests, FinalizeFailsIfParentIsNotRegistered) {
+    DeepHsm hsm;
+    TransitionTable<Event, 2> table;
+    // A1's parent A is missing.
+    EXPECT_FALSE(hsm.m_stateMachine.finalize(table, {&hsm.a1, &hsm.b}));
+    EXPECT_FALSE(hsm.m_stateMachine.isSealed());
+    EXPECT_EQ(hsm.errorCount, 1);
+    EXPECT_EQ(hsm.lastError, Error::FinalizeFailed);
+
+    // The state machine still works, unsealed.
+    hsm.m_stateMachine.initialTransitionTo(hsm.a1a1);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.a1a1);
+}
+
+TEST(SealedTests, FinalizeFailsIfHierarchyIsDeeperThanTable) {
+    DeepHsm hsm;
+    TransitionTable<Event, 4, 3> table;
+    EXPECT_FALSE(hsm.m_stateMachine.finalize(table, {&hsm.a, &hsm.a1, &hsm.a1a, &hsm.a1a1}));
+    EXPECT_EQ(hsm.lastError, Error::FinalizeFailed);
+}
+
+//============================================================================================//
+// StaticStateMachine (compile-time hierarchy)
+//============================================================================================//
+
+/**
+ * An HSM built with StaticStateMachine, mirroring a subset of TestHsm's scenarios. Layout:
+ *
+ *   S1
+ *     |-- S1A     (handles EVERYONE_HANDLES_THIS)
+ *   S2
+ *   S3          (entry guard: always transitions to S1)
+ *   S4          (entry transitions to its child S4A)
+ *     |-- S4A
+ *   S7          (exit overrides the transition and goes to S2)
+ */
+class StaticHsm {
+public:
+    StaticHsm() : m_sm(*this) {}
+
+    void s1_entry() { log.push_back("S1:entry"); }
+    void s1_event(const Event& event) {
+        log.push_back("S1:event");
+        switch (event.id) {
+            case EventId::GO_TO_STATE_1: m_sm.transitionTo<S1>(); break;
+            case EventId::GO_TO_STATE_1A: m_sm.transitionTo<S1A>(); break;
+            case EventId::GO_TO_STATE_2: m_sm.transitionTo<S2>(); break;
+            case EventId::GO_TO_STATE_3: m_sm.transitionTo<S3>(); break;
+            case EventId::GO_TO_STATE_4: m_sm.transitionTo<S4>(); break;
+            case EventId::GO_TO_STATE_7: m_sm.transitionTo<S7>(); break;
+            default: break;
+        }
+    }
+    void s1_exit() { log.push_back("S1:exit"); }
+
+    void s1a_entry() { log.push_back("S1A:entry"); }
+    void s1a_event(const Event& event) {
+        log.push_back("S1A:event");
+        if (event.id == EventId::EVERYONE_HANDLES_THIS) {
+            m_sm.eventHandled();
+        }
+    }
+    void s1a_exit() { log.push_back("S1A:exit"); }
+
+    void s2_entry() { log.push_back("S2:entry"); }
+    void s2_exit() { log.push_back("S2:exit"); }
+
+    void s3_entry() {
+        log.push_back("S3:entry");
+        m_sm.transitionTo<S1>();
+    }
+    void s3_exit() { log.push_back("S3:exit"); }
+
+    void s4_entry() {
+        log.push_back("S4:entry");
+        m_sm.transitionTo<S4A>();
+    }
+    void s4_exit() { log.push_back("S4:exit"); }
+    void s4a_entry() { log.push_back("S4A:entry"); }
+
+    void s7_entry() { log.push_back("S7:entry"); }
+    void s7_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_1) {
+            m_sm.transitionTo<S1>();
+        }
+    }
+    void s7_exit() {
+        log.push_back("S7:exit");
+        m_sm.transitionTo<S2>();
+    }
+
+    using S1 = StaticState<&StaticHsm::s1_entry, &StaticHsm::s1_event, &StaticHsm::s1_exit>;
+    using S1A = StaticState<&StaticHsm::s1a_entry, &StaticHsm::s1a_event, &StaticHsm::s1a_exit, S1>;
+    using S2 = StaticState<&StaticHsm::s2_entry, nullptr, &StaticHsm::s2_exit>;
+    using S3 = StaticState<&StaticHsm::s3_entry, nullptr, &StaticHsm::s3_exit>;
+    using S4 = StaticState<&StaticHsm::s4_entry, nullptr, &StaticHsm::s4_exit>;
+    using S4A = StaticState<&StaticHsm::s4a_entry, nullptr, nullptr, S4>;
+    using S7 = StaticState<&StaticHsm::s7_entry, &StaticHsm::s7_event, &StaticHsm::s7_exit>;
+
+    StaticStateMachine<StaticHsm, Event, S1, S1A, S2, S3, S4, S4A, S7> m_sm;
+    std::vector<std::string> log;
+};
+
+TEST(StaticStateMachineTests, TransitionsAndBubbling) {
+    StaticHsm hsm;
+    EXPECT_EQ(hsm.m_sm.getCurrentStateIndex(), decltype(hsm.m_sm)::NO_STATE);
+    EXPECT_EQ(decltype(hsm.m_sm)::indexOf<StaticHsm::S1A>(), 1);
+
+    EXPECT_FALSE(hsm.m_sm.isInState<StaticHsm::S1>());
+    hsm.m_sm.initialTransitionTo<StaticHsm::S1>();
+    EXPECT_TRUE(hsm.m_sm.isInState<StaticHsm::S1>());
+    EXPECT_FALSE(hsm.m_sm.isInState<StaticHsm::S1A>());
+
+    EXPECT_TRUE(hsm.m_sm.handleEvent(Event(EventId::GO_TO_STATE_1A)));
+    EXPECT_TRUE(hsm.m_sm.isInState<StaticHsm::S1A>());
+    // Ancestors are active too, as with StateMachine::isInState().
+    EXPECT_TRUE(hsm.m_sm.isInState<StaticHsm::S1>());
+    EXPECT_FALSE(hsm.m_sm.isInState<StaticHsm::S2>());
+
+    // Handled by the child, so it does not bubble.
+    hsm.log.clear();
+    EXPECT_TRUE(hsm.m_sm.handleEvent(Event(EventId::EVERYONE_HANDLES_THIS)));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("S1A:event"));
+
+    // Not handled by anyone: bubbles to the top.
+    hsm.log.clear();
+    EXPECT_FALSE(hsm.m_sm.handleEvent(Event(EventId::NO_ONE_HANDLES_THIS)));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("S1A:event", "S1:event"));
+
+    // Bubbles to S1, which transitions to a top-level sibling.
+    hsm.log.clear();
+    hsm.m_sm.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_TRUE(hsm.m_sm.isInState<StaticHsm::S2>());
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("S1A:event", "S1:event", "S1A:exit", "S1:exit", "S2:entry"));
+}
+
+TEST(StaticStateMachineTests, TransitionToSameStateCallsExitEntryAgain) {
+    StaticHsm hsm;
+    hsm.m_sm.initialTransitionTo<StaticHsm::S1>();
+    hsm.log.clear();
+    hsm.m_sm.handleEvent(Event(EventId::GO_TO_STATE_1));
+    EXPECT_TRUE(hsm.m_sm.isInState<StaticHsm::S1>());
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("S1:event", "S1:exit", "S1:entry"));
+}
+
+TEST(StaticStateMachineTests, EntryAndExitGuards) {
+    StaticHsm hsm;
+    hsm.m_sm.initialTransitionTo<StaticHsm::S1>();
+
+    // Entry guard redirecting to a non-child: S3 is treated as never entered (no exit()).
+    hsm.log.clear();
+    hsm.m_sm.handleEvent(Event(EventId::GO_TO_STATE_3));
+    EXPECT_TRUE(hsm.m_sm.isInState<StaticHsm::S1>());
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("S1:event", "S1:exit", "S3:entry", "S1:entry"));
+
+    // Entry transitioning to a child: S4 is treated as entered and is not re-entered.
+    hsm.log.clear();
+    hsm.m_sm.handleEvent(Event(EventId::GO_TO_STATE_4));
+    EXPECT_TRUE(hsm.m_sm.isInState<StaticHsm::S4A>());
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("S1:event", "S1:exit", "S4:entry", "S4A:entry"));
+
+    // Exit guard redirecting to a non-child: S7 is treated as exited and not exited again.
+    StaticHsm hsm2;
+    hsm2.m_sm.initialTransitionTo<StaticHsm::S7>();
+    hsm2.log.clear();
+    hsm2.m_sm.handleEvent(Event(EventId::GO_TO_STATE_1));
+    EXPECT_TRUE(hsm2.m_sm.isInState<StaticHsm::S2>());
+    EXPECT_THAT(hsm2.log, ::testing::ElementsAre("S7:exit", "S2:entry"));
+}
+
+//============================================================================================//
+// SpscEventQueue / QueuedStateMachine
+//============================================================================================//
+
+TEST(SpscEventQueueTests, IsFifoAndRejectsPushesWhenFull) {
+    SpscEventQueue<Event, 4> queue;
+    EXPECT_TRUE(queue.empty());
+    EXPECT_TRUE(queue.push(Event(EventId::GO_TO_STATE_1)));
+    EXPECT_TRUE(queue.push(Event(EventId::GO_TO_STATE_2)));
+    EXPECT_TRUE(queue.push(Event(EventId::GO_TO_STATE_3)));
+    EXPECT_TRUE(queue.push(Event(EventId::GO_TO_STATE_4)));
+    EXPECT_FALSE(queue.push(Event(EventId::GO_TO_STATE_5)));
+    EXPECT_EQ(queue.size(), 4);
+
+    std::vector<EventId> popped;
+    while (queue.pop([&](Event&& event) { popped.push_back(event.id); })) {}
+    EXPECT_THAT(popped, ::testing::ElementsAre(
+        EventId::GO_TO_STATE_1, EventId::GO_TO_STATE_2, EventId::GO_TO_STATE_3, EventId::GO_TO_STATE_4));
+    EXPECT_TRUE(queue.empty());
+
+    // Wrapping around the end of the buffer.
+    EXPECT_TRUE(queue.push(Event(EventId::GO_TO_STATE_6)));
+    EXPECT_TRUE(queue.pop([&](Event&& event) { EXPECT_EQ(event.id, EventId::GO_TO_STATE_6); }));
+    EXPECT_FALSE(queue.pop([&](Event&&) { FAIL(); }));
+}
+
+TEST(SpscEventQueueTests, ProducerAndConsumerOnDifferentThreads) {
+    SpscEventQueue<uint32_t, 64> queue;
+    constexpr uint32_t numEvents = 100000;
+
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < numEvents; i++) {
+            while (!queue.push(i)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    uint32_t expected = 0;
+    while (expected < numEvents) {
+        const bool popped = queue.pop([&](uint32_t&& value) {
+            EXPECT_EQ(value, expected);
+            expected++;
+        });
+        if (!popped) {
+            // Don't starve the producer if it shares our core.
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    EXPECT_TRUE(queue.empty());
+}
+
+/**
+ * Counts events that reach a single state, to check QueuedStateMachine drains into handleEvent().
+ */
+class QueuedHsm {
+public:
+    QueuedHsm() :
+      idle(makeState<Event, nullptr, &QueuedHsm::idle_event, nullptr>("Idle", *this)),
+      running(makeState<Event, nullptr, &QueuedHsm::running_event, nullptr>("Running", *this)) {
+        m_stateMachine.initialTransitionTo(idle);
+    }
+
+    void idle_event(const Event& event) {
+        handled.push_back(event.id);
+        if (event.id == EventId::GO_TO_STATE_2) {
+            m_stateMachine.transitionTo(running);
+        }
+    }
+    void running_event(const Event& event) { handled.push_back(event.id); }
+
+    State<Event> idle;
+    State<Event> running;
+    QueuedStateMachine<Event, 8> m_stateMachine;
+    std::vector<EventId> handled;
+};
+
+TEST(QueuedStateMachineTests, DispatchPendingDrainsInOrder) {
+    QueuedHsm hsm;
+    EXPECT_TRUE(hsm.m_stateMachine.postEvent(Event(EventId::GO_TO_STATE_1)));
+    EXPECT_TRUE(hsm.m_stateMachine.postEvent(Event(EventId::GO_TO_STATE_2)));
+    EXPECT_TRUE(hsm.m_stateMachine.postEvent(Event(EventId::GO_TO_STATE_3)));
+
+    // Nothing is handled until dispatchPending() is called.
+    EXPECT_TRUE(hsm.handled.empty());
+    EXPECT_EQ(hsm.m_stateMachine.numPendingEvents(), 3);
+
+    // maxEvents bounds the work done per call.
+    EXPECT_EQ(hsm.m_stateMachine.dispatchPending(2), 2);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.running);
+    EXPECT_EQ(hsm.m_stateMachine.dispatchPending(), 1);
+    EXPECT_EQ(hsm.m_stateMachine.dispatchPending(), 0);
+    EXPECT_THAT(hsm.handled, ::testing::ElementsAre(EventId::GO_TO_STATE_1, EventId::GO_TO_STATE_2, EventId::GO_TO_STATE_3));
+}
+
+//============================================================================================//
+// MpscEventQueue
+//============================================================================================//
+
+TEST(MpscEventQueueTests, DropPolicyRejectsAndCountsWhenFull) {
+    MpscEventQueue<uint32_t, 4> queue;
+    for (uint32_t i = 0; i < 4; i++) {
+        EXPECT_TRUE(queue.push(i));
+    }
+    EXPECT_FALSE(queue.push(4u));
+    EXPECT_FALSE(queue.push(5u));
+    EXPECT_EQ(queue.getStats().numDropped, 2);
+
+    std::vector<uint32_t> popped;
+    while (queue.pop([&](uint32_t&& value) { popped.push_back(value); })) {}
+    EXPECT_THAT(popped, ::testing::ElementsAre(0, 1, 2, 3));
+    EXPECT_EQ(queue.getStats().highWaterMark, 4);
+
+    queue.resetStats();
+    EXPECT_EQ(queue.getStats().numDropped, 0);
+    EXPECT_EQ(queue.getStats().highWaterMark, 0);
+}
+
+TEST(MpscEventQueueTests, RetryPolicyWaitsForTheConsumer) {
+    MpscEventQueue<uint32_t, 2> queue;
+    queue.setFullQueuePolicy(FullQueuePolicy::Retry);
+    EXPECT_TRUE(queue.push(0u));
+    EXPECT_TRUE(queue.push(1u));
+
+    // The queue is full, so this blocks until the consumer below frees a slot.
+    std::thread producer([&]() { EXPECT_TRUE(queue.push(2u)); });
+
+    std::vector<uint32_t> popped;
+    while (popped.size() < 3) {
+        if (!queue.pop([&](uint32_t&& value) { popped.push_back(value); })) {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    EXPECT_THAT(popped, ::testing::ElementsAre(0, 1, 2));
+    EXPECT_EQ(queue.getStats().numDropped, 0);
+}
+
+/**
+ * Event used to feed a QueuedStateMachine from several producer threads.
+ */
+struct ProducerEvent {
+    uint32_t producer;
+    uint32_t sequence;
+};
+
+/**
+ * Checks that every producer's events arrive complete and in order.
+ */
+class MpscHsm {
+public:
+    MpscHsm() : counting(makeState<ProducerEvent, nullptr, &MpscHsm::counting_event, nullptr>("Counting", *this)) {
+        m_stateMachine.getEventQueue().setFullQueuePolicy(FullQueuePolicy::Retry);
+        m_stateMachine.initialTransitionTo(counting);
+    }
+
+    void counting_event(const ProducerEvent& event) {
+        EXPECT_EQ(event.sequence, nextSequence[event.producer]);
+        nextSequence[event.producer]++;
+        m_stateMachine.eventHandled();
+    }
+
+    State<ProducerEvent> counting;
+    QueuedStateMachine<ProducerEvent, 64, CACHE_LINE_SIZE, MpscEventQueue> m_stateMachine;
+    uint32_t nextSequence[4] = {};
+};
+
+TEST(MpscEventQueueTests, FeedsOneStateMachineFromManyThreads) {
+    MpscHsm hsm;
+    constexpr uint32_t numProducers = 4;
+    constexpr uint32_t numEventsPerProducer = 25000;
+
+    std::vector<std::thread> producers;
+    for (uint32_t producer = 0; producer < numProducers; producer++) {
+        producers.emplace_back([&hsm, producer]() {
+            for (uint32_t i = 0; i < numEventsPerProducer; i++) {
+                hsm.m_stateMachine.postEvent(ProducerEvent{ producer, i });
+            }
+        });
+    }
+
+    size_t numDispatched = 0;
+    while (numDispatched < numProducers * numEventsPerProducer) {
+        const size_t numDispatchedNow = hsm.m_stateMachine.dispatchPending();
+        if (numDispatchedNow == 0) {
+            std::this_thread::yield();
+        }
+        numDispatched += numDispatchedNow;
+    }
+    for (std::thread& producer : producers) {
+        producer.join();
+    }
+
+    for (uint32_t producer = 0; producer < numProducers; producer++) {
+        EXPECT_EQ(hsm.nextSequence[producer], numEventsPerProducer);
+    }
+    const MpscEventQueueStats stats = hsm.m_stateMachine.getEventQueue().getStats();
+    EXPECT_EQ(stats.numDropped, 0);
+    // Producers racing with the consumer never see more than the capacity queued.
+    EXPECT_GE(stats.highWaterMark, 1u);
+    EXPECT_LE(stats.highWaterMark, hsm.m_stateMachine.getEventQueue().capacity());
+}
+
+//============================================================================================//
+// ActiveStateMachine
+//============================================================================================//
+
+/**
+ * Toggles between two states on every event, recording which thread handled the events.
+ */
+class ActiveHsm {
+public:
+    ActiveHsm() :
+      off(makeState<ProducerEvent, nullptr, &ActiveHsm::off_event, nullptr>("Off", *this)),
+      on(makeState<ProducerEvent, nullptr, &ActiveHsm::on_event, nullptr>("On", *this)) {}
+
+    void off_event(const ProducerEvent& event) {
+        record();
+        m_stateMachine.transitionTo(on);
+    }
+    void on_event(const ProducerEvent& event) {
+        record();
+        m_stateMachine.transitionTo(off);
+    }
+
+    void record() {
+        numHandled++;
+        if (std::this_thread::get_id() != workerThreadId) {
+            workerThreadId = std::this_thread::get_id();
+            numThreadChanges++;
+        }
+    }
+
+    State<ProducerEvent> off;
+    State<ProducerEvent> on;
+    uint32_t numHandled = 0;
+    uint32_t numThreadChanges = 0;
+    std::thread::id workerThreadId;
+    ActiveStateMachine<ProducerEvent, 128> m_stateMachine;
+};
+
+// Not even a base class reference gets at handleEvent() or the unwoken QueuedStateMachine::postEvent().
+static_assert(!std::is_convertible<ActiveStateMachine<ProducerEvent, 128>&, StateMachine<ProducerEvent>&>::value,
+    "An ActiveStateMachine must not be usable as a StateMachine.");
+static_assert(!std::is_convertible<ActiveStateMachine<ProducerEvent, 128>&, QueuedStateMachine<ProducerEvent, 128>&>::value,
+    "An ActiveStateMachine must not be usable as a QueuedStateMachine.");
+
+TEST(ActiveStateMachineTests, HandlesEventsFromManyThreadsOnItsOwnThread) {
+    ActiveHsm hsm;
+    hsm.m_stateMachine.getEventQueue().setFullQueuePolicy(FullQueuePolicy::Retry);
+    hsm.m_stateMachine.start(hsm.off);
+    EXPECT_TRUE(hsm.m_stateMachine.isRunning());
+
+    constexpr uint32_t numProducers = 4;
+    constexpr uint32_t numEventsPerProducer = 10000;
+    std::vector<std::thread> producers;
+    for (uint32_t producer = 0; producer < numProducers; producer++) {
+        producers.emplace_back([&hsm, producer]() {
+            for (uint32_t i = 0; i < numEventsPerProducer; i++) {
+                hsm.m_stateMachine.postEvent(ProducerEvent{ producer, i });
+            }
+        });
+    }
+    for (std::thread& producer : producers) {
+        producer.join();
+    }
+
+    // stop() handles everything posted before it was called.
+    hsm.m_stateMachine.stop();
+    EXPECT_FALSE(hsm.m_stateMachine.isRunning());
+    EXPECT_EQ(hsm.numHandled, numProducers * numEventsPerProducer);
+    // An even number of toggles ends up back where it started.
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.off);
+    EXPECT_EQ(hsm.numThreadChanges, 1);
+    EXPECT_NE(hsm.workerThreadId, std::this_thread::get_id());
+}
+
+TEST(ActiveStateMachineTests, WakesUpAfterIdling) {
+    ActiveHsm hsm;
+    hsm.m_stateMachine.start(hsm.off);
+
+    // Give the worker time to park with an empty queue, then make sure a post still wakes it.
+    for (uint32_t i = 0; i < 3; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        EXPECT_TRUE(hsm.m_stateMachine.postEvent(ProducerEvent{ 0, i }));
+    }
+    hsm.m_stateMachine.stop();
+    EXPECT_EQ(hsm.numHandled, 3);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.on);
+}
+
+/**
+ * An ActiveStateMachine that takes submit()ted events: GO_TO_STATE_1 toggles between Off and On,
+ * EVERYONE_HANDLES_THIS is claimed without a transition, and anything else goes unhandled.
+ */
+class SubmitHsm {
+public:
+    SubmitHsm() :
+      off(makeState<Event, nullptr, &SubmitHsm::off_event, nullptr>("Off", *this)),
+      on(makeState<Event, nullptr, &SubmitHsm::on_event, nullptr>("On", *this)) {}
+
+    void off_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_1) {
+            m_stateMachine.transitionTo(on);
+        } else if (event.id == EventId::EVERYONE_HANDLES_THIS) {
+            m_stateMachine.eventHandled();
+        }
+    }
+    void on_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_1) {
+            m_stateMachine.transitionTo(off);
+        } else if (event.id == EventId::EVERYONE_HANDLES_THIS) {
+            m_stateMachine.eventHandled();
+        }
+    }
+
+    State<Event> off;
+    State<Event> on;
+    ActiveStateMachine<Event, 8, MpscEventQueue, 4> m_stateMachine;
+};
+
+TEST(ActiveStateMachineTests, SubmitResolvesWithTheResultingState) {
+    SubmitHsm hsm;
+    hsm.m_stateMachine.start(hsm.off);
+
+    // Posted events ahead of a submitted one are handled first.
+    hsm.m_stateMachine.postEvent(Event(EventId::GO_TO_STATE_1));
+    EventCompletion<Event> completion = hsm.m_stateMachine.submit(Event(EventId::GO_TO_STATE_1));
+    ASSERT_TRUE(completion.isValid());
+    SubmitResult<Event> result = completion.wait();
+    EXPECT_TRUE(completion.isReady());
+    EXPECT_TRUE(result.handled);
+    EXPECT_EQ(result.state, &hsm.off);
+
+    result = hsm.m_stateMachine.submit(Event(EventId::EVERYONE_HANDLES_THIS)).wait();
+    EXPECT_TRUE(result.handled);
+    EXPECT_EQ(result.state, &hsm.off);
+
+    result = hsm.m_stateMachine.submit(Event(EventId::NO_ONE_HANDLES_THIS)).wait();
+    EXPECT_FALSE(result.handled);
+    EXPECT_EQ(result.state, &hsm.off);
+}
+
+TEST(ActiveStateMachineTests, SubmitFailsWhenEveryCompletionSlotIsInUse) {
+    SubmitHsm hsm;
+    std::vector<EventCompletion<Event>> completions;
+    for (uint32_t i = 0; i < 4; i++) {
+        completions.push_back(hsm.m_stateMachine.submit(Event(EventId::GO_TO_STATE_1)));
+        EXPECT_TRUE(completions.back().isValid());
+    }
+    EventCompletion<Event> failed = hsm.m_stateMachine.submit(Event(EventId::GO_TO_STATE_1));
+    EXPECT_FALSE(failed.isValid());
+    EXPECT_FALSE(failed.isReady());
+    EXPECT_EQ(failed.wait().state, nullptr);
+    EXPECT_EQ(hsm.m_stateMachine.numPendingEvents(), 4u);
+
+    // A handle dropped before its event is handled keeps its slot until the event is handled.
+    completions.pop_back();
+    EXPECT_FALSE(hsm.m_stateMachine.submit(Event(EventId::GO_TO_STATE_1)).isValid());
+
+    hsm.m_stateMachine.start(hsm.off);
+    EXPECT_EQ(completions[0].wait().state, &hsm.on);
+    EXPECT_EQ(completions[1].wait().state, &hsm.off);
+    EXPECT_EQ(completions[2].wait().state, &hsm.on);
+    hsm.m_stateMachine.stop();
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.off);
+
+    completions.clear();
+    for (uint32_t i = 0; i < 4; i++) {
+        completions.push_back(hsm.m_stateMachine.submit(Event(EventId::GO_TO_STATE_1)));
+        EXPECT_TRUE(completions.back().isValid());
+    }
+}
+
+TEST(ActiveStateMachineTests, ManyThreadsSubmitAndWait) {
+    SubmitHsm hsm;
+    hsm.m_stateMachine.getEventQueue().setFullQueuePolicy(FullQueuePolicy::Retry);
+    hsm.m_stateMachine.start(hsm.off);
+
+    constexpr uint32_t numSubmitters = 4;
+    constexpr uint32_t numEventsPerSubmitter = 2000;
+    std::atomic<uint32_t> numHandled{0};
+    std::atomic<uint32_t> numFailed{0};
+    std::vector<std::thread> submitters;
+    for (uint32_t submitter = 0; submitter < numSubmitters; submitter++) {
+        submitters.emplace_back([&]() {
+            for (uint32_t i = 0; i < numEventsPerSubmitter; i++) {
+                // Each thread has one handle at a time, so there is always a slot free.
+                const SubmitResult<Event> result = hsm.m_stateMachine.submit(Event(EventId::GO_TO_STATE_1)).wait();
+                if (result.handled && (result.state == &hsm.on || result.state == &hsm.off)) {
+                    numHandled++;
+                } else {
+                    numFailed++;
+                }
+            }
+        });
+    }
+    for (std::thread& submitter : submitters) {
+        submitter.join();
+    }
+    hsm.m_stateMachine.stop();
+    EXPECT_EQ(numHandled.load(), numSubmitters * numEventsPerSubmitter);
+    EXPECT_EQ(numFailed.load(), 0u);
+    EXPECT_EQ(hsm.m_stateMachine.getCurrentState(), &hsm.off);
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+/**
+ * A coroutine that starts straight away and cleans up after itself, for awaiting from a test.
+ */
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+DetachedTask submitTwice(SubmitHsm& hsm, std::vector<SubmitResult<Event>>& results, std::atomic<bool>& done) {
+    results.push_back(co_await hsm.m_stateMachine.submit(Event(EventId::GO_TO_STATE_1)));
+    results.push_back(co_await hsm.m_stateMachine.submit(Event(EventId::NO_ONE_HANDLES_THIS)));
+    done.store(true);
+}
+
+TEST(ActiveStateMachineTests, SubmittedEventsCanBeAwaited) {
+    SubmitHsm hsm;
+    hsm.m_stateMachine.start(hsm.off);
+    std::vector<SubmitResult<Event>> results;
+    std::atomic<bool> done{false};
+    submitTwice(hsm, results, done);
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!done.load() && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::yield();
+    }
+    ASSERT_TRUE(done.load());
+    hsm.m_stateMachine.stop();
+    ASSERT_EQ(results.size(), 2u);
+    EXPECT_TRUE(results[0].handled);
+    EXPECT_EQ(results[0].state, &hsm.on);
+    EXPECT_FALSE(results[1].handled);
+    EXPECT_EQ(results[1].state, &hsm.on);
+}
+#endif
+
+//============================================================================================//
+// CooperativeScheduler
+//============================================================================================//
+
+/**
+ * Several ScheduledStateMachines sharing one CooperativeScheduler. Every handled event is logged
+ * as (machine, event) into a shared log, so tests can check the order across machines.
+ */
+class ScheduledHsm {
+public:
+    ScheduledHsm(uint32_t id, std::vector<std::pair<uint32_t, EventId>>& log) :
+      idle(makeState<Event, nullptr, &ScheduledHsm::idle_event, nullptr>("Idle", *this)),
+      m_id(id),
+      m_log(log) {
+        m_stateMachine.initialTransitionTo(idle);
+    }
+
+    void idle_event(const Event& event) {
+        m_log.push_back({ m_id, event.id });
+        if (forwardTo != nullptr) {
+            forwardTo->m_stateMachine.postEvent(event);
+        }
+    }
+
+    State<Event> idle;
+    ScheduledStateMachine<Event, 8> m_stateMachine;
+    ScheduledHsm* forwardTo = nullptr;
+
+private:
+    uint32_t m_id;
+    std::vector<std::pair<uint32_t, EventId>>& m_log;
+};
+
+TEST(CooperativeSchedulerTests, HighestPriorityRunsFirst) {
+    std::vector<std::pair<uint32_t, EventId>> log;
+    CooperativeScheduler scheduler;
+    ScheduledHsm low(1, log);
+    ScheduledHsm high(2, log);
+    EXPECT_TRUE(low.m_stateMachine.attach(scheduler, 0));
+    EXPECT_TRUE(high.m_stateMachine.attach(scheduler, 31));
+
+    EXPECT_TRUE(scheduler.isIdle());
+    EXPECT_FALSE(scheduler.runOnce());
+
+    EXPECT_TRUE(low.m_stateMachine.postEvent(Event(EventId::GO_TO_STATE_1)));
+    EXPECT_TRUE(low.m_stateMachine.postEvent(Event(EventId::GO_TO_STATE_2)));
+    EXPECT_TRUE(high.m_stateMachine.postEvent(Event(EventId::GO_TO_STATE_3)));
+    EXPECT_FALSE(scheduler.isIdle());
+
+    // One event per step, highest priority first.
+    EXPECT_TRUE(scheduler.runOnce());
+    EXPECT_THAT(log, ::testing::ElementsAre(std::make_pair(2u, EventId::GO_TO_STATE_3)));
+
+    // Posting to a higher-priority machine from a handler makes it run next, ahead of the rest of
+    // the lower-priority machine's queue.
+    low.forwardTo = &high;
+    EXPECT_TRUE(scheduler.runOnce());
+    low.forwardTo = nullptr;
+    EXPECT_TRUE(scheduler.runOnce());
+    EXPECT_TRUE(scheduler.runOnce());
+    EXPECT_FALSE(scheduler.runOnce());
+    EXPECT_TRUE(scheduler.isIdle());
+    EXPECT_THAT(log, ::testing::ElementsAre(
+        std::make_pair(2u, EventId::GO_TO_STATE_3),
+        std::make_pair(1u, EventId::GO_TO_STATE_1),
+        std::make_pair(2u, EventId::GO_TO_STATE_1),
+        std::make_pair(1u, EventId::GO_TO_STATE_2)));
+}
+
+TEST(CooperativeSchedulerTests, RejectsInvalidPriorities) {
+    std::vector<std::pair<uint32_t, EventId>> log;
+    CooperativeScheduler scheduler;
+    ScheduledHsm first(1, log);
+    ScheduledHsm second(2, log);
+    ScheduledHsm unattached(3, log);
+    EXPECT_TRUE(first.m_stateMachine.attach(scheduler, 5));
+    EXPECT_FALSE(second.m_stateMachine.attach(scheduler, 5));
+    EXPECT_FALSE(second.m_stateMachine.attach(scheduler, CooperativeScheduler::MAX_PRIORITY + 1));
+
+    // Events can't be posted to a machine no scheduler will ever run.
+    EXPECT_FALSE(unattached.m_stateMachine.postEvent(Event(EventId::GO_TO_STATE_1)));
+    EXPECT_EQ(unattached.m_stateMachine.numPendingEvents(), 0);
+}
+
+/**
+ * Stands in for an ISR that posts an event and wakes the CPU each time the scheduler goes idle.
+ */
+struct FakeIsr {
+    void onIdle() {
+        EXPECT_TRUE(scheduler.isIdle());
+        if (++numIdleCalls > 3) {
+            scheduler.stop();
+        } else {
+            hsm.m_stateMachine.postEvent(Event(EventId::GO_TO_STATE_1));
+        }
+    }
+
+    CooperativeScheduler& scheduler;
+    ScheduledHsm& hsm;
+    uint32_t numIdleCalls = 0;
+};
+
+TEST(CooperativeSchedulerTests, RunCallsIdleHookUntilStopped) {
+    std::vector<std::pair<uint32_t, EventId>> log;
+    CooperativeScheduler scheduler;
+    ScheduledHsm hsm(1, log);
+    EXPECT_TRUE(hsm.m_stateMachine.attach(scheduler, 3));
+
+    FakeIsr isr{ scheduler, hsm };
+    scheduler.setIdleHook(CooperativeScheduler::IdleHook::create<FakeIsr, &FakeIsr::onIdle>(isr));
+    scheduler.run();
+
+    EXPECT_EQ(isr.numIdleCalls, 4);
+    EXPECT_EQ(log.size(), 3);
+}
+
+//============================================================================================//
+// WorkStealingExecutor
+//============================================================================================//
+
+/**
+ * One member of a fleet run by a WorkStealingExecutor. Checks it is never run on two workers at
+ * once and that every producer's events arrive in order.
+ */
+class ExecutorHsm {
+public:
+    static constexpr uint32_t MAX_PRODUCERS = 4;
+
+    ExecutorHsm() :
+      running(makeState<ProducerEvent, nullptr, &ExecutorHsm::running_event, nullptr>("Running", *this)) {
+        m_stateMachine.initialTransitionTo(running);
+    }
+
+    void running_event(const ProducerEvent& event) {
+        if (inHandler.exchange(true)) {
+            numOverlaps++;
+        }
+        if (event.sequence != nextSequence[event.producer]) {
+            numOutOfOrder++;
+        }
+        nextSequence[event.producer] = event.sequence + 1;
+        numHandled++;
+        threadId = std::this_thread::get_id();
+        if (release != nullptr) {
+            release->store(true);
+        }
+        if (waitFor != nullptr) {
+            started.store(true);
+            while (!waitFor->load()) {
+                std::this_thread::yield();
+            }
+        }
+        inHandler.store(false);
+    }
+
+    State<ProducerEvent> running;
+    ExecutorStateMachine<ProducerEvent, 64> m_stateMachine;
+
+    std::atomic<bool> inHandler{false};
+    uint32_t numOverlaps = 0;
+    uint32_t numOutOfOrder = 0;
+    uint32_t numHandled = 0;
+    uint32_t nextSequence[MAX_PRODUCERS] = {};
+    std::thread::id threadId;
+
+    /**
+     * If set, the handler blocks until this is true (and sets started first).
+     */
+    std::atomic<bool>* waitFor = nullptr;
+    std::atomic<bool> started{false};
+
+    /**
+     * If set, the handler sets this to true.
+     */
+    std::atomic<bool>* release = nullptr;
+};
+
+TEST(WorkStealingExecutorTests, RunsEveryMachineRunToCompletion) {
+    constexpr uint32_t numMachines = 32;
+    constexpr uint32_t numProducers = 2;
+    constexpr uint32_t numEventsPerProducer = 500;
+
+    WorkStealingExecutor<4> executor;
+    executor.setBatchSize(8);
+    ExecutorHsm machines[numMachines];
+    for (ExecutorHsm& machine : machines) {
+        machine.m_stateMachine.getEventQueue().setFullQueuePolicy(FullQueuePolicy::Retry);
+        machine.m_stateMachine.attach(executor);
+    }
+    executor.start();
+    EXPECT_TRUE(executor.isRunning());
+
+    std::vector<std::thread> producers;
+    for (uint32_t producer = 0; producer < numProducers; producer++) {
+        producers.emplace_back([&machines, producer]() {
+            for (uint32_t i = 0; i < numEventsPerProducer; i++) {
+                for (ExecutorHsm& machine : machines) {
+                    EXPECT_TRUE(machine.m_stateMachine.postEvent(ProducerEvent{ producer, i }));
+                }
+            }
+        });
+    }
+    for (std::thread& producer : producers) {
+        producer.join();
+    }
+
+    // stop() handles everything posted before it was called.
+    executor.stop();
+    EXPECT_FALSE(executor.isRunning());
+
+    for (const ExecutorHsm& machine : machines) {
+        EXPECT_EQ(machine.numHandled, numProducers * numEventsPerProducer);
+        EXPECT_EQ(machine.numOverlaps, 0);
+        EXPECT_EQ(machine.numOutOfOrder, 0);
+    }
+    uint64_t numEventsDispatched = 0;
+    for (uint32_t worker = 0; worker < executor.numWorkers(); worker++) {
+        numEventsDispatched += executor.getWorkerStats(worker).numEventsDispatched;
+    }
+    EXPECT_EQ(numEventsDispatched, numMachines * numProducers * numEventsPerProducer);
+}
+
+TEST(WorkStealingExecutorTests, IdleWorkerStealsFromBusyWorker) {
+    WorkStealingExecutor<2> executor;
+    // Homed round-robin: blocked and stolen on worker 0, other on worker 1.
+    ExecutorHsm blocked;
+    ExecutorHsm other;
+    ExecutorHsm stolen;
+    blocked.m_stateMachine.attach(executor);
+    other.m_stateMachine.attach(executor);
+    stolen.m_stateMachine.attach(executor);
+
+    // blocked's handler hogs its worker until stolen's handler runs, so stolen can only run if
+    // the other worker steals it.
+    std::atomic<bool> released{false};
+    blocked.waitFor = &released;
+    stolen.release = &released;
+
+    executor.start();
+    EXPECT_TRUE(blocked.m_stateMachine.postEvent(ProducerEvent{ 0, 0 }));
+    while (!blocked.started.load()) {
+        std::this_thread::yield();
+    }
+    EXPECT_TRUE(stolen.m_stateMachine.postEvent(ProducerEvent{ 0, 0 }));
+    executor.stop();
+
+    EXPECT_EQ(blocked.numHandled, 1);
+    EXPECT_EQ(stolen.numHandled, 1);
+    EXPECT_NE(blocked.threadId, stolen.threadId);
+    EXPECT_GE(executor.getWorkerStats(0).numSteals + executor.getWorkerStats(1).numSteals, 1);
+}
+
+TEST(WorkStealingExecutorTests, PostEventFailsWhenNotAttached) {
+    ExecutorHsm hsm;
+    EXPECT_FALSE(hsm.m_stateMachine.postEvent(ProducerEvent{ 0, 0 }));
+    EXPECT_EQ(hsm.m_stateMachine.numPendingEvents(), 0);
+}
+
+//============================================================================================//
+// SharedStateMachine (shared topology, per-instance context)
+//============================================================================================//
+
+/**
+ * Many instances share one SharedTopology. Each records its own entries/exits.
+ *
+ *   IDLE
+ *   ACTIVE
+ *     |-- ACTIVE_A
+ *     |-- ACTIVE_B
+ *   BOUNCE      (entry() transitions on to ACTIVE_A)
+ */
+class SharedHsm {
+public:
+    enum StateIndex : uint16_t { IDLE, ACTIVE, ACTIVE_A, ACTIVE_B, BOUNCE };
+    static constexpr size_t NUM_STATES = 5;
+    using Topology = SharedTopology<SharedHsm, Event, NUM_STATES>;
+
+    explicit SharedHsm(const Topology& topology) : m_sm(topology) {}
+
+    void idle_exit() { log.push_back("IDLE:exit"); }
+    void idle_event(const Event& event) {
+        switch (event.id) {
+            case EventId::GO_TO_STATE_1A: m_sm.transitionTo(*this, ACTIVE_A); break;
+            case EventId::GO_TO_STATE_1B: m_sm.transitionTo(*this, ACTIVE_B); break;
+            case EventId::GO_TO_STATE_3: m_sm.transitionTo(*this, BOUNCE); break;
+            default: break;
+        }
+    }
+
+    void active_entry() { log.push_back("ACTIVE:entry"); }
+    void active_event(const Event& event) {
+        log.push_back("ACTIVE:event");
+        if (event.id == EventId::GO_TO_STATE_1) {
+            m_sm.transitionTo(*this, IDLE);
+        } else if (event.id == EventId::GO_TO_STATE_1B) {
+            m_sm.transitionTo(*this, ACTIVE_B);
+        }
+    }
+    void active_exit() { log.push_back("ACTIVE:exit"); }
+
+    void active_a_entry() { log.push_back("ACTIVE_A:entry"); }
+    void active_a_exit() { log.push_back("ACTIVE_A:exit"); }
+    void active_b_entry() { log.push_back("ACTIVE_B:entry"); }
+
+    void bounce_entry() {
+        log.push_back("BOUNCE:entry");
+        m_sm.transitionTo(*this, ACTIVE_A);
+    }
+    void bounce_exit() { log.push_back("BOUNCE:exit"); }
+
+    static void onError(SharedHsm& hsm, Error error) {
+        hsm.errors.push_back(error);
+    }
+
+    SharedStateMachine<SharedHsm, Event, NUM_STATES> m_sm;
+    std::vector<std::string> log;
+    std::vector<Error> errors;
+};
+
+constexpr SharedState<SharedHsm, Event> SHARED_STATES[] = {
+    makeSharedState<SharedHsm, Event, nullptr, &SharedHsm::idle_event, &SharedHsm::idle_exit>("Idle"),
+    makeSharedState<SharedHsm, Event, &SharedHsm::active_entry, &SharedHsm::active_event, &SharedHsm::active_exit>("Active"),
+    makeSharedState<SharedHsm, Event, &SharedHsm::active_a_entry, nullptr, &SharedHsm::active_a_exit>("ActiveA", SharedHsm::ACTIVE),
+    makeSharedState<SharedHsm, Event, &SharedHsm::active_b_entry, nullptr, nullptr>("ActiveB", SharedHsm::ACTIVE),
+    makeSharedState<SharedHsm, Event, &SharedHsm::bounce_entry, nullptr, &SharedHsm::bounce_exit>("Bounce"),
+};
+
+constexpr SharedHsm::Topology SHARED_TOPOLOGY(SHARED_STATES, &SharedHsm::onError);
+static_assert(SHARED_TOPOLOGY.isValid(), "SHARED_STATES lists every parent before its children.");
+
+TEST(SharedStateMachineTests, InstancesShareTopologyButNotState) {
+    SharedHsm first(SHARED_TOPOLOGY);
+    SharedHsm second(SHARED_TOPOLOGY);
+    first.m_sm.initialTransitionTo(first, SharedHsm::IDLE);
+    second.m_sm.initialTransitionTo(second, SharedHsm::IDLE);
+
+    // Enter down through the parent, leaving the other instance alone.
+    first.m_sm.handleEvent(first, Event(EventId::GO_TO_STATE_1A));
+    EXPECT_EQ(first.m_sm.getCurrentStateIndex(), SharedHsm::ACTIVE_A);
+    EXPECT_EQ(second.m_sm.getCurrentStateIndex(), SharedHsm::IDLE);
+    EXPECT_THAT(first.log, ::testing::ElementsAre("IDLE:exit", "ACTIVE:entry", "ACTIVE_A:entry"));
+    EXPECT_TRUE(second.log.empty());
+
+    // ACTIVE_A has no event() handler, so this bubbles up to ACTIVE. Only the sibling changes.
+    first.log.clear();
+    EXPECT_TRUE(first.m_sm.handleEvent(first, Event(EventId::GO_TO_STATE_1B)));
+    EXPECT_EQ(first.m_sm.getCurrentStateIndex(), SharedHsm::ACTIVE_B);
+    EXPECT_THAT(first.log, ::testing::ElementsAre("ACTIVE:event", "ACTIVE_A:exit", "ACTIVE_B:entry"));
+
+    first.log.clear();
+    EXPECT_FALSE(first.m_sm.handleEvent(first, Event(EventId::NO_ONE_HANDLES_THIS)));
+    EXPECT_THAT(first.log, ::testing::ElementsAre("ACTIVE:event"));
+
+    EXPECT_STREQ(SHARED_TOPOLOGY.getState(first.m_sm.getCurrentStateIndex()).name, "ActiveB");
+    // A reference to the topology plus a few bytes of bookkeeping, less than a single State.
+    EXPECT_LE(sizeof(first.m_sm), sizeof(void*) + 16);
+    EXPECT_LT(sizeof(first.m_sm), sizeof(State<Event>));
+}
+
+TEST(SharedStateMachineTests, TransitionFromEntryFollowsGuards) {
+    SharedHsm hsm(SHARED_TOPOLOGY);
+    hsm.m_sm.initialTransitionTo(hsm, SharedHsm::IDLE);
+    hsm.m_sm.handleEvent(hsm, Event(EventId::GO_TO_STATE_3));
+    EXPECT_EQ(hsm.m_sm.getCurrentStateIndex(), SharedHsm::ACTIVE_A);
+    // As with StateMachine, BOUNCE never became the current state, so it is not exited.
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("IDLE:exit", "BOUNCE:entry", "ACTIVE:entry", "ACTIVE_A:entry"));
+}
+
+TEST(SharedStateMachineTests, InvalidTopologyReportsError) {
+    const SharedState<SharedHsm, Event> states[] = {
+        // Parent listed after its child.
+        makeSharedState<SharedHsm, Event, nullptr, nullptr, nullptr>("Child", 1),
+        makeSharedState<SharedHsm, Event, nullptr, nullptr, nullptr>("Parent"),
+        makeSharedState<SharedHsm, Event, nullptr, nullptr, nullptr>("Other"),
+        makeSharedState<SharedHsm, Event, nullptr, nullptr, nullptr>("Other"),
+        makeSharedState<SharedHsm, Event, nullptr, nullptr, nullptr>("Other"),
+    };
+    const SharedHsm::Topology topology(states, &SharedHsm::onError);
+    EXPECT_FALSE(topology.isValid());
+
+    SharedHsm hsm(topology);
+    hsm.m_sm.initialTransitionTo(hsm, 0);
+    EXPECT_EQ(hsm.m_sm.getCurrentStateIndex(), NO_SHARED_STATE);
+    EXPECT_THAT(hsm.errors, ::testing::ElementsAre(Error::InvalidTopology));
+
+    // Out of range indexes are rejected too.
+    SharedHsm valid(SHARED_TOPOLOGY);
+    valid.m_sm.initialTransitionTo(valid, SharedHsm::NUM_STATES);
+    EXPECT_EQ(valid.m_sm.getCurrentStateIndex(), NO_SHARED_STATE);
+    EXPECT_THAT(valid.errors, ::testing::ElementsAre(Error::InvalidTopology));
+}
+
+//============================================================================================//
+// StateFleet
+//============================================================================================//
+
+struct FleetCell;
+using CellFleet = StateFleet<FleetCell, Event, 3, 8>;
+
+/**
+ * Per-instance data of a StateFleet. Counts ticks (GO_TO_STATE_1 events) until it reaches its
+ * target, then transitions to DONE.
+ *
+ *   ROOT        (claims EVERYONE_HANDLES_THIS)
+ *     |-- COUNTING
+ *     |-- DONE
+ */
+struct FleetCell {
+    enum StateIndex : uint16_t { ROOT, COUNTING, DONE };
+
+    void root_event(const Event& event) {
+        if (event.id == EventId::EVERYONE_HANDLES_THIS) {
+            if (handledOrder != nullptr) {
+                handledOrder->push_back(fleet->indexOf(*this));
+            }
+            fleet->eventHandled(*this);
+        }
+    }
+    void counting_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_1 && ++ticks >= target) {
+            fleet->transitionTo(*this, DONE);
+        }
+    }
+    void done_entry() { numDoneEntries++; }
+
+    CellFleet* fleet = nullptr;
+    std::vector<size_t>* handledOrder = nullptr;
+    uint32_t target = 0;
+    uint32_t ticks = 0;
+    uint32_t numDoneEntries = 0;
+};
+
+constexpr SharedState<FleetCell, Event> FLEET_CELL_STATES[] = {
+    makeSharedState<FleetCell, Event, nullptr, &FleetCell::root_event, nullptr>("Root"),
+    makeSharedState<FleetCell, Event, nullptr, &FleetCell::counting_event, nullptr>("Counting", FleetCell::ROOT),
+    makeSharedState<FleetCell, Event, &FleetCell::done_entry, nullptr, nullptr>("Done", FleetCell::ROOT),
+};
+
+constexpr CellFleet::Topology FLEET_CELL_TOPOLOGY(FLEET_CELL_STATES);
+
+TEST(StateFleetTests, BroadcastDrivesEveryInstanceIndependently) {
+    FleetCell cells[8];
+    CellFleet fleet(FLEET_CELL_TOPOLOGY, cells);
+    for (size_t i = 0; i < fleet.capacity(); i++) {
+        cells[i].fleet = &fleet;
+        cells[i].target = static_cast<uint32_t>(i % 3) + 1; // 1, 2 or 3 ticks
+    }
+    EXPECT_EQ(fleet.getCurrentStateIndex(0), CellFleet::NO_STATE);
+    fleet.initialTransitionAllTo(FleetCell::COUNTING);
+
+    // Ticks are unhandled (they don't stop bubbling) unless they complete the count.
+    EXPECT_EQ(fleet.broadcast(Event(EventId::GO_TO_STATE_1)), 3); // Instances 0, 3, 6
+    EXPECT_EQ(fleet.getCurrentStateIndex(0), FleetCell::DONE);
+    EXPECT_EQ(fleet.getCurrentStateIndex(1), FleetCell::COUNTING);
+    EXPECT_EQ(fleet.broadcast(Event(EventId::GO_TO_STATE_1)), 3); // Instances 1, 4, 7
+    EXPECT_EQ(fleet.broadcast(Event(EventId::GO_TO_STATE_1)), 2); // Instances 2, 5
+
+    for (size_t i = 0; i < fleet.capacity(); i++) {
+        EXPECT_EQ(fleet.getCurrentStateIndex(i), FleetCell::DONE);
+        EXPECT_EQ(cells[i].numDoneEntries, 1);
+        EXPECT_EQ(cells[i].ticks, cells[i].target);
+    }
+
+    // Bubbles from DONE (no event() handler) up to ROOT, which claims it.
+    EXPECT_EQ(fleet.broadcast(Event(EventId::EVERYONE_HANDLES_THIS)), 8);
+}
+
+TEST(StateFleetTests, BroadcastToRangeAndSingleInstance) {
+    FleetCell cells[8];
+    CellFleet fleet(FLEET_CELL_TOPOLOGY, cells);
+    for (FleetCell& cell : cells) {
+        cell.fleet = &fleet;
+        cell.target = 1;
+    }
+    fleet.initialTransitionAllTo(FleetCell::COUNTING);
+
+    EXPECT_EQ(fleet.broadcast(Event(EventId::GO_TO_STATE_1), 2, 3), 3);
+    for (size_t i = 0; i < fleet.capacity(); i++) {
+        EXPECT_EQ(fleet.getCurrentStateIndex(i), i >= 2 && i < 5 ? FleetCell::DONE : FleetCell::COUNTING);
+    }
+
+    // Ranges are clamped to the end of the fleet.
+    EXPECT_EQ(fleet.broadcast(Event(EventId::GO_TO_STATE_1), 6, 100), 2);
+    EXPECT_EQ(fleet.broadcast(Event(EventId::GO_TO_STATE_1), 100), 0);
+
+    EXPECT_TRUE(fleet.handleEvent(0, Event(EventId::GO_TO_STATE_1)));
+    EXPECT_EQ(fleet.getCurrentStateIndex(0), FleetCell::DONE);
+    EXPECT_EQ(fleet.getCurrentStateIndex(1), FleetCell::COUNTING);
+    EXPECT_EQ(fleet.indexOf(cells[5]), 5);
+}
+
+TEST(StateFleetTests, BroadcastByStateMatchesBroadcast) {
+    FleetCell sequentialCells[8];
+    FleetCell groupedCells[8];
+    CellFleet sequential(FLEET_CELL_TOPOLOGY, sequentialCells);
+    CellFleet grouped(FLEET_CELL_TOPOLOGY, groupedCells);
+    for (size_t i = 0; i < 8; i++) {
+        sequentialCells[i].fleet = &sequential;
+        groupedCells[i].fleet = &grouped;
+        sequentialCells[i].target = groupedCells[i].target = static_cast<uint32_t>(i % 3) + 1;
+    }
+    sequential.initialTransitionAllTo(FleetCell::COUNTING);
+    grouped.initialTransitionAllTo(FleetCell::COUNTING);
+
+    // Transitions made by the handlers (COUNTING -> DONE) land just as they do one by one.
+    for (uint32_t tick = 0; tick < 3; tick++) {
+        EXPECT_EQ(grouped.broadcastByState(Event(EventId::GO_TO_STATE_1)), sequential.broadcast(Event(EventId::GO_TO_STATE_1)));
+        for (size_t i = 0; i < 8; i++) {
+            EXPECT_EQ(grouped.getCurrentStateIndex(i), sequential.getCurrentStateIndex(i));
+            EXPECT_EQ(groupedCells[i].ticks, sequentialCells[i].ticks);
+            EXPECT_EQ(groupedCells[i].numDoneEntries, sequentialCells[i].numDoneEntries);
+        }
+    }
+}
+
+TEST(StateFleetTests, BroadcastByStateHandlesOneGroupAtATime) {
+    FleetCell cells[8];
+    CellFleet fleet(FLEET_CELL_TOPOLOGY, cells);
+    std::vector<size_t> handledOrder;
+    for (size_t i = 0; i < fleet.capacity(); i++) {
+        cells[i].fleet = &fleet;
+        cells[i].handledOrder = &handledOrder;
+        cells[i].target = static_cast<uint32_t>(i % 3) + 1;
+    }
+    // Instance 7 never makes its initial transition, so is skipped.
+    for (size_t i = 0; i < 7; i++) {
+        fleet.initialTransitionTo(i, FleetCell::COUNTING);
+    }
+    fleet.broadcastByState(Event(EventId::GO_TO_STATE_1)); // Instances 0, 3 and 6 are now DONE
+
+    // COUNTING's group first, then DONE's (whose chain skips straight to ROOT), in index order
+    // within each group.
+    EXPECT_EQ(fleet.broadcastByState(Event(EventId::EVERYONE_HANDLES_THIS)), 7);
+    EXPECT_THAT(handledOrder, ::testing::ElementsAre(1, 2, 4, 5, 0, 3, 6));
+}
+
+//============================================================================================//
+// TimerService
+//============================================================================================//
+
+/**
+ * A clock the tests advance by hand.
+ */
+struct VirtualClock {
+    uint64_t read() const {
+        return ticks;
+    }
+
+    uint64_t ticks = 0;
+};
+
+/**
+ * Waits in WAITING for up to 100 ticks: the timeout takes it to TIMED_OUT, GO_TO_STATE_1 to DONE
+ * (leaving the timeout to be cancelled by WAITING's exit).
+ */
+class TimedHsm {
+public:
+    TimedHsm(TimerService<Event>& timers) :
+      waiting(makeState<Event, &TimedHsm::waiting_entry, &TimedHsm::waiting_event, nullptr>("Waiting", *this)),
+      timedOut(makeState<Event, nullptr, nullptr, nullptr>("TimedOut", *this)),
+      done(makeState<Event, nullptr, nullptr, nullptr>("Done", *this)),
+      m_timers(timers) {}
+
+    void waiting_entry() {
+        m_timers.startInState(timeout, stateMachine, waiting, Event(EventId::GO_TO_STATE_2), 100);
+    }
+
+    void waiting_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_2) {
+            stateMachine.transitionTo(timedOut);
+        } else if (event.id == EventId::GO_TO_STATE_1) {
+            stateMachine.transitionTo(done);
+        }
+    }
+
+    State<Event> waiting;
+    State<Event> timedOut;
+    State<Event> done;
+    StateMachine<Event> stateMachine;
+    Timer<Event> timeout;
+
+private:
+    TimerService<Event>& m_timers;
+};
+
+TEST(TimerServiceTests, FiresExactlyAtExpiry) {
+    VirtualClock clock;
+    TimerService<Event> timers(TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock));
+    TimedHsm hsm(timers);
+    hsm.stateMachine.initialTransitionTo(hsm.waiting);
+    EXPECT_TRUE(hsm.timeout.isArmed());
+    EXPECT_EQ(timers.numArmed(), 1u);
+
+    clock.ticks = 99;
+    EXPECT_EQ(timers.poll(), 0u);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.waiting);
+
+    clock.ticks = 100;
+    EXPECT_EQ(timers.poll(), 1u);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.timedOut);
+    EXPECT_FALSE(hsm.timeout.isArmed());
+    EXPECT_EQ(timers.numArmed(), 0u);
+    EXPECT_EQ(hsm.waiting.timers, nullptr);
+}
+
+TEST(TimerServiceTests, CancelledWhenItsStateExits) {
+    VirtualClock clock;
+    TimerService<Event> timers(TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock));
+    TimedHsm hsm(timers);
+    hsm.stateMachine.initialTransitionTo(hsm.waiting);
+
+    clock.ticks = 50;
+    timers.poll();
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_1));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.done);
+    EXPECT_FALSE(hsm.timeout.isArmed());
+    EXPECT_EQ(timers.numArmed(), 0u);
+
+    clock.ticks = 1000;
+    EXPECT_EQ(timers.poll(), 0u);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.done);
+
+    // Re-entering WAITING arms the timeout afresh, from the current tick.
+    hsm.stateMachine.transitionTo(hsm.waiting);
+    EXPECT_EQ(hsm.timeout.getExpiry(), 1100u);
+}
+
+TEST(TimerServiceTests, DestroyingTheServiceCancelsArmedTimers) {
+    VirtualClock clock;
+    auto timers = std::make_unique<TimerService<Event>>(
+        TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock));
+    TimedHsm hsm(*timers);
+    hsm.stateMachine.initialTransitionTo(hsm.waiting);
+    ASSERT_TRUE(hsm.timeout.isArmed());
+
+    timers.reset();
+    EXPECT_FALSE(hsm.timeout.isArmed());
+    EXPECT_EQ(hsm.waiting.timers, nullptr);
+
+    // Exiting the state no longer touches the destroyed service.
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_1));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.done);
+}
+
+/**
+ * Records the tick each timer fires at, indexed by the timer number carried in the event.
+ */
+template <size_t NumLevels>
+class TimerRecorder {
+public:
+    TimerRecorder(TimerService<Event, NumLevels>& timers, std::vector<uint64_t>& firedAt) :
+      idle(makeState<Event, nullptr, &TimerRecorder::idle_event, nullptr>("Idle", *this)),
+      m_timers(timers),
+      m_firedAt(firedAt) {
+        stateMachine.initialTransitionTo(idle);
+    }
+
+    void idle_event(const Event& event) {
+        m_firedAt[event.data1.data] = m_timers.now();
+        stateMachine.eventHandled();
+    }
+
+    State<Event> idle;
+    StateMachine<Event> stateMachine;
+
+private:
+    TimerService<Event, NumLevels>& m_timers;
+    std::vector<uint64_t>& m_firedAt;
+};
+
+/**
+ * Start many timers spread over (and beyond) the whole wheel, advance the clock in uneven steps,
+ * and check that every timer fires exactly at its expiry tick.
+ */
+template <size_t NumLevels>
+void checkManyTimersFireAtExpiry(uint64_t maxDelay) {
+    constexpr size_t NUM_TIMERS = 2000;
+    VirtualClock clock;
+    clock.ticks = 12345; // Not aligned to any slot boundary.
+    TimerService<Event, NumLevels> timers(
+        TimerService<Event, NumLevels>::ClockDelegate::template create<VirtualClock, &VirtualClock::read>(clock));
+    std::vector<uint64_t> firedAt(NUM_TIMERS, 0);
+    TimerRecorder<NumLevels> recorder(timers, firedAt);
+    std::vector<Timer<Event>> timerPool(NUM_TIMERS);
+    std::vector<uint64_t> expiries(NUM_TIMERS);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < NUM_TIMERS; i++) {
+        seed = seed * 1103515245u + 12345u;
+        const uint64_t delay = (seed >> 8) % maxDelay;
+        Event event(EventId::EVENT_WITH_DATA_1);
+        event.data1.data = static_cast<uint32_t>(i);
+        timers.start(timerPool[i], recorder.stateMachine, event, delay);
+        expiries[i] = clock.ticks + (delay == 0 ? 1 : delay);
+    }
+    // Cancel every tenth timer; those must never fire.
+    for (size_t i = 0; i < NUM_TIMERS; i += 10) {
+        EXPECT_TRUE(timerPool[i].cancel());
+    }
+    EXPECT_EQ(timers.numArmed(), NUM_TIMERS - NUM_TIMERS / 10);
+
+    const uint64_t end = clock.ticks + maxDelay + 1;
+    while (clock.ticks < end) {
+        seed = seed * 1103515245u + 12345u;
+        clock.ticks += (seed >> 8) % 97 + 1;
+        timers.poll();
+    }
+    EXPECT_EQ(timers.numArmed(), 0u);
+    for (size_t i = 0; i < NUM_TIMERS; i++) {
+        if (i % 10 == 0) {
+            EXPECT_EQ(firedAt[i], 0u) << "timer " << i;
+        } else {
+            EXPECT_EQ(firedAt[i], expiries[i]) << "timer " << i;
+        }
+    }
+}
+
+TEST(TimerServiceTests, ManyTimersFireExactlyAtExpiry) {
+    checkManyTimersFireAtExpiry<4>(300000);
+}
+
+TEST(TimerServiceTests, TimersBeyondTheWheelAreCascadedUntilDue) {
+    // Two levels cover 4096 ticks, one level 64.
+    checkManyTimersFireAtExpiry<2>(20000);
+    checkManyTimersFireAtExpiry<1>(1000);
+}
+
+//============================================================================================//
+// FleetDeadlines
+//============================================================================================//
+
+/**
+ * Arm most of a fleet's deadlines around @p base and check scan() against a one-by-one comparison
+ * at a range of times, including across the tick counter wrapping around.
+ */
+template <typename Tick>
+void checkScanMatchesReference(Tick base) {
+    using Signed = typename std::make_signed<Tick>::type;
+    constexpr size_t CAPACITY = 1000; // Not a multiple of 64, so the last block is partial.
+    FleetDeadlines<CAPACITY, Tick> deadlines;
+    uint32_t seed = 7;
+    for (size_t i = 0; i < CAPACITY; i++) {
+        seed = seed * 1103515245u + 12345u;
+        if ((seed >> 8) % 10 != 0) {
+            deadlines.arm(i, static_cast<Tick>(base + (seed >> 8) % 2000));
+        }
+    }
+    // Leave one whole block unarmed.
+    for (size_t i = 128; i < 192; i++) {
+        deadlines.disarm(i);
+    }
+
+    uint64_t expired[FleetDeadlines<CAPACITY, Tick>::NUM_MASK_WORDS];
+    for (uint32_t step = 0; step < 60; step++) {
+        const Tick now = static_cast<Tick>(base - 10 + step * 37);
+        size_t numExpected = 0;
+        const size_t numExpired = deadlines.scan(now, expired);
+        for (size_t i = 0; i < CAPACITY; i++) {
+            const bool expected = deadlines.isArmed(i) && static_cast<Signed>(deadlines.getDeadline(i) - now) <= 0;
+            numExpected += expected ? 1 : 0;
+            EXPECT_EQ((expired[i / 64] >> (i % 64)) & 1, expected ? 1u : 0u) << "instance " << i << " at " << now;
+        }
+        EXPECT_EQ(numExpired, numExpected);
+    }
+}
+
+TEST(FleetDeadlinesTests, ScanMatchesOneByOneComparison) {
+    checkScanMatchesReference<uint32_t>(5000);
+    checkScanMatchesReference<uint64_t>(5000);
+}
+
+TEST(FleetDeadlinesTests, ScanHandlesTickWrapAround) {
+    checkScanMatchesReference<uint32_t>(UINT32_MAX - 1000);
+    checkScanMatchesReference<uint64_t>(UINT64_MAX - 1000);
+}
+
+TEST(FleetDeadlinesTests, DispatchExpiredDeliversTimeoutAndDisarms) {
+    FleetCell cells[8];
+    CellFleet fleet(FLEET_CELL_TOPOLOGY, cells);
+    for (FleetCell& cell : cells) {
+        cell.fleet = &fleet;
+        cell.target = 1; // The first timeout completes the count.
+    }
+    fleet.initialTransitionAllTo(FleetCell::COUNTING);
+    FleetDeadlines<8> deadlines;
+    for (size_t i = 0; i < 8; i++) {
+        deadlines.arm(i, static_cast<uint32_t>(10 * i));
+    }
+    deadlines.disarm(1);
+
+    // Instances 0 and 2 have expired (1 was disarmed).
+    EXPECT_EQ(deadlines.dispatchExpired(fleet, 25u, Event(EventId::GO_TO_STATE_1)), 2u);
+    EXPECT_EQ(fleet.getCurrentStateIndex(0), FleetCell::DONE);
+    EXPECT_EQ(fleet.getCurrentStateIndex(1), FleetCell::COUNTING);
+    EXPECT_EQ(fleet.getCurrentStateIndex(2), FleetCell::DONE);
+    EXPECT_EQ(fleet.getCurrentStateIndex(3), FleetCell::COUNTING);
+    EXPECT_FALSE(deadlines.isArmed(0));
+    EXPECT_FALSE(deadlines.isArmed(2));
+    EXPECT_TRUE(deadlines.isArmed(3));
+
+    // Already dispatched, so not again.
+    EXPECT_EQ(deadlines.dispatchExpired(fleet, 25u, Event(EventId::GO_TO_STATE_1)), 0u);
+    EXPECT_EQ(deadlines.dispatchExpired(fleet, 70u, Event(EventId::GO_TO_STATE_1)), 5u);
+    for (size_t i = 0; i < 8; i++) {
+        EXPECT_EQ(fleet.getCurrentStateIndex(i), i == 1 ? FleetCell::COUNTING : FleetCell::DONE);
+    }
+}
+
+//============================================================================================//
+// Event subscription masks
+//============================================================================================//
+
+/**
+ * Three levels, each subscribed to different event kinds (the EventId):
+ *
+ *   Root   (EVERYONE_HANDLES_THIS, GO_TO_STATE_1)
+ *     |-- Middle (GO_TO_STATE_2)
+ *           |-- Leaf  (GO_TO_STATE_1)
+ *
+ * Every handler logs its call, and only Root claims the events it gets.
+ */
+class MaskedHsm {
+public:
+    MaskedHsm() :
+      root(makeState<Event, nullptr, &MaskedHsm::root_event, nullptr>("Root", *this, nullptr,
+        eventMaskOf(EventId::EVERYONE_HANDLES_THIS, EventId::GO_TO_STATE_1))),
+      middle(makeState<Event, nullptr, &MaskedHsm::middle_event, nullptr>("Middle", *this, &root,
+        eventMaskOf(EventId::GO_TO_STATE_2))),
+      leaf(makeState<Event, nullptr, &MaskedHsm::leaf_event, nullptr>("Leaf", *this, &middle,
+        eventMaskOf(EventId::GO_TO_STATE_1))) {
+        stateMachine.setUnhandledEventObserver(
+            StateMachine<Event>::UnhandledEventObserver::create<MaskedHsm, &MaskedHsm::onUnhandledEvent>(*this));
+        stateMachine.initialTransitionTo(leaf);
+    }
+
+    uint8_t kindOf(const Event& event) const {
+        return static_cast<uint8_t>(event.id);
+    }
+
+    void enableMasks() {
+        stateMachine.setEventKindSelector(
+            StateMachine<Event>::EventKindSelector::create<MaskedHsm, &MaskedHsm::kindOf>(*this));
+    }
+
+    void root_event(const Event& event) {
+        log.push_back("Root");
+        stateMachine.eventHandled();
+    }
+    void middle_event(const Event& event) { log.push_back("Middle"); }
+    void leaf_event(const Event& event) { log.push_back("Leaf"); }
+    void onUnhandledEvent(const Event& event) { log.push_back("Unhandled"); }
+
+    State<Event> root;
+    State<Event> middle;
+    State<Event> leaf;
+    StateMachine<Event> stateMachine;
+    std::vector<std::string> log;
+};
+
+TEST(EventMaskTests, BubblingSkipsStatesNotSubscribed) {
+    MaskedHsm hsm;
+    hsm.enableMasks();
+
+    hsm.stateMachine.handleEvent(Event(EventId::EVERYONE_HANDLES_THIS));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("Root"));
+
+    hsm.log.clear();
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_1));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("Leaf", "Root"));
+
+    hsm.log.clear();
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("Middle", "Unhandled"));
+}
+
+TEST(EventMaskTests, EventNoStateSubscribesToGoesStraightToUnhandled) {
+    MaskedHsm hsm;
+    hsm.enableMasks();
+    EXPECT_EQ(hsm.leaf.bubbleMask, hsm.root.eventMask | hsm.middle.eventMask | hsm.leaf.eventMask);
+
+    hsm.stateMachine.handleEvent(Event(EventId::NO_ONE_HANDLES_THIS));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("Unhandled"));
+}
+
+TEST(EventMaskTests, WithoutSelectorEveryHandlerIsCalled) {
+    MaskedHsm hsm;
+    hsm.stateMachine.handleEvent(Event(EventId::NO_ONE_HANDLES_THIS));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("Leaf", "Middle", "Root"));
+}
+
+namespace VariantEvents {
+struct Tick {};
+struct Press { uint32_t button; };
+struct Release { uint32_t button; };
+using Generic = std::variant<Tick, Press, Release>;
+}
+
+/**
+ * A parent subscribed to Tick and a child subscribed to Press, with a std::variant event type.
+ */
+class VariantMaskedHsm {
+public:
+    VariantMaskedHsm() :
+      parent(makeState<VariantEvents::Generic, nullptr, &VariantMaskedHsm::parent_event, nullptr>("Parent", *this, nullptr,
+        variantEventMask<VariantEvents::Generic, VariantEvents::Tick>())),
+      child(makeState<VariantEvents::Generic, nullptr, &VariantMaskedHsm::child_event, nullptr>("Child", *this, &parent,
+        variantEventMask<VariantEvents::Generic, VariantEvents::Press>())) {
+        stateMachine.setEventKindSelector(StateMachine<VariantEvents::Generic>::EventKindSelector::create<
+            &variantEventKind<VariantEvents::Generic>>());
+        stateMachine.initialTransitionTo(child);
+    }
+
+    void parent_event(const VariantEvents::Generic& event) { numParentCalls++; }
+    void child_event(const VariantEvents::Generic& event) { numChildCalls++; }
+
+    State<VariantEvents::Generic> parent;
+    State<VariantEvents::Generic> child;
+    StateMachine<VariantEvents::Generic> stateMachine;
+    uint32_t numParentCalls = 0;
+    uint32_t numChildCalls = 0;
+};
+
+TEST(EventMaskTests, VariantAlternativesAreEventKinds) {
+    EXPECT_EQ((variantEventMask<VariantEvents::Generic, VariantEvents::Press, VariantEvents::Release>()), 0b110u);
+
+    VariantMaskedHsm hsm;
+    hsm.stateMachine.handleEvent(VariantEvents::Tick{});
+    hsm.stateMachine.handleEvent(VariantEvents::Press{ 1 });
+    hsm.stateMachine.handleEvent(VariantEvents::Release{ 1 });
+    EXPECT_EQ(hsm.numChildCalls, 1u); // Press
+    EXPECT_EQ(hsm.numParentCalls, 1u); // Tick. Press bubbles up unclaimed, but Parent isn't subscribed.
+}
+
+//============================================================================================//
+// VariantState
+//============================================================================================//
+
+/**
+ * A parent handling Tick and Release and a child handling Press, each with one handler per
+ * alternative.
+ */
+class VariantDispatchHsm {
+public:
+    VariantDispatchHsm() :
+      parent(makeVariantState<VariantEvents::Generic, nullptr, nullptr,
+        &VariantDispatchHsm::parent_onTick, &VariantDispatchHsm::parent_onRelease>("Parent", *this)),
+      child(makeVariantState<VariantEvents::Generic, &VariantDispatchHsm::child_entry, nullptr,
+        &VariantDispatchHsm::child_onPress>("Child", *this, &parent)) {
+        stateMachine.initialTransitionTo(child);
+    }
+
+    void parent_onTick(const VariantEvents::Tick& tick) { log.push_back("Parent:Tick"); }
+    void parent_onRelease(const VariantEvents::Release& release) {
+        log.push_back("Parent:Release " + std::to_string(release.button));
+    }
+    void child_entry() { log.push_back("Child:entry"); }
+    void child_onPress(const VariantEvents::Press& press) {
+        log.push_back("Child:Press " + std::to_string(press.button));
+        stateMachine.eventHandled();
+    }
+
+    VariantState<VariantEvents::Generic> parent;
+    VariantState<VariantEvents::Generic> child;
+    StateMachine<VariantEvents::Generic> stateMachine;
+    std::vector<std::string> log;
+};
+
+TEST(VariantStateTests, DispatchesEachAlternativeToItsHandler) {
+    VariantDispatchHsm hsm;
+    hsm.stateMachine.handleEvent(VariantEvents::Press{ 3 });
+    hsm.stateMachine.handleEvent(VariantEvents::Release{ 4 });
+    hsm.stateMachine.handleEvent(VariantEvents::Tick{});
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "Child:entry",
+        "Child:Press 3",
+        "Parent:Release 4", // The child has no Release handler, so it bubbled up.
+        "Parent:Tick"));
+}
+
+TEST(VariantStateTests, EventMaskIsTheHandledAlternatives) {
+    VariantDispatchHsm hsm;
+    EXPECT_EQ(hsm.parent.eventMask, (variantEventMask<VariantEvents::Generic, VariantEvents::Tick, VariantEvents::Release>()));
+    EXPECT_EQ(hsm.child.eventMask, (variantEventMask<VariantEvents::Generic, VariantEvents::Press>()));
+
+    // With the selector set, the same events reach the same handlers.
+    hsm.stateMachine.setEventKindSelector(StateMachine<VariantEvents::Generic>::EventKindSelector::create<
+        &variantEventKind<VariantEvents::Generic>>());
+    hsm.stateMachine.handleEvent(VariantEvents::Release{ 1 });
+    hsm.stateMachine.handleEvent(VariantEvents::Press{ 2 });
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("Child:entry", "Parent:Release 1", "Child:Press 2"));
+}
+
+//============================================================================================//
+// StateMachine policies
+//============================================================================================//
+
+/**
+ * A parent with two children, where entering CHILD_B bounces straight back to CHILD_A (an entry
+ * guard), and PING/PONG whose entries transition to each other forever. Parameterised on the
+ * state machine's policy.
+ */
+template <typename Policy>
+class PolicyHsm {
+public:
+    PolicyHsm() :
+      parent(makeState<Event, &PolicyHsm::parent_entry, &PolicyHsm::parent_event, &PolicyHsm::parent_exit>("Parent", *this)),
+      childA(makeState<Event, &PolicyHsm::childA_entry, nullptr, &PolicyHsm::childA_exit>("ChildA", *this, &parent)),
+      childB(makeState<Event, &PolicyHsm::childB_entry, nullptr, nullptr>("ChildB", *this, &parent)),
+      ping(makeState<Event, &PolicyHsm::ping_entry, nullptr, nullptr>("Ping", *this)),
+      pong(makeState<Event, &PolicyHsm::pong_entry, nullptr, nullptr>("Pong", *this)) {}
+
+    void parent_entry() { log.push_back("Parent:entry"); }
+    void parent_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_1B) {
+            stateMachine.transitionTo(childB);
+        } else if (event.id == EventId::GO_TO_STATE_2) {
+            stateMachine.transitionTo(ping);
+        }
+    }
+    void parent_exit() { log.push_back("Parent:exit"); }
+    void childA_entry() { log.push_back("ChildA:entry"); }
+    void childA_exit() { log.push_back("ChildA:exit"); }
+    void childB_entry() {
+        log.push_back("ChildB:entry");
+        stateMachine.transitionTo(childA);
+    }
+    void ping_entry() {
+        numPingPongs++;
+        stateMachine.transitionTo(pong);
+    }
+    void pong_entry() {
+        numPingPongs++;
+        stateMachine.transitionTo(ping);
+    }
+    void onError(Error error) { errors.push_back(error); }
+
+    State<Event> parent;
+    State<Event> childA;
+    State<Event> childB;
+    State<Event> ping;
+    State<Event> pong;
+    StateMachine<Event, Policy> stateMachine;
+    std::vector<std::string> log;
+    std::vector<Error> errors;
+    uint32_t numPingPongs = 0;
+};
+
+// The queued front-ends pass their policy on to the state machine.
+static_assert(std::is_base_of<StateMachine<Event, LeanStateMachinePolicy>,
+    QueuedStateMachine<Event, 8, CACHE_LINE_SIZE, SpscEventQueue, LeanStateMachinePolicy>>::value, "QueuedStateMachine");
+static_assert(std::is_base_of<StateMachine<Event, LeanStateMachinePolicy>,
+    ScheduledStateMachine<Event, 8, CACHE_LINE_SIZE, SpscEventQueue, LeanStateMachinePolicy>>::value, "ScheduledStateMachine");
+static_assert(std::is_base_of<StateMachine<Event, LeanStateMachinePolicy>,
+    ExecutorStateMachine<Event, 8, MpscEventQueue, LeanStateMachinePolicy>>::value, "ExecutorStateMachine");
+static_assert(std::is_base_of<StateMachine<Event, LeanStateMachinePolicy>,
+    ActiveStateMachine<Event, 8, MpscEventQueue, 0, LeanStateMachinePolicy>>::value, "ActiveStateMachine");
+
+TEST(StateMachinePolicyTests, LeanPolicyIsSmallerAndBehavesTheSame) {
+    // Three observers, the event kind selector and the transition table view are compiled out.
+    EXPECT_GE(sizeof(StateMachine<Event>) - sizeof(StateMachine<Event, LeanStateMachinePolicy>),
+        4 * sizeof(StateMachine<Event>::ErrorObserver) + 3 * sizeof(void*));
+
+    PolicyHsm<StateMachinePolicy> fullHsm;
+    PolicyHsm<LeanStateMachinePolicy> leanHsm;
+    fullHsm.stateMachine.initialTransitionTo(fullHsm.childA);
+    leanHsm.stateMachine.initialTransitionTo(leanHsm.childA);
+    fullHsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_1B));
+    leanHsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_1B));
+
+    EXPECT_THAT(leanHsm.log, ::testing::ElementsAre(
+        "Parent:entry", "ChildA:entry",
+        "ChildA:exit", "ChildB:entry", // The guard in ChildB's entry() sends us back to ChildA
+        "ChildA:entry"));
+    EXPECT_EQ(leanHsm.log, fullHsm.log);
+    EXPECT_EQ(leanHsm.stateMachine.getCurrentState(), &leanHsm.childA);
+    EXPECT_FALSE(leanHsm.stateMachine.isSealed());
+}
+
+struct ShallowRecursionPolicy : StateMachinePolicy {
+    static constexpr uint32_t RECURSION_LIMIT = 4;
+};
+
+TEST(StateMachinePolicyTests, RecursionLimitComesFromThePolicy) {
+    PolicyHsm<ShallowRecursionPolicy> hsm;
+    hsm.stateMachine.setErrorObserver(
+        StateMachine<Event, ShallowRecursionPolicy>::ErrorObserver::create<
+            PolicyHsm<ShallowRecursionPolicy>, &PolicyHsm<ShallowRecursionPolicy>::onError>(hsm));
+    hsm.stateMachine.initialTransitionTo(hsm.childA);
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+
+    // The transition to PING is call 1, so PING and PONG's entries make calls 2 to 5.
+    EXPECT_EQ(hsm.numPingPongs, 4u);
+    EXPECT_THAT(hsm.errors, ::testing::ElementsAre(Error::MaxRecursionDepthExceeded));
+
+    // Recovers like the default policy.
+    hsm.stateMachine.transitionTo(hsm.childA);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.childA);
+}
+
+//============================================================================================//
+// Iterative transition engine
+//============================================================================================//
+
+struct IterativePolicy : StateMachinePolicy {
+    static constexpr bool ITERATIVE_TRANSITIONS = true;
+};
+
+/**
+ * Large enough that the scripted scenarios below never run out, so any difference from the
+ * recursive engine would be a difference in semantics.
+ */
+struct RoomyIterativePolicy : IterativePolicy {
+    static constexpr uint32_t TRANSITION_WORK_LIST_SIZE = 64;
+};
+
+struct TinyWorkListPolicy : IterativePolicy {
+    static constexpr uint32_t TRANSITION_WORK_LIST_SIZE = 2;
+};
+
+/**
+ * An HSM whose entry()/exit() methods call transitionTo() according to a script, so the same
+ * scenario can be replayed with each transition engine. The hierarchy is:
+ *
+ *     S0           S4          S7
+ *     +-- S1       +-- S5
+ *     +-- S2           +-- S6
+ *         +-- S3
+ */
+template <typename Policy>
+class ScriptedHsm {
+public:
+    static constexpr size_t NUM_STATES = 8;
+
+    /**
+     * A transitionTo() that an entry()/exit() makes the first `times` times it runs.
+     */
+    struct Action {
+        int8_t target = -1;
+        uint8_t times = 0;
+    };
+
+    struct Script {
+        Action entry[2];
+        Action exit[2];
+    };
+
+    ScriptedHsm() :
+      states{
+        makeState<Event, &ScriptedHsm::onEntry<0>, nullptr, &ScriptedHsm::onExit<0>>("S0", *this),
+        makeState<Event, &ScriptedHsm::onEntry<1>, nullptr, &ScriptedHsm::onExit<1>>("S1", *this, &states[0]),
+        makeState<Event, &ScriptedHsm::onEntry<2>, nullptr, &ScriptedHsm::onExit<2>>("S2", *this, &states[0]),
+        makeState<Event, &ScriptedHsm::onEntry<3>, nullptr, &ScriptedHsm::onExit<3>>("S3", *this, &states[2]),
+        makeState<Event, &ScriptedHsm::onEntry<4>, nullptr, &ScriptedHsm::onExit<4>>("S4", *this),
+        makeState<Event, &ScriptedHsm::onEntry<5>, nullptr, &ScriptedHsm::onExit<5>>("S5", *this, &states[4]),
+        makeState<Event, &ScriptedHsm::onEntry<6>, nullptr, &ScriptedHsm::onExit<6>>("S6", *this, &states[5]),
+        makeState<Event, &ScriptedHsm::onEntry<7>, nullptr, &ScriptedHsm::onExit<7>>("S7", *this)} {
+        stateMachine.setErrorObserver(
+            StateMachine<Event, Policy>::ErrorObserver::template create<ScriptedHsm, &ScriptedHsm::onError>(*this));
+    }
+
+    void transitionTo(size_t state) {
+        stateMachine.transitionTo(states[state]);
+        log.push_back(std::string("now ") + (stateMachine.getCurrentState() ? stateMachine.getCurrentState()->name : "-"));
+    }
+
+    template <size_t Index>
+    void onEntry() {
+        log.push_back(std::string(states[Index].name) + ":entry");
+        perform(scripts[Index].entry);
+    }
+
+    template <size_t Index>
+    void onExit() {
+        log.push_back(std::string(states[Index].name) + ":exit");
+        perform(scripts[Index].exit);
+    }
+
+    /**
+     * Decides which transitions to make before making any, since the engines differ in whether
+     * the transitions the first call leads to run before or after the second call.
+     */
+    void perform(Action (&actions)[2]) {
+        const bool first = actions[0].times > 0;
+        const bool second = actions[1].times > 0;
+        actions[0].times -= first ? 1 : 0;
+        actions[1].times -= second ? 1 : 0;
+        if (first) {
+            stateMachine.transitionTo(states[actions[0].target]);
+        }
+        if (second) {
+            stateMachine.transitionTo(states[actions[1].target]);
+        }
+    }
+
+    void onError(Error error) {
+        log.push_back("error " + std::to_string(static_cast<int>(error)));
+    }
+
+    State<Event> states[NUM_STATES];
+    Script scripts[NUM_STATES];
+    StateMachine<Event, Policy> stateMachine;
+    std::vector<std::string> log;
+};
+
+TEST(IterativeTransitionTests, GuardSemanticsMatchTheRecursiveEngine) {
+    using Recursive = ScriptedHsm<StateMachinePolicy>;
+    using Iterative = ScriptedHsm<IterativePolicy>;
+
+    // Each scenario: a state's entry()/exit() transitions elsewhere, as in the HsmTests above.
+    struct Scenario {
+        const char * description;
+        size_t from;
+        size_t to;
+        size_t scriptedState;
+        bool inEntry;
+        int8_t target;
+    };
+    const Scenario scenarios[] = {
+        { "entry guard to an unrelated state", 7, 3, 3, true, 7 },
+        { "entry guard to a sibling", 1, 3, 2, true, 1 },
+        { "entry to a child", 7, 2, 2, true, 3 },
+        { "entry to itself", 7, 3, 3, true, 3 },
+        { "exit to a child", 5, 7, 5, false, 6 },
+        { "exit to the parent", 6, 7, 6, false, 5 },
+        { "exit to an unrelated state", 3, 4, 2, false, 7 },
+    };
+    for (const Scenario& scenario : scenarios) {
+        auto run = [&scenario](auto& hsm) {
+            auto& action = scenario.inEntry
+                ? hsm.scripts[scenario.scriptedState].entry[0]
+                : hsm.scripts[scenario.scriptedState].exit[0];
+            action.target = scenario.target;
+            action.times = 1;
+            hsm.transitionTo(scenario.from);
+            hsm.transitionTo(scenario.to);
+        };
+        Recursive recursive;
+        Iterative iterative;
+        run(recursive);
+        run(iterative);
+        EXPECT_EQ(iterative.log, recursive.log) << scenario.description;
+    }
+}
+
+TEST(IterativeTransitionTests, ChainedTransitionsInEntryFunctions) {
+    ScriptedHsm<IterativePolicy> hsm;
+    // Like State5 -> 5A -> 5A1 -> State1 in ChainedTransitionToInEntryFunctions.
+    hsm.scripts[4].entry[0] = { 5, 1 };
+    hsm.scripts[5].entry[0] = { 6, 1 };
+    hsm.scripts[6].entry[0] = { 0, 1 };
+    hsm.transitionTo(7);
+    hsm.log.clear();
+
+    hsm.transitionTo(4);
+    // S6 transitioned away from its own entry(), so it is never exited.
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "S7:exit", "S4:entry", "S5:entry", "S6:entry", "S5:exit", "S4:exit", "S0:entry", "now S0"));
+}
+
+TEST(IterativeTransitionTests, MultipleTransitionsFromOneEntryRunInCallOrder) {
+    // S2's entry() transitions twice; the first transition's own nested one runs before the second.
+    auto run = [](auto& hsm) {
+        hsm.scripts[2].entry[0] = { 4, 1 };
+        hsm.scripts[2].entry[1] = { 1, 1 };
+        hsm.scripts[4].entry[0] = { 7, 1 };
+        hsm.transitionTo(1);
+        hsm.transitionTo(2);
+    };
+    ScriptedHsm<IterativePolicy> hsm;
+    ScriptedHsm<StateMachinePolicy> reference;
+    run(hsm);
+    run(reference);
+
+    EXPECT_EQ(hsm.log, reference.log);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.states[1]);
+}
+
+TEST(IterativeTransitionTests, RandomScriptsMatchTheRecursiveEngine) {
+    uint32_t seed = 12345;
+    auto random = [&seed](uint32_t range) {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 8) % range;
+    };
+    for (int scenario = 0; scenario < 2000; scenario++) {
+        ScriptedHsm<StateMachinePolicy> recursive;
+        ScriptedHsm<RoomyIterativePolicy> iterative;
+        for (size_t state = 0; state < ScriptedHsm<StateMachinePolicy>::NUM_STATES; state++) {
+            for (int slot = 0; slot < 4; slot++) {
+                if (random(10) < 3) {
+                    const int8_t target = static_cast<int8_t>(random(8));
+                    const uint8_t times = static_cast<uint8_t>(1 + random(2));
+                    (slot < 2 ? recursive.scripts[state].entry[slot] : recursive.scripts[state].exit[slot - 2]) = { target, times };
+                    (slot < 2 ? iterative.scripts[state].entry[slot] : iterative.scripts[state].exit[slot - 2]) = { target, times };
+                }
+            }
+        }
+        for (int step = 0; step < 5; step++) {
+            const size_t target = random(8);
+            recursive.transitionTo(target);
+            iterative.transitionTo(target);
+        }
+        ASSERT_EQ(iterative.log, recursive.log) << "scenario " << scenario;
+    }
+}
+
+TEST(IterativeTransitionTests, LongChainsNeedOnlyTwoWorkListSlots) {
+    // Bounces between PING and PONG from their entries until the recursion limit: 50 nested
+    // transitions, with the stack depth of one.
+    PolicyHsm<TinyWorkListPolicy> hsm;
+    hsm.stateMachine.setErrorObserver(
+        StateMachine<Event, TinyWorkListPolicy>::ErrorObserver::create<
+            PolicyHsm<TinyWorkListPolicy>, &PolicyHsm<TinyWorkListPolicy>::onError>(hsm));
+    hsm.stateMachine.initialTransitionTo(hsm.childA);
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+
+    EXPECT_EQ(hsm.numPingPongs, MAX_RECURSION_COUNT);
+    EXPECT_THAT(hsm.errors, ::testing::ElementsAre(Error::MaxRecursionDepthExceeded));
+    hsm.stateMachine.transitionTo(hsm.childA);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.childA);
+}
+
+TEST(IterativeTransitionTests, FullWorkListIsReported) {
+    ScriptedHsm<TinyWorkListPolicy> hsm;
+    // Two transitions from one entry() need three slots.
+    hsm.scripts[1].entry[0] = { 7, 1 };
+    hsm.scripts[1].entry[1] = { 4, 1 };
+    hsm.transitionTo(1);
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "S0:entry", "S1:entry", "error 0", "S0:exit", "S7:entry", "now S7"));
+}
+
+//============================================================================================//
+// post() (internal events)
+//============================================================================================//
+
+struct RtcPolicy : StateMachinePolicy {
+    static constexpr uint32_t INTERNAL_EVENT_QUEUE_SIZE = 3;
+};
+
+/**
+ * Posts events to itself: IDLE's entry() posts GO_TO_STATE_1 (to start up), and BUSY's event()
+ * posts a follow-up for each GO_TO_STATE_2.
+ */
+class RtcHsm {
+public:
+    RtcHsm() :
+      idle(makeState<Event, &RtcHsm::idle_entry, &RtcHsm::idle_event, nullptr>("Idle", *this)),
+      busy(makeState<Event, nullptr, &RtcHsm::busy_event, &RtcHsm::busy_exit>("Busy", *this)) {}
+
+    void idle_entry() {
+        log.push_back("Idle:entry");
+        stateMachine.post(Event(EventId::GO_TO_STATE_1));
+    }
+    void idle_event(const Event& event) {
+        log.push_back("Idle:" + std::to_string(static_cast<int>(event.id)));
+        if (event.id == EventId::GO_TO_STATE_1) {
+            stateMachine.transitionTo(busy);
+        }
+    }
+    void busy_event(const Event& event) {
+        log.push_back("Busy:" + std::to_string(static_cast<int>(event.id)));
+        if (event.id == EventId::GO_TO_STATE_2) {
+            // Handled after this event, before the next external one.
+            stateMachine.post(Event(EventId::GO_TO_STATE_3));
+        } else if (event.id == EventId::GO_TO_STATE_4) {
+            for (int i = 0; i < 4; i++) {
+                postResults.push_back(stateMachine.post(Event(EventId::GO_TO_STATE_5)));
+            }
+        } else if (event.id == EventId::GO_TO_STATE_1A) {
+            stateMachine.transitionTo(idle);
+        }
+        stateMachine.eventHandled();
+    }
+    void busy_exit() { log.push_back("Busy:exit"); }
+
+    State<Event> idle;
+    State<Event> busy;
+    StateMachine<Event, RtcPolicy> stateMachine;
+    std::vector<std::string> log;
+    std::vector<bool> postResults;
+};
+
+TEST(PostTests, EventsPostedByEntryRunAfterTheInitialTransition) {
+    RtcHsm hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.idle);
+    // IDLE's entry() posted GO_TO_STATE_1, which was handled before initialTransitionTo() returned.
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.busy);
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("Idle:entry", "Idle:" + std::to_string(static_cast<int>(EventId::GO_TO_STATE_1))));
+}
+
+TEST(PostTests, PostedEventsRunToCompletionBeforeHandleEventReturns) {
+    RtcHsm hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.idle);
+    hsm.log.clear();
+
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "Busy:" + std::to_string(static_cast<int>(EventId::GO_TO_STATE_2)),
+        "Busy:" + std::to_string(static_cast<int>(EventId::GO_TO_STATE_3))));
+
+    // BUSY's event() transitions to IDLE, whose entry() posts GO_TO_STATE_1 to go straight back.
+    hsm.log.clear();
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_1A));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "Busy:" + std::to_string(static_cast<int>(EventId::GO_TO_STATE_1A)),
+        "Busy:exit", "Idle:entry",
+        "Idle:" + std::to_string(static_cast<int>(EventId::GO_TO_STATE_1))));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.busy);
+}
+
+TEST(PostTests, EventsPostedWhileIdleGoBeforeTheNextExternalEvent) {
+    RtcHsm hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.busy);
+    hsm.log.clear();
+    hsm.stateMachine.post(Event(EventId::GO_TO_STATE_3));
+    EXPECT_TRUE(hsm.log.empty());
+
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_5));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "Busy:" + std::to_string(static_cast<int>(EventId::GO_TO_STATE_3)),
+        "Busy:" + std::to_string(static_cast<int>(EventId::GO_TO_STATE_5))));
+}
+
+TEST(PostTests, PostFailsWhenTheQueueIsFull) {
+    RtcHsm hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.busy);
+    hsm.log.clear();
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_4));
+    EXPECT_THAT(hsm.postResults, ::testing::ElementsAre(true, true, true, false));
+    EXPECT_EQ(hsm.log.size(), 4u); // GO_TO_STATE_4 and three of the four GO_TO_STATE_5s.
+}
+
+TEST(PostTests, PostedEventsAreDestroyed) {
+    // Leftover events are destroyed with the state machine.
+    struct CountedEvent {
+        explicit CountedEvent(int* live) : live(live) { (*live)++; }
+        CountedEvent(const CountedEvent& other) : live(other.live) { (*live)++; }
+        ~CountedEvent() { (*live)--; }
+        int* live;
+    };
+    int live = 0;
+    {
+        StateMachine<CountedEvent, RtcPolicy> stateMachine;
+        stateMachine.post(CountedEvent(&live));
+        stateMachine.post(CountedEvent(&live));
+        EXPECT_EQ(live, 2);
+    }
+    EXPECT_EQ(live, 0);
+}
+
+//============================================================================================//
+// defer() / recall()
+//============================================================================================//
+
+struct DeferringPolicy : StateMachinePolicy {
+    static constexpr uint32_t DEFERRED_EVENT_POOL_SIZE = 3;
+};
+
+/**
+ * A protocol that defers data (EVENT_WITH_DATA_1) until its handshake completes (GO_TO_STATE_2),
+ * and defers it again while paused (GO_TO_STATE_3).
+ */
+class HandshakeHsm {
+public:
+    HandshakeHsm() :
+      handshake(makeState<Event, nullptr, &HandshakeHsm::handshake_event, nullptr>("Handshake", *this)),
+      connected(makeState<Event, &HandshakeHsm::connected_entry, &HandshakeHsm::connected_event, nullptr>("Connected", *this)),
+      paused(makeState<Event, nullptr, &HandshakeHsm::paused_event, nullptr>("Paused", *this)) {
+        stateMachine.setUnhandledEventObserver(
+            StateMachine<Event, DeferringPolicy>::UnhandledEventObserver::create<HandshakeHsm, &HandshakeHsm::onUnhandled>(*this));
+    }
+
+    static Event data(uint32_t value) {
+        Event event(EventId::EVENT_WITH_DATA_1);
+        event.data1.data = value;
+        return event;
+    }
+
+    void handshake_event(const Event& event) {
+        if (event.id == EventId::EVENT_WITH_DATA_1) {
+            deferResults.push_back(stateMachine.defer(event));
+        } else if (event.id == EventId::GO_TO_STATE_2) {
+            stateMachine.transitionTo(connected);
+        }
+    }
+    void connected_entry() {
+        numRecalled += stateMachine.recall();
+    }
+    void connected_event(const Event& event) {
+        if (event.id == EventId::EVENT_WITH_DATA_1) {
+            received.push_back(event.data1.data);
+            if (event.data1.data == pauseAfter) {
+                stateMachine.transitionTo(paused);
+            }
+        }
+    }
+    void paused_event(const Event& event) {
+        if (event.id == EventId::EVENT_WITH_DATA_1) {
+            stateMachine.defer(event);
+        } else if (event.id == EventId::GO_TO_STATE_2) {
+            stateMachine.transitionTo(connected);
+        }
+    }
+    void onUnhandled(const Event& event) { numUnhandled++; }
+
+    State<Event> handshake;
+    State<Event> connected;
+    State<Event> paused;
+    StateMachine<Event, DeferringPolicy> stateMachine;
+    std::vector<bool> deferResults;
+    std::vector<uint32_t> received;
+    uint32_t numRecalled = 0;
+    uint32_t numUnhandled = 0;
+    uint32_t pauseAfter = UINT32_MAX;
+};
+
+TEST(DeferTests, RecalledEventsAreHandledInOrderAfterTheTransition) {
+    HandshakeHsm hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.handshake);
+    hsm.stateMachine.handleEvent(HandshakeHsm::data(1));
+    hsm.stateMachine.handleEvent(HandshakeHsm::data(2));
+    EXPECT_EQ(hsm.stateMachine.numDeferred(), 2u);
+    EXPECT_TRUE(hsm.received.empty());
+    EXPECT_EQ(hsm.numUnhandled, 0u); // Deferring counts as handling.
+
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_EQ(hsm.numRecalled, 2u);
+    EXPECT_THAT(hsm.received, ::testing::ElementsAre(1u, 2u));
+    EXPECT_EQ(hsm.stateMachine.numDeferred(), 0u);
+}
+
+TEST(DeferTests, EventsDeferredAgainWaitForTheNextRecall) {
+    HandshakeHsm hsm;
+    hsm.pauseAfter = 1;
+    hsm.stateMachine.initialTransitionTo(hsm.handshake);
+    for (uint32_t value = 1; value <= 3; value++) {
+        hsm.stateMachine.handleEvent(HandshakeHsm::data(value));
+    }
+
+    // Data 1 pauses the connection, so 2 and 3 are deferred again by PAUSED (still in order).
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_THAT(hsm.received, ::testing::ElementsAre(1u));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.paused);
+    EXPECT_EQ(hsm.stateMachine.numDeferred(), 2u);
+
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_THAT(hsm.received, ::testing::ElementsAre(1u, 2u, 3u));
+    EXPECT_EQ(hsm.numRecalled, 5u);
+}
+
+TEST(DeferTests, RecallFromEntryOutsideHandleEventWaitsForTheTransitionToComplete) {
+    // A standalone transitionTo(): CONNECTED's entry() recalls while the transition is still in
+    // progress, so the events must wait until CONNECTED is the current state.
+    {
+        HandshakeHsm hsm;
+        hsm.stateMachine.initialTransitionTo(hsm.handshake);
+        hsm.stateMachine.handleEvent(HandshakeHsm::data(1));
+        hsm.stateMachine.handleEvent(HandshakeHsm::data(2));
+        hsm.stateMachine.transitionTo(hsm.connected);
+        EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.connected);
+        EXPECT_THAT(hsm.received, ::testing::ElementsAre(1u, 2u));
+        EXPECT_EQ(hsm.stateMachine.numDeferred(), 0u);
+    }
+    // The same from initialTransitionTo(), e.g. when restarting a state machine that still has
+    // deferred events.
+    {
+        HandshakeHsm hsm;
+        hsm.stateMachine.initialTransitionTo(hsm.handshake);
+        hsm.stateMachine.handleEvent(HandshakeHsm::data(1));
+        hsm.stateMachine.initialTransitionTo(hsm.connected);
+        EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.connected);
+        EXPECT_THAT(hsm.received, ::testing::ElementsAre(1u));
+    }
+}
+
+TEST(DeferTests, DeferFailsWhenThePoolIsFull) {
+    HandshakeHsm hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.handshake);
+    for (uint32_t value = 1; value <= 4; value++) {
+        hsm.stateMachine.handleEvent(HandshakeHsm::data(value));
+    }
+    EXPECT_THAT(hsm.deferResults, ::testing::ElementsAre(true, true, true, false));
+    // The event that could not be deferred was not marked as handled.
+    EXPECT_EQ(hsm.numUnhandled, 1u);
+
+    hsm.stateMachine.discardDeferred();
+    EXPECT_EQ(hsm.stateMachine.numDeferred(), 0u);
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_TRUE(hsm.received.empty());
+}
+
+//============================================================================================//
+// History
+//============================================================================================//
+
+/**
+ * A player that remembers where it was when it was switched off:
+ *
+ *     Off        On
+ *                +-- Stopped
+ *                +-- Playing
+ *                    +-- Track1
+ *                    +-- Track2
+ */
+class HistoryHsm {
+public:
+    HistoryHsm() :
+      off(makeState<Event, &HistoryHsm::off_entry, nullptr, nullptr>("Off", *this)),
+      on(makeState<Event, &HistoryHsm::on_entry, nullptr, &HistoryHsm::on_exit>("On", *this)),
+      stopped(makeState<Event, &HistoryHsm::stopped_entry, nullptr, nullptr>("Stopped", *this, &on)),
+      playing(makeState<Event, &HistoryHsm::playing_entry, nullptr, nullptr>("Playing", *this, &on)),
+      track1(makeState<Event, &HistoryHsm::track1_entry, nullptr, nullptr>("Track1", *this, &playing)),
+      track2(makeState<Event, &HistoryHsm::track2_entry, nullptr, nullptr>("Track2", *this, &playing)) {}
+
+    void off_entry() { log.push_back("Off"); }
+    void on_entry() { log.push_back("On"); }
+    void on_exit() {}
+    void stopped_entry() { log.push_back("Stopped"); }
+    void playing_entry() { log.push_back("Playing"); }
+    void track1_entry() { log.push_back("Track1"); }
+    void track2_entry() { log.push_back("Track2"); }
+
+    State<Event> off;
+    State<Event> on;
+    State<Event> stopped;
+    State<Event> playing;
+    State<Event> track1;
+    State<Event> track2;
+    StateMachine<Event> stateMachine;
+    std::vector<std::string> log;
+};
+
+TEST(HistoryTests, DeepHistoryRestoresTheLastActiveLeaf) {
+    HistoryHsm hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.track2);
+    hsm.stateMachine.transitionTo(hsm.off);
+    hsm.log.clear();
+
+    hsm.stateMachine.transitionToHistory(hsm.on, History::Deep);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.track2);
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("On", "Playing", "Track2"));
+    EXPECT_EQ(hsm.on.deepHistory, &hsm.track2);
+    EXPECT_EQ(hsm.on.shallowHistory, &hsm.playing);
+    EXPECT_EQ(hsm.playing.shallowHistory, &hsm.track2);
+}
+
+TEST(HistoryTests, ShallowHistoryRestoresTheLastActiveChildOnly) {
+    HistoryHsm hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.track1);
+    hsm.stateMachine.transitionTo(hsm.off);
+    hsm.log.clear();
+
+    hsm.stateMachine.transitionToHistory(hsm.on, History::Shallow);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.playing);
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("On", "Playing"));
+}
+
+TEST(HistoryTests, HistoryStopsAtAStateThatWasTheDeepestActiveState) {
+    HistoryHsm hsm;
+    // Never exited: no history, so ON itself is entered.
+    hsm.stateMachine.initialTransitionTo(hsm.off);
+    hsm.stateMachine.transitionToHistory(hsm.on);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.on);
+
+    // PLAYING was the deepest state (its track had already been exited) when ON was exited, so
+    // deep history is PLAYING, not the track PLAYING last had.
+    hsm.stateMachine.transitionTo(hsm.track1);
+    hsm.stateMachine.transitionTo(hsm.playing);
+    hsm.stateMachine.transitionTo(hsm.off);
+    hsm.stateMachine.transitionToHistory(hsm.on);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.playing);
+
+    // Switching off straight from STOPPED.
+    hsm.stateMachine.transitionTo(hsm.stopped);
+    hsm.stateMachine.transitionTo(hsm.off);
+    hsm.stateMachine.transitionToHistory(hsm.on);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.stopped);
+}
+
+//============================================================================================//
+// Orthogonal Regions
+//============================================================================================//
+
+struct RegionPolicy : StateMachinePolicy {
+    static constexpr uint32_t MAX_REGIONS = 2;
+};
+
+struct IterativeRegionPolicy : RegionPolicy {
+    static constexpr bool ITERATIVE_TRANSITIONS = true;
+};
+
+/**
+ * A keyboard with two orthogonal regions:
+ *
+ *     Off        Keyboard
+ *                +-- Caps (region)      +-- Num (region)
+ *                    +-- CapsOff            +-- NumOff
+ *                    +-- CapsOn             +-- NumOn
+ *
+ * Each region's entry() transitions to its "off" state as the initial state. GO_TO_STATE_4 and
+ * GO_TO_STATE_6 toggle caps and num lock, EVERYONE_HANDLES_THIS is a key press both regions
+ * handle, GO_TO_STATE_5 leaves Keyboard from CapsOn, GO_TO_STATE_7 makes Caps restart Keyboard's
+ * regions, and Keyboard leaves on GO_TO_STATE_3.
+ */
+template <typename Policy>
+class RegionHsm {
+public:
+    RegionHsm() :
+      off(makeState<Event, &RegionHsm::off_entry, &RegionHsm::off_event, &RegionHsm::off_exit>("Off", *this)),
+      keyboard(makeState<Event, &RegionHsm::keyboard_entry, &RegionHsm::keyboard_event, &RegionHsm::keyboard_exit>("Keyboard", *this)),
+      caps(makeState<Event, &RegionHsm::caps_entry, &RegionHsm::caps_event, &RegionHsm::caps_exit>("Caps", *this, &keyboard)),
+      capsOff(makeState<Event, &RegionHsm::capsOff_entry, &RegionHsm::capsOff_event, &RegionHsm::capsOff_exit>("CapsOff", *this, &caps)),
+      capsOn(makeState<Event, &RegionHsm::capsOn_entry, &RegionHsm::capsOn_event, &RegionHsm::capsOn_exit>("CapsOn", *this, &caps)),
+      num(makeState<Event, &RegionHsm::num_entry, nullptr, &RegionHsm::num_exit>("Num", *this, &keyboard)),
+      numOff(makeState<Event, &RegionHsm::numOff_entry, &RegionHsm::numOff_event, &RegionHsm::numOff_exit>("NumOff", *this, &num)),
+      numOn(makeState<Event, &RegionHsm::numOn_entry, &RegionHsm::numOn_event, &RegionHsm::numOn_exit>("NumOn", *this, &num)) {
+        stateMachine.setUnhandledEventObserver(
+            StateMachine<Event, Policy>::UnhandledEventObserver::template create<RegionHsm, &RegionHsm::onUnhandledEvent>(*this));
+        stateMachine.setErrorObserver(
+            StateMachine<Event, Policy>::ErrorObserver::template create<RegionHsm, &RegionHsm::onError>(*this));
+        const State<Event>* const regions[] = { &caps, &num };
+        EXPECT_TRUE(stateMachine.setRegions(regions));
+    }
+
+    void off_entry() { log.push_back("Off:entry"); }
+    void off_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_1) {
+            stateMachine.transitionTo(keyboard);
+        }
+    }
+    void off_exit() { log.push_back("Off:exit"); }
+
+    void keyboard_entry() { log.push_back("Keyboard:entry"); }
+    void keyboard_event(const Event& event) {
+        log.push_back("Keyboard:event");
+        if (event.id == EventId::GO_TO_STATE_3) {
+            stateMachine.transitionTo(off);
+        }
+    }
+    void keyboard_exit() { log.push_back("Keyboard:exit"); }
+
+    void caps_entry() {
+        log.push_back("Caps:entry");
+        stateMachine.transitionTo(capsOff);
+    }
+    void caps_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_7) {
+            stateMachine.transitionTo(keyboard);
+        }
+    }
+    void caps_exit() { log.push_back("Caps:exit"); }
+
+    void capsOff_entry() { log.push_back("CapsOff:entry"); }
+    void capsOff_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_4) {
+            stateMachine.transitionTo(capsOn);
+        } else if (event.id == EventId::EVERYONE_HANDLES_THIS) {
+            log.push_back("CapsOff:key");
+            stateMachine.eventHandled();
+        }
+    }
+    void capsOff_exit() { log.push_back("CapsOff:exit"); }
+
+    void capsOn_entry() { log.push_back("CapsOn:entry"); }
+    void capsOn_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_4) {
+            stateMachine.transitionTo(capsOff);
+        } else if (event.id == EventId::GO_TO_STATE_5) {
+            stateMachine.transitionTo(off);
+        } else if (event.id == EventId::EVERYONE_HANDLES_THIS) {
+            log.push_back("CapsOn:key");
+            stateMachine.eventHandled();
+        }
+    }
+    void capsOn_exit() { log.push_back("CapsOn:exit"); }
+
+    void num_entry() {
+        log.push_back("Num:entry");
+        stateMachine.transitionTo(numOff);
+    }
+    void num_exit() { log.push_back("Num:exit"); }
+
+    void numOff_entry() { log.push_back("NumOff:entry"); }
+    void numOff_event(const Event& event) {
+        log.push_back("NumOff:event");
+        if (event.id == EventId::GO_TO_STATE_6) {
+            stateMachine.transitionTo(numOn);
+        } else if (event.id == EventId::EVERYONE_HANDLES_THIS) {
+            stateMachine.eventHandled();
+        }
+    }
+    void numOff_exit() { log.push_back("NumOff:exit"); }
+
+    void numOn_entry() { log.push_back("NumOn:entry"); }
+    void numOn_event(const Event& event) {
+        log.push_back("NumOn:event");
+        if (event.id == EventId::GO_TO_STATE_6) {
+            stateMachine.transitionTo(numOff);
+        } else if (event.id == EventId::EVERYONE_HANDLES_THIS) {
+            stateMachine.eventHandled();
+        }
+    }
+    void numOn_exit() { log.push_back("NumOn:exit"); }
+
+    void onUnhandledEvent(const Event& event) { log.push_back("Unhandled"); }
+    void onError(Error error) { errors.push_back(error); }
+
+    State<Event> off;
+    State<Event> keyboard;
+    State<Event> caps;
+    State<Event> capsOff;
+    State<Event> capsOn;
+    State<Event> num;
+    State<Event> numOff;
+    State<Event> numOn;
+    StateMachine<Event, Policy> stateMachine;
+    std::vector<std::string> log;
+    std::vector<Error> errors;
+};
+
+TEST(RegionTests, EnteringAnOrthogonalStateEntersEveryRegion) {
+    RegionHsm<RegionPolicy> hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.keyboard);
+
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "Keyboard:entry", "Caps:entry", "CapsOff:entry", "Num:entry", "NumOff:entry"));
+    EXPECT_EQ(hsm.stateMachine.getRegionState(0), &hsm.capsOff);
+    EXPECT_EQ(hsm.stateMachine.getRegionState(1), &hsm.numOff);
+    EXPECT_TRUE(hsm.stateMachine.isInState(hsm.keyboard));
+    EXPECT_TRUE(hsm.stateMachine.isInState(hsm.caps));
+    EXPECT_TRUE(hsm.stateMachine.isInState(hsm.capsOff));
+    EXPECT_TRUE(hsm.stateMachine.isInState(hsm.numOff));
+    EXPECT_FALSE(hsm.stateMachine.isInState(hsm.numOn));
+    EXPECT_FALSE(hsm.stateMachine.isInState(hsm.off));
+    EXPECT_TRUE(hsm.errors.empty());
+}
+
+TEST(RegionTests, EachEventIsOfferedToEveryRegionInOrder) {
+    RegionHsm<RegionPolicy> hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.keyboard);
+    hsm.log.clear();
+
+    hsm.stateMachine.handleEvent(Event(EventId::EVERYONE_HANDLES_THIS));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("CapsOff:key", "NumOff:event"));
+
+    // Only the num lock region transitions; caps lock stays where it was.
+    hsm.log.clear();
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_4));
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_6));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "CapsOff:exit", "CapsOn:entry", "NumOff:event",
+        "NumOff:event", "NumOff:exit", "NumOn:entry"));
+    EXPECT_EQ(hsm.stateMachine.getRegionState(0), &hsm.capsOn);
+    EXPECT_EQ(hsm.stateMachine.getRegionState(1), &hsm.numOn);
+}
+
+TEST(RegionTests, EventsNoRegionHandlesBubbleFromTheOrthogonalStateOnce) {
+    RegionHsm<RegionPolicy> hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.keyboard);
+    hsm.log.clear();
+
+    hsm.stateMachine.handleEvent(Event(EventId::NO_ONE_HANDLES_THIS));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("NumOff:event", "Keyboard:event", "Unhandled"));
+
+    // An event a region handles does not reach the orthogonal state.
+    hsm.log.clear();
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_4));
+    EXPECT_THAT(hsm.log, ::testing::Not(::testing::Contains("Keyboard:event")));
+}
+
+TEST(RegionTests, LeavingAnOrthogonalStateExitsEveryRegionLastFirst) {
+    RegionHsm<RegionPolicy> hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.keyboard);
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_4));
+    hsm.log.clear();
+
+    // From a region: the regions after it do not get the event, they are exited.
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_5));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "NumOff:exit", "Num:exit", "CapsOn:exit", "Caps:exit", "Keyboard:exit", "Off:entry"));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.off);
+    EXPECT_EQ(hsm.stateMachine.getRegionState(0), nullptr);
+    EXPECT_FALSE(hsm.stateMachine.isInState(hsm.keyboard));
+
+    // From the orthogonal state itself.
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_1));
+    hsm.log.clear();
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_3));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "NumOff:event", "Keyboard:event",
+        "NumOff:exit", "Num:exit", "CapsOff:exit", "Caps:exit", "Keyboard:exit", "Off:entry"));
+}
+
+TEST(RegionTests, TransitionIntoARegionEntersTheOtherRegions) {
+    RegionHsm<RegionPolicy> hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.off);
+    hsm.log.clear();
+
+    // The destination's region is entered first, then the others in order.
+    hsm.stateMachine.transitionTo(hsm.num);
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "Off:exit", "Keyboard:entry", "Num:entry", "NumOff:entry", "Caps:entry", "CapsOff:entry"));
+    EXPECT_EQ(hsm.stateMachine.getRegionState(0), &hsm.capsOff);
+    EXPECT_EQ(hsm.stateMachine.getRegionState(1), &hsm.numOff);
+}
+
+TEST(RegionTests, TransitionToTheOrthogonalStateRestartsItsRegions) {
+    RegionHsm<RegionPolicy> hsm;
+    hsm.stateMachine.initialTransitionTo(hsm.keyboard);
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_4));
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_6));
+    hsm.log.clear();
+
+    // Like any transition to an ancestor, Keyboard itself is not exited. Num, restarted by Caps,
+    // does not get the event.
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_7));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "NumOn:exit", "Num:exit", "CapsOn:exit", "Caps:exit",
+        "Caps:entry", "CapsOff:entry", "Num:entry", "NumOff:entry"));
+    EXPECT_EQ(hsm.stateMachine.getRegionState(0), &hsm.capsOff);
+    EXPECT_EQ(hsm.stateMachine.getRegionState(1), &hsm.numOff);
+}
+
+TEST(RegionTests, IterativeEngineMatchesTheRecursiveEngine) {
+    RegionHsm<RegionPolicy> recursiveHsm;
+    RegionHsm<IterativeRegionPolicy> iterativeHsm;
+    auto run = [](auto& hsm) {
+        hsm.stateMachine.initialTransitionTo(hsm.numOn);
+        for (EventId id : { EventId::GO_TO_STATE_4, EventId::EVERYONE_HANDLES_THIS, EventId::GO_TO_STATE_7,
+                EventId::GO_TO_STATE_6, EventId::GO_TO_STATE_3, EventId::GO_TO_STATE_1, EventId::GO_TO_STATE_4,
+                EventId::GO_TO_STATE_5 }) {
+            hsm.stateMachine.handleEvent(Event(id));
+        }
+    };
+    run(recursiveHsm);
+    run(iterativeHsm);
+    EXPECT_EQ(iterativeHsm.log, recursiveHsm.log);
+    EXPECT_EQ(iterativeHsm.stateMachine.getCurrentState(), &iterativeHsm.off);
+}
+
+TEST(RegionTests, SetRegionsRejectsInvalidRegions) {
+    RegionHsm<RegionPolicy> hsm;
+
+    const State<Event>* const topLevel[] = { &hsm.off };
+    EXPECT_FALSE(hsm.stateMachine.setRegions(topLevel));
+    const State<Event>* const twice[] = { &hsm.caps, &hsm.caps };
+    EXPECT_FALSE(hsm.stateMachine.setRegions(twice));
+    const State<Event>* const nested[] = { &hsm.caps, &hsm.capsOn };
+    EXPECT_FALSE(hsm.stateMachine.setRegions(nested));
+    EXPECT_THAT(hsm.errors, ::testing::ElementsAre(
+        Error::InvalidRegions, Error::InvalidRegions, Error::InvalidRegions));
+
+    // No regions are left set: Keyboard is an ordinary state.
+    hsm.stateMachine.initialTransitionTo(hsm.keyboard);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.keyboard);
+    EXPECT_EQ(hsm.stateMachine.getRegionState(0), nullptr);
+}
+
+//============================================================================================//
+// Parallel Regions
+//============================================================================================//
+
+struct ParallelRegionPolicy : StateMachinePolicy {
+    static constexpr uint32_t MAX_REGIONS = 2;
+    static constexpr bool PARALLEL_REGIONS = true;
+    static constexpr uint32_t INTERNAL_EVENT_QUEUE_SIZE = 4;
+    static constexpr uint32_t DEFERRED_EVENT_POOL_SIZE = 4;
+};
+
+/**
+ * Two orthogonal regions of Fusion, with handlers that can wait for each other:
+ *
+ *     Fault      Fusion
+ *                +-- Sensors (region)   +-- Comms (region)
+ *                    +-- Calibrating        +-- Idle
+ *                    +-- Tracking           +-- Sending
+ *
+ * EVERYONE_HANDLES_THIS moves both regions on (Calibrating -> Tracking, Idle -> Sending) and
+ * GO_TO_STATE_1 takes Tracking to Fault and Sending back to Idle. GO_TO_STATE_2 has Calibrating
+ * try to post, defer, recall and start a timer, recording what each returned. With rendezvous
+ * set, each region's handler first waits (up to a few seconds) for the other's to start, which
+ * only succeeds if they run at the same time. Handlers only write their own region's fields; entries
+ * and exits, made on the calling thread, go in the shared log.
+ */
+class ParallelHsm {
+public:
+    ParallelHsm() :
+      fault(makeState<Event, &ParallelHsm::fault_entry, nullptr, nullptr>("Fault", *this)),
+      fusion(makeState<Event, &ParallelHsm::fusion_entry, &ParallelHsm::fusion_event, &ParallelHsm::fusion_exit>("Fusion", *this)),
+      sensors(makeState<Event, &ParallelHsm::sensors_entry, nullptr, nullptr>("Sensors", *this, &fusion)),
+      calibrating(makeState<Event, &ParallelHsm::calibrating_entry, &ParallelHsm::calibrating_event, &ParallelHsm::calibrating_exit>("Calibrating", *this, &sensors)),
+      tracking(makeState<Event, &ParallelHsm::tracking_entry, &ParallelHsm::tracking_event, &ParallelHsm::tracking_exit>("Tracking", *this, &sensors)),
+      comms(makeState<Event, &ParallelHsm::comms_entry, nullptr, nullptr>("Comms", *this, &fusion)),
+      idle(makeState<Event, &ParallelHsm::idle_entry, &ParallelHsm::idle_event, &ParallelHsm::idle_exit>("Idle", *this, &comms)),
+      sending(makeState<Event, &ParallelHsm::sending_entry, &ParallelHsm::sending_event, &ParallelHsm::sending_exit>("Sending", *this, &comms)) {
+        const State<Event>* const regions[] = { &sensors, &comms };
+        stateMachine.setRegions(regions);
+    }
+
+    /**
+     * @return True if the other region's handler started within a few seconds of this one.
+     */
+    bool meetOtherRegion() {
+        if (!rendezvous) {
+            return true;
+        }
+        numArrived.fetch_add(1);
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (numArrived.load() < 2) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    void fault_entry() { log.push_back("Fault:entry"); }
+
+    void fusion_entry() { log.push_back("Fusion:entry"); }
+    void fusion_event(const Event& event) { log.push_back("Fusion:event"); }
+    void fusion_exit() { log.push_back("Fusion:exit"); }
+
+    void sensors_entry() { stateMachine.transitionTo(calibrating); }
+    void calibrating_entry() { log.push_back("Calibrating:entry"); }
+    void calibrating_event(const Event& event) {
+        if (event.id == EventId::EVERYONE_HANDLES_THIS) {
+            sensorsMet = meetOtherRegion();
+            sensorsThread = std::this_thread::get_id();
+            stateMachine.transitionTo(tracking);
+        } else if (event.id == EventId::GO_TO_STATE_2) {
+            posted = stateMachine.post(Event(EventId::NO_ONE_HANDLES_THIS));
+            deferred = stateMachine.defer(Event(EventId::NO_ONE_HANDLES_THIS));
+            numRecalled = stateMachine.recall();
+            timerStarted = timers.startInState(timer, stateMachine, calibrating, Event(EventId::GO_TO_STATE_1), 10);
+        }
+    }
+    void calibrating_exit() { log.push_back("Calibrating:exit"); }
+    void tracking_entry() { log.push_back("Tracking:entry"); }
+    void tracking_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_1) {
+            stateMachine.transitionTo(fault);
+        }
+    }
+    void tracking_exit() { log.push_back("Tracking:exit"); }
+
+    void comms_entry() { stateMachine.transitionTo(idle); }
+    void idle_entry() { log.push_back("Idle:entry"); }
+    void idle_event(const Event& event) {
+        if (event.id == EventId::EVERYONE_HANDLES_THIS) {
+            commsMet = meetOtherRegion();
+            commsThread = std::this_thread::get_id();
+            stateMachine.transitionTo(sending);
+        }
+    }
+    void idle_exit() { log.push_back("Idle:exit"); }
+    void sending_entry() { log.push_back("Sending:entry"); }
+    void sending_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_1) {
+            commsSawFaultEvent = true;
+            stateMachine.transitionTo(idle);
+        }
+    }
+    void sending_exit() { log.push_back("Sending:exit"); }
+
+    void onError(Error error) { errors.push_back(error); }
+
+    State<Event> fault;
+    State<Event> fusion;
+    State<Event> sensors;
+    State<Event> calibrating;
+    State<Event> tracking;
+    State<Event> comms;
+    State<Event> idle;
+    State<Event> sending;
+    StateMachine<Event, ParallelRegionPolicy> stateMachine;
+    std::vector<std::string> log;
+
+    bool rendezvous = false;
+    std::atomic<int> numArrived{0};
+    bool sensorsMet = false;
+    bool commsMet = false;
+    bool commsSawFaultEvent = false;
+    std::thread::id sensorsThread;
+    std::thread::id commsThread;
+
+    VirtualClock clock;
+    TimerService<Event> timers{TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock)};
+    Timer<Event> timer;
+    bool posted = false;
+    bool deferred = false;
+    uint32_t numRecalled = 0;
+    bool timerStarted = false;
+    std::vector<Error> errors;
+};
+
+TEST(ParallelRegionTests, RegionHandlersRunConcurrentlyAndTransitionsFollowInRegionOrder) {
+    RegionThreadPool<1> pool;
+    pool.start();
+    ParallelHsm hsm;
+    hsm.stateMachine.setRegionExecutor(pool.executor());
+    hsm.stateMachine.initialTransitionTo(hsm.fusion);
+    hsm.log.clear();
+
+    hsm.rendezvous = true;
+    hsm.stateMachine.handleEvent(Event(EventId::EVERYONE_HANDLES_THIS));
+    EXPECT_TRUE(hsm.sensorsMet);
+    EXPECT_TRUE(hsm.commsMet);
+    EXPECT_NE(hsm.sensorsThread, hsm.commsThread);
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "Calibrating:exit", "Tracking:entry", "Idle:exit", "Sending:entry"));
+    EXPECT_EQ(hsm.stateMachine.getRegionState(0), &hsm.tracking);
+    EXPECT_EQ(hsm.stateMachine.getRegionState(1), &hsm.sending);
+}
+
+TEST(ParallelRegionTests, TransitionsOfExitedRegionsAreDiscarded) {
+    RegionThreadPool<1> pool;
+    pool.start();
+    ParallelHsm hsm;
+    hsm.stateMachine.setRegionExecutor(pool.executor());
+    hsm.stateMachine.initialTransitionTo(hsm.fusion);
+    hsm.stateMachine.handleEvent(Event(EventId::EVERYONE_HANDLES_THIS));
+    hsm.log.clear();
+
+    // Both regions' handlers run, but Sensors leaves Fusion first, so Comms' transition is moot.
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_1));
+    EXPECT_TRUE(hsm.commsSawFaultEvent);
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre(
+        "Sending:exit", "Tracking:exit", "Fusion:exit", "Fault:entry"));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.fault);
+}
+
+TEST(ParallelRegionTests, EventsNoRegionHandlesBubbleFromTheOrthogonalState) {
+    RegionThreadPool<1> pool;
+    pool.start();
+    ParallelHsm hsm;
+    hsm.stateMachine.setRegionExecutor(pool.executor());
+    hsm.stateMachine.initialTransitionTo(hsm.fusion);
+    hsm.log.clear();
+
+    hsm.stateMachine.handleEvent(Event(EventId::NO_ONE_HANDLES_THIS));
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("Fusion:event"));
+}
+
+TEST(ParallelRegionTests, WithoutAnExecutorRegionsAreDispatchedInTurn) {
+    // A stopped pool also runs the tasks in turn on the calling thread.
+    RegionThreadPool<1> stoppedPool;
+    ParallelHsm hsm;
+    hsm.stateMachine.setRegionExecutor(stoppedPool.executor());
+    hsm.stateMachine.initialTransitionTo(hsm.fusion);
+    hsm.stateMachine.handleEvent(Event(EventId::EVERYONE_HANDLES_THIS));
+    EXPECT_EQ(hsm.sensorsThread, std::this_thread::get_id());
+    EXPECT_EQ(hsm.commsThread, std::this_thread::get_id());
+
+    // Dispatched one region after the other, Comms never sees the event that leaves Fusion.
+    hsm.stateMachine.setRegionExecutor(StateMachine<Event, ParallelRegionPolicy>::RegionExecutor());
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_1));
+    EXPECT_FALSE(hsm.commsSawFaultEvent);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.fault);
+}
+
+TEST(ParallelRegionTests, HandlersRunningInParallelCantPostDeferRecallOrStartTimers) {
+    RegionThreadPool<1> pool;
+    pool.start();
+    ParallelHsm hsm;
+    hsm.stateMachine.setErrorObserver(
+        StateMachine<Event, ParallelRegionPolicy>::ErrorObserver::create<ParallelHsm, &ParallelHsm::onError>(hsm));
+    hsm.stateMachine.setRegionExecutor(pool.executor());
+    hsm.stateMachine.initialTransitionTo(hsm.fusion);
+    hsm.log.clear();
+
+    hsm.deferred = true;
+    hsm.numRecalled = 1;
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_FALSE(hsm.posted);
+    EXPECT_FALSE(hsm.deferred);
+    EXPECT_EQ(hsm.numRecalled, 0u);
+    EXPECT_FALSE(hsm.timerStarted);
+    EXPECT_FALSE(hsm.timer.isArmed());
+    EXPECT_EQ(hsm.stateMachine.numDeferred(), 0u);
+    EXPECT_THAT(hsm.errors, ::testing::ElementsAre(Error::CalledFromParallelRegion, Error::CalledFromParallelRegion,
+        Error::CalledFromParallelRegion, Error::CalledFromParallelRegion));
+    // Nothing was posted: the event wasn't handled, so it bubbled from Fusion, and that's all.
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("Fusion:event"));
+
+    // Dispatched in turn, the same calls are fine.
+    hsm.errors.clear();
+    hsm.log.clear();
+    hsm.stateMachine.setRegionExecutor(StateMachine<Event, ParallelRegionPolicy>::RegionExecutor());
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_TRUE(hsm.posted);
+    EXPECT_TRUE(hsm.deferred);
+    EXPECT_EQ(hsm.numRecalled, 1u);
+    EXPECT_TRUE(hsm.timerStarted);
+    EXPECT_TRUE(hsm.timer.isArmed());
+    EXPECT_TRUE(hsm.errors.empty());
+    // The recalled event goes first, then the posted one.
+    EXPECT_THAT(hsm.log, ::testing::ElementsAre("Fusion:event", "Fusion:event"));
+}
+
+TEST(ParallelRegionTests, PoolRunsEveryTaskOnceAcrossManyRuns) {
+    RegionThreadPool<3> pool;
+    pool.start();
+    std::atomic<uint32_t> counts[8] = {};
+    struct Task {
+        static void run(void* context, uint32_t i) {
+            static_cast<std::atomic<uint32_t>*>(context)[i].fetch_add(1);
+        }
+    };
+    for (int run = 0; run < 1000; run++) {
+        pool.run(&Task::run, counts, 1 + run % 8);
+    }
+    uint32_t total = 0;
+    for (const std::atomic<uint32_t>& count : counts) {
+        total += count.load();
+    }
+    EXPECT_EQ(total, 4500u);
+    EXPECT_EQ(counts[0].load(), 1000u);
+    EXPECT_EQ(counts[7].load(), 125u);
+    pool.stop();
+    EXPECT_FALSE(pool.isRunning());
+}
+
+TEST(ParallelRegionTests, PoolRunsEachTaskOnceWhenRunFromManyThreads) {
+    RegionThreadPool<3> pool;
+    pool.start();
+    struct Task {
+        static void run(void* context, uint32_t i) {
+            static_cast<std::atomic<uint32_t>*>(context)[i].fetch_add(1);
+        }
+    };
+    constexpr uint32_t numCallers = 4;
+    std::atomic<uint32_t> numMiscounted{0};
+    std::vector<std::thread> callers;
+    for (uint32_t caller = 0; caller < numCallers; caller++) {
+        callers.emplace_back([&, caller]() {
+            std::atomic<uint32_t> counts[8] = {};
+            for (uint32_t run = 0; run < 2000; run++) {
+                const uint32_t numTasks = 2 + (run + caller) % 7;
+                pool.run(&Task::run, counts, numTasks);
+                // Every task of this run has finished, and no other run touched our counts.
+                for (uint32_t i = 0; i < 8; i++) {
+                    if (counts[i].exchange(0) != (i < numTasks ? 1u : 0u)) {
+                        numMiscounted++;
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread& caller : callers) {
+        caller.join();
+    }
+    EXPECT_EQ(numMiscounted.load(), 0u);
+    pool.stop();
+}
+
+//============================================================================================//
+// Snapshots
+//============================================================================================//
+
+struct SnapshotPolicy : StateMachinePolicy {
+    static constexpr uint32_t INTERNAL_EVENT_QUEUE_SIZE = 2;
+    static constexpr uint32_t DEFERRED_EVENT_POOL_SIZE = 4;
+};
+
+/**
+ * A player that buffers data (EVENT_WITH_DATA_1) while stopped and plays it once started
+ * (GO_TO_STATE_2), so a snapshot has history and deferred events to save:
+ *
+ *     Off        On
+ *                +-- Stopped
+ *                +-- Playing
+ *                    +-- Track1
+ *                    +-- Track2
+ */
+class SnapshotHsm {
+public:
+    SnapshotHsm() :
+      off(makeState<Event, &SnapshotHsm::off_entry, nullptr, nullptr>("Off", *this)),
+      on(makeState<Event, &SnapshotHsm::on_entry, nullptr, nullptr>("On", *this)),
+      stopped(makeState<Event, &SnapshotHsm::stopped_entry, &SnapshotHsm::stopped_event, nullptr>("Stopped", *this, &on)),
+      playing(makeState<Event, &SnapshotHsm::playing_entry, nullptr, nullptr>("Playing", *this, &on)),
+      track1(makeState<Event, &SnapshotHsm::track1_entry, nullptr, nullptr>("Track1", *this, &playing)),
+      track2(makeState<Event, &SnapshotHsm::track2_entry, &SnapshotHsm::track2_event, nullptr>("Track2", *this, &playing)) {}
+
+    bool finalize() {
+        return stateMachine.finalize(table, { &off, &on, &stopped, &playing, &track1, &track2 });
+    }
+
+    void off_entry() { log.push_back("Off"); }
+    void on_entry() { log.push_back("On"); }
+    void stopped_entry() { log.push_back("Stopped"); }
+    void stopped_event(const Event& event) {
+        if (event.id == EventId::EVENT_WITH_DATA_1) {
+            stateMachine.defer(event);
+        } else if (event.id == EventId::GO_TO_STATE_2) {
+            stateMachine.transitionTo(track2);
+        }
+    }
+    void playing_entry() { log.push_back("Playing"); }
+    void track1_entry() { log.push_back("Track1"); }
+    void track2_entry() {
+        log.push_back("Track2");
+        stateMachine.recall();
+    }
+    void track2_event(const Event& event) {
+        if (event.id == EventId::EVENT_WITH_DATA_1) {
+            received.push_back(event.data1.data);
+        }
+    }
+
+    State<Event> off;
+    State<Event> on;
+    State<Event> stopped;
+    State<Event> playing;
+    State<Event> track1;
+    State<Event> track2;
+    StateMachine<Event, SnapshotPolicy> stateMachine;
+    TransitionTable<Event, 6> table;
+    std::vector<std::string> log;
+    std::vector<uint32_t> received;
+};
+
+/**
+ * Leave @p hsm stopped, with history, two deferred data events and a third one posted.
+ */
+void prepareSnapshot(SnapshotHsm& hsm) {
+    ASSERT_TRUE(hsm.finalize());
+    hsm.stateMachine.initialTransitionTo(hsm.track1);
+    hsm.stateMachine.transitionTo(hsm.off);
+    hsm.stateMachine.transitionTo(hsm.stopped);
+    hsm.stateMachine.handleEvent(HandshakeHsm::data(1));
+    hsm.stateMachine.handleEvent(HandshakeHsm::data(2));
+    ASSERT_TRUE(hsm.stateMachine.post(HandshakeHsm::data(3)));
+}
+
+TEST(SnapshotTests, RestoresStateHistoryAndPendingEventsWithoutEntries) {
+    SnapshotHsm saved;
+    prepareSnapshot(saved);
+    uint8_t buffer[128];
+    const size_t size = saved.stateMachine.snapshot(buffer, sizeof(buffer));
+    ASSERT_NE(size, 0u);
+    EXPECT_EQ(size, saved.stateMachine.snapshotSize());
+
+    SnapshotHsm restored;
+    ASSERT_TRUE(restored.finalize());
+    ASSERT_TRUE(restored.stateMachine.restore(buffer, size));
+    EXPECT_TRUE(restored.log.empty());
+    EXPECT_EQ(restored.stateMachine.getCurrentState(), &restored.stopped);
+    EXPECT_EQ(restored.on.shallowHistory, &restored.playing);
+    EXPECT_EQ(restored.on.deepHistory, &restored.track1);
+    EXPECT_EQ(restored.stateMachine.numDeferred(), 2u);
+
+    // Saving the restored machine gives the same snapshot back.
+    uint8_t again[128];
+    ASSERT_EQ(restored.stateMachine.snapshot(again, sizeof(again)), size);
+    EXPECT_EQ(std::memcmp(buffer, again, size), 0);
+
+    // The posted event goes first (and is deferred), then playing recalls all three in order.
+    restored.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_EQ(restored.stateMachine.getCurrentState(), &restored.track2);
+    EXPECT_THAT(restored.received, ::testing::ElementsAre(1u, 2u, 3u));
+
+    restored.stateMachine.transitionTo(restored.off);
+    restored.stateMachine.transitionToHistory(restored.playing, History::Shallow);
+    EXPECT_EQ(restored.stateMachine.getCurrentState(), &restored.track2);
+}
+
+TEST(SnapshotTests, LeavesRunsOnlyTheLeafEntry) {
+    SnapshotHsm saved;
+    prepareSnapshot(saved);
+    saved.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    uint8_t buffer[128];
+    const size_t size = saved.stateMachine.snapshot(buffer, sizeof(buffer));
+    ASSERT_NE(size, 0u);
+
+    SnapshotHsm restored;
+    ASSERT_TRUE(restored.finalize());
+    ASSERT_TRUE(restored.stateMachine.restore(buffer, size, RestoreEntry::Leaves));
+    EXPECT_EQ(restored.stateMachine.getCurrentState(), &restored.track2);
+    EXPECT_THAT(restored.log, ::testing::ElementsAre("Track2"));
+}
+
+TEST(SnapshotTests, InvalidSnapshotsAreRejectedAndChangeNothing) {
+    SnapshotHsm saved;
+    prepareSnapshot(saved);
+    uint8_t buffer[128];
+    const size_t size = saved.stateMachine.snapshot(buffer, sizeof(buffer));
+    ASSERT_NE(size, 0u);
+    EXPECT_EQ(saved.stateMachine.snapshot(buffer, size - 1), 0u);
+    ASSERT_EQ(saved.stateMachine.snapshot(buffer, sizeof(buffer)), size);
+
+    SnapshotHsm unsealed;
+    EXPECT_FALSE(unsealed.stateMachine.restore(buffer, size));
+
+    SnapshotHsm restored;
+    ASSERT_TRUE(restored.finalize());
+    restored.stateMachine.initialTransitionTo(restored.off);
+    restored.log.clear();
+    EXPECT_FALSE(restored.stateMachine.restore(nullptr, size));
+    EXPECT_FALSE(restored.stateMachine.restore(buffer, size - 1));
+    EXPECT_FALSE(restored.stateMachine.restore(buffer, size + 1));
+
+    uint8_t corrupted[128];
+    const auto restoreWith = [&](size_t offset, uint8_t value) {
+        std::memcpy(corrupted, buffer, size);
+        corrupted[offset] = value;
+        return restored.stateMachine.restore(corrupted, size);
+    };
+    EXPECT_FALSE(restoreWith(0, 'X'));                  // Magic
+    EXPECT_FALSE(restoreWith(2, SNAPSHOT_VERSION + 1)); // Version
+    EXPECT_FALSE(restoreWith(3, buffer[3] ^ 1));        // Flags (another policy)
+    EXPECT_FALSE(restoreWith(4, 7));                    // Number of states
+    EXPECT_FALSE(restoreWith(6, 6));                    // Current state id out of range
+    EXPECT_FALSE(restoreWith(8, 6));                    // History id out of range
+    EXPECT_EQ(restored.stateMachine.getCurrentState(), &restored.off);
+    EXPECT_EQ(restored.on.shallowHistory, nullptr);
+    EXPECT_EQ(restored.stateMachine.numDeferred(), 0u);
+    EXPECT_TRUE(restored.log.empty());
+
+    EXPECT_TRUE(restoreWith(0, buffer[0]));
+    EXPECT_EQ(restored.stateMachine.getCurrentState(), &restored.stopped);
+}
+
+TEST(SnapshotTests, StatesNotRegisteredWithFinalizeCantBeSaved) {
+    SnapshotHsm hsm;
+    ASSERT_TRUE(hsm.finalize());
+    State<Event> stray = makeState<Event, &SnapshotHsm::off_entry, nullptr, nullptr>("Stray", hsm);
+    hsm.stateMachine.initialTransitionTo(stray);
+    uint8_t buffer[128];
+    EXPECT_EQ(hsm.stateMachine.snapshotSize(), 0u);
+    EXPECT_EQ(hsm.stateMachine.snapshot(buffer, sizeof(buffer)), 0u);
+}
+
+TEST(SnapshotTests, RestoresEachRegionsActiveState) {
+    const auto finalize = [](RegionHsm<RegionPolicy>& hsm, TransitionTable<Event, 8>& table) {
+        return hsm.stateMachine.finalize(table, {
+            &hsm.off, &hsm.keyboard, &hsm.caps, &hsm.capsOff, &hsm.capsOn, &hsm.num, &hsm.numOff, &hsm.numOn });
+    };
+    RegionHsm<RegionPolicy> saved;
+    TransitionTable<Event, 8> savedTable;
+    ASSERT_TRUE(finalize(saved, savedTable));
+    saved.stateMachine.initialTransitionTo(saved.keyboard);
+    saved.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_4));
+    saved.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_6));
+    uint8_t buffer[64];
+    const size_t size = saved.stateMachine.snapshot(buffer, sizeof(buffer));
+    ASSERT_NE(size, 0u);
+
+    RegionHsm<RegionPolicy> restored;
+    TransitionTable<Event, 8> restoredTable;
+    ASSERT_TRUE(finalize(restored, restoredTable));
+    ASSERT_TRUE(restored.stateMachine.restore(buffer, size, RestoreEntry::Leaves));
+    EXPECT_THAT(restored.log, ::testing::ElementsAre("CapsOn:entry", "NumOn:entry"));
+    EXPECT_EQ(restored.stateMachine.getRegionState(0), &restored.capsOn);
+    EXPECT_EQ(restored.stateMachine.getRegionState(1), &restored.numOn);
+
+    restored.log.clear();
+    restored.stateMachine.handleEvent(Event(EventId::EVERYONE_HANDLES_THIS));
+    EXPECT_THAT(restored.log, ::testing::ElementsAre("CapsOn:key", "NumOn:event"));
+    restored.log.clear();
+    restored.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_3));
+    EXPECT_THAT(restored.log, ::testing::ElementsAre("NumOn:event", "Keyboard:event",
+        "NumOn:exit", "Num:exit", "CapsOn:exit", "Caps:exit", "Keyboard:exit", "Off:entry"));
+    EXPECT_TRUE(restored.errors.empty());
+}
+
+/**
+ * A large fleet and its contexts, allocated together on the heap.
+ */
+struct LargeCellFleet {
+    static constexpr size_t CAPACITY = 100000;
+    using Fleet = StateFleet<FleetCell, Event, 3, CAPACITY>;
+
+    FleetCell cells[CAPACITY];
+    Fleet fleet{ FLEET_CELL_TOPOLOGY, cells };
+};
+
+TEST(SnapshotTests, FleetRoundTrip) {
+    auto saved = std::make_unique<LargeCellFleet>();
+    for (size_t i = 0; i < LargeCellFleet::CAPACITY; i++) {
+        // Every third instance is left without an initial transition.
+        if (i % 3 != 2) {
+            saved->fleet.initialTransitionTo(i, i % 3 == 0 ? FleetCell::DONE : FleetCell::COUNTING);
+        }
+    }
+    std::vector<uint8_t> buffer(LargeCellFleet::Fleet::snapshotSize());
+    ASSERT_EQ(saved->fleet.snapshot(buffer.data(), buffer.size()), buffer.size());
+    EXPECT_EQ(saved->fleet.snapshot(buffer.data(), buffer.size() - 1), 0u);
+
+    auto restored = std::make_unique<LargeCellFleet>();
+    EXPECT_FALSE(restored->fleet.restore(buffer.data(), buffer.size() - 1));
+    std::vector<uint8_t> corrupted = buffer;
+    corrupted[corrupted.size() - 2] = 3; // The last instance in state 3, which doesn't exist
+    EXPECT_FALSE(restored->fleet.restore(corrupted.data(), corrupted.size()));
+    EXPECT_EQ(restored->fleet.getCurrentStateIndex(0), LargeCellFleet::Fleet::NO_STATE);
+
+    ASSERT_TRUE(restored->fleet.restore(buffer.data(), buffer.size(), RestoreEntry::Leaves));
+    for (size_t i = 0; i < LargeCellFleet::CAPACITY; i++) {
+        ASSERT_EQ(restored->fleet.getCurrentStateIndex(i), saved->fleet.getCurrentStateIndex(i));
+        ASSERT_EQ(restored->cells[i].numDoneEntries, i % 3 == 0 ? 1u : 0u);
+    }
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+//============================================================================================//
+// Coroutine States
+//============================================================================================//
+
+/**
+ * Connecting is a coroutine state under Link that sends up to three times, waiting up to 100
+ * ticks for an ack (GO_TO_STATE_2) after each send, then transitions to ackTarget (Connected by
+ * default):
+ *
+ *     Idle      Link
+ *               +-- Connecting (coroutine)
+ *               |   +-- Probing
+ *               +-- Connected
+ *               +-- Failed
+ *               +-- Retrying
+ *
+ * Link handles GO_TO_STATE_1 (back to Idle) and logs everything else that bubbles up to it. The
+ * timeout event is GO_TO_STATE_8, which Probing claims. Retrying's entry() goes straight back to
+ * Connecting.
+ */
+class LinkHsm {
+public:
+    LinkHsm(TimerService<Event>& timers) :
+      idle(makeState<Event, nullptr, nullptr, nullptr>("Idle", *this)),
+      link(makeState<Event, nullptr, &LinkHsm::link_event, nullptr>("Link", *this)),
+      connecting(makeCoroutineState<Event, &LinkHsm::connecting_body>("Connecting", *this, stateMachine, framePool, &link)),
+      connected(makeState<Event, nullptr, nullptr, nullptr>("Connected", *this, &link)),
+      failed(makeState<Event, nullptr, nullptr, nullptr>("Failed", *this, &link)),
+      probing(makeState<Event, nullptr, &LinkHsm::probing_event, nullptr>("Probing", *this, &connecting)),
+      retrying(makeState<Event, &LinkHsm::retrying_entry, nullptr, nullptr>("Retrying", *this, &link)) {
+        connecting.setTimerService(timers, stateMachine);
+    }
+
+    /**
+     * Counts the body's locals destroyed, so tests can tell the frame was torn down properly.
+     */
+    struct Guard {
+        ~Guard() { numDestroyed++; }
+        int& numDestroyed;
+    };
+
+    CoroutineBody<Event> connecting_body(CoroutineState<Event>& state) {
+        Guard guard{numGuardsDestroyed};
+        for (int attempt = 0; attempt < 3; attempt++) {
+            log.push_back("send");
+            const Event* ack = co_await state.nextEvent(
+                [this](const Event& event) { return event.id == ackId; },
+                Event(EventId::GO_TO_STATE_8),
+                100);
+            if (ack != nullptr) {
+                stateMachine.transitionTo(*ackTarget);
+                co_return;
+            }
+            log.push_back("timeout");
+        }
+        stateMachine.transitionTo(failed);
+    }
+
+    void link_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_1) {
+            stateMachine.transitionTo(idle);
+        } else {
+            log.push_back("Link:event");
+        }
+    }
+
+    void probing_event(const Event& event) {
+        if (event.id == EventId::GO_TO_STATE_8) {
+            log.push_back("Probing:timeout");
+            stateMachine.eventHandled();
+        }
+    }
+
+    void retrying_entry() { stateMachine.transitionTo(connecting); }
+
+    CoroutineFramePool<512, 1> framePool;
+    State<Event> idle;
+    State<Event> link;
+    CoroutineState<Event> connecting;
+    State<Event> connected;
+    State<Event> failed;
+    State<Event> probing;
+    State<Event> retrying;
+    StateMachine<Event> stateMachine;
+    std::vector<std::string> log;
+    EventId ackId = EventId::GO_TO_STATE_2;
+    State<Event>* ackTarget = &connected;
+    int numGuardsDestroyed = 0;
+};
+
+TEST(CoroutineStateTests, BodyRunsToItsFirstAwaitOnEntry) {
+    VirtualClock clock;
+    TimerService<Event> timers(TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock));
+    LinkHsm hsm(timers);
+    hsm.stateMachine.initialTransitionTo(hsm.idle);
+    EXPECT_EQ(hsm.framePool.numInUse(), 0u);
+
+    hsm.stateMachine.transitionTo(hsm.connecting);
+    EXPECT_TRUE(hsm.connecting.isRunning());
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"send"}));
+    EXPECT_EQ(hsm.framePool.numInUse(), 1u);
+    EXPECT_EQ(timers.numArmed(), 1u);
+}
+
+TEST(CoroutineStateTests, RetriesOnTimeoutUntilAcked) {
+    VirtualClock clock;
+    TimerService<Event> timers(TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock));
+    LinkHsm hsm(timers);
+    hsm.stateMachine.initialTransitionTo(hsm.connecting);
+
+    clock.ticks = 100;
+    EXPECT_EQ(timers.poll(), 1u);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.connecting);
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"send", "timeout", "send"}));
+    EXPECT_EQ(timers.numArmed(), 1u);
+
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.connected);
+    EXPECT_FALSE(hsm.connecting.isRunning());
+    EXPECT_EQ(hsm.framePool.numInUse(), 0u);
+    EXPECT_EQ(hsm.numGuardsDestroyed, 1);
+    EXPECT_EQ(timers.numArmed(), 0u);
+
+    // The claimed ack did not bubble up to Link.
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"send", "timeout", "send"}));
+}
+
+TEST(CoroutineStateTests, GivesUpAfterThreeTimeouts) {
+    VirtualClock clock;
+    TimerService<Event> timers(TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock));
+    LinkHsm hsm(timers);
+    hsm.stateMachine.initialTransitionTo(hsm.connecting);
+
+    for (int i = 1; i <= 3; i++) {
+        clock.ticks = 100 * i;
+        EXPECT_EQ(timers.poll(), 1u);
+    }
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.failed);
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"send", "timeout", "send", "timeout", "send", "timeout"}));
+    EXPECT_EQ(hsm.framePool.numInUse(), 0u);
+    EXPECT_EQ(timers.numArmed(), 0u);
+}
+
+TEST(CoroutineStateTests, EventsTheBodyIsNotWaitingForBubbleUp) {
+    VirtualClock clock;
+    TimerService<Event> timers(TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock));
+    LinkHsm hsm(timers);
+    hsm.stateMachine.initialTransitionTo(hsm.connecting);
+
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_3));
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"send", "Link:event"}));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.connecting);
+    EXPECT_TRUE(hsm.connecting.isRunning());
+
+    // The matcher is evaluated when the event arrives, so it sees the captured state as it is then.
+    hsm.ackId = EventId::GO_TO_STATE_3;
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_3));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.connected);
+}
+
+TEST(CoroutineStateTests, ExitingTheStateDestroysTheSuspendedBody) {
+    VirtualClock clock;
+    TimerService<Event> timers(TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock));
+    LinkHsm hsm(timers);
+    hsm.stateMachine.initialTransitionTo(hsm.connecting);
+
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_1));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.idle);
+    EXPECT_FALSE(hsm.connecting.isRunning());
+    EXPECT_EQ(hsm.numGuardsDestroyed, 1);
+    EXPECT_EQ(hsm.framePool.numInUse(), 0u);
+    EXPECT_EQ(timers.numArmed(), 0u);
+
+    clock.ticks = 1000;
+    EXPECT_EQ(timers.poll(), 0u);
+
+    // Re-entering starts the body from the top, in the frame just freed.
+    hsm.stateMachine.transitionTo(hsm.connecting);
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"send", "send"}));
+    EXPECT_EQ(hsm.framePool.numInUse(), 1u);
+    EXPECT_EQ(hsm.framePool.highWaterMark(), 1u);
+}
+
+TEST(CoroutineStateTests, TransitioningBackIntoTheStateRestartsTheBody) {
+    VirtualClock clock;
+    TimerService<Event> timers(TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock));
+    LinkHsm hsm(timers);
+    hsm.stateMachine.initialTransitionTo(hsm.connecting);
+
+    // The body transitions to its own state: the old body is destroyed once it returns, and only
+    // then does the new one start (in the same, single frame).
+    hsm.ackTarget = &hsm.connecting;
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.connecting);
+    EXPECT_TRUE(hsm.connecting.isRunning());
+    EXPECT_EQ(hsm.numGuardsDestroyed, 1);
+    EXPECT_EQ(hsm.framePool.numInUse(), 1u);
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"send", "send"}));
+
+    // The new body's timeout works.
+    clock.ticks = 100;
+    EXPECT_EQ(timers.poll(), 1u);
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"send", "send", "timeout", "send"}));
+
+    // The same when a sibling's entry() transitions back.
+    hsm.ackTarget = &hsm.retrying;
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.connecting);
+    EXPECT_TRUE(hsm.connecting.isRunning());
+    EXPECT_EQ(hsm.numGuardsDestroyed, 2);
+    EXPECT_EQ(hsm.framePool.numInUse(), 1u);
+    EXPECT_EQ(timers.numArmed(), 1u);
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"send", "send", "timeout", "send", "send"}));
+}
+
+TEST(CoroutineStateTests, TimeoutsClaimedByAChildAreNotSeenByTheBody) {
+    VirtualClock clock;
+    TimerService<Event> timers(TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock));
+    LinkHsm hsm(timers);
+    hsm.stateMachine.initialTransitionTo(hsm.connecting);
+    hsm.stateMachine.transitionTo(hsm.probing);
+    EXPECT_TRUE(hsm.connecting.isRunning());
+
+    clock.ticks = 100;
+    EXPECT_EQ(timers.poll(), 1u);
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"send", "Probing:timeout"}));
+
+    // The next event is not mistaken for the timeout: the body is still waiting for an ack.
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_3));
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"send", "Probing:timeout", "Link:event"}));
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.connected);
+}
+
+TEST(CoroutineStateTests, BodyDoesNotRunWhenThePoolIsExhausted) {
+    VirtualClock clock;
+    TimerService<Event> timers(TimerService<Event>::ClockDelegate::create<VirtualClock, &VirtualClock::read>(clock));
+    LinkHsm hsm(timers);
+    void* frame = hsm.framePool.allocate(1);
+    ASSERT_NE(frame, nullptr);
+    EXPECT_EQ(hsm.framePool.allocate(1), nullptr);
+
+    hsm.stateMachine.initialTransitionTo(hsm.connecting);
+    EXPECT_EQ(hsm.stateMachine.getCurrentState(), &hsm.connecting);
+    EXPECT_FALSE(hsm.connecting.isRunning());
+    EXPECT_TRUE(hsm.log.empty());
+
+    // With no body waiting, everything bubbles up.
+    hsm.stateMachine.handleEvent(Event(EventId::GO_TO_STATE_2));
+    EXPECT_EQ(hsm.log, std::vector<std::string>({"Link:event"}));
+
+    CoroutineFrameAllocator::deallocate(frame);
+    hsm.stateMachine.transitionTo(hsm.connecting);
+    EXPECT_TRUE(hsm.connecting.isRunning());
+}
+
+#endif